@@ -2,6 +2,7 @@
 
 import array
 import binascii
+import struct
 import zmq
 
 port = 28332
@@ -12,6 +13,8 @@ zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "hashblock")
 zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "hashtx")
 zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "rawblock")
 zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "rawtx")
+zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "sequence")
+zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "auxpow")
 zmqSubSocket.connect("tcp://127.0.0.1:%i" % port)
 
 try:
@@ -19,19 +22,35 @@ try:
         msg = zmqSubSocket.recv_multipart()
         topic = str(msg[0])
         body = msg[1]
+        sequence = "Unknown"
+        if len(msg[-1]) == 4:
+            sequence = str(struct.unpack('<I', msg[-1])[-1])
 
         if topic == "hashblock":
-            print "- HASH BLOCK -"
+            print "- HASH BLOCK ("+sequence+") -"
             print binascii.hexlify(body)
         elif topic == "hashtx":
-            print '- HASH TX -'
+            print '- HASH TX ('+sequence+') -'
             print binascii.hexlify(body)
         elif topic == "rawblock":
-            print "- RAW BLOCK HEADER -"
+            print "- RAW BLOCK HEADER ("+sequence+") -"
             print binascii.hexlify(body[:80])
         elif topic == "rawtx":
-            print '- RAW TX -'
+            print '- RAW TX ('+sequence+') -'
             print binascii.hexlify(body)
+        elif topic == "sequence":
+            label = body[32]
+            print '- SEQUENCE '+label+' ('+sequence+') -'
+            print binascii.hexlify(body[:32])
+            if label in ('A', 'R'):
+                print 'mempool sequence', struct.unpack('<Q', body[33:41])[0]
+            if label == 'R':
+                print 'removal reason', ord(body[41])
+        elif topic == "auxpow":
+            print '- AUXPOW ('+sequence+') -'
+            print binascii.hexlify(body[:32])
+            print 'chain id', struct.unpack('<i', body[32:36])[0]
+            print 'parent header', binascii.hexlify(body[36:116])
 
 except KeyboardInterrupt:
     zmqContext.destroy()
@@ -79,6 +79,9 @@ testScripts = [
     'mempool_spendcoinbase.py',
     'mempool_coinbase_spends.py',
     'httpbasics.py',
+    'httplanes.py',
+    'rpcstats.py',
+    'sendheaders.py',
     'zapwallettxes.py',
     'proxy_test.py',
     'merkle_blocks.py',
@@ -115,6 +118,7 @@ testScriptsExt = [
     'p2p-acceptblock.py',
     'mempool_packages.py',
     'maxuploadtarget.py',
+    'historicalpacing.py',
     'replace-by-fee.py',
 ]
 
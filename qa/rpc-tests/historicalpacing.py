@@ -0,0 +1,101 @@
+#!/usr/bin/env python2
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from test_framework.mininode import *
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import time
+
+'''
+Test that -maxhistoricalrate keeps responses in the order of requests.
+
+A peer asks for more historical blocks than the upload bucket holds, then
+sends a getheaders and a ping.  The blocks are paced, and the headers and
+the pong must still only arrive after the last of them, as peers use a ping
+as a barrier for their earlier requests.
+'''
+
+class TestNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.events = []
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def on_inv(self, conn, message):
+        pass
+
+    def on_block(self, conn, message):
+        message.block.calc_sha256()
+        self.events.append(('block', message.block.sha256))
+
+    def on_headers(self, conn, message):
+        self.events.append(('headers', len(message.headers)))
+
+    def on_pong(self, conn, message):
+        self.events.append(('pong', message.nonce))
+
+    def wait_for(self, predicate, timeout):
+        while timeout > 0:
+            with mininode_lock:
+                if predicate():
+                    return True
+            time.sleep(0.05)
+            timeout -= 0.05
+        return False
+
+    def send_message(self, message):
+        self.connection.send_message(message)
+
+class HistoricalPacingTest(BitcoinTestFramework):
+    def setup_chain(self):
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        # 1 KiB/s, of which an inbound peer gets a burst of 2 KiB
+        self.nodes = [start_node(0, self.options.tmpdir, ["-debug", "-maxhistoricalrate=1"])]
+
+    def run_test(self):
+        node = self.nodes[0]
+
+        # Blocks more than a week older than the tip are historical
+        node.setmocktime(int(time.time()) - 2*60*60*24*7)
+        old_blocks = [int(h, 16) for h in node.generate(30)]
+        node.setmocktime(int(time.time()))
+        node.generate(1)
+        size = sum(node.getblock("%064x" % h)['size'] for h in old_blocks)
+        assert(size > 3 * 1024)
+
+        test_node = TestNode()
+        connection = NodeConn('127.0.0.1', p2p_port(0), node, test_node)
+        test_node.add_connection(connection)
+        NetworkThread().start()
+        assert(test_node.wait_for(lambda: test_node.verack_received, 10))
+
+        getdata = msg_getdata()
+        getdata.inv = [CInv(2, h) for h in old_blocks]
+        getheaders = msg_getheaders()
+        getheaders.locator.vHave = [old_blocks[-1]]
+        start = time.time()
+        test_node.send_message(getdata)
+        test_node.send_message(getheaders)
+        test_node.send_message(msg_ping(nonce=1))
+
+        assert(test_node.wait_for(lambda: ('pong', 1) in test_node.events, 60))
+
+        # The blocks came first, in the order they were asked for...
+        with mininode_lock:
+            assert_equal(test_node.events, [('block', h) for h in old_blocks] + [('headers', 1), ('pong', 1)])
+        # ...although they did not all fit in the bucket
+        assert(time.time() - start > 1)
+
+        connection.disconnect_node()
+
+if __name__ == '__main__':
+    HistoricalPacingTest().main()
@@ -0,0 +1,126 @@
+#!/usr/bin/env python2
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the lanes of the HTTP work queue: which lane a call is queued in,
+# -rpclanethreads and rejection of calls when their lane is full
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import base64
+import json
+import time
+
+try:
+    import http.client as httplib
+except ImportError:
+    import httplib
+try:
+    import urllib.parse as urlparse
+except ImportError:
+    import urlparse
+
+LANES = ['mining', 'wallet', 'chain', 'rest']
+
+def lane_stats(node, field):
+    return dict((lane['lane'], lane[field]) for lane in node.getrpcworkqueueinfo())
+
+class HTTPLanesTest (BitcoinTestFramework):
+    def setup_nodes(self):
+        args = ['-rpcthreads=3', '-rpclanethreads=mining:2', '-rpclanethreads=rest:9',
+                '-rpclanethreads=wallet', '-rpclanethreads=bogus:1']
+        return start_nodes(2, self.options.tmpdir, [args, []])
+
+    def setup_network(self, split=False):
+        self.nodes = self.setup_nodes()
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def connect(self, node):
+        url = urlparse.urlparse(node.url)
+        self.headers = {"Authorization": "Basic " + base64.b64encode(url.username + ':' + url.password)}
+        return httplib.HTTPConnection(url.hostname, url.port, timeout=600)
+
+    def post(self, conn, method, params=[]):
+        conn.request('POST', '/', json.dumps({"method": method, "params": params, "id": 1}), self.headers)
+
+    def run_test(self):
+        node = self.nodes[0]
+
+        ##################
+        # rpclanethreads #
+        ##################
+        # Invalid values are ignored, too many threads are capped at -rpcthreads
+        # and chain queries leave one thread free by default
+        assert_equal([lane['lane'] for lane in node.getrpcworkqueueinfo()], LANES)
+        maxrunning = lane_stats(node, 'maxrunning')
+        assert_equal(maxrunning, {'mining': 2, 'wallet': 3, 'chain': 2, 'rest': 3})
+
+        ##################
+        # lane selection #
+        ##################
+        # getrpcworkqueueinfo itself is a chain query, and counted before it runs
+        calls = [('getmininginfo', 'mining'), ('getblocktemplate', 'mining'), ('getwalletinfo', 'wallet'),
+                 ('getblockcount', 'chain'), ('nosuchmethod', 'chain')]
+        for (method, lane) in calls:
+            before = lane_stats(node, 'queued')
+            try:
+                getattr(node, method)()
+            except JSONRPCException:
+                pass
+            after = lane_stats(node, 'queued')
+            for other in LANES:
+                expected = (other == lane) + (other == 'chain')
+                assert_equal((method, other, after[other] - before[other]), (method, other, expected))
+
+        # Batches are scheduled as chain queries, whatever they contain
+        before = lane_stats(node, 'queued')
+        conn = self.connect(node)
+        conn.request('POST', '/', '[{"method": "getmininginfo", "id": 1}]', self.headers)
+        assert_equal(conn.getresponse().status, 200)
+        conn.close()
+        after = lane_stats(node, 'queued')
+        assert_equal(after['mining'] - before['mining'], 0)
+        assert_equal(after['chain'] - before['chain'] >= 2, True)
+
+        ############################
+        # rejection when lane full #
+        ############################
+        # One worker, one waiting call per lane
+        stop_node(node, 0)
+        node = self.nodes[0] = start_node(0, self.options.tmpdir, ['-rpcthreads=1', '-rpcworkqueue=1'])
+        connect_nodes_bi(self.nodes, 0, 1)
+
+        # Keep the only worker busy with a long poll
+        longpollid = node.getblocktemplate()['longpollid']
+        conns = [self.connect(node) for i in range(4)]
+        self.post(conns[0], 'getblocktemplate', [{'longpollid': longpollid}])
+        time.sleep(2)
+
+        # The first chain query waits, the second finds the chain lane full...
+        self.post(conns[1], 'getblockcount')
+        self.post(conns[2], 'getblockcount')
+        response = conns[2].getresponse()
+        assert_equal(response.status, 500)
+        assert_equal('Work queue depth exceeded' in response.read(), True)
+        # ...while a mining call still gets a place in its own lane
+        self.post(conns[3], 'getmininginfo')
+
+        # A block from the other node ends the long poll and everything queued is served
+        self.nodes[1].generate(1)
+        for i in [0, 3, 1]:
+            response = conns[i].getresponse()
+            assert_equal(response.status, 200)
+            assert_equal(json.loads(response.read())['error'], None)
+        for conn in conns:
+            conn.close()
+
+        rejected = lane_stats(node, 'rejected')
+        assert_equal(rejected, {'mining': 0, 'wallet': 0, 'chain': 1, 'rest': 0})
+
+if __name__ == '__main__':
+    HTTPLanesTest ().main ()
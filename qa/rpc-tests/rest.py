@@ -338,6 +338,65 @@ class RESTTest (BitcoinTestFramework):
         for tx in txs:
             assert_equal(tx in json_obj['tx'], True)
 
+        ############################################
+        # /rest/blockrange/ and /rest/headerrange/ #
+        ############################################
+        tip_height = self.nodes[0].getblockcount()
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/'+str(tip_height-2)+'/10'+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(response.status, 200)
+        range_bin = response.read()
+        blocks_bin = b''
+        for height in range(tip_height-2, tip_height+1):
+            blocks_bin += http_get_call(url.hostname, url.port, '/rest/block/'+self.nodes[0].getblockhash(height)+self.FORMAT_SEPARATOR+'bin')
+        assert_equal(range_bin, blocks_bin) #the range ends at the tip
+
+        json_string = http_get_call(url.hostname, url.port, '/rest/blockrange/0/'+str(tip_height+1)+self.FORMAT_SEPARATOR+'json')
+        json_obj = json.loads(json_string)
+        assert_equal(len(json_obj), tip_height+1)
+        assert_equal(json_obj[-1]['hash'], self.nodes[0].getbestblockhash())
+
+        response = http_get_call(url.hostname, url.port, '/rest/blockrange/'+str(tip_height+1)+'/1'+self.FORMAT_SEPARATOR+'bin', True)
+        assert_equal(response.status, 404)
+
+        #header ranges are streamed, so they are not limited to 2000 headers
+        json_string = http_get_call(url.hostname, url.port, '/rest/headerrange/0/5000'+self.FORMAT_SEPARATOR+'json')
+        json_obj = json.loads(json_string)
+        assert_equal(len(json_obj), tip_height+1)
+        json_string = http_get_call(url.hostname, url.port, '/rest/headers/5000/'+self.nodes[0].getblockhash(0)+self.FORMAT_SEPARATOR+'json')
+        assert_equal(len(json.loads(json_string)), tip_height+1)
+
+        hex_range = http_get_call(url.hostname, url.port, '/rest/headerrange/1/1'+self.FORMAT_SEPARATOR+'hex')
+        hex_headers = http_get_call(url.hostname, url.port, '/rest/headers/1/'+self.nodes[0].getblockhash(1)+self.FORMAT_SEPARATOR+'hex')
+        assert_equal(hex_range, hex_headers)
+
+        #########################
+        # /rest/getutxos/bulk/ #
+        #########################
+        #more outpoints than /rest/getutxos allows, answered in the order asked
+        outpoints = []
+        for x in range(0, 10):
+            for tx in txs:
+                outpoints.append({'txid': tx, 'vout': 0})
+        outpoints.append({'txid': vintx, 'vout': 0})
+        json_request = json.dumps({'checkmempool': True, 'outpoints': outpoints})
+        json_string = http_post_call(url.hostname, url.port, '/rest/getutxos/bulk'+self.FORMAT_SEPARATOR+'json', json_request)
+        json_obj = json.loads(json_string)
+        assert_equal(json_obj['chaintipHash'], self.nodes[0].getbestblockhash())
+        assert_equal(len(json_obj['utxos']), 31)
+        for utxo in json_obj['utxos'][:-1]:
+            assert(utxo is not None)
+        assert_equal(json_obj['utxos'][-1], None) #spent
+
+        response = http_get_call(url.hostname, url.port, '/rest/getutxos/bulk'+self.FORMAT_SEPARATOR+'json', True)
+        assert_equal(response.status, 405) #outpoints must be posted
+
+        #an output index must be a plain integer
+        for vout in ['1.5', '1e3', '-1', '4294967296']:
+            json_request = '{"outpoints": [{"txid": "%s", "vout": %s}]}' % (vintx, vout)
+            response = http_post_call(url.hostname, url.port, '/rest/getutxos/bulk'+self.FORMAT_SEPARATOR+'json', json_request, True)
+            assert_equal(response.status, 400)
+        assert_equal(self.nodes[0].getbestblockhash(), json_obj["chaintipHash"]) #still serving
+
         #test rest bestblock
         bb_hash = self.nodes[0].getbestblockhash()
 
@@ -0,0 +1,164 @@
+#!/usr/bin/env python2
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the statistics of the RPC server: getrpcstats, and the /metrics
+# endpoint enabled by -rpcmetrics
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import base64
+import json
+import re
+
+try:
+    import http.client as httplib
+except ImportError:
+    import httplib
+try:
+    import urllib.parse as urlparse
+except ImportError:
+    import urlparse
+
+METRIC_LINE = re.compile(r'^i0coin_[a-z_]+(\{[a-z]+="[^"]*"(,[a-z]+="[^"]*")*\})? [0-9.e+-]+$')
+
+class RPCStatsTest (BitcoinTestFramework):
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(2, self.options.tmpdir, [['-rpcmetrics'], []])
+        self.is_network_split = False
+
+    def connect(self, node):
+        url = urlparse.urlparse(node.url)
+        self.headers = {"Authorization": "Basic " + base64.b64encode(url.username + ':' + url.password)}
+        conn = httplib.HTTPConnection(url.hostname, url.port)
+        conn.connect()
+        return conn
+
+    def getrpcstats(self, node):
+        # A connection of its own, so the only reused requests are those made by the test
+        conn = self.connect(node)
+        conn.request('POST', '/', self.statsrequest, self.headers)
+        stats = json.loads(conn.getresponse().read())['result']
+        conn.close()
+        return stats
+
+    def method_stat(self, stats, method, field):
+        return stats['methods'][method][field] if method in stats['methods'] else 0
+
+    def run_test(self):
+        node = self.nodes[0]
+        self.statsrequest = '{"method": "getrpcstats", "id": 1}'
+
+        #############################################
+        # two requests on one persistent connection #
+        #############################################
+        before = self.getrpcstats(node)
+        requests = ['{"method": "getblockcount", "id": 1}',
+                    '{"method": "getblockhash", "params": [1000], "id": 2}']
+        conn = self.connect(node)
+        for request in requests:
+            conn.request('POST', '/', request, self.headers)
+            conn.getresponse().read()
+            assert_equal(conn.sock!=None, True)
+        conn.close()
+        after = self.getrpcstats(node)
+
+        # Both requests and the second getrpcstats call are counted, but only
+        # the second request came on a connection kept alive
+        http = dict((key, after['http'][key] - before['http'][key]) for key in after['http'])
+        assert_equal(http['requests'], 3)
+        assert_equal(http['connectionsopened'], 2)
+        assert_equal(http['reusedrequests'], 1)
+        assert_equal(http['bytesin'], sum(len(request) for request in requests) + len(self.statsrequest))
+        assert_equal(http['bytesout'] > 0, True)
+
+        ######################
+        # per-method counts  #
+        ######################
+        # Calls are recorded once they have run, so the earlier getrpcstats call
+        # shows up but the running one does not; failed calls count as errors
+        for (method, count, errors) in [('getblockcount', 1, 0), ('getblockhash', 1, 1), ('getrpcstats', 1, 0)]:
+            assert_equal(self.method_stat(after, method, 'count') - self.method_stat(before, method, 'count'), count)
+            assert_equal(self.method_stat(after, method, 'errors') - self.method_stat(before, method, 'errors'), errors)
+        stat = after['methods']['getblockcount']
+        assert_equal(stat['p50'] <= stat['max'] and stat['avg'] <= stat['max'], True)
+        assert_equal('nosuchmethod' in after['methods'], False)
+
+        ############
+        # /metrics #
+        ############
+        # Credentials are required...
+        conn = self.connect(node)
+        conn.request('GET', '/metrics')
+        response = conn.getresponse()
+        response.read()
+        assert_equal(response.status, 401)
+        conn.close()
+
+        # ...and only GET is served
+        conn = self.connect(node)
+        conn.request('POST', '/metrics', '', self.headers)
+        response = conn.getresponse()
+        response.read()
+        assert_equal(response.status, 405)
+        conn.close()
+
+        conn = self.connect(node)
+        conn.request('GET', '/metrics', '', self.headers)
+        response = conn.getresponse()
+        assert_equal(response.status, 200)
+        assert_equal(response.getheader('Content-Type'), 'text/plain; version=0.0.4')
+        text = response.read()
+        conn.close()
+
+        # Prometheus text format: every sample belongs to a family declared
+        # with HELP and TYPE before it
+        families = {}
+        samples = {}
+        for line in text.splitlines():
+            if line.startswith('# HELP '):
+                continue
+            if line.startswith('# TYPE '):
+                (name, kind) = line.split(' ')[2:]
+                assert_equal(kind in ['counter', 'gauge', 'histogram'], True)
+                families[name] = kind
+                continue
+            assert_equal((line, METRIC_LINE.match(line) != None), (line, True))
+            (name, value) = line.split(' ')
+            family = re.sub(r'(_bucket|_sum|_count)?(\{.*)?$', '', name)
+            assert_equal((name, family in families), (name, True))
+            samples[name] = float(value)
+        for family in ['i0coin_http_requests_total', 'i0coin_http_reused_requests_total', 'i0coin_http_received_bytes_total',
+                       'i0coin_http_queue_wait_seconds', 'i0coin_rpc_request_duration_seconds', 'i0coin_rpc_request_errors_total']:
+            assert_equal(family in families, True)
+        assert_equal(families['i0coin_rpc_request_duration_seconds'], 'histogram')
+
+        # The samples agree with getrpcstats, and histogram buckets are cumulative
+        assert_equal(samples['i0coin_http_reused_requests_total'], after['http']['reusedrequests'])
+        label = '{method="getblockhash"'
+        bucket = re.compile(r'^i0coin_rpc_request_duration_seconds_bucket' + re.escape(label) + r',le="([^"]*)"\}$')
+        buckets = sorted((float(bucket.match(name).group(1)), value) for (name, value) in samples.items() if bucket.match(name))
+        assert_equal(len(buckets) > 1, True)
+        assert_equal(buckets[-1][0], float('inf'))
+        assert_equal([value for (bound, value) in buckets], sorted(value for (bound, value) in buckets))
+        assert_equal(buckets[-1][1], after['methods']['getblockhash']['count'])
+        assert_equal(samples['i0coin_rpc_request_duration_seconds_count' + label + '}'], after['methods']['getblockhash']['count'])
+        assert_equal(samples['i0coin_rpc_request_errors_total' + label + '}'], after['methods']['getblockhash']['errors'])
+
+        # Without -rpcmetrics there is no /metrics
+        conn = self.connect(self.nodes[1])
+        conn.request('GET', '/metrics', '', self.headers)
+        response = conn.getresponse()
+        response.read()
+        assert_equal(response.status, 404)
+        conn.close()
+
+if __name__ == '__main__':
+    RPCStatsTest ().main ()
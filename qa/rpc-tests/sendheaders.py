@@ -0,0 +1,290 @@
+#!/usr/bin/env python2
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from test_framework.mininode import *
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import cStringIO
+import time
+
+'''
+SendHeadersTest -- test BIP130 block announcements with "headers" messages.
+
+Setup: two nodes, node0 and node1, not connected to each other.  A NodeConn
+test_node is connected to node0, which is the node under test; node1 only
+mines blocks that test_node then announces to node0.
+
+1. node0 asks test_node for headers announcements with "sendheaders".
+
+2. Before test_node sends "sendheaders", new blocks are announced with an inv.
+
+3. After "sendheaders", new blocks are still announced with an inv while node0
+   does not know test_node has the parent header.  Once node0 has sent that
+   header (in reply to a getheaders), or test_node has announced it,
+   new blocks are announced with headers.
+
+4. A reorg to a branch mined by node1 is announced with all headers of the
+   branch, or with an inv of the new tip if it is longer than
+   MAX_BLOCKS_TO_ANNOUNCE blocks.
+
+5. Headers announcing blocks on top of node0's tip are fetched directly with a
+   getdata for every block, without a getheaders round trip.
+
+6. Headers that do not connect get a getheaders reply.  Every
+   MAX_UNCONNECTING_HEADERS-th of those in a row adds to the ban score, and
+   headers that connect reset the count.
+'''
+
+MAX_BLOCKS_TO_ANNOUNCE = 8
+MAX_UNCONNECTING_HEADERS = 10
+
+class TestNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.ping_counter = 1
+        self.last_pong = msg_pong()
+        self.sendheaders_received = False
+        self.clear_last_announcement()
+        self.last_getdata = []
+        self.getheaders_count = 0
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def clear_last_announcement(self):
+        with mininode_lock:
+            self.block_announced = False
+            self.last_inv = []
+            self.last_headers = []
+
+    def on_sendheaders(self, conn, message):
+        self.sendheaders_received = True
+
+    def on_inv(self, conn, message):
+        blocks = [x.hash for x in message.inv if x.type == 2]
+        if blocks:
+            self.block_announced = True
+            self.last_inv += blocks
+
+    def on_headers(self, conn, message):
+        if message.headers:
+            self.block_announced = True
+            for header in message.headers:
+                header.calc_sha256()
+                self.last_headers.append(header.sha256)
+
+    def on_getdata(self, conn, message):
+        self.last_getdata += [(x.type, x.hash) for x in message.inv]
+
+    def on_getheaders(self, conn, message):
+        self.getheaders_count += 1
+
+    def on_pong(self, conn, message):
+        self.last_pong = message
+
+    def wait_for_verack(self):
+        while True:
+            with mininode_lock:
+                if self.verack_received:
+                    return
+            time.sleep(0.05)
+
+    def send_message(self, message):
+        self.connection.send_message(message)
+
+    def sync_with_ping(self, timeout=30):
+        self.connection.send_message(msg_ping(nonce=self.ping_counter))
+        received_pong = False
+        sleep_time = 0.05
+        while not received_pong and timeout > 0:
+            time.sleep(sleep_time)
+            timeout -= sleep_time
+            with mininode_lock:
+                if self.last_pong.nonce == self.ping_counter:
+                    received_pong = True
+        self.ping_counter += 1
+        return received_pong
+
+    # Wait until the announcements cover tip, and return (invs, headers)
+    def wait_for_announcement(self, tip, timeout=30):
+        while timeout > 0:
+            with mininode_lock:
+                if tip in self.last_inv or tip in self.last_headers:
+                    announcement = (self.last_inv, self.last_headers)
+                    break
+            time.sleep(0.05)
+            timeout -= 0.05
+        assert(timeout > 0)
+        self.clear_last_announcement()
+        return announcement
+
+    def send_header_for_blocks(self, headers):
+        message = msg_headers()
+        message.headers = headers
+        self.send_message(message)
+
+    def send_get_headers(self, locator, hashstop):
+        message = msg_getheaders()
+        message.locator.vHave = locator
+        message.hashstop = hashstop
+        self.send_message(message)
+
+
+class SendHeadersTest(BitcoinTestFramework):
+    def setup_chain(self):
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self):
+        self.nodes = start_nodes(2, self.options.tmpdir, [["-debug"], ["-debug"]])
+
+    def mine(self, node, count):
+        return [int(h, 16) for h in node.generate(count)]
+
+    def header(self, node, sha256):
+        header = CBlockHeader()
+        header.deserialize(cStringIO.StringIO(binascii.unhexlify(node.getblockheader("%064x" % sha256, False))))
+        header.calc_sha256()
+        return header
+
+    def block(self, node, sha256):
+        block = CBlock()
+        block.deserialize(cStringIO.StringIO(binascii.unhexlify(node.getblock("%064x" % sha256, False))))
+        return block
+
+    # Give node1 all of node0's blocks, so it can mine on the same chain
+    def copy_chain(self):
+        for height in range(self.nodes[1].getblockcount() + 1, self.nodes[0].getblockcount() + 1):
+            self.nodes[1].submitblock(self.nodes[0].getblock(self.nodes[0].getblockhash(height), False))
+        assert_equal(self.nodes[1].getbestblockhash(), self.nodes[0].getbestblockhash())
+
+    # Hand node1's blocks to node0 at once, so a longer branch is a single reorg
+    def submit_blocks(self, blocks):
+        for sha256 in blocks:
+            self.nodes[0].submitblock(self.nodes[1].getblock("%064x" % sha256, False))
+        assert_equal(self.nodes[0].getbestblockhash(), "%064x" % blocks[-1])
+
+    def banscore(self):
+        return [peer['banscore'] for peer in self.nodes[0].getpeerinfo()][0]
+
+    def run_test(self):
+        node = self.nodes[0]
+        # Leave IBD before connecting
+        self.mine(node, 1)
+
+        test_node = TestNode()
+        connections = [NodeConn('127.0.0.1', p2p_port(0), node, test_node)]
+        test_node.add_connection(connections[0])
+        NetworkThread().start()
+        test_node.wait_for_verack()
+        test_node.sync_with_ping()
+
+        # 1. node0 prefers headers announcements itself
+        assert(test_node.sendheaders_received)
+
+        # 2. Without sendheaders, a new block is announced with an inv
+        tip = self.mine(node, 1)[0]
+        assert_equal(test_node.wait_for_announcement(tip), ([tip], []))
+
+        # 3. node0 only sends headers that connect to a header it knows
+        # test_node has.  It has not sent test_node any headers yet.
+        test_node.send_message(msg_sendheaders())
+        test_node.sync_with_ping()
+        tip = self.mine(node, 1)[0]
+        assert_equal(test_node.wait_for_announcement(tip), ([tip], []))
+
+        # Once node0 has sent the tip's header, the next block's header follows it
+        test_node.send_get_headers([tip], 0)
+        test_node.sync_with_ping()
+        for i in range(3):
+            tip = self.mine(node, 1)[0]
+            assert_equal(test_node.wait_for_announcement(tip), ([], [tip]))
+
+        # Several blocks at once are announced with all their headers
+        blocks = self.mine(node, 3)
+        announced = []
+        while blocks[-1] not in announced:
+            (invs, headers) = test_node.wait_for_announcement(blocks[-1])
+            assert_equal(invs, [])
+            announced += headers
+        assert_equal(announced, blocks)
+
+        # 4. A reorg to a branch node1 mined is announced with the headers
+        # of the whole branch...
+        self.copy_chain()
+        tip = self.mine(node, 2)[-1]
+        test_node.wait_for_announcement(tip)
+        branch = self.mine(self.nodes[1], 3)
+        self.submit_blocks(branch)
+        announced = []
+        while branch[-1] not in announced:
+            (invs, headers) = test_node.wait_for_announcement(branch[-1])
+            assert_equal(invs, [])
+            announced += headers
+        assert_equal(announced, branch)
+
+        # ...unless it is longer than MAX_BLOCKS_TO_ANNOUNCE, when the peer
+        # cannot have the header the announcement would start from
+        self.copy_chain()
+        tip = self.mine(node, MAX_BLOCKS_TO_ANNOUNCE + 1)[-1]
+        test_node.wait_for_announcement(tip)
+        branch = self.mine(self.nodes[1], MAX_BLOCKS_TO_ANNOUNCE + 2)
+        self.submit_blocks(branch)
+        (invs, headers) = test_node.wait_for_announcement(branch[-1])
+        assert_equal((invs, headers), ([branch[-1]], []))
+
+        # 5. Headers of new blocks on top of our tip are fetched directly
+        self.copy_chain()
+        new_blocks = self.mine(self.nodes[1], 3)
+        with mininode_lock:
+            test_node.last_getdata = []
+            count = test_node.getheaders_count
+        test_node.send_header_for_blocks([self.header(self.nodes[1], h) for h in new_blocks])
+        test_node.sync_with_ping()
+        with mininode_lock:
+            assert_equal(test_node.last_getdata, [(2, h) for h in new_blocks])
+            assert_equal(test_node.getheaders_count, count)
+        for h in new_blocks:
+            test_node.send_message(msg_block(self.block(self.nodes[1], h)))
+        test_node.sync_with_ping()
+        assert_equal(node.getbestblockhash(), "%064x" % new_blocks[-1])
+
+        # The peer announced that tip itself, so the next block gets a header
+        tip = self.mine(node, 1)[0]
+        assert_equal(test_node.wait_for_announcement(tip), ([], [tip]))
+
+        # 6. Headers that do not connect ask for the headers in between...
+        orphan = self.header(self.nodes[1], new_blocks[-1])
+        orphan.hashPrevBlock = random.getrandbits(256)
+        orphan.rehash()
+        with mininode_lock:
+            count = test_node.getheaders_count
+        for i in range(MAX_UNCONNECTING_HEADERS - 1):
+            test_node.send_header_for_blocks([orphan])
+            test_node.sync_with_ping()
+            with mininode_lock:
+                assert_equal(test_node.getheaders_count, count + i + 1)
+        assert_equal(self.banscore(), 0)
+
+        # ...and a streak of MAX_UNCONNECTING_HEADERS is penalized
+        test_node.send_header_for_blocks([orphan])
+        test_node.sync_with_ping()
+        assert_equal(self.banscore(), 20)
+
+        # Headers that connect end the streak
+        for i in range(MAX_UNCONNECTING_HEADERS - 1):
+            test_node.send_header_for_blocks([orphan])
+        test_node.send_header_for_blocks([self.header(node, new_blocks[-1])])
+        test_node.sync_with_ping()
+        test_node.send_header_for_blocks([orphan])
+        test_node.sync_with_ping()
+        assert_equal(self.banscore(), 20)
+
+        [c.disconnect_node() for c in connections]
+
+if __name__ == '__main__':
+    SendHeadersTest().main()
@@ -11,6 +11,7 @@ from test_framework.test_framework import BitcoinTestFramework
 from test_framework.util import *
 import zmq
 import binascii
+import struct
 from test_framework.mininode import hash256
 
 try:
@@ -32,8 +33,12 @@ class ZMQTest (BitcoinTestFramework):
         self.zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "hashblock")
         self.zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "hashtx")
         self.zmqSubSocket.connect("tcp://127.0.0.1:%i" % self.port)
+        self.zmqSeqSocket = self.zmqContext.socket(zmq.SUB)
+        self.zmqSeqSocket.setsockopt(zmq.SUBSCRIBE, "sequence")
+        self.zmqSeqSocket.connect("tcp://127.0.0.1:%i" % (self.port + 1))
         return start_nodes(4, self.options.tmpdir, extra_args=[
-            ['-zmqpubhashtx=tcp://127.0.0.1:'+str(self.port), '-zmqpubhashblock=tcp://127.0.0.1:'+str(self.port)],
+            ['-zmqpubhashtx=tcp://127.0.0.1:'+str(self.port), '-zmqpubhashblock=tcp://127.0.0.1:'+str(self.port),
+             '-zmqpubsequence=tcp://127.0.0.1:'+str(self.port + 1)],
             [],
             [],
             []
@@ -49,10 +54,12 @@ class ZMQTest (BitcoinTestFramework):
         msg = self.zmqSubSocket.recv_multipart()
         topic = str(msg[0])
         body = msg[1]
+        assert_equal(struct.unpack('<I', msg[2])[-1], 0) #first hashtx
 
         msg = self.zmqSubSocket.recv_multipart()
         topic = str(msg[0])
         body = msg[1]
+        assert_equal(struct.unpack('<I', msg[2])[-1], 0) #first hashblock
         blkhash = binascii.hexlify(body)
 
         assert_equal(genhashes[0], blkhash) #blockhash from generate must be equal to the hash received over zmq
@@ -86,6 +93,28 @@ class ZMQTest (BitcoinTestFramework):
 
         assert_equal(hashRPC, hashZMQ) #blockhash from generate must be equal to the hash received over zmq
 
+        #the sequence stream has every connected block, then the mempool addition
+        for x in range(0, n + 1):
+            msg = self.zmqSeqSocket.recv_multipart()
+            assert_equal(str(msg[0]), "sequence")
+            assert_equal(struct.unpack('<I', msg[2])[-1], x)
+            assert_equal(msg[1][32], 'C')
+        assert_equal(binascii.hexlify(msg[1][:32]), genhashes[-1])
+        msg = self.zmqSeqSocket.recv_multipart()
+        assert_equal(binascii.hexlify(msg[1][:32]), hashRPC)
+        assert_equal(msg[1][32], 'A')
+        mempool = self.nodes[0].getrawmempool(False, True)
+        assert_equal(mempool['txids'], [hashRPC])
+        assert_equal(struct.unpack('<Q', msg[1][33:41])[0], mempool['mempool_sequence'])
+
+        #all publishers report what they sent
+        notifications = sorted(self.nodes[0].getzmqnotifications(), key=lambda n: n['type'])
+        assert_equal([n['type'] for n in notifications], ['pubhashblock', 'pubhashtx', 'pubsequence'])
+        for n in notifications:
+            assert_equal(n['hwm'], 1000)
+            assert(n['published'] > 0)
+        assert_equal(self.nodes[1].getzmqnotifications(), [])
+
 
 if __name__ == '__main__':
     ZMQTest ().main ()
@@ -0,0 +1,88 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "checkqueue.h"
+#include "coins.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "policy/policy.h"
+#include "primitives/transaction.h"
+#include "pubkey.h"
+#include "script/sign.h"
+#include "script/standard.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+// Number of signed inputs verified per iteration, roughly a full block.
+static const unsigned int SCRIPTCHECK_BENCH_INPUTS = 500;
+
+// Verify the inputs of a large signed transaction through a CCheckQueue
+// run by nThreads threads in total, mirroring -par=nThreads.
+static void ScriptCheckQueue(benchmark::State& state, int nThreads)
+{
+    ECCVerifyHandle verifyHandle;
+
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+
+    CMutableTransaction txFrom;
+    txFrom.vout.resize(SCRIPTCHECK_BENCH_INPUTS);
+    for (unsigned int i = 0; i < SCRIPTCHECK_BENCH_INPUTS; i++) {
+        txFrom.vout[i].nValue = 1000;
+        txFrom.vout[i].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    }
+    CTransaction txFromConst(txFrom);
+    CCoins coins(txFromConst, 1);
+
+    CMutableTransaction txTo;
+    txTo.vin.resize(SCRIPTCHECK_BENCH_INPUTS);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1000;
+    txTo.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    for (unsigned int i = 0; i < SCRIPTCHECK_BENCH_INPUTS; i++) {
+        txTo.vin[i].prevout.hash = txFromConst.GetHash();
+        txTo.vin[i].prevout.n = i;
+    }
+    for (unsigned int i = 0; i < SCRIPTCHECK_BENCH_INPUTS; i++)
+        SignSignature(keystore, txFromConst, txTo, i);
+    CTransaction tx(txTo);
+    PrecomputedTransactionData txdata(tx);
+
+    CCheckQueue<CScriptCheck> queue(128, MAX_SCRIPTCHECK_THREADS);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads - 1; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, &queue));
+
+    while (state.KeepRunning()) {
+        CCheckQueueControl<CScriptCheck> control(&queue);
+        // Add the checks in small groups, like ConnectBlock does per transaction.
+        for (unsigned int i = 0; i < SCRIPTCHECK_BENCH_INPUTS; i += 2) {
+            std::vector<CScriptCheck> vChecks;
+            for (unsigned int j = i; j < std::min(i + 2, SCRIPTCHECK_BENCH_INPUTS); j++)
+                vChecks.push_back(CScriptCheck(coins, tx, j, STANDARD_SCRIPT_VERIFY_FLAGS, false, &txdata));
+            control.Add(vChecks);
+        }
+        bool fValid = control.Wait();
+        assert(fValid);
+    }
+
+    queue.Quit();
+    threadGroup.join_all();
+}
+
+static void ScriptCheckQueue_par1(benchmark::State& state) { ScriptCheckQueue(state, 1); }
+static void ScriptCheckQueue_par2(benchmark::State& state) { ScriptCheckQueue(state, 2); }
+static void ScriptCheckQueue_par4(benchmark::State& state) { ScriptCheckQueue(state, 4); }
+static void ScriptCheckQueue_par8(benchmark::State& state) { ScriptCheckQueue(state, 8); }
+
+BENCHMARK(ScriptCheckQueue_par1);
+BENCHMARK(ScriptCheckQueue_par2);
+BENCHMARK(ScriptCheckQueue_par4);
+BENCHMARK(ScriptCheckQueue_par8);
@@ -0,0 +1,62 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "bloom.h"
+#include "crypto/common.h"
+#include "mruset.h"
+#include "net.h"
+#include "protocol.h"
+#include "uint256.h"
+
+#include <iostream>
+
+// Known-inventory tracking as done for every peer: each iteration remembers
+// one new inventory item and looks up one that was seen recently.
+
+static uint256 InventoryHash(uint64_t n)
+{
+    uint256 hash;
+    WriteLE64(hash.begin(), n);
+    WriteLE64(hash.begin() + 24, n * 0x9E3779B97F4A7C15ULL);
+    return hash;
+}
+
+static void RollingBloomInventory(benchmark::State& state)
+{
+    CRollingBloomFilter filter(INVENTORY_KNOWN_FILTER_ELEMENTS, 0.000001);
+    uint64_t n = 0;
+    for (; n < INVENTORY_KNOWN_FILTER_ELEMENTS; n++)
+        filter.insert(InventoryHash(n));
+
+    uint64_t nHits = 0;
+    while (state.KeepRunning()) {
+        filter.insert(InventoryHash(n));
+        nHits += filter.contains(InventoryHash(n - (n % 997)));
+        n++;
+    }
+    std::cout << "# RollingBloomInventory: " << filter.DynamicMemoryUsage() << " bytes per peer ("
+              << nHits << " hits)\n";
+}
+
+static void MruSetInventory(benchmark::State& state)
+{
+    mruset<CInv> set(INVENTORY_KNOWN_FILTER_ELEMENTS);
+    uint64_t n = 0;
+    for (; n < INVENTORY_KNOWN_FILTER_ELEMENTS; n++)
+        set.insert(CInv(MSG_TX, InventoryHash(n)));
+
+    uint64_t nHits = 0;
+    while (state.KeepRunning()) {
+        set.insert(CInv(MSG_TX, InventoryHash(n)));
+        nHits += set.count(CInv(MSG_TX, InventoryHash(n - (n % 997))));
+        n++;
+    }
+    std::cout << "# MruSetInventory: " << set.DynamicMemoryUsage() << " bytes per peer ("
+              << nHits << " hits)\n";
+}
+
+BENCHMARK(RollingBloomInventory);
+BENCHMARK(MruSetInventory);
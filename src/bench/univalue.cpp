@@ -0,0 +1,105 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "tinyformat.h"
+
+#include <univalue.h>
+
+// The work behind an RPC call returning a large result: building the reply
+// the way blockToJSON/TxToJSON do, writing it, parsing it on the client side
+// and looking up keys of a large object, as in a verbose getrawmempool.
+
+// Transactions in the block-like reply, and keys in the mempool-like object.
+static const int UNIVALUE_BENCH_TXS = 500;
+static const int UNIVALUE_BENCH_KEYS = 5000;
+
+static UniValue BuildBlockReply()
+{
+    UniValue block(UniValue::VOBJ);
+    block.push_back(Pair("hash", std::string(64, 'a')));
+    block.push_back(Pair("confirmations", 12));
+    block.push_back(Pair("height", 123456));
+    UniValue txs(UniValue::VARR);
+    for (int i = 0; i < UNIVALUE_BENCH_TXS; i++) {
+        UniValue tx(UniValue::VOBJ);
+        tx.push_back(Pair("txid", strprintf("%064x", i)));
+        tx.push_back(Pair("version", 1));
+        tx.push_back(Pair("locktime", 0));
+        UniValue vin(UniValue::VARR);
+        for (int j = 0; j < 2; j++) {
+            UniValue in(UniValue::VOBJ);
+            in.push_back(Pair("txid", strprintf("%064x", i * 2 + j)));
+            in.push_back(Pair("vout", j));
+            UniValue sig(UniValue::VOBJ);
+            sig.push_back(Pair("asm", std::string(140, 'b')));
+            sig.push_back(Pair("hex", std::string(212, 'c')));
+            in.push_back(Pair("scriptSig", sig));
+            in.push_back(Pair("sequence", (int64_t)4294967295LL));
+            vin.push_back(in);
+        }
+        tx.push_back(Pair("vin", vin));
+        UniValue vout(UniValue::VARR);
+        for (int j = 0; j < 2; j++) {
+            UniValue out(UniValue::VOBJ);
+            out.push_back(Pair("value", 12.5 + j));
+            out.push_back(Pair("n", j));
+            out.push_back(Pair("hex", std::string(50, 'd')));
+            vout.push_back(out);
+        }
+        tx.push_back(Pair("vout", vout));
+        txs.push_back(tx);
+    }
+    block.push_back(Pair("tx", txs));
+    block.push_back(Pair("difficulty", 1234.5678));
+    return block;
+}
+
+static void UniValueBuild(benchmark::State& state)
+{
+    while (state.KeepRunning()) {
+        UniValue block = BuildBlockReply();
+        assert(block.size() == 5);
+    }
+}
+
+static void UniValueWrite(benchmark::State& state)
+{
+    UniValue block = BuildBlockReply();
+    while (state.KeepRunning()) {
+        std::string str = block.write();
+        assert(!str.empty());
+    }
+}
+
+static void UniValueRead(benchmark::State& state)
+{
+    std::string str = BuildBlockReply().write();
+    while (state.KeepRunning()) {
+        UniValue block;
+        bool fRead = block.read(str);
+        assert(fRead);
+    }
+}
+
+static void UniValueFindKey(benchmark::State& state)
+{
+    UniValue obj(UniValue::VOBJ);
+    std::vector<std::string> keys;
+    for (int i = 0; i < UNIVALUE_BENCH_KEYS; i++) {
+        keys.push_back(strprintf("%064x", i * 7919));
+        obj.push_back(Pair(keys.back(), i));
+    }
+    int i = 0;
+    while (state.KeepRunning()) {
+        const UniValue& val = find_value(obj, keys[i++ % UNIVALUE_BENCH_KEYS]);
+        assert(val.isNum());
+    }
+}
+
+BENCHMARK(UniValueBuild);
+BENCHMARK(UniValueWrite);
+BENCHMARK(UniValueRead);
+BENCHMARK(UniValueFindKey);
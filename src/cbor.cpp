@@ -0,0 +1,288 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cbor.h"
+
+#include "utilstrencodings.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <limits>
+#include <vector>
+
+/** CBOR major types, stored in the top three bits of the initial byte */
+enum CBORMajorType {
+    CBOR_UINT = 0,
+    CBOR_NEGINT = 1,
+    CBOR_BYTES = 2,
+    CBOR_TEXT = 3,
+    CBOR_ARRAY = 4,
+    CBOR_MAP = 5,
+    CBOR_TAG = 6,
+    CBOR_SIMPLE = 7,
+};
+
+/** Append the initial byte of a data item and its big-endian argument */
+static void WriteHead(std::string& out, int nMajor, uint64_t n)
+{
+    unsigned char chMajor = nMajor << 5;
+    int nBytes;
+    if (n < 24) {
+        out += (char)(chMajor | n);
+        return;
+    } else if (n <= 0xff) {
+        out += (char)(chMajor | 24);
+        nBytes = 1;
+    } else if (n <= 0xffff) {
+        out += (char)(chMajor | 25);
+        nBytes = 2;
+    } else if (n <= 0xffffffffULL) {
+        out += (char)(chMajor | 26);
+        nBytes = 4;
+    } else {
+        out += (char)(chMajor | 27);
+        nBytes = 8;
+    }
+    for (int i = nBytes - 1; i >= 0; i--)
+        out += (char)((n >> (8 * i)) & 0xff);
+}
+
+static bool IsLowerHex(const std::string& str)
+{
+    if (str.empty() || str.size() % 2 != 0)
+        return false;
+    for (std::string::const_iterator it = str.begin(); it != str.end(); ++it)
+        if (!((*it >= '0' && *it <= '9') || (*it >= 'a' && *it <= 'f')))
+            return false;
+    return true;
+}
+
+/** Parse the digits of a JSON number without fraction or exponent */
+static bool ParseMagnitude(const std::string& str, size_t pos, uint64_t& n)
+{
+    if (pos >= str.size())
+        return false;
+    n = 0;
+    for (; pos < str.size(); pos++) {
+        if (str[pos] < '0' || str[pos] > '9')
+            return false;
+        uint64_t nDigit = str[pos] - '0';
+        if (n > (std::numeric_limits<uint64_t>::max() - nDigit) / 10)
+            return false;
+        n = n * 10 + nDigit;
+    }
+    return true;
+}
+
+static void WriteNumber(std::string& out, const UniValue& val)
+{
+    const std::string& str = val.getValStr();
+    bool fNegative = !str.empty() && str[0] == '-';
+    uint64_t n;
+    if (ParseMagnitude(str, fNegative ? 1 : 0, n)) {
+        if (!fNegative) {
+            WriteHead(out, CBOR_UINT, n);
+            return;
+        }
+        if (n > 0) {
+            WriteHead(out, CBOR_NEGINT, n - 1);
+            return;
+        }
+        // "-0" is still an integer
+        WriteHead(out, CBOR_UINT, 0);
+        return;
+    }
+    double d = val.get_real();
+    uint64_t nBits;
+    memcpy(&nBits, &d, sizeof(nBits));
+    out += (char)((CBOR_SIMPLE << 5) | 27);
+    for (int i = 7; i >= 0; i--)
+        out += (char)((nBits >> (8 * i)) & 0xff);
+}
+
+static void WriteString(std::string& out, const std::string& str)
+{
+    if (IsLowerHex(str)) {
+        std::vector<unsigned char> vch = ParseHex(str);
+        WriteHead(out, CBOR_BYTES, vch.size());
+        out.append(vch.begin(), vch.end());
+        return;
+    }
+    WriteHead(out, CBOR_TEXT, str.size());
+    out += str;
+}
+
+static void WriteValue(std::string& out, const UniValue& val)
+{
+    switch (val.getType()) {
+    case UniValue::VNULL:
+        out += (char)((CBOR_SIMPLE << 5) | 22);
+        break;
+    case UniValue::VBOOL:
+        out += (char)((CBOR_SIMPLE << 5) | (val.isTrue() ? 21 : 20));
+        break;
+    case UniValue::VNUM:
+        WriteNumber(out, val);
+        break;
+    case UniValue::VSTR:
+        WriteString(out, val.getValStr());
+        break;
+    case UniValue::VARR:
+        WriteHead(out, CBOR_ARRAY, val.size());
+        for (size_t i = 0; i < val.size(); i++)
+            WriteValue(out, val[i]);
+        break;
+    case UniValue::VOBJ: {
+        const std::vector<std::string>& keys = val.getKeys();
+        const std::vector<UniValue>& values = val.getValues();
+        WriteHead(out, CBOR_MAP, keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            // Keys are always text, even when they look like hex
+            WriteHead(out, CBOR_TEXT, keys[i].size());
+            out += keys[i];
+            WriteValue(out, values[i]);
+        }
+        break;
+    }
+    }
+}
+
+std::string EncodeCBOR(const UniValue& val)
+{
+    std::string out;
+    WriteValue(out, val);
+    return out;
+}
+
+/** Read the initial byte of a data item and its argument */
+static bool ReadHead(const std::string& str, size_t& pos, int& nMajor, int& nInfo, uint64_t& n)
+{
+    if (pos >= str.size())
+        return false;
+    unsigned char ch = str[pos++];
+    nMajor = ch >> 5;
+    nInfo = ch & 0x1f;
+    int nBytes;
+    if (nInfo < 24) {
+        n = nInfo;
+        return true;
+    } else if (nInfo <= 27) {
+        nBytes = 1 << (nInfo - 24);
+    } else {
+        // Reserved, or an indefinite length
+        return false;
+    }
+    if (str.size() - pos < (size_t)nBytes)
+        return false;
+    n = 0;
+    for (int i = 0; i < nBytes; i++)
+        n = (n << 8) | (unsigned char)str[pos++];
+    return true;
+}
+
+static bool ReadFloat(int nInfo, uint64_t n, double& d)
+{
+    if (nInfo == 25) {
+        int nExp = (n >> 10) & 0x1f;
+        int nMant = n & 0x3ff;
+        if (nExp == 31)
+            return false;
+        d = nExp == 0 ? ldexp((double)nMant, -24) : ldexp((double)(nMant + 1024), nExp - 25);
+        if (n & 0x8000)
+            d = -d;
+    } else if (nInfo == 26) {
+        uint32_t nBits = n;
+        float f;
+        memcpy(&f, &nBits, sizeof(f));
+        d = f;
+    } else {
+        memcpy(&d, &n, sizeof(d));
+    }
+    // JSON has no infinities or NaNs
+    return d - d == 0;
+}
+
+static bool ReadValue(const std::string& str, size_t& pos, UniValue& val, unsigned int nDepth)
+{
+    int nMajor, nInfo;
+    uint64_t n;
+    if (!ReadHead(str, pos, nMajor, nInfo, n))
+        return false;
+
+    switch (nMajor) {
+    case CBOR_UINT:
+        val.setInt(n);
+        return true;
+    case CBOR_NEGINT:
+        if (n > (uint64_t)std::numeric_limits<int64_t>::max())
+            return false;
+        val.setInt((int64_t)(-1 - (int64_t)n));
+        return true;
+    case CBOR_BYTES:
+    case CBOR_TEXT: {
+        if (n > str.size() - pos)
+            return false;
+        if (nMajor == CBOR_BYTES)
+            val.setStr(HexStr(str.begin() + pos, str.begin() + pos + n));
+        else
+            val.setStr(str.substr(pos, n));
+        pos += n;
+        return true;
+    }
+    case CBOR_ARRAY:
+    case CBOR_MAP: {
+        // Every item takes at least a byte, which bounds what is reserved
+        if (nDepth >= MAX_CBOR_DEPTH || n > str.size() - pos)
+            return false;
+        if (nMajor == CBOR_ARRAY)
+            val.setArray();
+        else
+            val.setObject();
+        for (uint64_t i = 0; i < n; i++) {
+            UniValue key, item;
+            if (nMajor == CBOR_MAP && (pos >= str.size() || (unsigned char)str[pos] >> 5 != CBOR_TEXT ||
+                !ReadValue(str, pos, key, nDepth + 1)))
+                return false;
+            if (!ReadValue(str, pos, item, nDepth + 1))
+                return false;
+            if (nMajor == CBOR_ARRAY)
+                val.push_backSwap(item);
+            else
+                val.pushKVSwap(key.getValStr(), item);
+        }
+        return true;
+    }
+    case CBOR_SIMPLE:
+        if (nInfo == 20 || nInfo == 21) {
+            val.setBool(nInfo == 21);
+            return true;
+        } else if (nInfo == 22 || nInfo == 23) {
+            // null and undefined
+            val.setNull();
+            return true;
+        } else if (nInfo >= 25 && nInfo <= 27) {
+            double d;
+            if (!ReadFloat(nInfo, n, d))
+                return false;
+            val.setFloat(d);
+            return true;
+        }
+        return false;
+    default:
+        // Tags would change the meaning of the value they wrap
+        return false;
+    }
+}
+
+bool DecodeCBOR(const std::string& str, UniValue& val)
+{
+    size_t pos = 0;
+    UniValue ret;
+    if (!ReadValue(str, pos, ret, 0) || pos != str.size())
+        return false;
+    val.swap(ret);
+    return true;
+}
@@ -0,0 +1,35 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CBOR_H
+#define BITCOIN_CBOR_H
+
+#include <string>
+
+#include <univalue.h>
+
+/** Media type of RPC requests and replies encoded with CBOR */
+static const char* const CBOR_CONTENT_TYPE = "application/cbor";
+
+/** Nesting of arrays and maps accepted by DecodeCBOR */
+static const unsigned int MAX_CBOR_DEPTH = 256;
+
+/**
+ * Encode a JSON value as CBOR (RFC 7049), for RPC clients that would rather
+ * not pay for JSON text. Arrays and objects are length-prefixed, integral
+ * numbers become CBOR integers and other numbers doubles. Strings of
+ * lowercase hex digits with an even length, which is how hashes, scripts
+ * and raw transactions appear in RPC results, are sent as byte strings.
+ */
+std::string EncodeCBOR(const UniValue& val);
+
+/**
+ * Decode CBOR into a JSON value, the reverse of EncodeCBOR: byte strings
+ * become lowercase hex strings so the RPC handlers see the same parameters
+ * as with JSON. Indefinite lengths, tags, map keys other than text strings
+ * and numbers that JSON cannot represent are rejected, as is trailing data.
+ */
+bool DecodeCBOR(const std::string& str, UniValue& val);
+
+#endif // BITCOIN_CBOR_H
@@ -6,9 +6,11 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -25,11 +27,24 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread owns one of a fixed number of local queues, and the master
+  * spreads new work over them. A thread takes work from the back of its own
+  * queue and, once that runs dry, steals from the front of the others. The
+  * shared mutex is only taken when work is added, and when a thread runs out
+  * of work to report its results.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
+    //! A thread-local share of the work, protected by its own mutex.
+    struct WorkerQueue
+    {
+        boost::mutex mutex;
+        std::deque<T> checks;
+    };
+
     //! Mutex to protect the inner state
     boost::mutex mutex;
 
@@ -39,23 +54,33 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The local queues. Slot 0 belongs to the master, worker threads are
+    //! assigned the other slots (sharing them if there are more threads).
+    boost::scoped_array<WorkerQueue> queues;
+
+    //! The number of local queues.
+    unsigned int nQueues;
+
+    //! The number of worker threads (excluding the master) that have started.
+    unsigned int nWorkers;
+
+    //! The queue the next call to Add starts filling.
+    unsigned int nNextQueue;
+
+    //! Incremented whenever work is added, so that a thread that found all
+    //! queues empty can tell whether it is safe to go to sleep.
+    unsigned int nGeneration;
 
     //! The number of workers (including the master) that are idle.
     int nIdle;
 
-    //! The total number of workers (including the master).
-    int nTotal;
-
     //! The temporary evaluation result.
     bool fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
-     * This includes elements that are no longer queued, but still in the
-     * worker's own batches.
+     * This includes elements that are no longer queued, but still in a
+     * worker's own batches, or processed but not yet reported.
      */
     unsigned int nTodo;
 
@@ -65,70 +90,114 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    /**
+     * Move a batch of checks from a local queue into vChecks and return its size.
+     * The owner takes from the back and thieves from the front, so both mostly
+     * stay out of each other's way. Batches are at most half of what is left
+     * (and no more than nBatchSize), so they shrink as the work drains and
+     * all threads finish approximately simultaneously.
+     */
+    unsigned int Take(WorkerQueue& wq, std::vector<T>& vChecks, bool fSteal)
+    {
+        boost::unique_lock<boost::mutex> lock(wq.mutex);
+        if (wq.checks.empty())
+            return 0;
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)(wq.checks.size() + 1) / 2));
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            if (fSteal) {
+                vChecks[i].swap(wq.checks.front());
+                wq.checks.pop_front();
+            } else {
+                vChecks[i].swap(wq.checks.back());
+                wq.checks.pop_back();
+            }
+        }
+        return nNow;
+    }
+
+    /** Throw away all queued checks after a failure. Requires mutex to be held. */
+    unsigned int Drain()
+    {
+        unsigned int nDrained = 0;
+        for (unsigned int i = 0; i < nQueues; i++) {
+            boost::unique_lock<boost::mutex> lock(queues[i].mutex);
+            nDrained += queues[i].checks.size();
+            queues[i].checks.clear();
+        }
+        return nDrained;
+    }
+
     /** Internal function that does bulk of the verification work. */
     bool Loop(bool fMaster = false)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
+        unsigned int nQueue = 0;
+        unsigned int nSeen;
+        bool fOk;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fMaster && nQueues > 1)
+                nQueue = 1 + nWorkers % (nQueues - 1);
+            if (!fMaster)
+                nWorkers++;
+            nSeen = nGeneration;
+            fOk = fAllOk;
+        }
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+            // Work until all queues are empty, reporting early if a check fails.
+            // fOk may also be false because another thread failed before;
+            // only a failure seen here may fail the current round.
+            unsigned int nDone = 0;
+            bool fFailed = false;
+            while (fOk) {
+                unsigned int nNow = Take(queues[nQueue], vChecks, false);
+                for (unsigned int i = 1; nNow == 0 && i < nQueues; i++)
+                    nNow = Take(queues[(nQueue + i) % nQueues], vChecks, true);
+                if (nNow == 0)
+                    break;
+                BOOST_FOREACH (T& check, vChecks)
+                    if (fOk)
+                        fOk = check();
+                fFailed = !fOk;
+                vChecks.clear();
+                nDone += nNow;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nTodo -= nDone;
+            if (fFailed && fAllOk) {
+                // No point in running the remaining checks.
+                fAllOk = false;
+                nTodo -= Drain();
+            }
+            if (nTodo == 0 && !fMaster)
+                // We processed the last element; inform the master it can exit and return the result
+                condMaster.notify_one();
+            if ((fMaster || fQuit) && nTodo == 0) {
+                bool fRet = fAllOk;
+                // reset the status for new work later
+                if (fMaster)
+                    fAllOk = true;
+                // return the current status
+                return fRet;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            // Only sleep if nothing was added since we last looked at the queues.
+            if (nGeneration == nSeen) {
+                nIdle++;
+                cond.wait(lock); // wait
+                nIdle--;
+            }
+            nSeen = nGeneration;
+            fOk = fAllOk;
         } while (true);
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nQueuesIn) : queues(new WorkerQueue[std::max(1U, nQueuesIn)]), nQueues(std::max(1U, nQueuesIn)), nWorkers(0), nNextQueue(0), nGeneration(0), nIdle(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
 
     //! Worker thread
     void Thread()
@@ -145,26 +214,55 @@ public:
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
+        if (vChecks.empty())
+            return;
         boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        // Once a check has failed, the outcome is known already.
+        if (!fAllOk)
+            return;
+        // Spread the checks in contiguous chunks over the queues of the running
+        // threads, rotating the starting queue so that small batches get
+        // distributed too.
+        unsigned int nActive = std::min(nQueues, nWorkers + 1);
+        unsigned int nChunk = (vChecks.size() + nActive - 1) / nActive;
+        unsigned int nPos = 0;
+        while (nPos < vChecks.size()) {
+            WorkerQueue& wq = queues[nNextQueue];
+            nNextQueue = (nNextQueue + 1) % nActive;
+            boost::unique_lock<boost::mutex> lockQueue(wq.mutex);
+            for (unsigned int nEnd = std::min(nPos + nChunk, (unsigned int)vChecks.size()); nPos < nEnd; nPos++) {
+                wq.checks.push_back(T());
+                vChecks[nPos].swap(wq.checks.back());
+            }
         }
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        nGeneration++;
+        // Only wake up as many workers as there are checks to run.
+        if (vChecks.size() >= (unsigned int)nIdle) {
             condWorker.notify_all();
+        } else {
+            for (unsigned int i = 0; i < vChecks.size(); i++)
+                condWorker.notify_one();
+        }
+    }
+
+    //! Make the worker threads exit once all queued work is done.
+    void Quit()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+        condWorker.notify_all();
     }
 
     ~CCheckQueue()
     {
     }
 
+    //! Whether the queue is unused, i.e. no checks are outstanding.
     bool IsIdle()
     {
         boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
     }
 
 };
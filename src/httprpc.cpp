@@ -1,8 +1,10 @@
 #include "httprpc.h"
 
 #include "base58.h"
+#include "cbor.h"
 #include "chainparams.h"
 #include "httpserver.h"
+#include "jsonwriter.h"
 #include "rpcprotocol.h"
 #include "rpcserver.h"
 #include "random.h"
@@ -12,6 +14,8 @@
 #include "ui_interface.h"
 
 #include <boost/algorithm/string.hpp> // boost::trim
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
 
 /** Simple one-shot callback timer to be used by the RPC mechanism to e.g.
  * re-lock the wellet.
@@ -55,7 +59,31 @@ static std::string strRPCUserColonPass;
 /* Stored RPC timer interface (for unregistration) */
 static HTTPRPCTimerInterface* httpRPCTimerInterface = 0;
 
-static void JSONErrorReply(HTTPRequest* req, const UniValue& objError, const UniValue& id)
+/** Whether a request is encoded as CBOR rather than JSON, judging by its
+ * Content-Type. Replies use the same encoding as the request.
+ */
+static bool IsCBORRequest(HTTPRequest* req)
+{
+    std::pair<bool, std::string> contentType = req->GetHeader("content-type");
+    if (!contentType.first)
+        return false;
+    std::string strType = contentType.second.substr(0, contentType.second.find(';'));
+    boost::trim(strType);
+    return boost::iequals(strType, CBOR_CONTENT_TYPE);
+}
+
+static void RPCReply(HTTPRequest* req, int nStatus, const UniValue& reply, bool fCBOR)
+{
+    if (fCBOR) {
+        req->WriteHeader("Content-Type", CBOR_CONTENT_TYPE);
+        req->WriteReply(nStatus, EncodeCBOR(reply));
+    } else {
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(nStatus, reply.write() + "\n");
+    }
+}
+
+static void JSONErrorReply(HTTPRequest* req, const UniValue& objError, const UniValue& id, bool fCBOR)
 {
     // Send error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
@@ -66,10 +94,7 @@ static void JSONErrorReply(HTTPRequest* req, const UniValue& objError, const Uni
     else if (code == RPC_METHOD_NOT_FOUND)
         nStatus = HTTP_NOT_FOUND;
 
-    std::string strReply = JSONRPCReply(NullUniValue, objError, id);
-
-    req->WriteHeader("Content-Type", "application/json");
-    req->WriteReply(nStatus, strReply);
+    RPCReply(req, nStatus, JSONRPCReplyObj(NullUniValue, objError, id), fCBOR);
 }
 
 static bool RPCAuthorized(const std::string& strAuth)
@@ -84,14 +109,9 @@ static bool RPCAuthorized(const std::string& strAuth)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
-static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
+/** Check the credentials of a request, replying with an error if they are wrong */
+static bool CheckAuthorization(HTTPRequest* req)
 {
-    // JSONRPC handles only POST
-    if (req->GetRequestMethod() != HTTPRequest::POST) {
-        req->WriteReply(HTTP_BAD_METHOD, "JSONRPC server handles only POST requests");
-        return false;
-    }
-    // Check authorization
     std::pair<bool, std::string> authHeader = req->GetHeader("authorization");
     if (!authHeader.first) {
         req->WriteReply(HTTP_UNAUTHORIZED);
@@ -109,42 +129,211 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         req->WriteReply(HTTP_UNAUTHORIZED);
         return false;
     }
+    return true;
+}
+
+/** Write the reply to a call whose result can be streamed, like JSONRPCReply does */
+static bool JSONRPCStreamReply(const JSONRequest& jreq, CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Key("result");
+    // Only the unflushed start of the reply is lost if the call isn't streamed
+    if (!tableRPC.executeStream(jreq.strMethod, jreq.params, writer))
+        return false;
+    writer.Pair("error", NullUniValue);
+    writer.Pair("id", jreq.id);
+    writer.EndObject();
+    return true;
+}
+
+static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
+{
+    // JSONRPC handles only POST
+    if (req->GetRequestMethod() != HTTPRequest::POST) {
+        req->WriteReply(HTTP_BAD_METHOD, "JSONRPC server handles only POST requests");
+        return false;
+    }
+    if (!CheckAuthorization(req))
+        return false;
 
     JSONRequest jreq;
+    bool fCBOR = IsCBORRequest(req);
     try {
         // Parse request
         UniValue valRequest;
-        if (!valRequest.read(req->ReadBody()))
+        if (fCBOR ? !DecodeCBOR(req->ReadBody(), valRequest) : !valRequest.read(req->ReadBody()))
             throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
-        std::string strReply;
+        UniValue reply;
         // singleton request
         if (valRequest.isObject()) {
             jreq.parse(valRequest);
 
+            // Streamed results are written as JSON text, so CBOR clients get them whole
+            if (!fCBOR && req->WriteJSONReply(boost::bind(JSONRPCStreamReply, boost::cref(jreq), _1)))
+                return true;
+
             UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
 
             // Send reply
-            strReply = JSONRPCReply(result, NullUniValue, jreq.id);
+            reply = JSONRPCReplyObj(result, NullUniValue, jreq.id);
 
         // array of requests
         } else if (valRequest.isArray())
-            strReply = JSONRPCExecBatch(valRequest.get_array());
+            reply = JSONRPCExecBatchObj(valRequest.get_array());
         else
             throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strReply);
+        RPCReply(req, HTTP_OK, reply, fCBOR);
     } catch (const UniValue& objError) {
-        JSONErrorReply(req, objError, jreq.id);
+        JSONErrorReply(req, objError, jreq.id, fCBOR);
         return false;
     } catch (const std::exception& e) {
-        JSONErrorReply(req, JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        JSONErrorReply(req, JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id, fCBOR);
         return false;
     }
     return true;
 }
 
+/** Bytes of a request body inspected to find the method it calls */
+static const size_t RPC_LANE_PEEK_SIZE = 1024;
+
+/** Find the method called by the start of a JSON request, if it is a single call */
+static std::string PeekJSONMethod(const std::string& strBody)
+{
+    size_t pos = strBody.find_first_not_of(" \t\r\n");
+    if (pos == std::string::npos || strBody[pos] != '{')
+        return "";
+    pos = strBody.find("\"method\"", pos);
+    if (pos == std::string::npos || (pos = strBody.find(':', pos)) == std::string::npos ||
+        (pos = strBody.find('"', pos)) == std::string::npos)
+        return "";
+    size_t end = strBody.find('"', pos + 1);
+    if (end == std::string::npos)
+        return "";
+    return strBody.substr(pos + 1, end - pos - 1);
+}
+
+/** Find the method called by the start of a CBOR request, if it is a single call */
+static std::string PeekCBORMethod(const std::string& strBody)
+{
+    // A map, then the text string "method" followed by a short text string
+    if (strBody.empty() || (unsigned char)strBody[0] >> 5 != 5)
+        return "";
+    size_t pos = strBody.find("\x66" "method");
+    if (pos == std::string::npos || (pos += 7) >= strBody.size())
+        return "";
+    unsigned char ch = strBody[pos++];
+    size_t nLen = ch & 0x1f;
+    if (ch >> 5 != 3)
+        return "";
+    if (nLen == 24 && pos < strBody.size())
+        nLen = (unsigned char)strBody[pos++];
+    else if (nLen >= 24)
+        return "";
+    return strBody.substr(pos, nLen);
+}
+
+/** Schedule mining and wallet calls ahead of chain queries. The body is
+ * only scanned, not parsed; anything unrecognized, including batches, goes
+ * to the chain lane.
+ */
+static HTTPWorkLane HTTPReq_JSONRPC_Lane(HTTPRequest* req, const std::string &)
+{
+    std::string strBody = req->PeekBody(RPC_LANE_PEEK_SIZE);
+    const CRPCCommand* pcmd = tableRPC[IsCBORRequest(req) ? PeekCBORMethod(strBody) : PeekJSONMethod(strBody)];
+    if (!pcmd)
+        return HTTP_LANE_CHAIN;
+    if (pcmd->category == "mining" || pcmd->category == "generating")
+        return HTTP_LANE_MINING;
+    if (pcmd->category == "wallet")
+        return HTTP_LANE_WALLET;
+    return HTTP_LANE_CHAIN;
+}
+
+static std::string FormatSeconds(int64_t nMicros)
+{
+    return strprintf("%d.%06d", nMicros / 1000000, nMicros % 1000000);
+}
+
+static void WriteMetricHeader(std::string& out, const std::string& strName, const std::string& strType, const std::string& strHelp)
+{
+    out += "# HELP i0coin_" + strName + " " + strHelp + "\n";
+    out += "# TYPE i0coin_" + strName + " " + strType + "\n";
+}
+
+static void WriteMetric(std::string& out, const std::string& strName, const std::string& strLabels, uint64_t nValue)
+{
+    out += strprintf("i0coin_%s%s %u\n", strName, strLabels.empty() ? "" : "{" + strLabels + "}", nValue);
+}
+
+/** Write a histogram in seconds, with cumulative buckets as Prometheus expects */
+static void WriteHistogram(std::string& out, const std::string& strName, const std::string& strLabels, const CLatencyStats& latency)
+{
+    uint64_t nCumulative = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        nCumulative += latency.vBuckets[i];
+        std::string strBound = i < LATENCY_BUCKETS - 1 ? strprintf("%g", LATENCY_BUCKET_BOUNDS[i] / 1e6) : "+Inf";
+        out += strprintf("i0coin_%s_bucket{%s,le=\"%s\"} %u\n", strName, strLabels, strBound, nCumulative);
+    }
+    out += strprintf("i0coin_%s_sum{%s} %s\n", strName, strLabels, FormatSeconds(latency.nTotalMicros));
+    out += strprintf("i0coin_%s_count{%s} %u\n", strName, strLabels, latency.nCount);
+}
+
+static bool HTTPReq_Metrics(HTTPRequest* req, const std::string &)
+{
+    if (req->GetRequestMethod() != HTTPRequest::GET) {
+        req->WriteReply(HTTP_BAD_METHOD, "Metrics are only served to GET requests");
+        return false;
+    }
+    if (!CheckAuthorization(req))
+        return false;
+
+    HTTPServerStats httpStats;
+    GetHTTPServerStats(httpStats);
+    std::vector<HTTPWorkLaneStats> laneStats;
+    GetHTTPWorkQueueStats(laneStats);
+    std::map<std::string, RPCMethodStats> mapMethodStats;
+    GetRPCMethodStats(mapMethodStats);
+
+    std::string out;
+    WriteMetricHeader(out, "http_connections", "gauge", "HTTP connections currently open.");
+    WriteMetric(out, "http_connections", "", httpStats.nConnectionsOpen);
+    WriteMetricHeader(out, "http_connections_opened_total", "counter", "HTTP connections opened.");
+    WriteMetric(out, "http_connections_opened_total", "", httpStats.nConnectionsOpened);
+    WriteMetricHeader(out, "http_requests_total", "counter", "HTTP requests received.");
+    WriteMetric(out, "http_requests_total", "", httpStats.nRequests);
+    WriteMetricHeader(out, "http_reused_requests_total", "counter", "HTTP requests on a connection kept alive from an earlier request.");
+    WriteMetric(out, "http_reused_requests_total", "", httpStats.nRequestsReused);
+    WriteMetricHeader(out, "http_received_bytes_total", "counter", "Bytes of HTTP request bodies received.");
+    WriteMetric(out, "http_received_bytes_total", "", httpStats.nBytesIn);
+    WriteMetricHeader(out, "http_sent_bytes_total", "counter", "Bytes of HTTP reply bodies sent.");
+    WriteMetric(out, "http_sent_bytes_total", "", httpStats.nBytesOut);
+
+    WriteMetricHeader(out, "http_queue_depth", "gauge", "HTTP requests waiting for a worker.");
+    BOOST_FOREACH(const HTTPWorkLaneStats& lane, laneStats)
+        WriteMetric(out, "http_queue_depth", "lane=\"" + lane.name + "\"", lane.nDepth);
+    WriteMetricHeader(out, "http_queue_rejected_total", "counter", "HTTP requests rejected because their lane of the work queue was full.");
+    BOOST_FOREACH(const HTTPWorkLaneStats& lane, laneStats)
+        WriteMetric(out, "http_queue_rejected_total", "lane=\"" + lane.name + "\"", lane.nRejected);
+    WriteMetricHeader(out, "http_queue_wait_seconds", "histogram", "Time HTTP requests waited for a worker.");
+    BOOST_FOREACH(const HTTPWorkLaneStats& lane, laneStats)
+        WriteHistogram(out, "http_queue_wait_seconds", "lane=\"" + lane.name + "\"", lane.wait);
+
+    // Only methods in the RPC table are recorded, so names need no escaping
+    std::map<std::string, RPCMethodStats>::const_iterator it;
+    WriteMetricHeader(out, "rpc_request_duration_seconds", "histogram", "Time RPC calls took to execute.");
+    for (it = mapMethodStats.begin(); it != mapMethodStats.end(); ++it)
+        WriteHistogram(out, "rpc_request_duration_seconds", "method=\"" + it->first + "\"", it->second.latency);
+    WriteMetricHeader(out, "rpc_request_errors_total", "counter", "RPC calls that failed.");
+    for (it = mapMethodStats.begin(); it != mapMethodStats.end(); ++it)
+        WriteMetric(out, "rpc_request_errors_total", "method=\"" + it->first + "\"", it->second.nErrors);
+
+    req->WriteHeader("Content-Type", "text/plain; version=0.0.4");
+    req->WriteReply(HTTP_OK, out);
+    return true;
+}
+
 static bool InitRPCAuthentication()
 {
     if (mapArgs["-rpcpassword"] == "")
@@ -168,7 +357,13 @@ bool StartHTTPRPC()
     if (!InitRPCAuthentication())
         return false;
 
-    RegisterHTTPHandler("/", true, HTTPReq_JSONRPC);
+    RegisterHTTPHandler("/", true, HTTPReq_JSONRPC, HTTP_LANE_CHAIN, HTTPReq_JSONRPC_Lane);
+    // Served in the mining lane, so scrapes are not stuck behind slow calls they should report on
+    if (GetBoolArg("-rpcmetrics", DEFAULT_RPC_METRICS))
+        RegisterHTTPHandler("/metrics", true, HTTPReq_Metrics, HTTP_LANE_MINING);
+    // Batches are handled in the chain lane, so their calls are spread over it too
+    RPCSetBatchDispatcher(boost::bind(&QueueHTTPWork, _1, HTTP_LANE_CHAIN),
+                          std::max((int)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1));
 
     assert(EventBase());
     httpRPCTimerInterface = new HTTPRPCTimerInterface(EventBase());
@@ -185,6 +380,8 @@ void StopHTTPRPC()
 {
     LogPrint("rpc", "Stopping HTTP RPC server\n");
     UnregisterHTTPHandler("/", true);
+    UnregisterHTTPHandler("/metrics", true);
+    RPCSetBatchDispatcher(RPCWorkDispatcher(), 0);
     if (httpRPCTimerInterface) {
         RPCUnregisterTimerInterface(httpRPCTimerInterface);
         delete httpRPCTimerInterface;
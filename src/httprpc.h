@@ -10,6 +10,9 @@
 
 class HTTPRequest;
 
+/** Serve metrics in the Prometheus text format at /metrics (-rpcmetrics) */
+static const bool DEFAULT_RPC_METRICS = false;
+
 /** Start HTTP RPC subsystem.
  * Precondition; HTTP and RPC has been started.
  */
@@ -6,11 +6,13 @@
 
 #include "chainparamsbase.h"
 #include "compat.h"
+#include "jsonwriter.h"
 #include "util.h"
 #include "netbase.h"
 #include "rpcprotocol.h" // For HTTP status codes
 #include "sync.h"
 #include "ui_interface.h"
+#include "utilstrencodings.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +26,7 @@
 #include <event2/http.h>
 #include <event2/thread.h>
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/util.h>
 #include <event2/keyvalq_struct.h>
 
@@ -38,6 +41,9 @@
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
 
+#include <limits>
+#include <set>
+
 /** Maximum size of http request (request line + headers) */
 static const size_t MAX_HEADERS_SIZE = 8192;
 
@@ -61,18 +67,50 @@ private:
     HTTPRequestHandler func;
 };
 
-/** Simple work queue for distributing work over multiple threads.
- * Work items are simply callable objects.
+/** Work item running a plain function */
+class HTTPFunctionItem : public HTTPClosure
+{
+public:
+    HTTPFunctionItem(const boost::function<void(void)>& func): func(func)
+    {
+    }
+    void operator()()
+    {
+        func();
+    }
+
+private:
+    boost::function<void(void)> func;
+};
+
+/** Work queue for distributing work over multiple threads.
+ * Work items are simply callable objects, queued in one of several lanes.
+ * Workers take the oldest item of the first lane that has one and is below
+ * its concurrency limit, so a busy lane can neither delay the lanes before
+ * it nor take every worker. The lock is only held to move items in and out.
  */
 template <typename WorkItem>
 class WorkQueue
 {
 private:
+    struct Lane
+    {
+        /* XXX in C++11 we can use std::unique_ptr here and avoid manual cleanup */
+        std::deque<std::pair<int64_t, WorkItem*> > queue;
+        int nRunning;
+        int nMaxRunning;
+        size_t nPeakDepth;
+        uint64_t nQueued;
+        uint64_t nRejected;
+        CLatencyStats wait;
+
+        Lane() : nRunning(0), nMaxRunning(1), nPeakDepth(0), nQueued(0), nRejected(0) {}
+    };
+
     /** Mutex protects entire object */
     CWaitableCriticalSection cs;
     CConditionVariable cond;
-    /* XXX in C++11 we can use std::unique_ptr here and avoid manual cleanup */
-    std::deque<WorkItem*> queue;
+    Lane lanes[HTTP_LANE_MAX];
     bool running;
     size_t maxDepth;
     int numThreads;
@@ -95,6 +133,15 @@ private:
         }
     };
 
+    /** Return the lane to take work from next, or -1 if there is none */
+    int NextLane() const
+    {
+        for (int i = 0; i < HTTP_LANE_MAX; i++)
+            if (!lanes[i].queue.empty() && lanes[i].nRunning < lanes[i].nMaxRunning)
+                return i;
+        return -1;
+    }
+
 public:
     WorkQueue(size_t maxDepth) : running(true),
                                  maxDepth(maxDepth),
@@ -106,19 +153,31 @@ public:
      */
     ~WorkQueue()
     {
-        while (!queue.empty()) {
-            delete queue.front();
-            queue.pop_front();
+        for (int i = 0; i < HTTP_LANE_MAX; i++) {
+            while (!lanes[i].queue.empty()) {
+                delete lanes[i].queue.front().second;
+                lanes[i].queue.pop_front();
+            }
         }
     }
+    /** Limit the number of workers that run items of a lane at once */
+    void SetMaxRunning(HTTPWorkLane lane, int nMaxRunning)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        lanes[lane].nMaxRunning = std::max(nMaxRunning, 1);
+    }
     /** Enqueue a work item */
-    bool Enqueue(WorkItem* item)
+    bool Enqueue(WorkItem* item, HTTPWorkLane laneIn = HTTP_LANE_CHAIN)
     {
         boost::unique_lock<boost::mutex> lock(cs);
-        if (queue.size() >= maxDepth) {
+        Lane& lane = lanes[laneIn];
+        if (lane.queue.size() >= maxDepth) {
+            lane.nRejected++;
             return false;
         }
-        queue.push_back(item);
+        lane.queue.push_back(std::make_pair(GetTimeMicros(), item));
+        lane.nQueued++;
+        lane.nPeakDepth = std::max(lane.nPeakDepth, lane.queue.size());
         cond.notify_one();
         return true;
     }
@@ -126,21 +185,35 @@ public:
     void Run()
     {
         ThreadCounter count(*this);
+        int nLane = -1;
         while (running) {
             WorkItem* i = 0;
             {
                 boost::unique_lock<boost::mutex> lock(cs);
-                while (running && queue.empty())
+                if (nLane >= 0)
+                    lanes[nLane].nRunning--;
+                // A slot of a saturated lane may just have been freed, which
+                // this thread will use itself unless it finds other work first
+                while (running && (nLane = NextLane()) < 0)
                     cond.wait(lock);
                 if (!running)
                     break;
-                i = queue.front();
-                queue.pop_front();
+                Lane& lane = lanes[nLane];
+                lane.wait.Add(GetTimeMicros() - lane.queue.front().first);
+                i = lane.queue.front().second;
+                lane.queue.pop_front();
+                lane.nRunning++;
             }
             (*i)();
             delete i;
         }
     }
+    /** Whether the queue has not been interrupted */
+    bool IsRunning()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return running;
+    }
     /** Interrupt and exit loops */
     void Interrupt()
     {
@@ -160,20 +233,42 @@ public:
     size_t Depth()
     {
         boost::unique_lock<boost::mutex> lock(cs);
-        return queue.size();
+        size_t nDepth = 0;
+        for (int i = 0; i < HTTP_LANE_MAX; i++)
+            nDepth += lanes[i].queue.size();
+        return nDepth;
+    }
+
+    void GetStats(std::vector<HTTPWorkLaneStats>& stats)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        stats.resize(HTTP_LANE_MAX);
+        for (int i = 0; i < HTTP_LANE_MAX; i++) {
+            const Lane& lane = lanes[i];
+            stats[i].name = HTTPWorkLaneName((HTTPWorkLane)i);
+            stats[i].nDepth = lane.queue.size();
+            stats[i].nPeakDepth = lane.nPeakDepth;
+            stats[i].nRunning = lane.nRunning;
+            stats[i].nMaxRunning = lane.nMaxRunning;
+            stats[i].nQueued = lane.nQueued;
+            stats[i].nRejected = lane.nRejected;
+            stats[i].wait = lane.wait;
+        }
     }
 };
 
 struct HTTPPathHandler
 {
     HTTPPathHandler() {}
-    HTTPPathHandler(std::string prefix, bool exactMatch, HTTPRequestHandler handler):
-        prefix(prefix), exactMatch(exactMatch), handler(handler)
+    HTTPPathHandler(std::string prefix, bool exactMatch, HTTPRequestHandler handler, HTTPWorkLane lane, HTTPLaneSelector laneSelector):
+        prefix(prefix), exactMatch(exactMatch), handler(handler), lane(lane), laneSelector(laneSelector)
     {
     }
     std::string prefix;
     bool exactMatch;
     HTTPRequestHandler handler;
+    HTTPWorkLane lane;
+    HTTPLaneSelector laneSelector;
 };
 
 /** HTTP module state */
@@ -190,6 +285,8 @@ static WorkQueue<HTTPClosure>* workQueue = 0;
 std::vector<HTTPPathHandler> pathHandlers;
 //! Bound listening sockets
 std::vector<evhttp_bound_socket *> boundSockets;
+//! Seconds a client may take to make any progress (-rpcservertimeout)
+static int nHTTPServerTimeout = DEFAULT_HTTP_SERVER_TIMEOUT;
 
 /** Check if a network address is allowed to access the HTTP server */
 static bool ClientAllowed(const CNetAddr& netaddr)
@@ -249,9 +346,50 @@ static std::string RequestMethodString(HTTPRequest::RequestMethod m)
     }
 }
 
+/** Protects httpStats, which is updated by the event thread and workers */
+static CCriticalSection cs_httpStats;
+static HTTPServerStats httpStats;
+/** Connections that have made a request; only used by the event thread */
+static std::set<evhttp_connection*> setHTTPConnections;
+
+static void http_connection_close_cb(struct evhttp_connection* con, void* arg)
+{
+    if (!setHTTPConnections.erase(con))
+        return;
+    LOCK(cs_httpStats);
+    httpStats.nConnectionsOpen--;
+}
+
+/** Count a request, and its connection if this is the first request on it */
+static void http_count_request(struct evhttp_request* req)
+{
+    evhttp_connection* con = evhttp_request_get_connection(req);
+    bool fNewConnection = con && setHTTPConnections.insert(con).second;
+    if (fNewConnection)
+        evhttp_connection_set_closecb(con, http_connection_close_cb, NULL);
+    size_t nBytesIn = evbuffer_get_length(evhttp_request_get_input_buffer(req));
+
+    LOCK(cs_httpStats);
+    httpStats.nRequests++;
+    if (fNewConnection) {
+        httpStats.nConnectionsOpened++;
+        httpStats.nConnectionsOpen++;
+    } else if (con) {
+        httpStats.nRequestsReused++;
+    }
+    httpStats.nBytesIn += nBytesIn;
+}
+
+static void http_count_bytes_out(size_t nBytes)
+{
+    LOCK(cs_httpStats);
+    httpStats.nBytesOut += nBytes;
+}
+
 /** HTTP request callback */
 static void http_request_cb(struct evhttp_request* req, void* arg)
 {
+    http_count_request(req);
     std::auto_ptr<HTTPRequest> hreq(new HTTPRequest(req));
 
     LogPrint("http", "Received a %s request for %s from %s\n",
@@ -288,9 +426,10 @@ static void http_request_cb(struct evhttp_request* req, void* arg)
 
     // Dispatch to worker thread
     if (i != iend) {
+        HTTPWorkLane lane = i->laneSelector ? i->laneSelector(hreq.get(), path) : i->lane;
         std::auto_ptr<HTTPWorkItem> item(new HTTPWorkItem(hreq.release(), path, i->handler));
         assert(workQueue);
-        if (workQueue->Enqueue(item.get()))
+        if (workQueue->Enqueue(item.get(), lane))
             item.release(); /* if true, queue took ownership */
         else
             item->req->WriteReply(HTTP_INTERNAL, "Work queue depth exceeded");
@@ -420,7 +559,8 @@ bool InitHTTPServer()
         return false;
     }
 
-    evhttp_set_timeout(http, GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT));
+    nHTTPServerTimeout = GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT);
+    evhttp_set_timeout(http, nHTTPServerTimeout);
     evhttp_set_max_headers_size(http, MAX_HEADERS_SIZE);
     evhttp_set_max_body_size(http, MAX_SIZE);
     evhttp_set_gencb(http, http_request_cb, NULL);
@@ -437,6 +577,34 @@ bool InitHTTPServer()
     LogPrintf("HTTP: creating work queue of depth %d\n", workQueueDepth);
 
     workQueue = new WorkQueue<HTTPClosure>(workQueueDepth);
+
+    // By default mining and wallet calls may use every worker, while chain
+    // queries and REST leave one free for them
+    int rpcThreads = std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
+    int laneThreads[HTTP_LANE_MAX];
+    laneThreads[HTTP_LANE_MINING] = rpcThreads;
+    laneThreads[HTTP_LANE_WALLET] = rpcThreads;
+    laneThreads[HTTP_LANE_CHAIN] = rpcThreads - 1;
+    laneThreads[HTTP_LANE_REST] = rpcThreads - 1;
+    if (mapMultiArgs.count("-rpclanethreads")) {
+        BOOST_FOREACH(const std::string& strLane, mapMultiArgs["-rpclanethreads"]) {
+            size_t pos = strLane.find(':');
+            int lane = 0;
+            while (lane < HTTP_LANE_MAX && strLane.substr(0, pos) != HTTPWorkLaneName((HTTPWorkLane)lane))
+                lane++;
+            if (pos == std::string::npos || lane == HTTP_LANE_MAX) {
+                LogPrintf("Invalid -rpclanethreads value %s, expected <lane>:<n> with lane mining, wallet, chain or rest\n", strLane);
+                continue;
+            }
+            laneThreads[lane] = atoi(strLane.substr(pos + 1));
+        }
+    }
+    for (int lane = 0; lane < HTTP_LANE_MAX; lane++) {
+        laneThreads[lane] = std::max(1, std::min(laneThreads[lane], rpcThreads));
+        LogPrint("http", "HTTP: at most %d workers for %s calls\n", laneThreads[lane], HTTPWorkLaneName((HTTPWorkLane)lane));
+        workQueue->SetMaxRunning((HTTPWorkLane)lane, laneThreads[lane]);
+    }
+
     eventBase = base;
     eventHTTP = http;
     return true;
@@ -513,6 +681,46 @@ struct event_base* EventBase()
     return eventBase;
 }
 
+std::string HTTPWorkLaneName(HTTPWorkLane lane)
+{
+    switch (lane) {
+    case HTTP_LANE_MINING:
+        return "mining";
+    case HTTP_LANE_WALLET:
+        return "wallet";
+    case HTTP_LANE_CHAIN:
+        return "chain";
+    case HTTP_LANE_REST:
+        return "rest";
+    default:
+        return "unknown";
+    }
+}
+
+bool QueueHTTPWork(const boost::function<void(void)>& func, HTTPWorkLane lane)
+{
+    if (!workQueue)
+        return false;
+    std::auto_ptr<HTTPFunctionItem> item(new HTTPFunctionItem(func));
+    if (!workQueue->Enqueue(item.get(), lane))
+        return false;
+    item.release(); /* if true, queue took ownership */
+    return true;
+}
+
+void GetHTTPWorkQueueStats(std::vector<HTTPWorkLaneStats>& stats)
+{
+    stats.clear();
+    if (workQueue)
+        workQueue->GetStats(stats);
+}
+
+void GetHTTPServerStats(HTTPServerStats& stats)
+{
+    LOCK(cs_httpStats);
+    stats = httpStats;
+}
+
 static void httpevent_callback_fn(evutil_socket_t, short, void* data)
 {
     // Static handler: simply call inner handler
@@ -540,12 +748,17 @@ void HTTPEvent::trigger(struct timeval* tv)
         evtimer_add(ev, tv); // trigger after timeval passed
 }
 HTTPRequest::HTTPRequest(struct evhttp_request* req) : req(req),
-                                                       replySent(false)
+                                                       replySent(false),
+                                                       replyStarted(false)
 {
 }
 HTTPRequest::~HTTPRequest()
 {
-    if (!replySent) {
+    if (replyStarted && !replySent) {
+        // The status was sent already, so all that is left is to cut the body short
+        LogPrintf("%s: Unfinished reply\n", __func__);
+        WriteReplyEnd();
+    } else if (!replySent) {
         // Keep track of whether reply was sent to avoid request leaks
         LogPrintf("%s: Unhandled request\n", __func__);
         WriteReply(HTTP_INTERNAL, "Unhandled request");
@@ -584,6 +797,19 @@ std::string HTTPRequest::ReadBody()
     return rv;
 }
 
+std::string HTTPRequest::PeekBody(size_t maxSize)
+{
+    struct evbuffer* buf = evhttp_request_get_input_buffer(req);
+    if (!buf)
+        return "";
+    std::string rv(std::min(maxSize, evbuffer_get_length(buf)), '\0');
+    if (rv.empty())
+        return rv;
+    ev_ssize_t nCopied = evbuffer_copyout(buf, &rv[0], rv.size());
+    rv.resize(std::max<ev_ssize_t>(nCopied, 0));
+    return rv;
+}
+
 void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
 {
     struct evkeyvalq* headers = evhttp_request_get_output_headers(req);
@@ -598,7 +824,8 @@ void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
  */
 void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
 {
-    assert(!replySent && req);
+    assert(!replySent && !replyStarted && req);
+    http_count_bytes_out(strReply.size());
     // Send event to main http thread to send reply message
     struct evbuffer* evb = evhttp_request_get_output_buffer(req);
     assert(evb);
@@ -610,6 +837,151 @@ void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
     req = 0; // transferred back to main thread
 }
 
+/* The pieces of a streamed reply are sent by separate events. libevent runs
+ * active events of the same priority in the order they were activated, which
+ * keeps the start, chunks and end in order.
+ */
+void HTTPRequest::WriteReplyStart(int nStatus)
+{
+    assert(!replySent && !replyStarted && req);
+    HTTPEvent* ev = new HTTPEvent(eventBase, true,
+        boost::bind(evhttp_send_reply_start, req, nStatus, (const char*)NULL));
+    ev->trigger(0);
+    replyStarted = true;
+}
+
+static void http_send_reply_chunk(struct evhttp_request* req, struct evbuffer* evb)
+{
+    evhttp_send_reply_chunk(req, evb);
+    evbuffer_free(evb);
+}
+
+void HTTPRequest::WriteReplyChunk(const std::string& strChunk)
+{
+    assert(!replySent && replyStarted && req);
+    if (strChunk.empty())
+        return; // An empty chunk would end the reply
+    http_count_bytes_out(strChunk.size());
+    struct evbuffer* evb = evbuffer_new();
+    assert(evb);
+    evbuffer_add(evb, strChunk.data(), strChunk.size());
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(http_send_reply_chunk, req, evb));
+    ev->trigger(0);
+}
+
+/** Size of the output of a connection, as seen from the event thread */
+struct HTTPReplyBacklog
+{
+    boost::mutex cs;
+    boost::condition_variable cond;
+    bool fDone;
+    bool fClosed;
+    size_t nBytes;
+
+    HTTPReplyBacklog() : fDone(false), fClosed(false), nBytes(0) {}
+};
+
+static void http_reply_backlog(struct evhttp_request* req, HTTPReplyBacklog* backlog)
+{
+    // Once the client is gone, libevent detaches the request from the connection
+    evhttp_connection* con = evhttp_request_get_connection(req);
+    size_t nBytes = con ? evbuffer_get_length(bufferevent_get_output(evhttp_connection_get_bufferevent(con))) : 0;
+    boost::unique_lock<boost::mutex> lock(backlog->cs);
+    backlog->fClosed = !con;
+    backlog->nBytes = nBytes;
+    backlog->fDone = true;
+    backlog->cond.notify_all();
+}
+
+/** Interval between checks of the output of a client that is behind */
+static const int HTTP_REPLY_DRAIN_POLL_MS = 10;
+
+bool HTTPRequest::WaitReplyDrained(size_t nMaxBytes)
+{
+    assert(!replySent && replyStarted && req);
+    // The deadline moves on whenever the client takes some of the backlog, so
+    // only one that stops reading altogether keeps a worker for this long
+    int64_t nDeadline = GetTimeMillis() + nHTTPServerTimeout * 1000;
+    size_t nLastBytes = std::numeric_limits<size_t>::max();
+    while (true) {
+        // Events run in order, so the chunks written so far have been handed
+        // to the connection by the time the backlog is measured
+        HTTPReplyBacklog backlog;
+        HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(http_reply_backlog, req, &backlog));
+        ev->trigger(0);
+        {
+            boost::unique_lock<boost::mutex> lock(backlog.cs);
+            while (!backlog.fDone)
+                backlog.cond.wait(lock);
+        }
+        if (backlog.fClosed || !workQueue->IsRunning())
+            return false;
+        if (backlog.nBytes <= nMaxBytes)
+            return true;
+        int64_t nNow = GetTimeMillis();
+        if (backlog.nBytes < nLastBytes) {
+            nLastBytes = backlog.nBytes;
+            nDeadline = nNow + nHTTPServerTimeout * 1000;
+        } else if (nNow >= nDeadline) {
+            LogPrint("http", "Client of %s read nothing for %d seconds, cutting the reply short\n", GetURI(), nHTTPServerTimeout);
+            return false;
+        }
+        MilliSleep(HTTP_REPLY_DRAIN_POLL_MS);
+    }
+}
+
+void HTTPRequest::WriteReplyEnd()
+{
+    assert(!replySent && replyStarted && req);
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(evhttp_send_reply_end, req));
+    ev->trigger(0);
+    replySent = true;
+    req = 0; // transferred back to main thread
+}
+
+static void http_write_json_chunk(HTTPRequest* req, bool* fStarted, const std::string& strChunk)
+{
+    if (!*fStarted) {
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReplyStart(HTTP_OK);
+        *fStarted = true;
+    }
+    req->WriteReplyChunk(strChunk);
+    // Hold the writer up while the client is behind; if it went away, abort
+    // the writer, and WriteJSONReply cuts the reply short
+    if (!req->WaitReplyDrained())
+        throw std::runtime_error("client went away");
+}
+
+bool HTTPRequest::WriteJSONReply(const boost::function<bool(CJSONWriter&)>& func)
+{
+    assert(!replySent && !replyStarted && req);
+    bool fStarted = false;
+    CJSONWriter writer(boost::bind(http_write_json_chunk, this, &fStarted, _1));
+    try {
+        if (!func(writer)) {
+            assert(!fStarted);
+            return false;
+        }
+    } catch (...) {
+        if (!fStarted)
+            throw;
+        LogPrintf("%s: Error after the reply to %s was started, cutting it short\n", __func__, GetURI());
+        WriteReplyEnd();
+        return true;
+    }
+
+    std::string strRest = writer.Release() + "\n";
+    if (fStarted) {
+        WriteReplyChunk(strRest);
+        WriteReplyEnd();
+    } else {
+        WriteHeader("Content-Type", "application/json");
+        WriteReply(HTTP_OK, strRest);
+    }
+    return true;
+}
+
 CService HTTPRequest::GetPeer()
 {
     evhttp_connection* con = evhttp_request_get_connection(req);
@@ -650,10 +1022,11 @@ HTTPRequest::RequestMethod HTTPRequest::GetRequestMethod()
     }
 }
 
-void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler)
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler,
+                         HTTPWorkLane lane, const HTTPLaneSelector &laneSelector)
 {
     LogPrint("http", "Registering HTTP handler for %s (exactmatch %d)\n", prefix, exactMatch);
-    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler));
+    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler, lane, laneSelector));
 }
 
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch)
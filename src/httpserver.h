@@ -5,8 +5,11 @@
 #ifndef BITCOIN_HTTPSERVER_H
 #define BITCOIN_HTTPSERVER_H
 
+#include "latencystats.h"
+
 #include <string>
 #include <stdint.h>
+#include <vector>
 #include <boost/thread.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/function.hpp>
@@ -14,10 +17,13 @@
 static const int DEFAULT_HTTP_THREADS=4;
 static const int DEFAULT_HTTP_WORKQUEUE=16;
 static const int DEFAULT_HTTP_SERVER_TIMEOUT=30;
+/** Bytes of a streamed reply that may wait to be sent before the writer is held up */
+static const size_t MAX_HTTP_REPLY_BACKLOG = 1024 * 1024;
 
 struct evhttp_request;
 struct event_base;
 class CService;
+class CJSONWriter;
 class HTTPRequest;
 
 /** Initialize HTTP server.
@@ -34,15 +40,64 @@ void InterruptHTTPServer();
 /** Stop HTTP server */
 void StopHTTPServer();
 
+/** Lanes of the work queue, in the order workers serve them */
+enum HTTPWorkLane {
+    HTTP_LANE_MINING,
+    HTTP_LANE_WALLET,
+    HTTP_LANE_CHAIN,
+    HTTP_LANE_REST,
+    HTTP_LANE_MAX
+};
+
+/** Lane name as used by -rpclanethreads and getrpcworkqueueinfo */
+std::string HTTPWorkLaneName(HTTPWorkLane lane);
+
 /** Handler for requests to a certain HTTP path */
 typedef boost::function<void(HTTPRequest* req, const std::string &)> HTTPRequestHandler;
+/** Picks the lane for a request; called on the event loop thread, so it must be cheap */
+typedef boost::function<HTTPWorkLane(HTTPRequest* req, const std::string &)> HTTPLaneSelector;
 /** Register handler for prefix.
  * If multiple handlers match a prefix, the first-registered one will
- * be invoked.
+ * be invoked. Its requests are queued in the given lane, or in the one
+ * laneSelector picks if that is set.
  */
-void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler);
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler,
+                         HTTPWorkLane lane = HTTP_LANE_CHAIN, const HTTPLaneSelector &laneSelector = HTTPLaneSelector());
 /** Unregister handler for prefix */
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
+/** Run func on a worker thread, queued in the given lane. Returns false if
+ * the lane is full or the server is not running. */
+bool QueueHTTPWork(const boost::function<void(void)>& func, HTTPWorkLane lane);
+
+struct HTTPWorkLaneStats
+{
+    std::string name;
+    size_t nDepth;
+    size_t nPeakDepth;
+    int nRunning;
+    int nMaxRunning;
+    uint64_t nQueued;
+    uint64_t nRejected;
+    CLatencyStats wait; //! Time requests spent queued before a worker took them
+};
+
+/** Fill in the work queue metrics, one entry per lane; empty if the server is not running */
+void GetHTTPWorkQueueStats(std::vector<HTTPWorkLaneStats>& stats);
+
+/** Connection and traffic counters of the HTTP server since startup */
+struct HTTPServerStats
+{
+    uint64_t nConnectionsOpened;
+    uint64_t nConnectionsOpen;
+    uint64_t nRequests;
+    uint64_t nRequestsReused; //! Requests that arrived on a connection used before (keep-alive)
+    uint64_t nBytesIn;        //! Request bodies
+    uint64_t nBytesOut;       //! Reply bodies
+
+    HTTPServerStats() : nConnectionsOpened(0), nConnectionsOpen(0), nRequests(0), nRequestsReused(0), nBytesIn(0), nBytesOut(0) {}
+};
+
+void GetHTTPServerStats(HTTPServerStats& stats);
 
 /** Return evhttp event base. This can be used by submodules to
  * queue timers or custom events.
@@ -57,6 +112,7 @@ class HTTPRequest
 private:
     struct evhttp_request* req;
     bool replySent;
+    bool replyStarted;
 
 public:
     HTTPRequest(struct evhttp_request* req);
@@ -96,6 +152,12 @@ public:
      */
     std::string ReadBody();
 
+    /**
+     * Return up to maxSize bytes from the start of the request body without
+     * consuming them.
+     */
+    std::string PeekBody(size_t maxSize);
+
     /**
      * Write output header.
      *
@@ -112,6 +174,43 @@ public:
      * main thread, do not call any other HTTPRequest methods after calling this.
      */
     void WriteReply(int nStatus, const std::string& strReply = "");
+
+    /**
+     * Start a reply whose body follows in pieces, sent with chunked transfer
+     * encoding (or until the connection closes, for HTTP/1.0 clients).
+     *
+     * @note Call WriteHeader before, and WriteReplyChunk and WriteReplyEnd
+     * after this instead of WriteReply.
+     */
+    void WriteReplyStart(int nStatus);
+    /** Send the next piece of a reply started by WriteReplyStart */
+    void WriteReplyChunk(const std::string& strChunk);
+    /**
+     * Wait until no more than nMaxBytes of a started reply are waiting to be
+     * sent, so a slow client cannot make the reply pile up in memory.
+     *
+     * @return false if the client has gone away, has read nothing for
+     * -rpcservertimeout seconds, or the server is shutting down; the reply
+     * should then be ended without writing the rest.
+     */
+    bool WaitReplyDrained(size_t nMaxBytes = MAX_HTTP_REPLY_BACKLOG);
+    /**
+     * Finish a reply started by WriteReplyStart.
+     *
+     * @note Like WriteReply, this gives the request back to the main thread.
+     */
+    void WriteReplyEnd();
+
+    /**
+     * Send a JSON reply with status 200 that func writes. The reply starts
+     * once the writer flushes its first piece; a shorter one is sent in one
+     * go. If func returns false, it must not have flushed anything, and no
+     * reply is sent. Exceptions thrown before the reply starts are passed on;
+     * once it has started, all that can be done is to cut it short.
+     * Every flushed piece waits for the client as WaitReplyDrained does, so
+     * func must not write with locks held.
+     */
+    bool WriteJSONReply(const boost::function<bool(CJSONWriter&)>& func);
 };
 
 /** Event handler closure.
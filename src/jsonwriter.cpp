@@ -0,0 +1,149 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonwriter.h"
+
+#include "tinyformat.h"
+
+#include <assert.h>
+#include <ctype.h>
+
+/** Append str as a JSON string, escaped the same way as by UniValue */
+static void JSONEscape(const std::string& str, std::string& out)
+{
+    out.reserve(out.size() + str.size() + 2);
+    out += '"';
+    for (std::string::const_iterator it = str.begin(); it != str.end(); ++it) {
+        unsigned char ch = *it;
+        switch (ch) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (isprint(ch))
+                out += ch;
+            else
+                out += strprintf("\\u%04x", ch);
+        }
+    }
+    out += '"';
+}
+
+CJSONWriter::CJSONWriter(const Sink& sinkIn, size_t nFlushSizeIn) :
+    sink(sinkIn), nFlushSize(nFlushSizeIn), fAfterKey(false), fFlushed(false)
+{
+}
+
+void CJSONWriter::BeginValue()
+{
+    if (fAfterKey) {
+        fAfterKey = false;
+        return;
+    }
+    if (!vEmpty.empty()) {
+        if (!vEmpty.back())
+            buf += ',';
+        vEmpty.back() = false;
+    }
+}
+
+void CJSONWriter::EndValue()
+{
+    if (buf.size() >= nFlushSize)
+        Flush();
+}
+
+void CJSONWriter::BeginObject()
+{
+    BeginValue();
+    buf += '{';
+    vEmpty.push_back(true);
+}
+
+void CJSONWriter::EndObject()
+{
+    assert(!vEmpty.empty() && !fAfterKey);
+    vEmpty.pop_back();
+    buf += '}';
+    EndValue();
+}
+
+void CJSONWriter::BeginArray()
+{
+    BeginValue();
+    buf += '[';
+    vEmpty.push_back(true);
+}
+
+void CJSONWriter::EndArray()
+{
+    assert(!vEmpty.empty() && !fAfterKey);
+    vEmpty.pop_back();
+    buf += ']';
+    EndValue();
+}
+
+void CJSONWriter::Key(const std::string& key)
+{
+    assert(!vEmpty.empty() && !fAfterKey);
+    BeginValue();
+    JSONEscape(key, buf);
+    buf += ':';
+    fAfterKey = true;
+}
+
+void CJSONWriter::Null()
+{
+    BeginValue();
+    buf += "null";
+    EndValue();
+}
+
+void CJSONWriter::Bool(bool f)
+{
+    BeginValue();
+    buf += f ? "true" : "false";
+    EndValue();
+}
+
+void CJSONWriter::Int(int64_t n)
+{
+    BeginValue();
+    buf += strprintf("%d", n);
+    EndValue();
+}
+
+void CJSONWriter::Str(const std::string& str)
+{
+    BeginValue();
+    JSONEscape(str, buf);
+    EndValue();
+}
+
+void CJSONWriter::Value(const UniValue& val)
+{
+    BeginValue();
+    buf += val.write();
+    EndValue();
+}
+
+void CJSONWriter::Flush()
+{
+    if (buf.empty())
+        return;
+    fFlushed = true;
+    sink(buf);
+    buf.clear();
+}
+
+std::string CJSONWriter::Release()
+{
+    std::string ret;
+    ret.swap(buf);
+    return ret;
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_JSONWRITER_H
+#define BITCOIN_JSONWRITER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+#include <univalue.h>
+
+/** Output collected by a CJSONWriter before it is handed to the sink */
+static const size_t DEFAULT_JSON_WRITER_FLUSH_SIZE = 64 * 1024;
+
+/**
+ * Writes JSON incrementally, formatted like UniValue::write() without
+ * indentation. Output is handed to a sink in pieces of about nFlushSize
+ * bytes, so large results need not be built as a UniValue tree and a
+ * string first. Commas are inserted automatically; keys are only valid
+ * directly inside an object, and each must be followed by one value.
+ *
+ * Nothing is passed to the sink until nFlushSize bytes are collected or
+ * Flush() is called, which lets callers discard a small result on error.
+ */
+class CJSONWriter
+{
+public:
+    typedef boost::function<void(const std::string&)> Sink;
+
+    CJSONWriter(const Sink& sink, size_t nFlushSize = DEFAULT_JSON_WRITER_FLUSH_SIZE);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& key);
+
+    void Null();
+    void Bool(bool f);
+    void Int(int64_t n);
+    void Str(const std::string& str);
+    /** Write a complete value, such as a small object built as usual */
+    void Value(const UniValue& val);
+    /** Write a key and its value */
+    void Pair(const std::string& key, const UniValue& val)
+    {
+        Key(key);
+        Value(val);
+    }
+
+    /** Whether anything has been handed to the sink yet */
+    bool Flushed() const { return fFlushed; }
+    /** Hand everything written so far to the sink */
+    void Flush();
+    /** Take everything written but not flushed yet, leaving nothing to flush */
+    std::string Release();
+
+private:
+    Sink sink;
+    size_t nFlushSize;
+    std::string buf;
+    /** For each open object or array, whether it has no elements yet */
+    std::vector<bool> vEmpty;
+    /** A key was written and its value is pending */
+    bool fAfterKey;
+    bool fFlushed;
+
+    void BeginValue();
+    void EndValue();
+};
+
+#endif // BITCOIN_JSONWRITER_H
@@ -0,0 +1,72 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_LATENCYSTATS_H
+#define BITCOIN_LATENCYSTATS_H
+
+#include <stdint.h>
+
+/** Upper bounds in microseconds of the buckets of CLatencyStats, as
+ * Prometheus uses by default plus one for calls under a millisecond */
+static const int64_t LATENCY_BUCKET_BOUNDS[] = {
+    1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+/** Number of buckets, including the last one without an upper bound */
+static const int LATENCY_BUCKETS = sizeof(LATENCY_BUCKET_BOUNDS) / sizeof(LATENCY_BUCKET_BOUNDS[0]) + 1;
+
+/**
+ * Histogram of durations, such as the time RPC calls take. It is not
+ * thread-safe; owners protect it with their own lock and hand out copies.
+ */
+class CLatencyStats
+{
+public:
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    //! Number of durations in each bucket (not cumulative)
+    uint64_t vBuckets[LATENCY_BUCKETS];
+
+    CLatencyStats() : nCount(0), nTotalMicros(0), nMaxMicros(0)
+    {
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+            vBuckets[i] = 0;
+    }
+
+    void Add(int64_t nMicros)
+    {
+        if (nMicros < 0)
+            nMicros = 0;
+        nCount++;
+        nTotalMicros += nMicros;
+        if (nMicros > nMaxMicros)
+            nMaxMicros = nMicros;
+        int i = 0;
+        while (i < LATENCY_BUCKETS - 1 && nMicros > LATENCY_BUCKET_BOUNDS[i])
+            i++;
+        vBuckets[i]++;
+    }
+
+    int64_t AverageMicros() const
+    {
+        return nCount ? nTotalMicros / (int64_t)nCount : 0;
+    }
+
+    /** Estimate a quantile (0 < q <= 1) as the upper bound of the bucket it falls in */
+    int64_t QuantileMicros(double q) const
+    {
+        uint64_t nRank = (uint64_t)(q * nCount + 0.5);
+        if (nRank < 1)
+            nRank = 1;
+        uint64_t nSeen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+            nSeen += vBuckets[i];
+            if (nSeen >= nRank)
+                return LATENCY_BUCKET_BOUNDS[i] < nMaxMicros ? LATENCY_BUCKET_BOUNDS[i] : nMaxMicros;
+        }
+        return nMaxMicros;
+    }
+};
+
+#endif // BITCOIN_LATENCYSTATS_H
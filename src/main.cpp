@@ -9,6 +9,7 @@
 #include "alert.h"
 #include "arith_uint256.h"
 #include "auxpow.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -207,6 +208,7 @@ namespace {
         int64_t nTime;  //! Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
+        boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //! Optional, used for "cmpctblock" downloads
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -221,8 +223,56 @@ namespace {
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /**
+     * "block" messages for the last few blocks we served, serialized once and
+     * shared by the send queues of every peer that asks for them. A new block
+     * is typically requested by most of our peers at once; without this it
+     * would be read, serialized and held in memory once per peer.
+     */
+    CCriticalSection cs_recentBlockMsgs;
+    std::deque<std::pair<uint256, CSharedNetMsg> > recentBlockMsgs;
+    /** The same for "cmpctblock" messages */
+    std::deque<std::pair<uint256, CSharedNetMsg> > recentCmpctBlockMsgs;
+    /** Number of shared "block" messages kept, and how far below the tip a block may be to be kept */
+    static const int MAX_RECENT_BLOCK_MSGS = 4;
+
+    /**
+     * Peers we asked to announce new blocks with an unsolicited "cmpctblock"
+     * (BIP152 high-bandwidth mode), oldest first. Protected by cs_main.
+     */
+    std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
+    /** Number of peers kept in high-bandwidth compact block mode */
+    static const unsigned int MAX_CMPCTBLOCK_ANNOUNCERS = 3;
 } // anon namespace
 
+static CSharedNetMsg GetRecentBlockMsg(const std::deque<std::pair<uint256, CSharedNetMsg> >& msgs, const uint256& hash)
+{
+    LOCK(cs_recentBlockMsgs);
+    for (std::deque<std::pair<uint256, CSharedNetMsg> >::const_iterator it = msgs.begin(); it != msgs.end(); ++it)
+        if (it->first == hash)
+            return it->second;
+    return CSharedNetMsg();
+}
+
+/** Serialize a block as a "block" or "cmpctblock" message, and keep it for other peers if fRecent */
+static CSharedNetMsg MakeBlockMsg(const CBlock& block, bool fCompact, bool fRecent)
+{
+    CSharedNetMsg msg;
+    if (fCompact)
+        msg = MakeSharedNetMsg("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+    else
+        msg = MakeSharedNetMsg("block", block);
+    if (fRecent) {
+        LOCK(cs_recentBlockMsgs);
+        std::deque<std::pair<uint256, CSharedNetMsg> >& msgs = fCompact ? recentCmpctBlockMsgs : recentBlockMsgs;
+        msgs.push_back(std::make_pair(block.GetHash(), msg));
+        if (msgs.size() > (size_t)MAX_RECENT_BLOCK_MSGS)
+            msgs.pop_front();
+    }
+    return msg;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Registration of network node signals.
@@ -261,6 +311,10 @@ struct CNodeState {
     uint256 hashLastUnknownBlock;
     //! The last full block we both have.
     CBlockIndex *pindexLastCommonBlock;
+    //! The best header we have sent our peer.
+    CBlockIndex *pindexBestHeaderSent;
+    //! Length of current-streak of unconnecting headers announcements
+    int nUnconnectingHeaders;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
     //! Since when we're stalling block download progress (in microseconds), or 0.
@@ -268,8 +322,24 @@ struct CNodeState {
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! How many blocks we request from this peer at once, adapted to its measured download speed.
+    int nBlocksInFlightMax;
+    //! Moving average of the time (in microseconds) the peer needs per block while it has requests queued, or 0 if unknown.
+    int64_t nBlockServiceTime;
+    //! Moving average of the time (in microseconds) from requesting a block to receiving it, or 0 if unknown.
+    int64_t nBlockLatency;
+    //! Moving average of the peer's block download speed in bytes per second.
+    int64_t nBlockBytesPerSec;
+    //! When we last received a block we had requested from this peer (in microseconds), or 0.
+    int64_t nLastBlockReceived;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer wants invs or headers (when possible) for block announcements.
+    bool fPreferHeaders;
+    //! Whether this peer wants new blocks announced with an unsolicited "cmpctblock".
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer can give us compact blocks ("sendcmpct" with version 1).
+    bool fProvidesHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -278,11 +348,21 @@ struct CNodeState {
         pindexBestKnownBlock = NULL;
         hashLastUnknownBlock.SetNull();
         pindexLastCommonBlock = NULL;
+        pindexBestHeaderSent = NULL;
+        nUnconnectingHeaders = 0;
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlocksInFlightMax = DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+        nBlockServiceTime = 0;
+        nBlockLatency = 0;
+        nBlockBytesPerSec = 0;
+        nLastBlockReceived = 0;
         fPreferredDownload = false;
+        fPreferHeaders = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
     }
 };
 
@@ -341,6 +421,7 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -363,20 +444,134 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false if the block was already in flight from this node. If pit is
+// given, it is pointed at the entry, which gets a PartiallyDownloadedBlock
+// when newly created.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex, list<QueuedBlock>::iterator **pit) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    // Short-circuit most stuff in case it's from the same node
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = &itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
     int64_t nNow = GetTimeMicros();
     QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams)};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
+    if (pit)
+        newentry.partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    itInFlight = mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it))).first;
+    if (pit)
+        *pit = &itInFlight->second.second;
+    return true;
+}
+
+/** Moving average giving new samples a weight of 1/8; the first sample is taken as is. */
+int64_t BlockDownloadAverage(int64_t nAverage, int64_t nSample)
+{
+    return nAverage == 0 ? nSample : nAverage + (nSample - nAverage) / 8;
+}
+
+} // anon namespace
+
+// The block download scheduling below is not static so the unit tests can
+// drive it.
+
+// Requires cs_main.
+// Returns false if the block was already in flight from this node.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL)
+{
+    return MarkBlockAsInFlight(nodeid, hash, consensusParams, pindex, NULL);
+}
+
+// Requires cs_main.
+// Account for a block of nBytes that we requested from nodeid at
+// nTimeRequested and that arrived at nNow (both in microseconds), and resize
+// the peer's download window to its measured speed.  Returns false without
+// taking a sample if the block arrived before it was requested: an
+// unsolicited compact block is only marked in flight once it is processed,
+// so it tells nothing about how fast the peer answers our requests.
+bool UpdateBlockDownloadStats(NodeId nodeid, int64_t nTimeRequested, unsigned int nBytes, int64_t nNow)
+{
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    if (nTimeRequested >= nNow)
+        return false;
+
+    // While blocks are queued, the peer starts on the next one as soon as it
+    // delivered the previous one, so only the time since then is what this
+    // block cost it.  This measures throughput rather than latency.
+    int64_t nServiceTime = std::max<int64_t>(nNow - std::max(nTimeRequested, state->nLastBlockReceived), 1);
+    state->nBlockServiceTime = BlockDownloadAverage(state->nBlockServiceTime, nServiceTime);
+    state->nBlockLatency = BlockDownloadAverage(state->nBlockLatency, nNow - nTimeRequested);
+    state->nBlockBytesPerSec = BlockDownloadAverage(state->nBlockBytesPerSec, (int64_t)nBytes * 1000000 / nServiceTime);
+    state->nLastBlockReceived = nNow;
+
+    int64_t nWindow = 1000000LL * BLOCK_DOWNLOAD_TARGET_QUEUE_TIME / state->nBlockServiceTime + 1;
+    state->nBlocksInFlightMax = std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER, nWindow));
+    return true;
+}
+
+// Requires cs_main.
+// Move up to count blocks that staller holds up the download window with
+// over to nodeid, if nodeid measured faster and is expected to deliver them
+// before the time staller has already taken by nNow.  The moved blocks are
+// appended to vGetData.
+void StealStalledBlocks(NodeId nodeid, NodeId staller, unsigned int count, std::vector<CInv>& vGetData, const Consensus::Params& consensusParams, int64_t nNow)
+{
+    CNodeState *state = State(nodeid);
+    CNodeState *stateStaller = State(staller);
+    assert(state != NULL && stateStaller != NULL);
+
+    // Only ever move blocks to a faster peer, so that two peers can not keep
+    // taking the same blocks from each other.
+    if (state->nBlockServiceTime == 0 ||
+            (stateStaller->nBlockServiceTime != 0 && stateStaller->nBlockServiceTime <= state->nBlockServiceTime))
+        return;
+
+    std::vector<CBlockIndex*> vSteal;
+    BOOST_FOREACH(const QueuedBlock& queued, stateStaller->vBlocksInFlight) {
+        if (vSteal.size() >= count)
+            break;
+        // Compact block downloads are near the tip and not what holds up the window.
+        if (queued.pindex == NULL || queued.partialBlock)
+            continue;
+        // Blocks are queued in request order, so the remaining ones have
+        // been waiting for an even shorter time.
+        int64_t nExpected = state->nBlockServiceTime * (state->nBlocksInFlight + vSteal.size() + 1);
+        if (nNow - queued.nTime < nExpected)
+            break;
+        vSteal.push_back(queued.pindex);
+    }
+
+    BOOST_FOREACH(CBlockIndex *pindex, vSteal) {
+        vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+        MarkBlockAsInFlight(nodeid, pindex->GetBlockHash(), consensusParams, pindex);
+        LogPrint("net", "Moving stalled block %s (%d) from peer=%d to peer=%d\n", pindex->GetBlockHash().ToString(),
+            pindex->nHeight, staller, nodeid);
+    }
+    if (!vSteal.empty())
+        stateStaller->nBlocksInFlightMax = std::max(MIN_BLOCKS_IN_TRANSIT_PER_PEER, stateStaller->nBlocksInFlightMax / 2);
+}
+
+namespace {
+
+// Requires cs_main.
+// Whether we are close enough to the tip to fetch announced blocks directly.
+bool CanDirectFetch(const Consensus::Params &consensusParams)
+{
+    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nPowTargetSpacing * 20;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -412,6 +607,16 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+// Requires cs_main
+bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
@@ -529,6 +734,10 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInFlightMax = state->nBlocksInFlightMax;
+    stats.nBlockServiceTime = state->nBlockServiceTime;
+    stats.nBlockLatency = state->nBlockLatency;
+    stats.nBlockBytesPerSec = state->nBlockBytesPerSec;
     return true;
 }
 
@@ -1156,21 +1365,28 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
+        // Signatures are cached for the check below, but the result is not:
+        // blocks never look up the script execution cache with these flags.
+        PrecomputedTransactionData txdata;
+        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, NULL, &txdata, false))
             return false;
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
+        // Check again against just the consensus-critical script verification
+        // flags of the next block, in case of bugs in the standard flags that
+        // cause transactions to pass as valid when they're actually invalid.
+        // For instance the STRICTENC flag was incorrectly allowing certain
         // CHECKSIG NOT scripts to pass, even though they were invalid.
         //
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        //
+        // Using the block's flags also stores the result in the script
+        // execution cache, so that connecting the block later is cheap.
+        unsigned int nBlockFlags = GetBlockScriptFlags(chainActive.Tip(), CBlockHeader::CURRENT_VERSION, GetAdjustedTime(), Params().GetConsensus());
+        if (!CheckInputs(tx, state, view, true, nBlockFlags, true, NULL, &txdata))
         {
-            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
+            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against block but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
         }
 
@@ -1183,7 +1399,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                     FormatMoney(nFees - nConflictingFees),
                     (int)nSize - (int)nConflictingSize);
         }
-        pool.RemoveStaged(allConflicting);
+        pool.RemoveStaged(allConflicting, MEMPOOL_REMOVAL_REPLACED);
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
@@ -1597,7 +1813,7 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, txdata), &error)) {
         return false;
     }
     return true;
@@ -1656,7 +1872,31 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
+unsigned int GetBlockScriptFlags(const CBlockIndex* pindexPrev, int nBaseVersion, int64_t nTime, const Consensus::Params& consensusParams)
+{
+    // BIP16 will be enabled for I0coin on 2013-09-01 0:00 UTC
+    // date -d "2013-09-01 0:00 UTC" +"%s"
+    const int64_t nBIP16SwitchTime = 1377993600;
+    bool fStrictPayToScriptHash = (nTime >= nBIP16SwitchTime);
+
+    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+
+    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
+    // when 75% of the network has upgraded:
+    if (nBaseVersion >= 3 && IsSuperMajority(3, pindexPrev, consensusParams.nMajorityEnforceBlockUpgrade, consensusParams)) {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
+    // blocks, when 75% of the network has upgraded:
+    if (nBaseVersion >= 4 && IsSuperMajority(4, pindexPrev, consensusParams.nMajorityEnforceBlockUpgrade, consensusParams)) {
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    }
+
+    return flags;
+}
+
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks, PrecomputedTransactionData *ptxdata, bool fCacheExecution)
 {
     if (!tx.IsCoinBase())
     {
@@ -1674,13 +1914,25 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Skip the scripts entirely if they are known to pass with these
+            // flags, e.g. because the transaction was accepted to our mempool.
+            if (fCacheExecution && IsScriptExecutionCached(tx.GetHash(), flags, !cacheStore))
+                return true;
+
+            // Signature hashes of a multi-input transaction share everything
+            // but the input being signed; serialize that part only once.
+            PrecomputedTransactionData txdataLocal;
+            PrecomputedTransactionData* txdata = ptxdata ? ptxdata : (pvChecks ? NULL : &txdataLocal);
+            if (txdata && tx.vin.size() > 1 && !txdata->IsInitialized())
+                txdata->Init(tx);
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(*coins, tx, i, flags, cacheStore, txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1693,7 +1945,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, txdata);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1707,6 +1959,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            // Checks deferred to pvChecks have not run yet, so only remember
+            // the result if they were all done here.
+            if (fCacheExecution && cacheStore && !pvChecks)
+                AddScriptExecutionCache(tx.GetHash(), flags);
         }
     }
 
@@ -1915,7 +2172,7 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
@@ -2049,30 +2306,19 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    // BIP16 will be enabled for I0coin on 2013-09-01 0:00 UTC
-    // date -d "2013-09-01 0:00 UTC" +"%s"
-    const int64_t nBIP16SwitchTime = 1377993600;
-    bool fStrictPayToScriptHash = (pindex->nTime >= nBIP16SwitchTime);
-
-    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
-
-    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
-    // when 75% of the network has upgraded:
-    if (block.nVersion.GetBaseVersion() >= 3 && IsSuperMajority(3, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
-
-    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
-    // blocks, when 75% of the network has upgraded:
-    if (block.nVersion.GetBaseVersion() >= 4 && IsSuperMajority(4, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    }
+    unsigned int flags = GetBlockScriptFlags(pindex->pprev, block.nVersion.GetBaseVersion(), pindex->nTime, chainparams.GetConsensus());
+    bool fStrictPayToScriptHash = (flags & SCRIPT_VERIFY_P2SH) != 0;
 
     int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
     LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), nTimeForks * 0.000001);
 
     CBlockUndo blockundo;
 
+    // Must outlive control, whose checks point into it; reserved up front so
+    // that the elements never move.
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(block.vtx.size());
+
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     CAmount nFees = 0;
@@ -2087,6 +2333,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         const CTransaction &tx = block.vtx[i];
 
         nInputs += tx.vin.size();
+        txdata.push_back(PrecomputedTransactionData());
         nSigOps += GetLegacySigOpCount(tx);
         if (nSigOps > MAX_BLOCK_SIGOPS)
             return state.DoS(100, error("ConnectBlock(): too many sigops"),
@@ -2113,7 +2360,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, nScriptCheckThreads ? &vChecks : NULL, &txdata[i]))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
             control.Add(vChecks);
@@ -2376,7 +2623,7 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
         list<CTransaction> removed;
         CValidationState stateDummy;
         if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
-            mempool.remove(tx, removed, true);
+            mempool.remove(tx, removed, true, MEMPOOL_REMOVAL_REORG);
         } else if (mempool.exists(tx.GetHash())) {
             vHashUpdate.push_back(tx.GetHash());
         }
@@ -2396,6 +2643,7 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
         SyncWithWallets(tx, NULL);
     }
+    GetMainSignals().BlockDisconnected(block);
     return true;
 }
 
@@ -2461,6 +2709,7 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
         SyncWithWallets(tx, pblock);
     }
+    GetMainSignals().BlockConnected(*pblock, pindexNew);
 
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
     LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, nTimePostConnect * 0.000001);
@@ -2624,9 +2873,11 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
     do {
         boost::this_thread::interruption_point();
 
+        const CBlockIndex *pindexFork;
         bool fInitialDownload;
         {
             LOCK(cs_main);
+            CBlockIndex *pindexOldTip = chainActive.Tip();
             pindexMostWork = FindMostWorkChain();
 
             // Whether we have anything to do at all.
@@ -2637,22 +2888,43 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
                 return false;
 
             pindexNewTip = chainActive.Tip();
+            pindexFork = pindexOldTip ? chainActive.FindFork(pindexOldTip) : NULL;
             fInitialDownload = IsInitialBlockDownload();
+
+            // Have the "cmpctblock" ready for peers that get new blocks announced that way
+            if (!fInitialDownload && pblock && pblock->GetHash() == pindexNewTip->GetBlockHash())
+                MakeBlockMsg(*pblock, true, true);
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
 
         // Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            // Find the hashes of all blocks that weren't previously in the best chain.
+            std::vector<uint256> vHashes;
+            const CBlockIndex *pindexToAnnounce = pindexNewTip;
+            while (pindexToAnnounce != pindexFork) {
+                vHashes.push_back(pindexToAnnounce->GetBlockHash());
+                pindexToAnnounce = pindexToAnnounce->pprev;
+                if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE) {
+                    // Limit announcements in case of a huge reorganization.
+                    // Rely on the peer's synchronization mechanism in that case.
+                    break;
+                }
+            }
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = 0;
             if (fCheckpointsEnabled)
                 nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainparams.Checkpoints());
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        BOOST_REVERSE_FOREACH(const uint256& hash, vHashes) {
+                            pnode->PushBlockHash(hash);
+                        }
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             GetMainSignals().UpdatedBlockTip(pindexNewTip);
@@ -4091,138 +4363,226 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/**
+ * Message processing was written for a single message handler thread. With
+ * several, messages that touch state shared between peers still run one at a
+ * time under this lock; only those known to be safe (see IsParallelMessage)
+ * run without it. Lock order: cs_serialMessages, then cs_main.
+ */
+static CCriticalSection cs_serialMessages;
+
+/** SendMessages passes a peer may skip for busy locks before it waits for them */
+static const int MAX_SEND_LOCK_SKIPS = 8;
+
+/** Messages that only touch the sending peer's own state. */
+static bool IsParallelMessage(const std::string& strCommand)
+{
+    return strCommand == "ping" || strCommand == "pong";
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
+    // The block to send (if any) is chosen under cs_main, but read from disk
+    // and sent without it, so that serving old blocks does not hold up
+    // validation or other peers.
+    CInv invBlock;
+    CDiskBlockPos posBlock;
+    bool fRecentBlock = false;
+    bool fHistoricalBlock = false;
+    uint256 hashContinueTip;
+    pfrom->fGetDataPaced = false;
 
-    while (it != pfrom->vRecvGetData.end()) {
-        // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
-            break;
+    {
+        LOCK(cs_main);
 
-        const CInv &inv = *it;
-        {
-            boost::this_thread::interruption_point();
-            it++;
+        while (it != pfrom->vRecvGetData.end()) {
+            // Don't bother if send buffer is too full to respond anyway
+            if (pfrom->nSendSize >= SendBufferSize())
+                break;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            const CInv &inv = *it;
             {
-                bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                boost::this_thread::interruption_point();
+                it++;
+
+                if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    bool send = false;
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, consensusParams) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
                     }
-                }
-                // disconnect node in case we have reached the outbound limit for serving historical blocks
-                // never disconnect whitelisted nodes
-                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
-                if (send && CNode::OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
-                {
-                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    // disconnect node in case we have reached the outbound limit for serving historical blocks
+                    // never disconnect whitelisted nodes
+                    static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                    bool fHistorical = send && (pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek);
+                    if (send && CNode::HistoricalServingLimitReached(pfrom->GetUploadClass()) && (fHistorical || inv.type == MSG_FILTERED_BLOCK))
+                    {
+                        LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
 
-                    //disconnect node
-                    pfrom->fDisconnect = true;
-                    send = false;
-                }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
-                {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                        //disconnect node
+                        pfrom->fDisconnect = true;
+                        send = false;
+                    }
+                    // Same for a peer that used up its own share of historical blocks
+                    uint64_t nMaxHistoricalBytesPerPeer = CNode::GetMaxHistoricalBytesPerPeer();
+                    if (send && fHistorical && !pfrom->fWhitelisted && nMaxHistoricalBytesPerPeer > 0 && pfrom->nHistoricalBytesSent >= nMaxHistoricalBytesPerPeer)
                     {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter)
+                        LogPrint("net", "historical block limit per peer reached, disconnect peer=%d\n", pfrom->GetId());
+                        pfrom->fDisconnect = true;
+                        send = false;
+                    }
+                    // Historical blocks are paced by a token bucket, so that
+                    // syncing peers cannot crowd out new blocks, headers and
+                    // transactions. The request stays queued until it may go.
+                    if (send && fHistorical && !CNode::HistoricalUploadAllowed(pfrom->GetUploadClass()))
+                    {
+                        it--;
+                        pfrom->fGetDataPaced = true;
+                        break;
+                    }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                    {
+                        invBlock = inv;
+                        posBlock = mi->second->GetBlockPos();
+                        fRecentBlock = mi->second->nHeight > chainActive.Height() - MAX_RECENT_BLOCK_MSGS;
+                        fHistoricalBlock = fHistorical;
+
+                        // Trigger the peer node to send a getblocks request for the next batch of inventory
+                        if (inv.hash == pfrom->hashContinue)
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage("merkleblock", merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            hashContinueTip = chainActive.Tip()->GetBlockHash();
+                            pfrom->hashContinue.SetNull();
                         }
-                        // else
-                            // no response
                     }
-
-                    // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                }
+                else if (inv.IsKnownType())
+                {
+                    // Send stream from relay memory
+                    bool pushed = false;
                     {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue.SetNull();
+                        LOCK(cs_mapRelay);
+                        map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                        if (mi != mapRelay.end()) {
+                            pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                            pushed = true;
+                        }
+                    }
+                    if (!pushed && inv.type == MSG_TX) {
+                        CTransaction tx;
+                        if (mempool.lookup(inv.hash, tx)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << tx;
+                            pfrom->PushMessage("tx", ss);
+                            pushed = true;
+                        }
+                    }
+                    if (!pushed) {
+                        vNotFound.push_back(inv);
                     }
                 }
+
+                // Track requests for our stuff.
+                GetMainSignals().Inventory(inv.hash);
+
+                if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    break;
             }
-            else if (inv.IsKnownType())
+        }
+    }
+
+    pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
+
+    if (!posBlock.IsNull())
+    {
+        // A peer asking for an old block with MSG_CMPCT_BLOCK will not have
+        // a useful mempool for it, so it gets the full block instead.
+        bool fCompact = invBlock.type == MSG_CMPCT_BLOCK && fRecentBlock;
+        CSharedNetMsg msgBlock;
+        if (invBlock.type != MSG_FILTERED_BLOCK && fRecentBlock)
+            msgBlock = GetRecentBlockMsg(fCompact ? recentCmpctBlockMsgs : recentBlockMsgs, invBlock.hash);
+
+        // Send block from disk
+        CBlock block;
+        if (!msgBlock && (!ReadBlockFromDisk(block, posBlock, consensusParams) || block.GetHash() != invBlock.hash))
+        {
+            // Without cs_main the block may have been pruned in the meantime
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(invBlock.hash);
+            if (mi == mapBlockIndex.end() || (mi->second->nStatus & BLOCK_HAVE_DATA))
+                assert(!"cannot load block from disk");
+        }
+        else
+        {
+            if (invBlock.type == MSG_BLOCK || invBlock.type == MSG_CMPCT_BLOCK)
+            {
+                if (!msgBlock)
+                    msgBlock = MakeBlockMsg(block, fCompact, fRecentBlock);
+                pfrom->PushSharedMessage(msgBlock);
+            }
+            else // MSG_FILTERED_BLOCK)
             {
-                // Send stream from relay memory
-                bool pushed = false;
+                LOCK(pfrom->cs_filter);
+                if (pfrom->pfilter)
                 {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
-                }
-                if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                        pushed = true;
-                    }
-                }
-                if (!pushed) {
-                    vNotFound.push_back(inv);
+                    CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                    pfrom->PushMessage("merkleblock", merkleBlock);
+                    // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                    // This avoids hurting performance by pointlessly requiring a round-trip
+                    // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                    // they must either disconnect and retry or request the full block.
+                    // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                    // however we MUST always provide at least what the remote peer needs
+                    typedef std::pair<unsigned int, uint256> PairType;
+                    BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+                        if (!pfrom->filterInventoryKnown.contains(pair.second))
+                            pfrom->PushMessage("tx", block.vtx[pair.first]);
                 }
+                // else
+                    // no response
             }
 
-            // Track requests for our stuff.
-            GetMainSignals().Inventory(inv.hash);
+            if (fHistoricalBlock)
+            {
+                // Filtered blocks are charged as the full block
+                uint64_t nBytes = msgBlock ? msgBlock->size() : ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+                pfrom->nHistoricalBytesSent += nBytes;
+                CNode::RecordHistoricalBytesSent(nBytes);
+            }
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
-                break;
+            if (!hashContinueTip.IsNull())
+            {
+                // Bypass PushInventory, this must send even if redundant,
+                // and we want it right after the last block so they don't
+                // wait for other stuff first.
+                vector<CInv> vInv;
+                vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
+                pfrom->PushMessage("inv", vInv);
+            }
         }
     }
 
-    pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
-
     if (!vNotFound.empty()) {
         // Let the peer know that we didn't find what it asked for, so it doesn't
         // have to wait around forever. Currently only SPV clients actually care
@@ -4235,6 +4595,99 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+/**
+ * Ask a peer that just gave us a new tip to announce future blocks with an
+ * unsolicited "cmpctblock", which saves a round trip per block. Only the
+ * MAX_CMPCTBLOCK_ANNOUNCERS peers that did so most recently are asked.
+ */
+static void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    NodeId nodeStop = -1;
+    {
+        LOCK(cs_main);
+        CNodeState* nodestate = State(pfrom->GetId());
+        if (!nodestate || !nodestate->fProvidesHeaderAndIDs)
+            return;
+        if (std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), pfrom->GetId()) != lNodesAnnouncingHeaderAndIDs.end())
+            return;
+        if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_ANNOUNCERS) {
+            nodeStop = lNodesAnnouncingHeaderAndIDs.front();
+            lNodesAnnouncingHeaderAndIDs.pop_front();
+        }
+        lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+    }
+
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (nodeStop != -1) {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeStop) {
+                pnode->PushMessage("sendcmpct", false, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+    }
+    pfrom->PushMessage("sendcmpct", true, nCMPCTBLOCKVersion);
+}
+
+/**
+ * Validate a block received from pfrom, in full or reconstructed from a
+ * compact block, and update the download speed we measure for pfrom
+ */
+static void ProcessReceivedBlock(CNode* pfrom, const string& strCommand, const CBlock& block, bool fForceProcessing, int64_t nTimeReceived, const CChainParams& chainparams)
+{
+    {
+        LOCK(cs_main);
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(block.GetHash());
+        if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId())
+            UpdateBlockDownloadStats(pfrom->GetId(), itInFlight->second.second->nTime,
+                                     ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION), nTimeReceived);
+    }
+
+    CValidationState state;
+    ProcessNewBlock(state, chainparams, pfrom, &block, fForceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+        return;
+    }
+
+    bool fNewTip;
+    {
+        LOCK(cs_main);
+        fNewTip = chainActive.Tip()->GetBlockHash() == block.GetHash() && !IsInitialBlockDownload();
+    }
+    if (fNewTip)
+        MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+}
+
+// Requires cs_main.
+// Complete a compact block download from pfrom with the transactions that
+// were missing from our mempool. Returns true if block now holds the block.
+static bool FillCompactBlock(CNode* pfrom, PartiallyDownloadedBlock& partialBlock, const std::vector<CTransaction>& vtxMissing, CBlock& block)
+{
+    uint256 hash = partialBlock.header.GetHash();
+    ReadStatus status = partialBlock.FillBlock(block, vtxMissing);
+    if (status == READ_STATUS_INVALID) {
+        MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+        Misbehaving(pfrom->GetId(), 100);
+        LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+        return false;
+    } else if (status == READ_STATUS_FAILED) {
+        // Might have collided, fall back to getdata now :(
+        std::vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+        pfrom->PushMessage("getdata", vInv);
+        return false;
+    }
+    return true;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -4402,6 +4855,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SENDHEADERS_VERSION) {
+            // Tell our peer we prefer to receive headers rather than inv's
+            // We send this to non-NODE NETWORK peers as well, because even
+            // non-NODE NETWORK peers can announce blocks (such as pruning
+            // nodes)
+            pfrom->PushMessage("sendheaders");
+        }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell our peer we can provide version-1 compact blocks, without
+            // asking it to announce new blocks that way yet. This goes to
+            // non-NODE_NETWORK peers as well, as they may want compact blocks
+            // from us.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
     }
 
 
@@ -4529,9 +5000,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     // not a direct successor.
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                    if (CanDirectFetch(chainparams.GetConsensus()) &&
+                        nodestate->nBlocksInFlight < nodestate->nBlocksInFlightMax) {
+                        // Near the tip our mempool likely has most of the
+                        // block's transactions, so ask for it in compact form
+                        // if the peer can provide that.
+                        vToFetch.push_back(CInv(nodestate->fProvidesHeaderAndIDs ? MSG_CMPCT_BLOCK : MSG_BLOCK, inv.hash));
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -4577,8 +5051,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
             LogPrint("net", "received getdata for: %s peer=%d\n", vInv[0].ToString(), pfrom->id);
 
+        // Served by ProcessMessages once this message is done, outside cs_serialMessages
         pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
-        ProcessGetData(pfrom, chainparams.GetConsensus());
     }
 
 
@@ -4656,6 +5130,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
+        CNodeState *nodestate = State(pfrom->GetId());
         unsigned nCount = 0;
         unsigned nSize = 0;
         LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
@@ -4685,6 +5160,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         {
             LogPrint("net", "pushing %u headers, %u bytes\n", nCount, nSize);
             pfrom->PushMessage("headers", vHeaders);
+            // pindex can be NULL either if we sent chainActive.Tip() OR
+            // if our peer has chainActive.Tip() (and thus we are sending an empty
+            // headers message). In both cases it's safe to update
+            // pindexBestHeaderSent to be our tip.
+            nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         }
     }
 
@@ -4862,6 +5342,34 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // If this looks like it could be a block announcement (nCount <=
+        // MAX_BLOCKS_TO_ANNOUNCE), use special logic for handling headers that
+        // don't connect:
+        // - Send a getheaders message in response to try to connect the chain.
+        // - The peer can send up to MAX_UNCONNECTING_HEADERS in a row that
+        //   don't connect before giving DoS points
+        // - Once a headers message is received that is valid and does connect,
+        //   nUnconnectingHeaders gets reset back to 0.
+        if (mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end() && nCount <= MAX_BLOCKS_TO_ANNOUNCE) {
+            nodestate->nUnconnectingHeaders++;
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
+                    headers[0].GetHash().ToString(),
+                    headers[0].hashPrevBlock.ToString(),
+                    pindexBestHeader->nHeight,
+                    pfrom->id, nodestate->nUnconnectingHeaders);
+            // Set hashLastUnknownBlock for this peer, so that if we
+            // eventually get the headers - even from a different peer -
+            // we can use this peer to download.
+            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+
+            if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+                Misbehaving(pfrom->GetId(), 20);
+            return true;
+        }
+
         const CBlockIndex *pindexFormerBest = pindexBestHeader;
         bool fExtendingFormerBest = false;
         CBlockIndex *pindexLast = NULL;
@@ -4883,6 +5391,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
+        if (nodestate->nUnconnectingHeaders > 0)
+            LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
+        nodestate->nUnconnectingHeaders = 0;
+
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
@@ -4911,6 +5423,59 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256());
         }
 
+        // A peer that announced new blocks with "headers" expects us to
+        // fetch them directly, without another round trip.  If this set of
+        // headers is valid and ends in a block with at least as much work as
+        // our tip, download as much as possible.
+        if (pindexLast && !fInitialHeadersSync && CanDirectFetch(chainparams.GetConsensus()) &&
+                pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
+            vector<CBlockIndex *> vToFetch;
+            CBlockIndex *pindexWalk = pindexLast;
+            // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
+                        !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
+                    // We don't have this block, and it's not yet in flight.
+                    vToFetch.push_back(pindexWalk);
+                }
+                pindexWalk = pindexWalk->pprev;
+            }
+            // If pindexWalk still isn't on our main chain, we're looking at a
+            // very large reorg at a time we think we're close to caught up to
+            // the main chain -- this shouldn't really happen.  Bail out on the
+            // direct fetch and rely on parallel download instead.
+            if (!chainActive.Contains(pindexWalk)) {
+                LogPrint("net", "Large reorg, won't direct fetch to %s (%d)\n",
+                        pindexLast->GetBlockHash().ToString(),
+                        pindexLast->nHeight);
+            } else {
+                vector<CInv> vGetData;
+                // Download as much as possible, from earliest to latest.
+                BOOST_REVERSE_FOREACH(CBlockIndex *pindex, vToFetch) {
+                    if (nodestate->nBlocksInFlight >= nodestate->nBlocksInFlightMax) {
+                        // Can't download any more from this peer
+                        break;
+                    }
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex);
+                    LogPrint("net", "Requesting block %s from peer=%d\n",
+                            pindex->GetBlockHash().ToString(), pfrom->id);
+                }
+                if (vGetData.size() > 1) {
+                    LogPrint("net", "Downloading blocks toward %s (%d) via headers direct fetch\n",
+                            pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+                }
+                if (!vGetData.empty()) {
+                    // A single new block on top of our tip is most likely
+                    // made up of transactions in our mempool, so fetch it
+                    // as a compact block if the peer can provide that.
+                    if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1 && pindexLast->pprev == chainActive.Tip())
+                        vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                    pfrom->PushMessage("getdata", vGetData);
+                }
+            }
+        }
+
         CheckBlockIndex(chainparams.GetConsensus());
     }
 
@@ -4924,24 +5489,223 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
         // Process all blocks from whitelisted peers, even if not requested,
         // unless we're still syncing with the network.
         // Such an unrequested block may still be processed, subject to the
         // conditions in AcceptBlock().
         bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
-        ProcessNewBlock(state, chainparams, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
+        ProcessReceivedBlock(pfrom, strCommand, block, forceProcessing, nTimeReceived, chainparams);
+    }
+
+
+    else if (strCommand == "sendheaders")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        // Set when every transaction was prefilled or found in our mempool;
+        // the block is then processed once cs_main is released.
+        CBlock block;
+        {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+            if (!IsInitialBlockDownload())
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            return true;
+        }
+
+        // The header is checked in full, auxpow included, before we spend
+        // any effort on the transactions.
+        CBlockIndex *pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                return true;
+            }
+        }
+        if (pindex == NULL)
+            return true;
+
+        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+        bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+            return true;
+
+        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                pindex->nTx != 0) { // We had this block at some point, but pruned it
+            if (fAlreadyInFlight) {
+                // We requested this block for some reason, but our mempool will probably be useless
+                // so we just grab the block via normal getdata
+                std::vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                pfrom->PushMessage("getdata", vInv);
+            }
+            return true;
+        }
+
+        // If we're not close to tip yet, give up and let parallel block fetch work its magic
+        if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+            return true;
+
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // We want to be a bit conservative just to be extra careful about DoS
+        // possibilities in compact block processing...
+        if (pindex->nHeight > chainActive.Height() + 2) {
+            if (fAlreadyInFlight) {
+                // We requested this block, but it's far into the future, so our
+                // mempool will probably be useless - request the block normally
+                std::vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                pfrom->PushMessage("getdata", vInv);
+            }
+            // Otherwise the header was accepted above and the regular block
+            // download logic will fetch the block.
+            return true;
+        }
+
+        if ((fAlreadyInFlight && blockInFlightIt->second.first != pfrom->GetId()) ||
+                (!fAlreadyInFlight && nodestate->nBlocksInFlight >= nodestate->nBlocksInFlightMax))
+            return true;
+
+        list<QueuedBlock>::iterator *queuedBlockIt = NULL;
+        if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
+            if (!(*queuedBlockIt)->partialBlock)
+                (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+            else {
+                // The block was already in flight using compact blocks from the same peer
+                LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                return true;
+            }
+        }
+
+        PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+        ReadStatus status = partialBlock.InitData(cmpctblock);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+            return true;
+        } else if (status == READ_STATUS_FAILED) {
+            // Duplicate txindexes, the block is now in-flight, so just request it
+            std::vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+            pfrom->PushMessage("getdata", vInv);
+            return true;
+        }
+
+        BlockTransactionsRequest req;
+        for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+            if (!partialBlock.IsTxAvailable(i))
+                req.indexes.push_back(i);
+        }
+        if (!req.indexes.empty()) {
+            req.blockhash = pindex->GetBlockHash();
+            pfrom->PushMessage("getblocktxn", req);
+            return true;
+        }
+
+        if (!FillCompactBlock(pfrom, partialBlock, std::vector<CTransaction>(), block))
+            return true;
+        }
+
+        ProcessReceivedBlock(pfrom, strCommand, block, true, nTimeReceived, chainparams);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        CDiskBlockPos posBlock;
+        {
+            LOCK(cs_main);
+
+            BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+            if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
+            }
+
+            if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+                // Answer requests for older blocks with the full block. A
+                // peer sending many of them to make us read blocks from disk
+                // then has to download all of that data too.
+                LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+                pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+                return true;
+            }
+            posBlock = it->second->GetBlockPos();
+        }
+
+        // Like getdata, read the block without holding cs_main
+        CBlock block;
+        if (!ReadBlockFromDisk(block, posBlock, chainparams.GetConsensus()) || block.GetHash() != req.blockhash)
+            return true; // Pruned in the meantime
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
                 LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+            if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                    it->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
             }
+
+            if (!FillCompactBlock(pfrom, *it->second.second->partialBlock, resp.txn, block))
+                return true;
         }
 
+        ProcessReceivedBlock(pfrom, strCommand, block, true, nTimeReceived, chainparams);
     }
 
 
@@ -5197,7 +5961,10 @@ bool ProcessMessages(CNode* pfrom)
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom, chainparams.GetConsensus());
 
-    // this maintains the order of responses
+    // this maintains the order of responses. A peer whose historical blocks
+    // wait for upload tokens has its whole receive queue held back with them,
+    // so that a pong or headers never overtakes the blocks it asked for
+    // first; once the queue is full, -maxreceivebuffer stops reading from it.
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
@@ -5255,7 +6022,12 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (IsParallelMessage(strCommand)) {
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            } else {
+                LOCK(cs_serialMessages);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         }
         catch (const std::ios_base::failure& e)
@@ -5288,6 +6060,9 @@ bool ProcessMessages(CNode* pfrom)
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
 
+        if (!pfrom->vRecvGetData.empty())
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+
         break;
     }
 
@@ -5299,7 +6074,7 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
-bool SendMessages(CNode* pto, bool fSendTrickle)
+bool SendMessages(CNode* pto)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
     {
@@ -5336,9 +6111,20 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
-        TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
-        if (!lockMain)
+        // Skip this pass if the locks are busy, but wait for them once the peer
+        // has been skipped too often, so that it is not starved by other peers
+        bool fTryLocks = pto->nSendLockSkips < MAX_SEND_LOCK_SKIPS;
+        CCriticalBlock lockSerial(cs_serialMessages, "cs_serialMessages", __FILE__, __LINE__, fTryLocks);
+        if (!lockSerial) {
+            pto->nSendLockSkips++;
+            return true;
+        }
+        CCriticalBlock lockMain(cs_main, "cs_main", __FILE__, __LINE__, fTryLocks); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
+        if (!lockMain) {
+            pto->nSendLockSkips++;
             return true;
+        }
+        pto->nSendLockSkips = 0;
 
         // Address refresh broadcast
         static int64_t nLastRebroadcast;
@@ -5358,11 +6144,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 nLastRebroadcast = GetTime();
         }
 
+        int64_t nNow = GetTimeMicros();
+
         //
         // Message: addr
         //
-        if (fSendTrickle)
+        if (pto->nNextAddrSend < nNow)
         {
+            pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -5437,55 +6226,198 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         }
 
         //
-        // Message: inventory
+        // Try sending block announcements via headers
         //
-        vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
+            // If we have less than MAX_BLOCKS_TO_ANNOUNCE in our
+            // list of block hashes we're relaying, and our peer wants
+            // headers announcements, then find the first header
+            // not yet known to our peer but would connect, and send.
+            // If no header would connect, or if we have too many
+            // blocks, or if the peer doesn't want headers, just
+            // add all to the inv queue.
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
-            {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
+            vector<CBlock> vHeaders;
+            unsigned nSize = 0;
+            bool fRevertToInv = ((!state.fPreferHeaders &&
+                                 (!state.fPreferHeaderAndIDs || pto->vBlockHashesToAnnounce.size() > 1)) ||
+                                pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            CBlockIndex *pBestIndex = NULL; // last header queued for delivery
+            ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                // Try to find first header that our peer doesn't have, and
+                // then send all headers past that one.  If we come across any
+                // headers that aren't on chainActive, give up.
+                BOOST_FOREACH(const uint256 &hash, pto->vBlockHashesToAnnounce) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        // Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        // This means that the list of blocks to announce don't
+                        // connect to each other.  One way this could happen is
+                        // by using invalidateblock / reconsiderblock repeatedly
+                        // on the tip, causing it to be added multiple times to
+                        // vBlockHashesToAnnounce.  Robustly deal with this rare
+                        // situation by reverting to an inv.
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (!fFoundStartingHeader) {
+                        if (PeerHasHeader(&state, pindex))
+                            continue; // keep looking for the first new block
+                        if (pindex->pprev != NULL && !PeerHasHeader(&state, pindex->pprev)) {
+                            // Peer doesn't have this header or the prior one -- nothing will
+                            // connect, so bail out.
+                            fRevertToInv = true;
+                            break;
+                        }
+                        // Peer doesn't have this header but they do have the prior one.
+                        // Start sending headers.
+                        fFoundStartingHeader = true;
+                    }
+                    // The headers carry their auxpow, so keep the message
+                    // well below the size limit our peer enforces.
+                    const CBlockHeader header = pindex->GetBlockHeader(consensusParams);
+                    nSize += GetSerializeSize(header, SER_NETWORK, PROTOCOL_VERSION);
+                    if (nSize > THRESHOLD_HEADERS_SIZE) {
+                        fRevertToInv = true;
+                        break;
+                    }
+                    vHeaders.push_back(header);
+                }
+            }
+            if (!fRevertToInv && !vHeaders.empty()) {
+                bool fAnnounced = false;
+                if (vHeaders.size() == 1 && state.fPreferHeaderAndIDs) {
+                    // Peers in high-bandwidth compact block mode get a single
+                    // new block as a "cmpctblock" right away.  More than one
+                    // probably means they are catching up, so they get headers.
+                    CSharedNetMsg msg = GetRecentBlockMsg(recentCmpctBlockMsgs, pBestIndex->GetBlockHash());
+                    CBlock block;
+                    if (!msg && ReadBlockFromDisk(block, pBestIndex, consensusParams))
+                        msg = MakeBlockMsg(block, true, pBestIndex == chainActive.Tip());
+                    if (msg) {
+                        pto->PushSharedMessage(msg);
+                        fAnnounced = true;
+                    }
+                }
+                if (!fAnnounced && state.fPreferHeaders) {
+                    if (vHeaders.size() > 1) {
+                        LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
+                                vHeaders.size(),
+                                vHeaders.front().GetHash().ToString(),
+                                vHeaders.back().GetHash().ToString(), pto->id);
+                    } else {
+                        LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
+                                vHeaders.front().GetHash().ToString(), pto->id);
+                    }
+                    pto->PushMessage("headers", vHeaders);
+                    fAnnounced = true;
+                }
+                if (fAnnounced)
+                    state.pindexBestHeaderSent = pBestIndex;
+                else
+                    fRevertToInv = true;
+            }
+            if (fRevertToInv) {
+                // If falling back to using an inv, just try to inv the tip.
+                // The last entry in vBlockHashesToAnnounce was our tip at some point
+                // in the past.
+                if (!pto->vBlockHashesToAnnounce.empty()) {
+                    const uint256 &hashToAnnounce = pto->vBlockHashesToAnnounce.back();
+                    BlockMap::iterator mi = mapBlockIndex.find(hashToAnnounce);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+
+                    // Warn if we're announcing a block that is not on the main chain.
+                    // This should be very rare and could be optimized out.
+                    // Just log for now.
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        LogPrint("net", "Announcing block %s not on main chain (tip=%s)\n",
+                            hashToAnnounce.ToString(), chainActive.Tip()->GetBlockHash().ToString());
+                    }
 
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
+                    // If the peer announced this block to us, don't inv it back.
+                    // (Since block announcements may not be via inv's, we can't solely rely on
+                    // filterInventoryKnown to track this.)
+                    if (!PeerHasHeader(&state, pindex)) {
+                        pto->PushInventory(CInv(MSG_BLOCK, hashToAnnounce));
+                        LogPrint("net", "%s: sending inv peer=%d hash=%s\n", __func__,
+                            pto->id, hashToAnnounce.ToString());
                     }
                 }
+            }
+            pto->vBlockHashesToAnnounce.clear();
+        }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
-                {
+        //
+        // Message: inventory
+        //
+        vector<CInv> vInv;
+        {
+            LOCK(pto->cs_inventory);
+            vInv.reserve(std::max<size_t>(pto->vInventoryToSend.size(), INVENTORY_BROADCAST_MAX));
+
+            // Add blocks
+            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend) {
+                if (!pto->filterInventoryKnown.contains(inv.hash)) {
+                    pto->filterInventoryKnown.insert(inv.hash);
                     vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
+                    if (vInv.size() == MAX_INV_SZ) {
+                        pto->PushMessage("inv", vInv);
+                        vInv.clear();
+                    }
+                }
+            }
+            pto->vInventoryToSend.clear();
+
+            // Transactions are trickled out in batches at exponentially
+            // distributed intervals, so that their arrival order at our peers
+            // reveals as little as possible about where they originated.
+            bool fSendTrickle = pto->fWhitelisted;
+            if (pto->nNextInvSend < nNow) {
+                fSendTrickle = true;
+                // Use half the delay for outbound peers, as there is less privacy concern for them.
+                pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> !pto->fInbound);
+            }
+            if (fSendTrickle && !pto->setInventoryTxToSend.empty()) {
+                // Announce parents before their children and well-paying
+                // transactions first; whatever exceeds the per-interval limit
+                // waits for the next batch. Transactions the peer already
+                // knows, or that left the mempool meanwhile, are dropped.
+                vector<uint256> vHashes;
+                vHashes.reserve(pto->setInventoryTxToSend.size());
+                BOOST_FOREACH(const uint256& hash, pto->setInventoryTxToSend)
+                    if (!pto->filterInventoryKnown.contains(hash))
+                        vHashes.push_back(hash);
+                unsigned int nRelayedTransactions = mempool.SortForRelay(vHashes, INVENTORY_BROADCAST_MAX);
+                for (unsigned int i = 0; i < nRelayedTransactions; i++) {
+                    pto->filterInventoryKnown.insert(vHashes[i]);
+                    vInv.push_back(CInv(MSG_TX, vHashes[i]));
+                    if (vInv.size() == MAX_INV_SZ) {
                         pto->PushMessage("inv", vInv);
                         vInv.clear();
                     }
                 }
+                pto->setInventoryTxToSend = std::set<uint256>(vHashes.begin() + nRelayedTransactions, vHashes.end());
+                pto->nRelayTxSent += nRelayedTransactions;
+                if (nRelayedTransactions > 0)
+                    pto->nRelayInvSent++;
             }
-            pto->vInventoryToSend = vInvWait;
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
+        nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -5520,16 +6452,20 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < state.nBlocksInFlightMax) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextBlocksToDownload(pto->GetId(), state.nBlocksInFlightMax - state.nBlocksInFlight, vToDownload, staller);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
+            // The window is held up by another peer, which may well be
+            // slower than this one: take over what it has not delivered yet.
+            if (staller != -1 && state.nBlocksInFlight < state.nBlocksInFlightMax)
+                StealStalledBlocks(pto->GetId(), staller, state.nBlocksInFlightMax - state.nBlocksInFlight, vGetData, consensusParams, nNow);
             if (state.nBlocksInFlight == 0 && staller != -1) {
                 if (State(staller)->nStallingSince == 0) {
                     State(staller)->nStallingSince = nNow;
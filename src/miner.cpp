@@ -151,6 +151,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& s
         const int nHeight = pindexPrev->nHeight + 1;
         pblock->nTime = GetAdjustedTime();
         const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
+        const unsigned int nBlockScriptFlags = GetBlockScriptFlags(pindexPrev, pblock->nVersion.GetBaseVersion(), pblock->GetBlockTime(), chainparams.GetConsensus());
         CCoinsViewCache view(pcoinsTip);
 
         // Priority order to process transactions
@@ -296,8 +297,10 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& s
             // Note that flags: we don't want to set mempool/IsStandard()
             // policy here, but we still have to ensure that the block we
             // create only contains transactions that are valid in new blocks.
+            // These are the flags mempool acceptance checked too, so this is
+            // usually answered by the script execution cache.
             CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            if (!CheckInputs(tx, state, view, true, nBlockScriptFlags, true))
                 continue;
 
             UpdateCoins(tx, state, view, nHeight);
@@ -5,6 +5,8 @@
 #ifndef BITCOIN_MRUSET_H
 #define BITCOIN_MRUSET_H
 
+#include "memusage.h"
+
 #include <set>
 #include <vector>
 #include <utility>
@@ -60,6 +62,7 @@ public:
         return ret;
     }
     size_type max_size() const { return nMaxSize; }
+    size_t DynamicMemoryUsage() const { return memusage::DynamicUsage(set) + memusage::DynamicUsage(order); }
 };
 
 #endif // BITCOIN_MRUSET_H
@@ -20,10 +20,17 @@
 #include "ui_interface.h"
 #include "utilstrencodings.h"
 
+#include <math.h>
+
 #ifdef WIN32
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -39,6 +46,13 @@
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
+/** Longest time the socket handler waits for socket events, in milliseconds */
+static const int SOCKET_HANDLER_TIMEOUT = 50;
+/** Maximum number of socket events handled per epoll_wait() call */
+static const int MAX_SOCKET_EVENTS = 256;
+/** Maximum number of queued messages handed to the kernel in one send call */
+static const int MAX_SEND_BUFFERS = 64;
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -80,6 +94,8 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+/** epoll instance the socket handler waits on, or -1 when it uses select() */
+static int epollfd = -1;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
@@ -338,8 +354,13 @@ CCriticalSection CNode::cs_totalBytesSent;
 
 uint64_t CNode::nMaxOutboundLimit = 0;
 uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundBytesSentInCycleByClass[UPLOAD_CLASS_MAX] = {};
 uint64_t CNode::nMaxOutboundTimeframe = 60*60*24; //1 day
 uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxHistoricalBytesPerPeer = 0;
+uint64_t CNode::nMaxHistoricalRate = 0;
+int64_t CNode::nHistoricalTokens = 0;
+int64_t CNode::nHistoricalTokensTime = 0;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -377,6 +398,32 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+/** Whether the socket handler is able to wait on hSocket. */
+static bool IsHandledSocket(SOCKET hSocket)
+{
+    return epollfd != -1 || IsSelectableSocket(hSocket);
+}
+
+/**
+ * Add a node's socket to the socket handler's epoll set. Readiness is
+ * edge-triggered, so the handler has to consume it until the socket would
+ * block, or remember it (see fSocketRecvReady/fSocketSendReady).
+ */
+static void RegisterNodeSocket(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (epollfd == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
+        pnode->fDisconnect = true;
+    }
+#endif
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -403,7 +450,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsHandledSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -418,6 +465,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+            RegisterNodeSocket(pnode);
         }
 
         pnode->nTimeConnected = GetTime();
@@ -630,6 +678,7 @@ void CNode::copyStats(CNodeStats &stats)
     X(nSendBytes);
     X(nRecvBytes);
     X(fWhitelisted);
+    X(nHistoricalBytesSent);
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -649,9 +698,74 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_inventory);
+        stats.nRelayTxQueue = setInventoryTxToSend.size();
+        X(nRelayTxSent);
+        X(nRelayInvSent);
+        X(nRelayTxDropped);
+    }
 }
 #undef X
 
+/** Receive buffers are allocated up to this far ahead of the data received */
+static const unsigned int RECV_BUFFER_STEP = 256 * 1024;
+/** Maximum total capacity of the buffers kept in the receive buffer pool */
+static const size_t RECV_BUFFER_POOL_MAX_BYTES = 32 * 1024 * 1024;
+
+/**
+ * Buffers of processed messages, kept for the next ones so that message
+ * floods do not allocate (and zero on free) a new buffer for every message.
+ */
+class CRecvBufferPool
+{
+private:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vBuffers;
+    size_t nPoolBytes;
+
+public:
+    CRecvBufferPool() : nPoolBytes(0) {}
+
+    /** Swap a buffer with room for at least nSize bytes into data, if one is available */
+    void Get(CDataStream& data, size_t nSize)
+    {
+        LOCK(cs);
+        for (size_t i = vBuffers.size(); i-- > 0; ) {
+            if (vBuffers[i].capacity() >= nSize) {
+                nPoolBytes -= vBuffers[i].capacity();
+                data.swap(vBuffers[i]);
+                vBuffers[i].swap(vBuffers.back());
+                vBuffers.pop_back();
+                return;
+            }
+        }
+    }
+
+    /** Take data's buffer into the pool, leaving data empty */
+    void Put(CDataStream& data)
+    {
+        CSerializeData buf;
+        data.swap(buf);
+        if (buf.capacity() == 0)
+            return;
+        buf.clear();
+        LOCK(cs);
+        if (nPoolBytes + buf.capacity() > RECV_BUFFER_POOL_MAX_BYTES)
+            return;
+        nPoolBytes += buf.capacity();
+        vBuffers.push_back(CSerializeData());
+        vBuffers.back().swap(buf);
+    }
+};
+static CRecvBufferPool recvBufferPool;
+
+CNetMessage::~CNetMessage()
+{
+    recvBufferPool.Put(vRecv);
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -719,22 +833,45 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    // Most messages fit in the first step, so take a pooled buffer that
+    // holds it all; larger ones grow as their data actually arrives.
+    if (hdr.nMessageSize > 0)
+        recvBufferPool.Get(vRecv, std::min(hdr.nMessageSize, RECV_BUFFER_STEP));
+
     return nCopy;
 }
 
+char* CNetMessage::PrepareData(unsigned int& nSpace)
+{
+    assert(in_data && nDataPos < hdr.nMessageSize);
+
+    if (vRecv.size() == nDataPos) {
+        // Allocate up to 256 KiB, or as much as was received so far, ahead,
+        // but never more than the total message size.
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + std::max(nDataPos, RECV_BUFFER_STEP)));
+    }
+
+    nSpace = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+    unsigned int nHandled = 0;
+    while (nHandled < nCopy) {
+        unsigned int nSpace;
+        char* pchDest = PrepareData(nSpace);
+        unsigned int nChunk = std::min(nSpace, nCopy - nHandled);
+        // Data received in place (see PrepareData) is already where it belongs
+        if (pchDest != pch + nHandled)
+            memcpy(pchDest, pch + nHandled, nChunk);
+        nDataPos += nChunk;
+        nHandled += nChunk;
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
-
     return nCopy;
 }
 
@@ -749,23 +886,53 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSharedNetMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = **it;
+        size_t nQueued = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nQueued, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather as many queued messages as possible into a single call. The
+        // buffers are shared with other peers' queues, so they are written as
+        // they are rather than copied into one contiguous block first.
+        struct iovec iov[MAX_SEND_BUFFERS];
+        int nBuffers = 0;
+        size_t nQueued = 0;
+        for (std::deque<CSharedNetMsg>::iterator itBuf = it; itBuf != pnode->vSendMsg.end() && nBuffers < MAX_SEND_BUFFERS; ++itBuf, ++nBuffers) {
+            const CSerializeData &data = **itBuf;
+            size_t nOffset = (itBuf == it) ? pnode->nSendOffset : 0;
+            iov[nBuffers].iov_base = (void*)&data[nOffset];
+            iov[nBuffers].iov_len = data.size() - nOffset;
+            nQueued += data.size() - nOffset;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nBuffers;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
-            pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            pnode->RecordBytesSent(nBytes, pnode->GetUploadClass());
+            // Drop every message that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nRemaining = (*it)->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nQueued) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -972,7 +1139,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsHandledSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1014,83 +1181,340 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+        RegisterNodeSocket(pnode);
     }
 }
 
-void ThreadSocketHandler()
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+/**
+ * Receive one buffer worth of data from pnode's socket. Returns whether more
+ * may be available right away. Requires LOCK(cs_vRecvMsg).
+ */
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    char* pch = pchBuf;
+    unsigned int nSpace = sizeof(pchBuf);
+
+    // In the middle of a message payload, receive straight into its buffer
+    if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.back().in_data && !pnode->vRecvMsg.back().complete())
+        pch = pnode->vRecvMsg.back().PrepareData(nSpace);
+
+    int nBytes = recv(pnode->hSocket, pch, nSpace, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pch, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return true;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEINTR)
+            return true;
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Act on the socket readiness remembered for pnode. Returns whether some of
+ * it could not be consumed yet and has to be retried later.
+ */
+static bool ServiceNodeSocket(CNode* pnode)
+{
+    if (pnode->fSocketSendReady)
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+        {
+            if (!pnode->vSendMsg.empty())
+                SocketSendData(pnode);
+            // Anything left means the socket is full again and a new edge follows
+            pnode->fSocketSendReady = false;
+        }
+    }
+
+    if (pnode->fSocketRecvReady && pnode->hSocket != INVALID_SOCKET)
+    {
+        // As with select(), drain our send queue before receiving more, so
+        // that peers that do not read are not rewarded with buffer space.
+        bool fSendQueued = true;
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                fSendQueued = !pnode->vSendMsg.empty();
+        }
+        if (!fSendQueued)
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+            {
+                // Read until the socket would block, unless a complete message
+                // is waiting and we are over the flood limit; the rest stays
+                // in the kernel buffer (TCP flow control) until it is processed.
+                while (pnode->hSocket != INVALID_SOCKET)
+                {
+                    if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+                        pnode->GetTotalRecvSize() > ReceiveFloodSize())
+                        break;
+                    if (!SocketRecvData(pnode)) {
+                        pnode->fSocketRecvReady = false;
+                        break;
                     }
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+    return pnode->fSocketRecvReady || pnode->fSocketSendReady;
+}
+
+/**
+ * Socket handler loop based on epoll. Only sockets that reported events (or
+ * still have unconsumed readiness) are touched, so the cost of an iteration
+ * does not grow with the number of idle connections.
+ */
+static void SocketHandlerEpoll()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastDisconnectSweep = 0;
+    int64_t nLastInactivityCheck = 0;
+    // Nodes with readiness that is not consumed yet; each holds a reference
+    std::set<CNode*> setPending;
+    std::vector<struct epoll_event> vEvents(MAX_SOCKET_EVENTS);
+
+    while (true)
+    {
+        int64_t nNow = GetTimeMillis();
+        if (nNow - nLastDisconnectSweep >= SOCKET_HANDLER_TIMEOUT)
+        {
+            DisconnectNodes(nPrevNodeCount);
+            nLastDisconnectSweep = nNow;
+        }
+
+        int nEvents = epoll_wait(epollfd, &vEvents[0], vEvents.size(), SOCKET_HANDLER_TIMEOUT);
+        boost::this_thread::interruption_point();
+
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+                MilliSleep(SOCKET_HANDLER_TIMEOUT);
+            }
+            nEvents = 0;
+        }
+
+        bool fAccept = false;
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode* pnode = (CNode*)vEvents[i].data.ptr;
+            // Listening sockets are registered without a node
+            if (pnode == NULL)
+            {
+                fAccept = true;
+                continue;
+            }
+            if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fSocketRecvReady = true;
+            if (vEvents[i].events & EPOLLOUT)
+                pnode->fSocketSendReady = true;
+            if (setPending.insert(pnode).second)
+            {
+                LOCK(cs_vNodes);
+                pnode->AddRef();
+            }
+        }
+
+        //
+        // Accept new connections
+        //
+        if (fAccept)
+        {
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                if (hListenSocket.socket != INVALID_SOCKET)
+                    AcceptConnection(hListenSocket);
         }
 
+        //
+        // Inactivity checking, and a safety net for queued data that
+        // did not get an event
+        //
+        nNow = GetTimeMillis();
+        if (nNow - nLastInactivityCheck >= 1000)
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+            {
+                InactivityCheck(pnode);
+                if (pnode->nSendSize > 0 && pnode->hSocket != INVALID_SOCKET)
+                {
+                    pnode->fSocketSendReady = true;
+                    if (setPending.insert(pnode).second)
+                        pnode->AddRef();
+                }
+            }
+            nLastInactivityCheck = nNow;
+        }
+
+        //
+        // Service sockets with pending readiness
+        //
+        std::vector<CNode*> vDone;
+        BOOST_FOREACH(CNode* pnode, setPending)
+        {
+            boost::this_thread::interruption_point();
+            if (!ServiceNodeSocket(pnode))
+                vDone.push_back(pnode);
+        }
+        if (!vDone.empty())
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vDone)
+            {
+                setPending.erase(pnode);
+                pnode->Release();
+            }
+        }
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (epollfd != -1)
+    {
+        SocketHandlerEpoll();
+        return;
+    }
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
+
         //
         // Find which sockets have data to receive
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = SOCKET_HANDLER_TIMEOUT * 1000; // frequency to poll pnode->vSend
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -1201,39 +1625,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1251,30 +1643,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1704,7 +2073,7 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+void ThreadMessageHandler(int nThread, int nThreads)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1721,10 +2090,9 @@ void ThreadMessageHandler()
             }
         }
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        // Poll the connected nodes for messages. Threads start at different
+        // offsets so that they do not all compete for the same peers.
+        std::rotate(vNodesCopy.begin(), vNodesCopy.begin() + vNodesCopy.size() * nThread / nThreads, vNodesCopy.end());
 
         bool fSleep = true;
 
@@ -1733,6 +2101,11 @@ void ThreadMessageHandler()
             if (pnode->fDisconnect)
                 continue;
 
+            // Another thread is serving this peer
+            TRY_LOCK(pnode->cs_process, lockProcess);
+            if (!lockProcess)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1743,7 +2116,7 @@ void ThreadMessageHandler()
 
                     if (pnode->nSendSize < SendBufferSize())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        if ((!pnode->vRecvGetData.empty() && !pnode->fGetDataPaced) || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
                             fSleep = false;
                         }
@@ -1752,12 +2125,10 @@ void ThreadMessageHandler()
             }
             boost::this_thread::interruption_point();
 
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
-            }
+            // Send messages. cs_process already keeps other threads out;
+            // cs_vSend is not held, as SendMessages may wait for cs_main,
+            // whose holders push messages to this peer.
+            g_signals.SendMessages(pnode);
             boost::this_thread::interruption_point();
         }
 
@@ -1974,6 +2345,35 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Map ports with UPnP
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (epollfd == -1 && GetBoolArg("-socketevents", DEFAULT_SOCKET_EVENTS))
+    {
+        epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollfd == -1)
+            LogPrintf("epoll_create1 failed, falling back to select(): %s\n", NetworkErrorString(errno));
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        {
+            if (epollfd == -1)
+                break;
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+            {
+                LogPrintf("epoll_ctl failed for listening socket, falling back to select(): %s\n", NetworkErrorString(errno));
+                close(epollfd);
+                epollfd = -1;
+            }
+        }
+        if (epollfd != -1)
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                RegisterNodeSocket(pnode);
+        }
+    }
+#endif
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -1984,7 +2384,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageHandlerThreads = std::max(1, std::min((int)GetArg("-msghandlers", DEFAULT_MESSAGE_HANDLER_THREADS), MAX_MESSAGE_HANDLER_THREADS));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+            boost::function<void()>(boost::bind(&ThreadMessageHandler, i, nMessageHandlerThreads))));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2031,6 +2434,11 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef HAVE_SYS_EPOLL_H
+        if (epollfd != -1)
+            close(epollfd);
+        epollfd = -1;
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -2089,13 +2497,18 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
     }
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
     nTotalBytesRecv += bytes;
 }
 
-void CNode::RecordBytesSent(uint64_t bytes)
+void CNode::RecordBytesSent(uint64_t bytes, UploadClass uploadClass)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
@@ -2106,10 +2519,14 @@ void CNode::RecordBytesSent(uint64_t bytes)
         // timeframe expired, reset cycle
         nMaxOutboundCycleStartTime = now;
         nMaxOutboundTotalBytesSentInCycle = 0;
+        for (int i = 0; i < UPLOAD_CLASS_MAX; i++)
+            nMaxOutboundBytesSentInCycleByClass[i] = 0;
     }
 
-    // TODO, exclude whitebind peers
-    nMaxOutboundTotalBytesSentInCycle += bytes;
+    nMaxOutboundBytesSentInCycleByClass[uploadClass] += bytes;
+    // whitelisted peers are trusted and do not count against the target
+    if (uploadClass != UPLOAD_WHITELISTED)
+        nMaxOutboundTotalBytesSentInCycle += bytes;
 }
 
 void CNode::SetMaxOutboundTarget(uint64_t limit)
@@ -2189,6 +2606,96 @@ uint64_t CNode::GetOutboundTargetBytesLeft()
     return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
 }
 
+uint64_t CNode::GetOutboundBytesInCycle(UploadClass uploadClass)
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundBytesSentInCycleByClass[uploadClass];
+}
+
+bool CNode::HistoricalServingLimitReached(UploadClass uploadClass)
+{
+    if (uploadClass == UPLOAD_WHITELISTED)
+        return false;
+    if (OutboundTargetReached(true))
+        return true;
+    if (uploadClass != UPLOAD_INBOUND)
+        return false;
+
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    // Inbound peers, usually nodes doing their initial sync, only get part of
+    // what is left for historical blocks after the relay buffer, so that our
+    // own outbound links are not starved by them.
+    uint64_t buffer = GetMaxOutboundTimeLeftInCycle() / 600 * MAX_BLOCK_SIZE;
+    uint64_t historicalBudget = nMaxOutboundLimit - buffer;
+    return nMaxOutboundBytesSentInCycleByClass[UPLOAD_INBOUND] >= historicalBudget / 100 * INBOUND_HISTORICAL_UPLOAD_SHARE;
+}
+
+void CNode::SetMaxHistoricalBytesPerPeer(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxHistoricalBytesPerPeer = limit;
+}
+
+uint64_t CNode::GetMaxHistoricalBytesPerPeer()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxHistoricalBytesPerPeer;
+}
+
+void CNode::SetMaxHistoricalRate(uint64_t rate)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxHistoricalRate = rate;
+    nHistoricalTokens = rate * HISTORICAL_RATE_BURST_SECONDS;
+    nHistoricalTokensTime = GetTimeMicros();
+}
+
+uint64_t CNode::GetMaxHistoricalRate()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxHistoricalRate;
+}
+
+bool CNode::HistoricalUploadAllowed(UploadClass uploadClass)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxHistoricalRate == 0 || uploadClass == UPLOAD_WHITELISTED)
+        return true;
+
+    // Refill the bucket for the time passed, up to its burst size
+    int64_t nNow = GetTimeMicros();
+    int64_t nBurst = nMaxHistoricalRate * HISTORICAL_RATE_BURST_SECONDS;
+    if (nNow > nHistoricalTokensTime) {
+        int64_t nElapsed = nNow - nHistoricalTokensTime;
+        int64_t nAdd = nElapsed >= (int64_t)HISTORICAL_RATE_BURST_SECONDS * 1000000 ? nBurst : nElapsed * (int64_t)nMaxHistoricalRate / 1000000;
+        nHistoricalTokens += nAdd;
+        if (nHistoricalTokens >= nBurst) {
+            nHistoricalTokens = nBurst;
+            nHistoricalTokensTime = nNow;
+        } else {
+            // Only the time that made whole tokens is used up, so frequent
+            // polls at low rates still add up
+            nHistoricalTokensTime += std::min(nElapsed, (nAdd * 1000000 + (int64_t)nMaxHistoricalRate - 1) / (int64_t)nMaxHistoricalRate);
+        }
+    }
+
+    // The block is only charged once it is sent, so the bucket may go into
+    // debt by up to one block; that is paid off before the next one.
+    if (uploadClass == UPLOAD_INBOUND)
+        return nHistoricalTokens > nBurst / 2;
+    return nHistoricalTokens > 0;
+}
+
+void CNode::RecordHistoricalBytesSent(uint64_t bytes)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxHistoricalRate > 0)
+        nHistoricalTokens -= bytes;
+}
+
 uint64_t CNode::GetTotalBytesRecv()
 {
     LOCK(cs_totalBytesRecv);
@@ -2343,7 +2850,7 @@ unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNameIn, bool fInboundIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addrKnown(5000, 0.001),
-    setInventoryKnown(SendBufferSize() / 1000)
+    filterInventoryKnown(INVENTORY_KNOWN_FILTER_ELEMENTS, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2365,6 +2872,8 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fSocketRecvReady = false;
+    fSocketSendReady = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -2378,6 +2887,14 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nPingUsecTime = 0;
     fPingQueued = false;
     nMinPingUsecTime = std::numeric_limits<int64_t>::max();
+    nNextAddrSend = 0;
+    nNextInvSend = 0;
+    nRelayTxSent = 0;
+    nRelayInvSent = 0;
+    nRelayTxDropped = 0;
+    nHistoricalBytesSent = 0;
+    fGetDataPaced = false;
+    nSendLockSkips = 0;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2436,6 +2953,19 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+/** Fill in the size and checksum fields of a message serialized after its header */
+static void SetMessageSizeAndChecksum(CDataStream& ss)
+{
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
@@ -2472,30 +3002,54 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
     unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    SetMessageSizeAndChecksum(ssSend);
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    boost::shared_ptr<CSerializeData> msg(new CSerializeData());
+    ssSend.GetAndClear(*msg);
+    nSendSize += msg->size();
+    vSendMsg.push_back(msg);
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+CSharedNetMsg FinishSharedNetMsg(const char* pszCommand, CDataStream& ss)
+{
+    assert(ss.size() >= CMessageHeader::HEADER_SIZE);
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+    assert(ssHeader.size() == CMessageHeader::HEADER_SIZE);
+    memcpy(&ss[0], &ssHeader[0], CMessageHeader::HEADER_SIZE);
+    SetMessageSizeAndChecksum(ss);
+
+    boost::shared_ptr<CSerializeData> msg(new CSerializeData());
+    ss.GetAndClear(*msg);
+    return msg;
+}
+
+void CNode::PushSharedMessage(const CSharedNetMsg& msg)
+{
+    assert(msg->size() >= CMessageHeader::HEADER_SIZE);
+    LOCK(cs_vSend);
+
+    const char* pchCommand = &(*msg)[MESSAGE_START_SIZE];
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE))),
+        msg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    nSendSize += msg->size();
+    vSendMsg.push_back(msg);
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
 //
 // CBanDB
 //
@@ -9,7 +9,6 @@
 #include "bloom.h"
 #include "compat.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -18,6 +17,7 @@
 #include "uint256.h"
 
 #include <deque>
+#include <set>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -26,6 +26,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -42,6 +43,8 @@ static const int PING_INTERVAL = 2 * 60;
 static const int TIMEOUT_INTERVAL = 20 * 60;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** Number of recent inventory items remembered per peer, so that they are not announced to it again. */
+static const unsigned int INVENTORY_KNOWN_FILTER_ELEMENTS = 10000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /**
@@ -64,12 +67,28 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** The maximum number of transactions queued for announcement to a peer; beyond it new ones are not announced to it */
+static const size_t MAX_INV_TX_QUEUE = MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 /** The default for -maxuploadtarget. 0 = Unlimited */
 static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The default for -maxuploadpeer (historical block MiB per peer). 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_UPLOAD_PEER = 0;
+/** The default for -maxhistoricalrate (KiB/s of historical blocks). 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_HISTORICAL_RATE = 0;
+/** Seconds worth of -maxhistoricalrate that may be sent in one burst */
+static const unsigned int HISTORICAL_RATE_BURST_SECONDS = 4;
+/** Percentage of the historical block budget of -maxuploadtarget that inbound peers may use */
+static const unsigned int INBOUND_HISTORICAL_UPLOAD_SHARE = 50;
 /** Default for blocks only*/
 static const bool DEFAULT_BLOCKSONLY = false;
+/** Default for -socketevents, wait on sockets with epoll where available */
+static const bool DEFAULT_SOCKET_EVENTS = true;
+/** Default for -msghandlers, the number of message handler threads */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 2;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -89,6 +108,29 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/**
+ * A complete serialized message, header included. It is never modified once
+ * queued, so a single copy can sit in the send queues of any number of peers.
+ */
+typedef boost::shared_ptr<const CSerializeData> CSharedNetMsg;
+
+/** Write the header in front of a payload serialized after HEADER_SIZE reserved bytes, and take the result */
+CSharedNetMsg FinishSharedNetMsg(const char* pszCommand, CDataStream& ss);
+
+/**
+ * Serialize a message once so it can be handed to many peers with
+ * CNode::PushSharedMessage, instead of serializing it again for each of them.
+ * Only for payloads whose encoding does not depend on the peer's version.
+ */
+template<typename T1>
+CSharedNetMsg MakeSharedNetMsg(const char* pszCommand, const T1& a1)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.resize(CMessageHeader::HEADER_SIZE);
+    ss << a1;
+    return FinishSharedNetMsg(pszCommand, ss);
+}
+
 typedef int NodeId;
 
 struct CombinerAll
@@ -106,12 +148,21 @@ struct CombinerAll
     }
 };
 
+/** Classes of peers whose uploads are accounted and limited separately */
+enum UploadClass
+{
+    UPLOAD_WHITELISTED,
+    UPLOAD_OUTBOUND,
+    UPLOAD_INBOUND,
+    UPLOAD_CLASS_MAX
+};
+
 // Signals for message handling
 struct CNodeSignals
 {
     boost::signals2::signal<int ()> GetHeight;
     boost::signals2::signal<bool (CNode*), CombinerAll> ProcessMessages;
-    boost::signals2::signal<bool (CNode*, bool), CombinerAll> SendMessages;
+    boost::signals2::signal<bool (CNode*), CombinerAll> SendMessages;
     boost::signals2::signal<void (NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void (NodeId)> FinalizeNode;
 };
@@ -203,6 +254,11 @@ public:
     double dPingWait;
     double dPingMin;
     std::string addrLocal;
+    size_t nRelayTxQueue;
+    uint64_t nRelayTxSent;
+    uint64_t nRelayInvSent;
+    uint64_t nRelayTxDropped;
+    uint64_t nHistoricalBytesSent;
 };
 
 
@@ -229,6 +285,9 @@ public:
         nTime = 0;
     }
 
+    // Hands vRecv's buffer back to the receive buffer pool
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -244,6 +303,13 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /**
+     * Make room in vRecv for more of the payload and return where it goes;
+     * nSpace is set to the room available there. Data received straight into
+     * that space is not copied again by readData().
+     */
+    char* PrepareData(unsigned int& nSpace);
 };
 
 
@@ -319,12 +385,17 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedNetMsg> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Held by the message handler thread currently serving this node, so that
+    // each peer is handled by one thread at a time and its messages stay in order
+    CCriticalSection cs_process;
+    // SendMessages passes in a row skipped for lack of cs_serialMessages or cs_main (guarded by cs_process)
+    int nSendLockSkips;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -348,6 +419,10 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Socket readiness reported by the socket handler's event loop that it
+    // has not consumed yet. Only accessed by the socket handler thread.
+    bool fSocketRecvReady;
+    bool fSocketSendReady;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
@@ -384,10 +459,29 @@ public:
     bool fGetAddr;
     std::set<uint256> setKnown;
 
+    int64_t nNextAddrSend;
+
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
+    // Transaction ids we still have to announce. They are batched and
+    // ordered by the mempool when the next inv is due, so a set suffices.
+    std::set<uint256> setInventoryTxToSend;
+    // Other (block) inventory, which is announced right away
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    int64_t nNextInvSend;
+    // Relay statistics: transaction invs announced, inv messages they took,
+    // and transactions not announced because the queue was full
+    uint64_t nRelayTxSent;
+    uint64_t nRelayInvSent;
+    uint64_t nRelayTxDropped;
+
+    // Bytes of historical blocks uploaded to this peer
+    uint64_t nHistoricalBytesSent;
+    // Whether the last getdata processing waited for historical upload tokens
+    bool fGetDataPaced;
+    // Block hashes to announce, with "headers" if the peer asked for it
+    std::vector<uint256> vBlockHashesToAnnounce;
     std::multimap<int64_t, CInv> mapAskFor;
 
     // Ping time measurement:
@@ -414,10 +508,17 @@ private:
 
     // outbound limit & stats
     static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundBytesSentInCycleByClass[UPLOAD_CLASS_MAX];
     static uint64_t nMaxOutboundCycleStartTime;
     static uint64_t nMaxOutboundLimit;
     static uint64_t nMaxOutboundTimeframe;
 
+    // historical block serving limits: per peer, and a token bucket shared by all peers
+    static uint64_t nMaxHistoricalBytesPerPeer;
+    static uint64_t nMaxHistoricalRate;
+    static int64_t nHistoricalTokens;
+    static int64_t nHistoricalTokensTime;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -427,6 +528,12 @@ public:
       return id;
     }
 
+    UploadClass GetUploadClass() const {
+        if (fWhitelisted)
+            return UPLOAD_WHITELISTED;
+        return fInbound ? UPLOAD_INBOUND : UPLOAD_OUTBOUND;
+    }
+
     int GetRefCount()
     {
         assert(nRefCount >= 0);
@@ -490,17 +597,28 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
     void PushInventory(const CInv& inv)
     {
-        {
-            LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
-        }
+        LOCK(cs_inventory);
+        if (filterInventoryKnown.contains(inv.hash))
+            return;
+        if (inv.type == MSG_TX) {
+            if (setInventoryTxToSend.size() < MAX_INV_TX_QUEUE)
+                setInventoryTxToSend.insert(inv.hash);
+            else
+                nRelayTxDropped++;
+        } else
+            vInventoryToSend.push_back(inv);
+    }
+
+    void PushBlockHash(const uint256 &hash)
+    {
+        LOCK(cs_inventory);
+        vBlockHashesToAnnounce.push_back(hash);
     }
 
     void AskFor(const CInv& inv);
@@ -514,6 +632,9 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message built by MakeSharedNetMsg without copying it */
+    void PushSharedMessage(const CSharedNetMsg& msg);
+
     void PushVersion();
 
 
@@ -715,7 +836,7 @@ public:
 
     // Network stats
     static void RecordBytesRecv(uint64_t bytes);
-    static void RecordBytesSent(uint64_t bytes);
+    static void RecordBytesSent(uint64_t bytes, UploadClass uploadClass);
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
@@ -740,6 +861,28 @@ public:
     //!response the time in second left in the current max outbound cycle
     // in case of no limit, it will always response 0
     static uint64_t GetMaxOutboundTimeLeftInCycle();
+
+    //!response the bytes sent to peers of the given class in the current cycle
+    static uint64_t GetOutboundBytesInCycle(UploadClass uploadClass);
+
+    //!check if peers of the given class may no longer be served historical
+    // blocks in this cycle; inbound peers only get part of the budget
+    static bool HistoricalServingLimitReached(UploadClass uploadClass);
+
+    //!set the historical block bytes a single peer may be served, 0 = no limit
+    static void SetMaxHistoricalBytesPerPeer(uint64_t limit);
+    static uint64_t GetMaxHistoricalBytesPerPeer();
+
+    //!set the rate (bytes per second) at which historical blocks are uploaded, 0 = no limit
+    static void SetMaxHistoricalRate(uint64_t rate);
+    static uint64_t GetMaxHistoricalRate();
+
+    //!check if the token bucket allows uploading a historical block now;
+    // outbound peers may drain the bucket, inbound ones only its upper half
+    static bool HistoricalUploadAllowed(UploadClass uploadClass);
+
+    //!take the bytes of an uploaded historical block from the token bucket
+    static void RecordHistoricalBytesSent(uint64_t bytes);
 };
 
 
@@ -748,6 +891,9 @@ class CTransaction;
 void RelayTransaction(const CTransaction& tx);
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
 {
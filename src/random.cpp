@@ -10,6 +10,7 @@
 #include "compat.h" // for Windows API
 #endif
 #include "serialize.h"        // for begin_ptr(vec)
+#include "sync.h"
 #include "util.h"             // for LogPrint()
 #include "utilstrencodings.h" // for GetTime()
 
@@ -43,6 +44,11 @@ void RandAddSeed()
     memory_cleanse((void*)&nCounter, sizeof(nCounter));
 }
 
+#ifdef WIN32
+/** Serializes the perfmon query, which message handler threads may ask for at once */
+static CCriticalSection cs_perfmon;
+#endif
+
 void RandAddSeedPerfmon()
 {
     RandAddSeed();
@@ -51,7 +57,11 @@ void RandAddSeedPerfmon()
     // Don't need this on Linux, OpenSSL automatically uses /dev/urandom
     // Seed with the entire set of perfmon data
 
-    // This can take up to 2 seconds, so only do it every 10 minutes
+    // This can take up to 2 seconds, so only do it every 10 minutes, on
+    // one thread; the others go on without it
+    TRY_LOCK(cs_perfmon, lockPerfmon);
+    if (!lockPerfmon)
+        return;
     static int64_t nLastPerfmon;
     if (GetTime() < nLastPerfmon + 10 * 60)
         return;
@@ -9,21 +9,29 @@
 #include "primitives/transaction.h"
 #include "main.h"
 #include "httpserver.h"
+#include "jsonwriter.h"
 #include "rpcserver.h"
 #include "streams.h"
 #include "sync.h"
 #include "txmempool.h"
+#include "util.h"
 #include "utilstrencodings.h"
 #include "version.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include <boost/dynamic_bitset.hpp>
 
+#include <limits>
+
 #include <univalue.h>
 
 using namespace std;
 
 static const size_t MAX_GETUTXOS_OUTPOINTS = 15; //allow a max of 15 outpoints to be queried at once
+static const int REST_HEADER_BATCH_SIZE = 500; //headers read per hold of cs_main by streamed replies
+static const size_t REST_UTXO_BATCH_SIZE = 1000; //outpoints looked up per hold of cs_main by bulk queries
+static const size_t REST_CHUNK_SIZE = 64 * 1024; //output collected before a streamed reply is sent on
 
 enum RetFormat {
     RF_UNDEF,
@@ -59,9 +67,11 @@ struct CCoin {
 };
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
-extern UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
+extern UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false, bool fIncludeTxs = true);
+extern void blockToJSON(CJSONWriter& result, const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
 extern UniValue mempoolInfoToJSON();
-extern UniValue mempoolToJSON(bool fVerbose = false);
+extern UniValue mempoolToJSON(bool fVerbose = false, bool fIncludeSequence = false);
+extern void mempoolToJSON(CJSONWriter& result);
 extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 extern UniValue blockheaderToJSON(const CBlockIndex* blockindex);
 
@@ -126,6 +136,159 @@ static bool CheckWarmup(HTTPRequest* req)
     return true;
 }
 
+static const char* ContentTypeForFormat(RetFormat rf)
+{
+    switch (rf) {
+    case RF_BINARY: return "application/octet-stream";
+    case RF_JSON: return "application/json";
+    default: return "text/plain";
+    }
+}
+
+/**
+ * Reply of unknown length in one of the data formats. Output is collected
+ * until REST_CHUNK_SIZE bytes are ready and then sent with chunked encoding,
+ * holding the writer up while the client is behind, so memory use stays
+ * bounded however long the reply. Shorter replies are sent in one go.
+ * Send() may wait for the client, so it must not be called with locks held.
+ */
+class CRESTReplyStream
+{
+public:
+    CRESTReplyStream(HTTPRequest* reqIn, RetFormat rfIn) : req(reqIn), rf(rfIn), fStarted(false), fClosed(false) {}
+
+    /** Whether more output is still wanted */
+    bool Good() const { return !fClosed; }
+
+    /** Add text, such as JSON, to the reply */
+    void Write(const std::string& str)
+    {
+        if (!fClosed)
+            strBuf += str;
+    }
+
+    /** Add serialized data, which is hex encoded for .hex replies */
+    void WriteData(const std::string& str)
+    {
+        if (rf == RF_HEX)
+            Write(HexStr(str.begin(), str.end()));
+        else
+            Write(str);
+    }
+
+    /** Send the collected output if there is enough of it */
+    void Send()
+    {
+        if (fClosed || strBuf.size() < REST_CHUNK_SIZE)
+            return;
+        if (!fStarted) {
+            req->WriteHeader("Content-Type", ContentTypeForFormat(rf));
+            req->WriteReplyStart(HTTP_OK);
+            fStarted = true;
+        }
+        req->WriteReplyChunk(strBuf);
+        strBuf.clear();
+        if (!req->WaitReplyDrained())
+            fClosed = true;
+    }
+
+    /** Complete the reply */
+    void End()
+    {
+        if (rf != RF_BINARY)
+            Write("\n");
+        if (!fStarted) {
+            req->WriteHeader("Content-Type", ContentTypeForFormat(rf));
+            req->WriteReply(HTTP_OK, strBuf);
+            return;
+        }
+        if (!fClosed)
+            req->WriteReplyChunk(strBuf);
+        req->WriteReplyEnd();
+    }
+
+    /** Give up on the reply: send an error if nothing was sent yet, otherwise cut it short */
+    bool Fail(enum HTTPStatusCode status, const std::string& message)
+    {
+        if (!fStarted)
+            return RESTERR(req, status, message);
+        LogPrintf("%s: %s, cutting the reply to %s short\n", __func__, message, req->GetURI());
+        req->WriteReplyEnd();
+        return false;
+    }
+
+private:
+    HTTPRequest* req;
+    RetFormat rf;
+    std::string strBuf;
+    bool fStarted;
+    bool fClosed;
+};
+
+/** Parse the <start>/<count> of a range of heights */
+static bool ParseHeightRange(HTTPRequest* req, const std::string& param, const std::string& strUsage, int& nStart, int& nCount)
+{
+    vector<string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "No height range specified. Use " + strUsage + ".");
+    if (!ParseInt32(path[0], &nStart) || nStart < 0)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid start height: " + path[0]);
+    if (!ParseInt32(path[1], &nCount) || nCount < 1)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid count: " + path[1]);
+    return true;
+}
+
+/** The last block of the active chain in a range of heights, which may end above the tip; cs_main must be held */
+static const CBlockIndex* LastInHeightRange(int nStart, int nCount)
+{
+    if (nStart > chainActive.Height())
+        return NULL;
+    return chainActive[std::min((int64_t)nStart + nCount - 1, (int64_t)chainActive.Height())];
+}
+
+/** Stream the headers of the blocks from height nStart up to pindexLast, if any */
+static bool StreamHeaders(HTTPRequest* req, RetFormat rf, int nStart, const CBlockIndex* pindexLast)
+{
+    if (rf != RF_BINARY && rf != RF_HEX && rf != RF_JSON)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+
+    CRESTReplyStream stream(req, rf);
+    CJSONWriter writer(boost::bind(&CRESTReplyStream::Write, &stream, _1));
+    if (rf == RF_JSON)
+        writer.BeginArray();
+    const CChainParams& chainparams = Params();
+    int nHeight = nStart;
+    while (pindexLast && nHeight <= pindexLast->nHeight && stream.Good()) {
+        int nBatchEnd = std::min(nHeight + REST_HEADER_BATCH_SIZE - 1, pindexLast->nHeight);
+        CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+        std::vector<UniValue> vHeaders;
+        {
+            LOCK(cs_main);
+            for (; nHeight <= nBatchEnd; nHeight++) {
+                const CBlockIndex* pindex = pindexLast->GetAncestor(nHeight);
+                if (rf == RF_JSON)
+                    vHeaders.push_back(blockheaderToJSON(pindex));
+                else
+                    ssHeader << pindex->GetBlockHeader(chainparams.GetConsensus());
+            }
+        }
+        if (rf == RF_JSON) {
+            BOOST_FOREACH(const UniValue& header, vHeaders)
+                writer.Value(header);
+        } else {
+            stream.WriteData(ssHeader.str());
+        }
+        stream.Send();
+    }
+    if (rf == RF_JSON) {
+        writer.EndArray();
+        writer.Flush();
+    }
+    stream.End();
+    return true;
+}
+
 static bool rest_headers(HTTPRequest* req,
                          const std::string& strURIPart)
 {
@@ -139,8 +302,9 @@ static bool rest_headers(HTTPRequest* req,
     if (path.size() != 2)
         return RESTERR(req, HTTP_BAD_REQUEST, "No header count specified. Use /rest/headers/<count>/<hash>.<ext>.");
 
-    long count = strtol(path[0].c_str(), NULL, 10);
-    if (count < 1 || count > 2000)
+    // The reply is streamed, so any number of headers can be asked for
+    int count;
+    if (!ParseInt32(path[0], &count) || count < 1)
         return RESTERR(req, HTTP_BAD_REQUEST, "Header count out of range: " + path[0]);
 
     string hashStr = path[1];
@@ -148,57 +312,47 @@ static bool rest_headers(HTTPRequest* req,
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
-    std::vector<const CBlockIndex *> headers;
-    headers.reserve(count);
+    int nStart = 0;
+    const CBlockIndex* pindexLast = NULL;
     {
         LOCK(cs_main);
         BlockMap::const_iterator it = mapBlockIndex.find(hash);
         const CBlockIndex *pindex = (it != mapBlockIndex.end()) ? it->second : NULL;
-        while (pindex != NULL && chainActive.Contains(pindex)) {
-            headers.push_back(pindex);
-            if (headers.size() == (unsigned long)count)
-                break;
-            pindex = chainActive.Next(pindex);
+        if (pindex != NULL && chainActive.Contains(pindex)) {
+            nStart = pindex->nHeight;
+            pindexLast = LastInHeightRange(nStart, count);
         }
     }
 
-    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
-    const CChainParams& chainparams = Params();
-    BOOST_FOREACH(const CBlockIndex *pindex, headers) {
-        ssHeader << pindex->GetBlockHeader(chainparams.GetConsensus());
-    }
+    return StreamHeaders(req, rf, nStart, pindexLast);
+}
 
-    switch (rf) {
-    case RF_BINARY: {
-        string binaryHeader = ssHeader.str();
-        req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryHeader);
-        return true;
-    }
+static bool rest_headerrange(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
 
-    case RF_HEX: {
-        string strHex = HexStr(ssHeader.begin(), ssHeader.end()) + "\n";
-        req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
-        return true;
-    }
-    case RF_JSON: {
-        UniValue jsonHeaders(UniValue::VARR);
-        BOOST_FOREACH(const CBlockIndex *pindex, headers) {
-            jsonHeaders.push_back(blockheaderToJSON(pindex));
-        }
-        string strJSON = jsonHeaders.write() + "\n";
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
-        return true;
-    }
-    default: {
-        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: .bin, .hex)");
-    }
+    int nStart, nCount;
+    if (!ParseHeightRange(req, param, "/rest/headerrange/<start>/<count>.<ext>", nStart, nCount))
+        return false;
+
+    const CBlockIndex* pindexLast;
+    {
+        LOCK(cs_main);
+        pindexLast = LastInHeightRange(nStart, nCount);
     }
+    if (!pindexLast)
+        return RESTERR(req, HTTP_NOT_FOUND, "Block height out of range");
 
-    // not reached
-    return true; // continue to process further HTTP reqs on this cxn
+    return StreamHeaders(req, rf, nStart, pindexLast);
+}
+
+static bool BlockToJSONStream(const CBlock& block, const CBlockIndex* pblockindex, bool showTxDetails, CJSONWriter& result)
+{
+    blockToJSON(result, block, pblockindex, showTxDetails);
+    return true;
 }
 
 static bool rest_block(HTTPRequest* req,
@@ -229,11 +383,10 @@ static bool rest_block(HTTPRequest* req,
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-    ssBlock << block;
-
     switch (rf) {
     case RF_BINARY: {
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << block;
         string binaryBlock = ssBlock.str();
         req->WriteHeader("Content-Type", "application/octet-stream");
         req->WriteReply(HTTP_OK, binaryBlock);
@@ -241,6 +394,8 @@ static bool rest_block(HTTPRequest* req,
     }
 
     case RF_HEX: {
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << block;
         string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
         req->WriteHeader("Content-Type", "text/plain");
         req->WriteReply(HTTP_OK, strHex);
@@ -248,10 +403,7 @@ static bool rest_block(HTTPRequest* req,
     }
 
     case RF_JSON: {
-        UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
-        string strJSON = objBlock.write() + "\n";
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->WriteJSONReply(boost::bind(BlockToJSONStream, boost::cref(block), pblockindex, showTxDetails, _1));
         return true;
     }
 
@@ -274,6 +426,64 @@ static bool rest_block_notxdetails(HTTPRequest* req, const std::string& strURIPa
     return rest_block(req, strURIPart, false);
 }
 
+static bool rest_blockrange(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+
+    int nStart, nCount;
+    if (!ParseHeightRange(req, param, "/rest/blockrange/<start>/<count>.<ext>", nStart, nCount))
+        return false;
+    if (rf != RF_BINARY && rf != RF_HEX && rf != RF_JSON)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+
+    const CBlockIndex* pindexLast;
+    {
+        LOCK(cs_main);
+        pindexLast = LastInHeightRange(nStart, nCount);
+        if (!pindexLast)
+            return RESTERR(req, HTTP_NOT_FOUND, "Block height out of range");
+        // Refuse pruned ranges up front rather than break the reply off
+        if (fHavePruned) {
+            for (const CBlockIndex* pindex = pindexLast; pindex && pindex->nHeight >= nStart; pindex = pindex->pprev)
+                if (!(pindex->nStatus & BLOCK_HAVE_DATA) && pindex->nTx > 0)
+                    return RESTERR(req, HTTP_NOT_FOUND, strprintf("Block at height %d not available (pruned data)", pindex->nHeight));
+        }
+    }
+
+    // Blocks are read one at a time, so at most one block and the output
+    // for it are held in memory
+    CRESTReplyStream stream(req, rf);
+    CJSONWriter writer(boost::bind(&CRESTReplyStream::Write, &stream, _1));
+    if (rf == RF_JSON)
+        writer.BeginArray();
+    for (int nHeight = nStart; nHeight <= pindexLast->nHeight && stream.Good(); nHeight++) {
+        const CBlockIndex* pindex = pindexLast->GetAncestor(nHeight);
+        CBlock block;
+        {
+            LOCK(cs_main);
+            if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
+                return stream.Fail(HTTP_NOT_FOUND, strprintf("Block at height %d not found", nHeight));
+        }
+        if (rf == RF_JSON) {
+            blockToJSON(writer, block, pindex, true);
+        } else {
+            CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+            ssBlock << block;
+            stream.WriteData(ssBlock.str());
+        }
+        stream.Send();
+    }
+    if (rf == RF_JSON) {
+        writer.EndArray();
+        writer.Flush();
+    }
+    stream.End();
+    return true;
+}
+
 static bool rest_chaininfo(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -324,6 +534,12 @@ static bool rest_mempool_info(HTTPRequest* req, const std::string& strURIPart)
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+static bool MempoolToJSONStream(CJSONWriter& result)
+{
+    mempoolToJSON(result);
+    return true;
+}
+
 static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -333,11 +549,7 @@ static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPar
 
     switch (rf) {
     case RF_JSON: {
-        UniValue mempoolObject = mempoolToJSON(true);
-
-        string strJSON = mempoolObject.write() + "\n";
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        req->WriteJSONReply(MempoolToJSONStream);
         return true;
     }
     default: {
@@ -401,6 +613,39 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+/** Look up an unspent output, with fPruneSpent treating outputs spent in the mempool as spent; cs_main and mempool.cs must be held */
+static bool GetUTXO(CCoinsViewCache& view, const COutPoint& outpoint, bool fPruneSpent, CCoin& coin)
+{
+    CCoins coins;
+    if (!view.GetCoins(outpoint.hash, coins))
+        return false;
+    if (fPruneSpent)
+        mempool.pruneSpent(outpoint.hash, coins);
+    if (!coins.IsAvailable(outpoint.n))
+        return false;
+    // Safe to index into vout here because IsAvailable checked if it's off the end of the array, or if
+    // n is valid but points to an already spent output (IsNull).
+    coin.nTxVer = coins.nVersion;
+    coin.nHeight = coins.nHeight;
+    coin.out = coins.vout.at(outpoint.n);
+    assert(!coin.out.IsNull());
+    return true;
+}
+
+static UniValue CoinToJSON(const CCoin& coin)
+{
+    UniValue utxo(UniValue::VOBJ);
+    utxo.push_back(Pair("txvers", (int32_t)coin.nTxVer));
+    utxo.push_back(Pair("height", (int32_t)coin.nHeight));
+    utxo.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
+
+    // include the script in a json output
+    UniValue o(UniValue::VOBJ);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
+    utxo.push_back(Pair("scriptPubKey", o));
+    return utxo;
+}
+
 static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -513,21 +758,11 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
             view.SetBackend(viewMempool); // switch cache backend to db+mempool in case user likes to query mempool
 
         for (size_t i = 0; i < vOutPoints.size(); i++) {
-            CCoins coins;
-            uint256 hash = vOutPoints[i].hash;
-            if (view.GetCoins(hash, coins)) {
-                mempool.pruneSpent(hash, coins);
-                if (coins.IsAvailable(vOutPoints[i].n)) {
-                    hits[i] = true;
-                    // Safe to index into vout here because IsAvailable checked if it's off the end of the array, or if
-                    // n is valid but points to an already spent output (IsNull).
-                    CCoin coin;
-                    coin.nTxVer = coins.nVersion;
-                    coin.nHeight = coins.nHeight;
-                    coin.out = coins.vout.at(vOutPoints[i].n);
-                    assert(!coin.out.IsNull());
-                    outs.push_back(coin);
-                }
+            CCoin coin;
+            // BIP64 replies never include outputs spent in the mempool, whether or not checkmempool is set
+            if (GetUTXO(view, vOutPoints[i], true, coin)) {
+                hits[i] = true;
+                outs.push_back(coin);
             }
 
             bitmapStringRepresentation.append(hits[i] ? "1" : "0"); // form a binary string representation (human-readable for json output)
@@ -569,16 +804,7 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
 
         UniValue utxos(UniValue::VARR);
         BOOST_FOREACH (const CCoin& coin, outs) {
-            UniValue utxo(UniValue::VOBJ);
-            utxo.push_back(Pair("txvers", (int32_t)coin.nTxVer));
-            utxo.push_back(Pair("height", (int32_t)coin.nHeight));
-            utxo.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
-
-            // include the script in a json output
-            UniValue o(UniValue::VOBJ);
-            ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
-            utxo.push_back(Pair("scriptPubKey", o));
-            utxos.push_back(utxo);
+            utxos.push_back(CoinToJSON(coin));
         }
         objGetUTXOResponse.push_back(Pair("utxos", utxos));
 
@@ -597,6 +823,134 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+static bool rest_getutxos_bulk(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    if (req->GetRequestMethod() != HTTPRequest::POST)
+        return RESTERR(req, HTTP_BAD_METHOD, "Outpoints must be posted");
+    if (!param.empty())
+        return RESTERR(req, HTTP_BAD_REQUEST, "Outpoints must be posted, not given in the URI");
+
+    std::string strRequest = req->ReadBody();
+    bool fCheckMemPool = false;
+    vector<COutPoint> vOutPoints;
+
+    switch (rf) {
+    case RF_HEX: {
+        std::vector<unsigned char> vchRequest = ParseHex(strRequest);
+        strRequest.assign(vchRequest.begin(), vchRequest.end());
+    }
+    // fall through
+    case RF_BINARY: {
+        // Same request as for /rest/getutxos (BIP64)
+        try {
+            CDataStream ssRequest(strRequest.data(), strRequest.data() + strRequest.size(), SER_NETWORK, PROTOCOL_VERSION);
+            ssRequest >> fCheckMemPool;
+            ssRequest >> vOutPoints;
+        } catch (const std::ios_base::failure& e) {
+            return RESTERR(req, HTTP_BAD_REQUEST, "Parse error");
+        }
+        break;
+    }
+    case RF_JSON: {
+        // {"checkmempool": bool, "outpoints": [{"txid": hex, "vout": n}, ...]}
+        UniValue valRequest;
+        if (!valRequest.read(strRequest) || !valRequest.isObject())
+            return RESTERR(req, HTTP_BAD_REQUEST, "Parse error");
+        const UniValue& checkMemPool = find_value(valRequest, "checkmempool");
+        const UniValue& outpoints = find_value(valRequest, "outpoints");
+        if (!(checkMemPool.isNull() || checkMemPool.isBool()) || !outpoints.isArray())
+            return RESTERR(req, HTTP_BAD_REQUEST, "Parse error");
+        fCheckMemPool = checkMemPool.isTrue();
+        vOutPoints.reserve(outpoints.size());
+        for (size_t i = 0; i < outpoints.size(); i++) {
+            const UniValue& txid = find_value(outpoints[i], "txid");
+            const UniValue& vout = find_value(outpoints[i], "vout");
+            uint256 hash;
+            // A number such as 1.5 or 1e3 is not an output index (and
+            // get_int64() would throw on it), so parse the plain integer
+            int64_t n;
+            if (!txid.isStr() || !ParseHashStr(txid.get_str(), hash) || !vout.isNum() ||
+                !ParseInt64(vout.getValStr(), &n) || n < 0 || n > std::numeric_limits<uint32_t>::max())
+                return RESTERR(req, HTTP_BAD_REQUEST, strprintf("Invalid outpoint %u", i));
+            vOutPoints.push_back(COutPoint(hash, (uint32_t)n));
+        }
+        break;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+    strRequest.clear();
+
+    int nChainHeight;
+    uint256 hashChainTip;
+    {
+        LOCK(cs_main);
+        nChainHeight = chainActive.Height();
+        hashChainTip = chainActive.Tip()->GetBlockHash();
+    }
+
+    // Outpoints are looked up in batches, releasing the locks and sending
+    // the results in between, so the node is not held up by a long reply.
+    // Each batch sees the chain and mempool as they are at the time.
+    CRESTReplyStream stream(req, rf);
+    CJSONWriter writer(boost::bind(&CRESTReplyStream::Write, &stream, _1));
+    if (rf == RF_JSON) {
+        writer.BeginObject();
+        writer.Pair("chainHeight", nChainHeight);
+        writer.Pair("chaintipHash", hashChainTip.GetHex());
+        writer.Key("utxos");
+        writer.BeginArray();
+    } else {
+        CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+        ssHeader << nChainHeight << hashChainTip;
+        stream.WriteData(ssHeader.str());
+    }
+    for (size_t nBatch = 0; nBatch < vOutPoints.size() && stream.Good(); nBatch += REST_UTXO_BATCH_SIZE) {
+        size_t nBatchEnd = std::min(nBatch + REST_UTXO_BATCH_SIZE, vOutPoints.size());
+        std::vector<CCoin> vCoins(nBatchEnd - nBatch);
+        std::vector<bool> vFound(nBatchEnd - nBatch);
+        {
+            LOCK2(cs_main, mempool.cs);
+            CCoinsViewCache& viewChain = *pcoinsTip;
+            CCoinsViewMemPool viewMempool(&viewChain, mempool);
+            CCoinsViewCache view(fCheckMemPool ? (CCoinsView*)&viewMempool : (CCoinsView*)&viewChain);
+            for (size_t i = nBatch; i < nBatchEnd; i++)
+                vFound[i - nBatch] = GetUTXO(view, vOutPoints[i], fCheckMemPool, vCoins[i - nBatch]);
+        }
+
+        // One entry per outpoint, in the order asked for: null, or a flag
+        // byte, for a spent or unknown output
+        CDataStream ssBatch(SER_NETWORK, PROTOCOL_VERSION);
+        for (size_t i = 0; i < vCoins.size(); i++) {
+            if (rf == RF_JSON) {
+                if (vFound[i])
+                    writer.Value(CoinToJSON(vCoins[i]));
+                else
+                    writer.Null();
+            } else {
+                ssBatch << (bool)vFound[i];
+                if (vFound[i])
+                    ssBatch << vCoins[i];
+            }
+        }
+        if (rf != RF_JSON)
+            stream.WriteData(ssBatch.str());
+        stream.Send();
+    }
+    if (rf == RF_JSON) {
+        writer.EndArray();
+        writer.EndObject();
+        writer.Flush();
+    }
+    stream.End();
+    return true;
+}
+
 static const struct {
     const char* prefix;
     bool (*handler)(HTTPRequest* req, const std::string& strReq);
@@ -608,13 +962,16 @@ static const struct {
       {"/rest/mempool/info", rest_mempool_info},
       {"/rest/mempool/contents", rest_mempool_contents},
       {"/rest/headers/", rest_headers},
+      {"/rest/headerrange/", rest_headerrange},
+      {"/rest/blockrange/", rest_blockrange},
+      {"/rest/getutxos/bulk", rest_getutxos_bulk},
       {"/rest/getutxos", rest_getutxos},
 };
 
 bool StartREST()
 {
     for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++)
-        RegisterHTTPHandler(uri_prefixes[i].prefix, false, uri_prefixes[i].handler);
+        RegisterHTTPHandler(uri_prefixes[i].prefix, false, uri_prefixes[i].handler, HTTP_LANE_REST);
     return true;
 }
 
@@ -10,15 +10,18 @@
 #include "coins.h"
 #include "consensus/validation.h"
 #include "core_io.h"
+#include "jsonwriter.h"
 #include "main.h"
 #include "policy/policy.h"
 #include "primitives/transaction.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "streams.h"
 #include "sync.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "validationinterface.h"
 
 #include <stdint.h>
 
@@ -127,7 +130,7 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     return result;
 }
 
-UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false, bool fIncludeTxs = true)
 {
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", block.GetHash().GetHex()));
@@ -143,16 +146,18 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     UniValue txs(UniValue::VARR);
     BOOST_FOREACH(const CTransaction&tx, block.vtx)
     {
+        if (!fIncludeTxs)
+            break;
         if(txDetails)
         {
             UniValue objTx(UniValue::VOBJ);
             TxToJSON(tx, uint256(), objTx);
-            txs.push_back(objTx);
+            txs.push_backSwap(objTx);
         }
         else
             txs.push_back(tx.GetHash().GetHex());
     }
-    result.push_back(Pair("tx", txs));
+    result.pushKVSwap("tx", txs);
     result.push_back(Pair("time", block.GetBlockTime()));
     result.push_back(Pair("mediantime", (int64_t)blockindex->GetMedianTimePast()));
     result.push_back(Pair("nonce", (uint64_t)block.nNonce));
@@ -171,6 +176,45 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     return result;
 }
 
+/**
+ * Write the same as blockToJSON, building one transaction at a time. Only
+ * the description of the block itself is built with cs_main held; writing
+ * may wait for the client, so the transactions are written without it.
+ */
+void blockToJSON(CJSONWriter& result, const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+{
+    // Apart from the transactions the result is small, so build it as usual
+    // and write the transactions in place of the empty list
+    UniValue header;
+    {
+        LOCK(cs_main);
+        header = blockToJSON(block, blockindex, txDetails, false);
+    }
+    std::vector<std::string> keys = header.getKeys();
+    result.BeginObject();
+    for (unsigned int i = 0; i < keys.size(); i++) {
+        if (keys[i] != "tx") {
+            result.Pair(keys[i], header[i]);
+            continue;
+        }
+        result.Key("tx");
+        result.BeginArray();
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            if (txDetails)
+            {
+                UniValue objTx(UniValue::VOBJ);
+                TxToJSON(tx, uint256(), objTx);
+                result.Value(objTx);
+            }
+            else
+                result.Str(tx.GetHash().GetHex());
+        }
+        result.EndArray();
+    }
+    result.EndObject();
+}
+
 UniValue getblockcount(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -222,7 +266,38 @@ UniValue getdifficulty(const UniValue& params, bool fHelp)
     return GetDifficulty();
 }
 
-UniValue mempoolToJSON(bool fVerbose = false)
+/** Describe a mempool entry; mempool.cs must be held */
+static UniValue mempoolEntryToJSON(const CTxMemPoolEntry& e)
+{
+    UniValue info(UniValue::VOBJ);
+    info.push_back(Pair("size", (int)e.GetTxSize()));
+    info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+    info.push_back(Pair("time", e.GetTime()));
+    info.push_back(Pair("height", (int)e.GetHeight()));
+    info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
+    info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+    info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+    info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+    info.push_back(Pair("descendantfees", e.GetFeesWithDescendants()));
+    const CTransaction& tx = e.GetTx();
+    set<string> setDepends;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (mempool.exists(txin.prevout.hash))
+            setDepends.insert(txin.prevout.hash.ToString());
+    }
+
+    UniValue depends(UniValue::VARR);
+    BOOST_FOREACH(const string& dep, setDepends)
+    {
+        depends.push_back(dep);
+    }
+
+    info.push_back(Pair("depends", depends));
+    return info;
+}
+
+UniValue mempoolToJSON(bool fVerbose = false, bool fIncludeSequence = false)
 {
     if (fVerbose)
     {
@@ -231,37 +306,13 @@ UniValue mempoolToJSON(bool fVerbose = false)
         BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
         {
             const uint256& hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            info.push_back(Pair("size", (int)e.GetTxSize()));
-            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-            info.push_back(Pair("time", e.GetTime()));
-            info.push_back(Pair("height", (int)e.GetHeight()));
-            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
-            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
-            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
-            info.push_back(Pair("descendantfees", e.GetFeesWithDescendants()));
-            const CTransaction& tx = e.GetTx();
-            set<string> setDepends;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
-            }
-
-            UniValue depends(UniValue::VARR);
-            BOOST_FOREACH(const string& dep, setDepends)
-            {
-                depends.push_back(dep);
-            }
-
-            info.push_back(Pair("depends", depends));
-            o.push_back(Pair(hash.ToString(), info));
+            o.push_back(Pair(hash.ToString(), mempoolEntryToJSON(e)));
         }
         return o;
     }
     else
     {
+        LOCK(mempool.cs);
         vector<uint256> vtxid;
         mempool.queryHashes(vtxid);
 
@@ -269,23 +320,75 @@ UniValue mempoolToJSON(bool fVerbose = false)
         BOOST_FOREACH(const uint256& hash, vtxid)
             a.push_back(hash.ToString());
 
-        return a;
+        if (!fIncludeSequence)
+            return a;
+
+        UniValue o(UniValue::VOBJ);
+        o.push_back(Pair("txids", a));
+        o.push_back(Pair("mempool_sequence", mempool.GetSequence()));
+        return o;
+    }
+}
+
+/** Mempool entries described per acquisition of the locks when the mempool is streamed */
+static const size_t MEMPOOL_JSON_BATCH_SIZE = 1000;
+
+/**
+ * Write the same as mempoolToJSON(true), one entry at a time. Writing may
+ * wait for the client, so entries are described in batches with the locks
+ * held and written after releasing them; entries that leave the mempool in
+ * the meantime are left out.
+ */
+void mempoolToJSON(CJSONWriter& result)
+{
+    std::vector<uint256> vtxid;
+    {
+        LOCK(mempool.cs);
+        mempool.queryHashes(vtxid);
     }
+    result.BeginObject();
+    std::vector<std::pair<uint256, UniValue> > vEntries;
+    size_t nNext = 0;
+    while (nNext < vtxid.size()) {
+        vEntries.clear();
+        {
+            LOCK2(cs_main, mempool.cs);
+            size_t nEnd = std::min(nNext + MEMPOOL_JSON_BATCH_SIZE, vtxid.size());
+            for (; nNext < nEnd; nNext++) {
+                CTxMemPool::txiter it = mempool.mapTx.find(vtxid[nNext]);
+                if (it != mempool.mapTx.end())
+                    vEntries.push_back(std::make_pair(vtxid[nNext], mempoolEntryToJSON(*it)));
+            }
+        }
+        for (size_t i = 0; i < vEntries.size(); i++)
+            result.Pair(vEntries[i].first.ToString(), vEntries[i].second);
+    }
+    result.EndObject();
 }
 
 UniValue getrawmempool(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() > 1)
+    if (fHelp || params.size() > 2)
         throw runtime_error(
-            "getrawmempool ( verbose )\n"
+            "getrawmempool ( verbose mempool_sequence )\n"
             "\nReturns all transaction ids in memory pool as a json array of string transaction ids.\n"
             "\nArguments:\n"
             "1. verbose           (boolean, optional, default=false) true for a json object, false for array of transaction ids\n"
+            "2. mempool_sequence  (boolean, optional, default=false) If verbose=false, returns a json object with the transaction list\n"
+            "                     and the mempool sequence number, to follow up with the ZeroMQ \"sequence\" notifications\n"
             "\nResult: (for verbose = false):\n"
             "[                     (json array of string)\n"
             "  \"transactionid\"     (string) The transaction id\n"
             "  ,...\n"
             "]\n"
+            "\nResult: (for verbose = false and mempool_sequence = true):\n"
+            "{                           (json object)\n"
+            "  \"txids\" : [               (json array of string)\n"
+            "      \"transactionid\"       (string) The transaction id\n"
+            "      ,...\n"
+            "  ],\n"
+            "  \"mempool_sequence\" : n    (numeric) The mempool sequence number the list corresponds to\n"
+            "}\n"
             "\nResult: (for verbose = true):\n"
             "{                           (json object)\n"
             "  \"transactionid\" : {       (json object)\n"
@@ -314,7 +417,24 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
     if (params.size() > 0)
         fVerbose = params[0].get_bool();
 
-    return mempoolToJSON(fVerbose);
+    bool fIncludeSequence = false;
+    if (params.size() > 1)
+        fIncludeSequence = params[1].get_bool();
+
+    if (fVerbose && fIncludeSequence)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Verbose results cannot contain mempool sequence values.");
+
+    return mempoolToJSON(fVerbose, fIncludeSequence);
+}
+
+bool getrawmempool_stream(const UniValue& params, CJSONWriter& result)
+{
+    // Only the verbose form is big enough to be worth streaming
+    if (params.size() != 1 || !params[0].get_bool())
+        return false;
+
+    mempoolToJSON(result);
+    return true;
 }
 
 UniValue getblockhash(const UniValue& params, bool fHelp)
@@ -399,6 +519,26 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
     return blockheaderToJSON(pblockindex);
 }
 
+/** Read the block with the hash in value; cs_main must be held */
+static CBlockIndex* ReadBlockForRPC(const UniValue& value, CBlock& block)
+{
+    std::string strHash = value.get_str();
+    uint256 hash(uint256S(strHash));
+
+    if (mapBlockIndex.count(hash) == 0)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+    CBlockIndex* pblockindex = mapBlockIndex[hash];
+
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
+    if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
+    return pblockindex;
+}
+
 UniValue getblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -438,24 +578,12 @@ UniValue getblock(const UniValue& params, bool fHelp)
 
     LOCK(cs_main);
 
-    std::string strHash = params[0].get_str();
-    uint256 hash(uint256S(strHash));
-
     bool fVerbose = true;
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
-
-    if(!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    CBlockIndex* pblockindex = ReadBlockForRPC(params[0], block);
 
     if (!fVerbose)
     {
@@ -468,6 +596,22 @@ UniValue getblock(const UniValue& params, bool fHelp)
     return blockToJSON(block, pblockindex);
 }
 
+bool getblock_stream(const UniValue& params, CJSONWriter& result)
+{
+    // The hex form is a single string, which gains nothing from streaming
+    if (params.size() < 1 || params.size() > 2 || (params.size() > 1 && !params[1].get_bool()))
+        return false;
+
+    CBlock block;
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        pblockindex = ReadBlockForRPC(params[0], block);
+    }
+    blockToJSON(result, block, pblockindex);
+    return true;
+}
+
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -851,6 +995,90 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+static UniValue HashCacheStatsToJSON(const CHashCacheStats& stats)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("entries", (int64_t) stats.nEntries));
+    ret.push_back(Pair("capacity", (int64_t) stats.nCapacity));
+    ret.push_back(Pair("usage", (int64_t) stats.nMemoryUsage));
+    ret.push_back(Pair("hits", (int64_t) stats.nHits));
+    ret.push_back(Pair("misses", (int64_t) stats.nMisses));
+    ret.push_back(Pair("inserts", (int64_t) stats.nInserts));
+    ret.push_back(Pair("evictions", (int64_t) stats.nEvictions));
+    return ret;
+}
+
+UniValue getsigcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "\nReturns details on the state of the signature and script execution caches.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"signatures\": {              (json object) The cache of valid signatures\n"
+            "    \"entries\": xxxxx           (numeric) Number of cached entries\n"
+            "    \"capacity\": xxxxx          (numeric) Maximum number of cached entries\n"
+            "    \"usage\": xxxxx             (numeric) Memory allocated for the cache\n"
+            "    \"hits\": xxxxx              (numeric) Number of lookups that found an entry\n"
+            "    \"misses\": xxxxx            (numeric) Number of lookups that did not find an entry\n"
+            "    \"inserts\": xxxxx           (numeric) Number of entries added\n"
+            "    \"evictions\": xxxxx         (numeric) Number of entries evicted to make room\n"
+            "  },\n"
+            "  \"scripts\": {                 (json object) The cache of transactions whose scripts passed, same fields\n"
+            "    ...\n"
+            "  }\n"
+            "}\n"
+            "\nThe memory of both caches together is bounded by -maxsigcachesize.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getsigcacheinfo", "")
+            + HelpExampleRpc("getsigcacheinfo", "")
+        );
+
+    CHashCacheStats stats;
+    UniValue ret(UniValue::VOBJ);
+    GetSignatureCacheStats(stats);
+    ret.push_back(Pair("signatures", HashCacheStatsToJSON(stats)));
+    GetScriptExecutionCacheStats(stats);
+    ret.push_back(Pair("scripts", HashCacheStatsToJSON(stats)));
+    return ret;
+}
+
+UniValue getvalidationqueueinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getvalidationqueueinfo\n"
+            "\nReturns details on the queue of notifications for asynchronous listeners (such as ZMQ).\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"listeners\": xxxxx          (numeric) Number of asynchronous listeners\n"
+            "  \"size\": xxxxx               (numeric) Notifications waiting to be delivered\n"
+            "  \"maxsize\": xxxxx            (numeric) Queue size above which notifications other than for blocks are dropped\n"
+            "  \"peaksize\": xxxxx           (numeric) Largest number of notifications that were waiting at once\n"
+            "  \"queued\": xxxxx             (numeric) Notifications queued in total\n"
+            "  \"dropped\": xxxxx            (numeric) Notifications dropped because the queue was full\n"
+            "  \"averagewait\": x.xxx        (numeric) Average time in seconds between queueing and delivery\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getvalidationqueueinfo", "")
+            + HelpExampleRpc("getvalidationqueueinfo", "")
+        );
+
+    CValidationQueueStats stats;
+    GetValidationQueueStats(stats);
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("listeners", (int64_t) stats.nListeners));
+    ret.push_back(Pair("size", (int64_t) stats.nSize));
+    ret.push_back(Pair("maxsize", (int64_t) stats.nMaxSize));
+    ret.push_back(Pair("peaksize", (int64_t) stats.nPeakSize));
+    ret.push_back(Pair("queued", stats.nQueued));
+    ret.push_back(Pair("dropped", stats.nDropped));
+    uint64_t nDelivered = stats.nQueued - stats.nSize;
+    ret.push_back(Pair("averagewait", nDelivered ? stats.nWaitMicros * 0.000001 / nDelivered : 0.0));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -5,6 +5,7 @@
 
 #include "base58.h"
 #include "clientversion.h"
+#include "httpserver.h"
 #include "init.h"
 #include "main.h"
 #include "net.h"
@@ -13,6 +14,10 @@
 #include "timedata.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#if ENABLE_ZMQ
+#include "zmq/zmqabstractnotifier.h"
+#include "zmq/zmqnotificationinterface.h"
+#endif
 #ifdef ENABLE_WALLET
 #include "wallet/wallet.h"
 #include "wallet/walletdb.h"
@@ -396,3 +401,172 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
 
     return NullUniValue;
 }
+
+UniValue getzmqnotifications(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getzmqnotifications\n"
+            "\nReturns information about the active ZeroMQ notifications.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"type\": \"pubhashtx\",        (string) Type of notification\n"
+            "    \"address\": \"...\",           (string) Address of the publisher\n"
+            "    \"hwm\": n,                     (numeric) Outbound message high water mark\n"
+            "    \"published\": n                (numeric) Messages published, including those dropped for subscribers at the high water mark\n"
+            "  },\n"
+            "  ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getzmqnotifications", "")
+            + HelpExampleRpc("getzmqnotifications", "")
+        );
+
+    UniValue result(UniValue::VARR);
+#if ENABLE_ZMQ
+    if (g_zmq_notification_interface) {
+        std::list<const CZMQAbstractNotifier*> notifiers = g_zmq_notification_interface->GetActiveNotifiers();
+        BOOST_FOREACH(const CZMQAbstractNotifier* n, notifiers) {
+            UniValue obj(UniValue::VOBJ);
+            obj.push_back(Pair("type", n->GetType()));
+            obj.push_back(Pair("address", n->GetAddress()));
+            obj.push_back(Pair("hwm", n->GetOutboundMessageHighWaterMark()));
+            obj.push_back(Pair("published", n->GetPublishedCount()));
+            result.push_back(obj);
+        }
+    }
+#endif
+    return result;
+}
+
+UniValue getrpcworkqueueinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcworkqueueinfo\n"
+            "\nReturns the state of the HTTP work queue, per lane in the order workers serve them.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"lane\": \"mining\",          (string) Lane name: mining, wallet, chain or rest\n"
+            "    \"depth\": n,                 (numeric) Requests waiting for a worker\n"
+            "    \"peakdepth\": n,             (numeric) Highest number of requests waiting at once\n"
+            "    \"running\": n,               (numeric) Requests currently being handled\n"
+            "    \"maxrunning\": n,            (numeric) Workers the lane may use at once (-rpclanethreads)\n"
+            "    \"queued\": n,                (numeric) Requests queued since startup\n"
+            "    \"rejected\": n,              (numeric) Requests rejected because the lane was full (-rpcworkqueue)\n"
+            "    \"avgwait\": x.xxx            (numeric) Average time in seconds a request waited for a worker\n"
+            "  },\n"
+            "  ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrpcworkqueueinfo", "")
+            + HelpExampleRpc("getrpcworkqueueinfo", "")
+        );
+
+    std::vector<HTTPWorkLaneStats> stats;
+    GetHTTPWorkQueueStats(stats);
+
+    UniValue result(UniValue::VARR);
+    BOOST_FOREACH(const HTTPWorkLaneStats& lane, stats) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("lane", lane.name));
+        obj.push_back(Pair("depth", (uint64_t)lane.nDepth));
+        obj.push_back(Pair("peakdepth", (uint64_t)lane.nPeakDepth));
+        obj.push_back(Pair("running", lane.nRunning));
+        obj.push_back(Pair("maxrunning", lane.nMaxRunning));
+        obj.push_back(Pair("queued", lane.nQueued));
+        obj.push_back(Pair("rejected", lane.nRejected));
+        obj.push_back(Pair("avgwait", lane.wait.AverageMicros() * 0.000001));
+        result.push_back(obj);
+    }
+    return result;
+}
+
+static UniValue LatencyToJSON(const CLatencyStats& latency)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("count", latency.nCount));
+    obj.push_back(Pair("avg", latency.AverageMicros()));
+    obj.push_back(Pair("p50", latency.QuantileMicros(0.5)));
+    obj.push_back(Pair("p95", latency.QuantileMicros(0.95)));
+    obj.push_back(Pair("p99", latency.QuantileMicros(0.99)));
+    obj.push_back(Pair("max", latency.nMaxMicros));
+    return obj;
+}
+
+UniValue getrpcstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcstats\n"
+            "\nReturns statistics of the HTTP server and the RPC calls it handled since startup.\n"
+            "Times are in microseconds; percentiles are estimated from histogram buckets.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"http\": {\n"
+            "    \"connections\": n,          (numeric) Connections currently open\n"
+            "    \"connectionsopened\": n,    (numeric) Connections opened since startup\n"
+            "    \"requests\": n,             (numeric) Requests received\n"
+            "    \"reusedrequests\": n,       (numeric) Requests on a connection kept alive from an earlier request\n"
+            "    \"bytesin\": n,              (numeric) Bytes of request bodies received\n"
+            "    \"bytesout\": n              (numeric) Bytes of reply bodies sent\n"
+            "  },\n"
+            "  \"queuewait\": {             (json object) Time requests waited for a worker, by lane\n"
+            "    \"lane\": {\n"
+            "      \"count\": n,              (numeric) Requests that got a worker\n"
+            "      \"avg\": n,                (numeric) Average wait\n"
+            "      \"p50\": n,                (numeric) Median wait\n"
+            "      \"p95\": n,                (numeric) 95th percentile\n"
+            "      \"p99\": n,                (numeric) 99th percentile\n"
+            "      \"max\": n                 (numeric) Longest wait\n"
+            "    },\n"
+            "    ...\n"
+            "  },\n"
+            "  \"methods\": {              (json object) Time calls took to execute, by method\n"
+            "    \"method\": {\n"
+            "      \"count\": n,              (numeric) Calls, including failed ones\n"
+            "      \"errors\": n,             (numeric) Calls that failed\n"
+            "      \"avg\": n, \"p50\": n, \"p95\": n, \"p99\": n, \"max\": n  (numeric) As for queuewait\n"
+            "    },\n"
+            "    ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrpcstats", "")
+            + HelpExampleRpc("getrpcstats", "")
+        );
+
+    HTTPServerStats httpStats;
+    GetHTTPServerStats(httpStats);
+    std::vector<HTTPWorkLaneStats> laneStats;
+    GetHTTPWorkQueueStats(laneStats);
+    std::map<std::string, RPCMethodStats> mapMethodStats;
+    GetRPCMethodStats(mapMethodStats);
+
+    UniValue http(UniValue::VOBJ);
+    http.push_back(Pair("connections", httpStats.nConnectionsOpen));
+    http.push_back(Pair("connectionsopened", httpStats.nConnectionsOpened));
+    http.push_back(Pair("requests", httpStats.nRequests));
+    http.push_back(Pair("reusedrequests", httpStats.nRequestsReused));
+    http.push_back(Pair("bytesin", httpStats.nBytesIn));
+    http.push_back(Pair("bytesout", httpStats.nBytesOut));
+
+    UniValue queuewait(UniValue::VOBJ);
+    BOOST_FOREACH(const HTTPWorkLaneStats& lane, laneStats)
+        queuewait.push_back(Pair(lane.name, LatencyToJSON(lane.wait)));
+
+    UniValue methods(UniValue::VOBJ);
+    for (std::map<std::string, RPCMethodStats>::const_iterator it = mapMethodStats.begin(); it != mapMethodStats.end(); ++it) {
+        UniValue obj = LatencyToJSON(it->second.latency);
+        obj.push_back(Pair("errors", it->second.nErrors));
+        methods.push_back(Pair(it->first, obj));
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("http", http));
+    result.push_back(Pair("queuewait", queuewait));
+    result.push_back(Pair("methods", methods));
+    return result;
+}
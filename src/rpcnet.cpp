@@ -111,6 +111,16 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ]\n"
+            "    \"blockwindow\": n,          (numeric) How many blocks we request from this peer at once\n"
+            "    \"blockservicetime\": n,     (numeric) Average time in seconds the peer needs per requested block\n"
+            "    \"blocklatency\": n,         (numeric) Average time in seconds from requesting a block to receiving it\n"
+            "    \"blockbytespersec\": n,     (numeric) Average block download speed from this peer in bytes per second\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"relaytxqueue\": n,         (numeric) Transactions waiting to be announced to this peer\n"
+            "    \"relaytxsent\": n,          (numeric) Transactions announced to this peer\n"
+            "    \"relayinvsent\": n,         (numeric) Inv messages used to announce them\n"
+            "    \"relaytxdropped\": n,       (numeric) Transactions not announced to this peer because its queue was full\n"
+            "    \"historicalbytessent\": n,  (numeric) Bytes of historical blocks served to this peer\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -162,8 +172,17 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("blockwindow", statestats.nBlocksInFlightMax));
+            obj.push_back(Pair("blockservicetime", statestats.nBlockServiceTime * 0.000001));
+            obj.push_back(Pair("blocklatency", statestats.nBlockLatency * 0.000001));
+            obj.push_back(Pair("blockbytespersec", statestats.nBlockBytesPerSec));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("relaytxqueue", (uint64_t)stats.nRelayTxQueue));
+        obj.push_back(Pair("relaytxsent", stats.nRelayTxSent));
+        obj.push_back(Pair("relayinvsent", stats.nRelayInvSent));
+        obj.push_back(Pair("relaytxdropped", stats.nRelayTxDropped));
+        obj.push_back(Pair("historicalbytessent", stats.nHistoricalBytesSent));
 
         ret.push_back(obj);
     }
@@ -378,7 +397,16 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "    \"target_reached\": true|false,           (boolean) True if target is reached\n"
             "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
             "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
-            "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "    \"time_left_in_cycle\": t,              (numeric) Seconds left in current time cycle\n"
+            "    \"bytes_sent_in_cycle\":                 (object) Bytes sent in the current cycle by class of peer\n"
+            "    {\n"
+            "      \"whitelisted\": n,                     (numeric) To whitelisted peers, which do not count against the target\n"
+            "      \"outbound\": n,                        (numeric) To peers we connected to\n"
+            "      \"inbound\": n                          (numeric) To peers that connected to us\n"
+            "    },\n"
+            "    \"serve_historical_blocks_inbound\": true|false,  (boolean) True if serving historical blocks to inbound peers\n"
+            "    \"historical_peer_limit\": n,             (numeric) Bytes of historical blocks served to a peer before disconnecting it, 0 = no limit\n"
+            "    \"historical_rate\": n                    (numeric) Bytes per second of historical blocks uploaded at most, 0 = no limit\n"
             "  }\n"
             "}\n"
             "\nExamples:\n"
@@ -398,6 +426,14 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
     outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
     outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    UniValue bytesByClass(UniValue::VOBJ);
+    bytesByClass.push_back(Pair("whitelisted", CNode::GetOutboundBytesInCycle(UPLOAD_WHITELISTED)));
+    bytesByClass.push_back(Pair("outbound", CNode::GetOutboundBytesInCycle(UPLOAD_OUTBOUND)));
+    bytesByClass.push_back(Pair("inbound", CNode::GetOutboundBytesInCycle(UPLOAD_INBOUND)));
+    outboundLimit.push_back(Pair("bytes_sent_in_cycle", bytesByClass));
+    outboundLimit.push_back(Pair("serve_historical_blocks_inbound", !CNode::HistoricalServingLimitReached(UPLOAD_INBOUND)));
+    outboundLimit.push_back(Pair("historical_peer_limit", CNode::GetMaxHistoricalBytesPerPeer()));
+    outboundLimit.push_back(Pair("historical_rate", CNode::GetMaxHistoricalRate()));
     obj.push_back(Pair("uploadtarget", outboundLimit));
     return obj;
 }
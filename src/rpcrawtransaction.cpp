@@ -75,12 +75,12 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry)
             UniValue o(UniValue::VOBJ);
             o.push_back(Pair("asm", ScriptToAsmStr(txin.scriptSig, true)));
             o.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
-            in.push_back(Pair("scriptSig", o));
+            in.pushKVSwap("scriptSig", o);
         }
         in.push_back(Pair("sequence", (int64_t)txin.nSequence));
-        vin.push_back(in);
+        vin.push_backSwap(in);
     }
-    entry.push_back(Pair("vin", vin));
+    entry.pushKVSwap("vin", vin);
     UniValue vout(UniValue::VARR);
     for (unsigned int i = 0; i < tx.vout.size(); i++) {
         const CTxOut& txout = tx.vout[i];
@@ -89,10 +89,10 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry)
         out.push_back(Pair("n", (int64_t)i));
         UniValue o(UniValue::VOBJ);
         ScriptPubKeyToJSON(txout.scriptPubKey, o, true);
-        out.push_back(Pair("scriptPubKey", o));
-        vout.push_back(out);
+        out.pushKVSwap("scriptPubKey", o);
+        vout.push_backSwap(out);
     }
-    entry.push_back(Pair("vout", vout));
+    entry.pushKVSwap("vout", vout);
 
     if (!hashBlock.IsNull()) {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
@@ -37,6 +37,13 @@ static std::vector<RPCTimerInterface*> timerInterfaces;
 /* Map of name to timer.
  * @note Can be changed to std::unique_ptr when C++11 */
 static std::map<std::string, boost::shared_ptr<RPCTimerBase> > deadlineTimers;
+/* Spreads batch calls over the RPC threads */
+static CCriticalSection cs_rpcStats;
+static std::map<std::string, RPCMethodStats> mapRPCMethodStats;
+
+static CCriticalSection cs_rpcBatch;
+static RPCWorkDispatcher rpcBatchDispatcher;
+static int nRPCBatchThreads = 0;
 
 static struct CRPCSignals
 {
@@ -253,129 +260,147 @@ UniValue stop(const UniValue& params, bool fHelp)
  * Call Table
  */
 static const CRPCCommand vRPCCommands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
+{ //  category              name                      actor (function)         okSafeMode okConcurrent
+  //  --------------------- ------------------------  -----------------------  ---------- ------------
     /* Overall control/query calls */
-    { "control",            "getinfo",                &getinfo,                true  }, /* uses wallet if enabled */
-    { "control",            "help",                   &help,                   true  },
-    { "control",            "stop",                   &stop,                   true  },
+    { "control",            "getinfo",                &getinfo,                true,      false }, /* uses wallet if enabled */
+    { "control",            "getrpcstats",            &getrpcstats,            true,      true  },
+    { "control",            "getrpcworkqueueinfo",    &getrpcworkqueueinfo,    true,      false },
+    { "control",            "help",                   &help,                   true,      false },
+    { "control",            "stop",                   &stop,                   true,      false },
 
     /* P2P networking */
-    { "network",            "getnetworkinfo",         &getnetworkinfo,         true  },
-    { "network",            "addnode",                &addnode,                true  },
-    { "network",            "disconnectnode",         &disconnectnode,         true  },
-    { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true  },
-    { "network",            "getconnectioncount",     &getconnectioncount,     true  },
-    { "network",            "getnettotals",           &getnettotals,           true  },
-    { "network",            "getpeerinfo",            &getpeerinfo,            true  },
-    { "network",            "ping",                   &ping,                   true  },
-    { "network",            "setban",                 &setban,                 true  },
-    { "network",            "listbanned",             &listbanned,             true  },
-    { "network",            "clearbanned",            &clearbanned,            true  },
+    { "network",            "getnetworkinfo",         &getnetworkinfo,         true,      false },
+    { "network",            "addnode",                &addnode,                true,      false },
+    { "network",            "disconnectnode",         &disconnectnode,         true,      false },
+    { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,      false },
+    { "network",            "getconnectioncount",     &getconnectioncount,     true,      false },
+    { "network",            "getnettotals",           &getnettotals,           true,      false },
+    { "network",            "getpeerinfo",            &getpeerinfo,            true,      false },
+    { "network",            "ping",                   &ping,                   true,      false },
+    { "network",            "setban",                 &setban,                 true,      false },
+    { "network",            "listbanned",             &listbanned,             true,      false },
+    { "network",            "clearbanned",            &clearbanned,            true,      false },
 
     /* Block chain and UTXO */
-    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true  },
-    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true  },
-    { "blockchain",         "getblockcount",          &getblockcount,          true  },
-    { "blockchain",         "getblock",               &getblock,               true  },
-    { "blockchain",         "getblockhash",           &getblockhash,           true  },
-    { "blockchain",         "getblockheader",         &getblockheader,         true  },
-    { "blockchain",         "getchaintips",           &getchaintips,           true  },
-    { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
-    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
-    { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
-    { "blockchain",         "gettxout",               &gettxout,               true  },
-    { "blockchain",         "gettxoutproof",          &gettxoutproof,          true  },
-    { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true  },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
-    { "blockchain",         "verifychain",            &verifychain,            true  },
+    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true,      true  },
+    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true,      true  },
+    { "blockchain",         "getblockcount",          &getblockcount,          true,      true  },
+    { "blockchain",         "getblock",               &getblock,               true,      true  },
+    { "blockchain",         "getblockhash",           &getblockhash,           true,      true  },
+    { "blockchain",         "getblockheader",         &getblockheader,         true,      true  },
+    { "blockchain",         "getchaintips",           &getchaintips,           true,      true  },
+    { "blockchain",         "getdifficulty",          &getdifficulty,          true,      true  },
+    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,      true  },
+    { "blockchain",         "getrawmempool",          &getrawmempool,          true,      true  },
+    { "blockchain",         "getsigcacheinfo",        &getsigcacheinfo,        true,      true  },
+    { "blockchain",         "getvalidationqueueinfo", &getvalidationqueueinfo, true,      true  },
+    { "blockchain",         "gettxout",               &gettxout,               true,      true  },
+    { "blockchain",         "gettxoutproof",          &gettxoutproof,          true,      true  },
+    { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true,      true  },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false },
+    { "blockchain",         "verifychain",            &verifychain,            true,      false },
 
     /* Mining */
-    { "mining",             "getblocktemplate",       &getblocktemplate,       true  },
-    { "mining",             "getmininginfo",          &getmininginfo,          true  },
-    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true  },
-    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true  },
-    { "mining",             "submitblock",            &submitblock,            true  },
-    { "mining",             "getauxblock",            &getauxblock,            true  },
+    { "mining",             "getblocktemplate",       &getblocktemplate,       true,      false },
+    { "mining",             "getmininginfo",          &getmininginfo,          true,      false },
+    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true,      true  },
+    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true,      false },
+    { "mining",             "submitblock",            &submitblock,            true,      false },
+    { "mining",             "getauxblock",            &getauxblock,            true,      false },
 
     /* Coin generation */
-    { "generating",         "getgenerate",            &getgenerate,            true  },
-    { "generating",         "setgenerate",            &setgenerate,            true  },
-    { "generating",         "generate",               &generate,               true  },
+    { "generating",         "getgenerate",            &getgenerate,            true,      false },
+    { "generating",         "setgenerate",            &setgenerate,            true,      false },
+    { "generating",         "generate",               &generate,               true,      false },
 
     /* Raw transactions */
-    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true  },
-    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true  },
-    { "rawtransactions",    "decodescript",           &decodescript,           true  },
-    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true  },
-    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false },
-    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false }, /* uses wallet if enabled */
+    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true,      true  },
+    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true,      true  },
+    { "rawtransactions",    "decodescript",           &decodescript,           true,      true  },
+    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true,      true  },
+    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false,     false },
+    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false,     false }, /* uses wallet if enabled */
 #ifdef ENABLE_WALLET
-    { "rawtransactions",    "fundrawtransaction",     &fundrawtransaction,     false },
+    { "rawtransactions",    "fundrawtransaction",     &fundrawtransaction,     false,     false },
 #endif
 
     /* Utility functions */
-    { "util",               "createmultisig",         &createmultisig,         true  },
-    { "util",               "validateaddress",        &validateaddress,        true  }, /* uses wallet if enabled */
-    { "util",               "verifymessage",          &verifymessage,          true  },
-    { "util",               "estimatefee",            &estimatefee,            true  },
-    { "util",               "estimatepriority",       &estimatepriority,       true  },
-    { "util",               "estimatesmartfee",       &estimatesmartfee,       true  },
-    { "util",               "estimatesmartpriority",  &estimatesmartpriority,  true  },
+    { "util",               "createmultisig",         &createmultisig,         true,      true  },
+    { "util",               "validateaddress",        &validateaddress,        true,      false }, /* uses wallet if enabled */
+    { "util",               "verifymessage",          &verifymessage,          true,      true  },
+    { "util",               "estimatefee",            &estimatefee,            true,      true  },
+    { "util",               "estimatepriority",       &estimatepriority,       true,      true  },
+    { "util",               "estimatesmartfee",       &estimatesmartfee,       true,      true  },
+    { "util",               "estimatesmartpriority",  &estimatesmartpriority,  true,      true  },
+
+    /* ZeroMQ */
+    { "zmq",                "getzmqnotifications",    &getzmqnotifications,    true,      false },
 
     /* Not shown in help */
-    { "hidden",             "invalidateblock",        &invalidateblock,        true  },
-    { "hidden",             "reconsiderblock",        &reconsiderblock,        true  },
-    { "hidden",             "setmocktime",            &setmocktime,            true  },
+    { "hidden",             "invalidateblock",        &invalidateblock,        true,      false },
+    { "hidden",             "reconsiderblock",        &reconsiderblock,        true,      false },
+    { "hidden",             "setmocktime",            &setmocktime,            true,      false },
 #ifdef ENABLE_WALLET
-    { "hidden",             "resendwallettransactions", &resendwallettransactions, true},
+    { "hidden",             "resendwallettransactions", &resendwallettransactions, true, false },
 #endif
 
 #ifdef ENABLE_WALLET
     /* Wallet */
-    { "wallet",             "addmultisigaddress",     &addmultisigaddress,     true  },
-    { "wallet",             "backupwallet",           &backupwallet,           true  },
-    { "wallet",             "dumpprivkey",            &dumpprivkey,            true  },
-    { "wallet",             "dumpwallet",             &dumpwallet,             true  },
-    { "wallet",             "encryptwallet",          &encryptwallet,          true  },
-    { "wallet",             "getaccountaddress",      &getaccountaddress,      true  },
-    { "wallet",             "getaccount",             &getaccount,             true  },
-    { "wallet",             "getaddressesbyaccount",  &getaddressesbyaccount,  true  },
-    { "wallet",             "getbalance",             &getbalance,             false },
-    { "wallet",             "getnewaddress",          &getnewaddress,          true  },
-    { "wallet",             "getrawchangeaddress",    &getrawchangeaddress,    true  },
-    { "wallet",             "getreceivedbyaccount",   &getreceivedbyaccount,   false },
-    { "wallet",             "getreceivedbyaddress",   &getreceivedbyaddress,   false },
-    { "wallet",             "gettransaction",         &gettransaction,         false },
-    { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false },
-    { "wallet",             "getwalletinfo",          &getwalletinfo,          false },
-    { "wallet",             "importprivkey",          &importprivkey,          true  },
-    { "wallet",             "importwallet",           &importwallet,           true  },
-    { "wallet",             "importaddress",          &importaddress,          true  },
-    { "wallet",             "importpubkey",           &importpubkey,           true  },
-    { "wallet",             "keypoolrefill",          &keypoolrefill,          true  },
-    { "wallet",             "listaccounts",           &listaccounts,           false },
-    { "wallet",             "listaddressgroupings",   &listaddressgroupings,   false },
-    { "wallet",             "listlockunspent",        &listlockunspent,        false },
-    { "wallet",             "listreceivedbyaccount",  &listreceivedbyaccount,  false },
-    { "wallet",             "listreceivedbyaddress",  &listreceivedbyaddress,  false },
-    { "wallet",             "listsinceblock",         &listsinceblock,         false },
-    { "wallet",             "listtransactions",       &listtransactions,       false },
-    { "wallet",             "listunspent",            &listunspent,            false },
-    { "wallet",             "lockunspent",            &lockunspent,            true  },
-    { "wallet",             "move",                   &movecmd,                false },
-    { "wallet",             "sendfrom",               &sendfrom,               false },
-    { "wallet",             "sendmany",               &sendmany,               false },
-    { "wallet",             "sendtoaddress",          &sendtoaddress,          false },
-    { "wallet",             "setaccount",             &setaccount,             true  },
-    { "wallet",             "settxfee",               &settxfee,               true  },
-    { "wallet",             "signmessage",            &signmessage,            true  },
-    { "wallet",             "walletlock",             &walletlock,             true  },
-    { "wallet",             "walletpassphrasechange", &walletpassphrasechange, true  },
-    { "wallet",             "walletpassphrase",       &walletpassphrase,       true  },
+    { "wallet",             "addmultisigaddress",     &addmultisigaddress,     true,      false },
+    { "wallet",             "backupwallet",           &backupwallet,           true,      false },
+    { "wallet",             "dumpprivkey",            &dumpprivkey,            true,      false },
+    { "wallet",             "dumpwallet",             &dumpwallet,             true,      false },
+    { "wallet",             "encryptwallet",          &encryptwallet,          true,      false },
+    { "wallet",             "getaccountaddress",      &getaccountaddress,      true,      false },
+    { "wallet",             "getaccount",             &getaccount,             true,      false },
+    { "wallet",             "getaddressesbyaccount",  &getaddressesbyaccount,  true,      false },
+    { "wallet",             "getbalance",             &getbalance,             false,     false },
+    { "wallet",             "getnewaddress",          &getnewaddress,          true,      false },
+    { "wallet",             "getrawchangeaddress",    &getrawchangeaddress,    true,      false },
+    { "wallet",             "getreceivedbyaccount",   &getreceivedbyaccount,   false,     false },
+    { "wallet",             "getreceivedbyaddress",   &getreceivedbyaddress,   false,     false },
+    { "wallet",             "gettransaction",         &gettransaction,         false,     false },
+    { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false,     false },
+    { "wallet",             "getwalletinfo",          &getwalletinfo,          false,     false },
+    { "wallet",             "importprivkey",          &importprivkey,          true,      false },
+    { "wallet",             "importwallet",           &importwallet,           true,      false },
+    { "wallet",             "importaddress",          &importaddress,          true,      false },
+    { "wallet",             "importpubkey",           &importpubkey,           true,      false },
+    { "wallet",             "keypoolrefill",          &keypoolrefill,          true,      false },
+    { "wallet",             "listaccounts",           &listaccounts,           false,     false },
+    { "wallet",             "listaddressgroupings",   &listaddressgroupings,   false,     false },
+    { "wallet",             "listlockunspent",        &listlockunspent,        false,     false },
+    { "wallet",             "listreceivedbyaccount",  &listreceivedbyaccount,  false,     false },
+    { "wallet",             "listreceivedbyaddress",  &listreceivedbyaddress,  false,     false },
+    { "wallet",             "listsinceblock",         &listsinceblock,         false,     false },
+    { "wallet",             "listtransactions",       &listtransactions,       false,     false },
+    { "wallet",             "listunspent",            &listunspent,            false,     false },
+    { "wallet",             "lockunspent",            &lockunspent,            true,      false },
+    { "wallet",             "move",                   &movecmd,                false,     false },
+    { "wallet",             "sendfrom",               &sendfrom,               false,     false },
+    { "wallet",             "sendmany",               &sendmany,               false,     false },
+    { "wallet",             "sendtoaddress",          &sendtoaddress,          false,     false },
+    { "wallet",             "setaccount",             &setaccount,             true,      false },
+    { "wallet",             "settxfee",               &settxfee,               true,      false },
+    { "wallet",             "signmessage",            &signmessage,            true,      false },
+    { "wallet",             "walletlock",             &walletlock,             true,      false },
+    { "wallet",             "walletpassphrasechange", &walletpassphrasechange, true,      false },
+    { "wallet",             "walletpassphrase",       &walletpassphrase,       true,      false },
 #endif // ENABLE_WALLET
 };
 
+/**
+ * Calls that can also write their result as a stream
+ */
+static const struct {
+    const char* name;
+    rpcstreamfn_type actor;
+} vRPCStreamCommands[] = {
+    { "getblock",               &getblock_stream         },
+    { "getrawmempool",          &getrawmempool_stream    },
+};
+
 CRPCTable::CRPCTable()
 {
     unsigned int vcidx;
@@ -386,6 +411,8 @@ CRPCTable::CRPCTable()
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
     }
+    for (vcidx = 0; vcidx < (sizeof(vRPCStreamCommands) / sizeof(vRPCStreamCommands[0])); vcidx++)
+        mapStreamCommands[vRPCStreamCommands[vcidx].name] = vRPCStreamCommands[vcidx].actor;
 }
 
 const CRPCCommand *CRPCTable::operator[](const std::string &name) const
@@ -396,6 +423,13 @@ const CRPCCommand *CRPCTable::operator[](const std::string &name) const
     return (*it).second;
 }
 
+bool CRPCTable::appendCommand(const std::string& name, const CRPCCommand* pcmd)
+{
+    if (IsRPCRunning())
+        return false;
+    return mapCommands.insert(std::make_pair(name, pcmd)).second;
+}
+
 bool StartRPC()
 {
     LogPrint("rpc", "Starting RPC\n");
@@ -498,15 +532,164 @@ static UniValue JSONRPCExecOne(const UniValue& req)
     return rpc_result;
 }
 
-std::string JSONRPCExecBatch(const UniValue& vReq)
+/** Whether a batch entry calls a method that may run concurrently with its neighbours */
+static bool IsConcurrentRequest(const UniValue& req)
 {
+    if (!req.isObject())
+        return false;
+    const UniValue& valMethod = find_value(req.get_obj(), "method");
+    if (!valMethod.isStr())
+        return false;
+    const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->okConcurrent;
+}
+
+/**
+ * A run of batch entries executed by several threads. Each thread claims the
+ * next entry until none are left. The thread owning the batch takes part, so
+ * the run completes even if no helper gets a worker; helpers that start late
+ * find nothing to claim, which is why they share ownership of this object.
+ */
+class CRPCBatchRun
+{
+private:
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    const UniValue& vReq;
+    std::vector<UniValue>& vResult;
+    size_t nNext;
+    size_t nEnd;
+    size_t nPending;
+
+public:
+    CRPCBatchRun(const UniValue& vReqIn, std::vector<UniValue>& vResultIn, size_t nBegin, size_t nEndIn) :
+        vReq(vReqIn), vResult(vResultIn), nNext(nBegin), nEnd(nEndIn), nPending(nEndIn - nBegin) {}
+
+    /** Execute entries until all are claimed. vReq and vResult are only
+     * touched for claimed entries, which the owner waits for. */
+    void Work()
+    {
+        while (true) {
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (nNext == nEnd)
+                    return;
+                i = nNext++;
+            }
+            UniValue result = JSONRPCExecOne(vReq[i]);
+            boost::unique_lock<boost::mutex> lock(cs);
+            vResult[i] = result;
+            if (--nPending == 0)
+                cond.notify_all();
+        }
+    }
+
+    /** Wait until every entry has been executed */
+    void Wait()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nPending > 0)
+            cond.wait(lock);
+    }
+};
+
+static void RPCBatchHelper(boost::shared_ptr<CRPCBatchRun> run)
+{
+    run->Work();
+}
+
+void RPCSetBatchDispatcher(const RPCWorkDispatcher& dispatcher, int nThreads)
+{
+    LOCK(cs_rpcBatch);
+    rpcBatchDispatcher = dispatcher;
+    nRPCBatchThreads = nThreads;
+}
+
+UniValue JSONRPCExecBatchObj(const UniValue& vReq)
+{
+    int64_t nMaxBatchSize = GetArg("-rpcmaxbatchsize", DEFAULT_RPC_MAX_BATCH_SIZE);
+    if (nMaxBatchSize > 0 && vReq.size() > (uint64_t)nMaxBatchSize)
+        throw JSONRPCError(RPC_INVALID_REQUEST, strprintf("Batch of %u calls exceeds -rpcmaxbatchsize=%d", vReq.size(), nMaxBatchSize));
+
+    RPCWorkDispatcher dispatcher;
+    int nThreads;
+    {
+        LOCK(cs_rpcBatch);
+        dispatcher = rpcBatchDispatcher;
+        nThreads = nRPCBatchThreads;
+    }
+
+    std::vector<UniValue> vResult(vReq.size());
+    size_t reqIdx = 0;
+    while (reqIdx < vReq.size()) {
+        size_t reqEnd = reqIdx;
+        while (reqEnd < vReq.size() && IsConcurrentRequest(vReq[reqEnd]))
+            reqEnd++;
+        if (reqEnd - reqIdx < 2 || !dispatcher || nThreads < 2) {
+            vResult[reqIdx] = JSONRPCExecOne(vReq[reqIdx]);
+            reqIdx++;
+            continue;
+        }
+
+        boost::shared_ptr<CRPCBatchRun> run(new CRPCBatchRun(vReq, vResult, reqIdx, reqEnd));
+        size_t nHelpers = std::min(reqEnd - reqIdx, (size_t)nThreads) - 1;
+        for (size_t i = 0; i < nHelpers; i++)
+            if (!dispatcher(boost::bind(&RPCBatchHelper, run)))
+                break;
+        run->Work();
+        run->Wait();
+        reqIdx = reqEnd;
+    }
+
     UniValue ret(UniValue::VARR);
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    ret.push_backV(vResult);
+    return ret;
+}
+
+std::string JSONRPCExecBatch(const UniValue& vReq)
+{
+    return JSONRPCExecBatchObj(vReq).write() + "\n";
+}
 
-    return ret.write() + "\n";
+void GetRPCMethodStats(std::map<std::string, RPCMethodStats>& mapStats)
+{
+    LOCK(cs_rpcStats);
+    mapStats = mapRPCMethodStats;
 }
 
+/**
+ * Records how long a call took when it goes out of scope, as an error unless
+ * Succeeded() was called.
+ */
+class CRPCCallTimer
+{
+private:
+    const std::string& strMethod;
+    int64_t nStart;
+    bool fSucceeded;
+    bool fDiscard;
+
+public:
+    CRPCCallTimer(const std::string& strMethodIn) : strMethod(strMethodIn), nStart(GetTimeMicros()), fSucceeded(false), fDiscard(false) {}
+
+    ~CRPCCallTimer()
+    {
+        if (fDiscard)
+            return;
+        int64_t nMicros = GetTimeMicros() - nStart;
+        LOCK(cs_rpcStats);
+        RPCMethodStats& stats = mapRPCMethodStats[strMethod];
+        stats.latency.Add(nMicros);
+        if (!fSucceeded)
+            stats.nErrors++;
+    }
+
+    void Succeeded() { fSucceeded = true; }
+    //! The call did not happen after all
+    void Discard() { fDiscard = true; }
+};
+
 UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params) const
 {
     // Return immediately if in warmup
@@ -523,10 +706,13 @@ UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params
 
     g_rpcSignals.PreCommand(*pcmd);
 
+    CRPCCallTimer timer(strMethod);
     try
     {
         // Execute
-        return pcmd->actor(params, false);
+        UniValue result = pcmd->actor(params, false);
+        timer.Succeeded();
+        return result;
     }
     catch (const std::exception& e)
     {
@@ -536,6 +722,42 @@ UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params
     g_rpcSignals.PostCommand(*pcmd);
 }
 
+bool CRPCTable::executeStream(const std::string &strMethod, const UniValue &params, CJSONWriter& result) const
+{
+    std::map<std::string, rpcstreamfn_type>::const_iterator it = mapStreamCommands.find(strMethod);
+    if (it == mapStreamCommands.end())
+        return false;
+
+    // Return immediately if in warmup
+    {
+        LOCK(cs_rpcWarmup);
+        if (fRPCInWarmup)
+            throw JSONRPCError(RPC_IN_WARMUP, rpcWarmupStatus);
+    }
+
+    const CRPCCommand *pcmd = tableRPC[strMethod];
+    assert(pcmd);
+
+    g_rpcSignals.PreCommand(*pcmd);
+
+    CRPCCallTimer timer(strMethod);
+    try
+    {
+        // Execute
+        if (!it->second(params, result)) {
+            // Timed by execute() instead
+            timer.Discard();
+            return false;
+        }
+        timer.Succeeded();
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+}
+
 std::string HelpExampleCli(const std::string& methodname, const std::string& args)
 {
     return "> bitcoin-cli " + methodname + " " + args + "\n";
@@ -7,6 +7,7 @@
 #define BITCOIN_RPCSERVER_H
 
 #include "amount.h"
+#include "latencystats.h"
 #include "rpcprotocol.h"
 #include "uint256.h"
 
@@ -30,6 +31,7 @@ namespace RPCServer
 }
 
 class CBlockIndex;
+class CJSONWriter;
 class CNetAddr;
 
 class JSONRequest
@@ -111,7 +113,24 @@ void RPCUnregisterTimerInterface(RPCTimerInterface *iface);
  */
 void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds);
 
+/** Default for -rpcmaxbatchsize, the largest number of calls accepted in one batch */
+static const int DEFAULT_RPC_MAX_BATCH_SIZE = 1000;
+
+/** Queues a function on another RPC thread; returns false if it could not be queued */
+typedef boost::function<bool(const boost::function<void(void)>&)> RPCWorkDispatcher;
+
+/**
+ * Set how batches spread their calls over the RPC threads. Runs of calls
+ * that are okConcurrent are executed by up to nThreads threads at once, the
+ * rest in order on the thread that handles the batch. An empty dispatcher
+ * executes every batch sequentially.
+ */
+void RPCSetBatchDispatcher(const RPCWorkDispatcher& dispatcher, int nThreads);
+
 typedef UniValue(*rpcfn_type)(const UniValue& params, bool fHelp);
+/** Writes the result of a call to a stream; returns false, without writing
+ * anything, to leave calls it does not handle to the usual actor */
+typedef bool(*rpcstreamfn_type)(const UniValue& params, CJSONWriter& result);
 
 class CRPCCommand
 {
@@ -120,6 +139,7 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
+    bool okConcurrent; //! May run concurrently with the other calls of a batch
 };
 
 /**
@@ -129,11 +149,18 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    std::map<std::string, rpcstreamfn_type> mapStreamCommands;
 public:
     CRPCTable();
     const CRPCCommand* operator[](const std::string& name) const;
     std::string help(const std::string& name) const;
 
+    /**
+     * Appends a CRPCCommand to the dispatch table. Returns false if the RPC
+     * server is already running, or if a command of that name exists.
+     */
+    bool appendCommand(const std::string& name, const CRPCCommand* pcmd);
+
     /**
      * Execute a method.
      * @param method   Method to execute
@@ -142,10 +169,35 @@ public:
      * @throws an exception (UniValue) when an error happens.
      */
     UniValue execute(const std::string &method, const UniValue &params) const;
+
+    /**
+     * Execute a method, writing its result to a stream. Large results are
+     * then never held in memory as a whole.
+     * @returns false if the method cannot stream this call; nothing was
+     * written then, and it should be executed as usual.
+     * @throws an exception (UniValue) when an error happens. The result may
+     * be partially written then.
+     * @note Writing may wait for the client, so methods must not write with
+     * locks held.
+     */
+    bool executeStream(const std::string &method, const UniValue &params, CJSONWriter& result) const;
 };
 
 extern const CRPCTable tableRPC;
 
+/** Timings of the calls to one RPC method */
+struct RPCMethodStats
+{
+    CLatencyStats latency;
+    //! Calls that failed, included in latency
+    uint64_t nErrors;
+
+    RPCMethodStats() : nErrors(0) {}
+};
+
+/** Get the timings of every RPC method that has been called, by method name */
+void GetRPCMethodStats(std::map<std::string, RPCMethodStats>& mapStats);
+
 /**
  * Utilities: convert hex-encoded Values
  * (throws error if not hex).
@@ -230,10 +282,13 @@ extern UniValue walletlock(const UniValue& params, bool fHelp);
 extern UniValue encryptwallet(const UniValue& params, bool fHelp);
 extern UniValue validateaddress(const UniValue& params, bool fHelp);
 extern UniValue getinfo(const UniValue& params, bool fHelp);
+extern UniValue getrpcstats(const UniValue& params, bool fHelp);
+extern UniValue getrpcworkqueueinfo(const UniValue& params, bool fHelp);
 extern UniValue getwalletinfo(const UniValue& params, bool fHelp);
 extern UniValue getblockchaininfo(const UniValue& params, bool fHelp);
 extern UniValue getnetworkinfo(const UniValue& params, bool fHelp);
 extern UniValue setmocktime(const UniValue& params, bool fHelp);
+extern UniValue getzmqnotifications(const UniValue& params, bool fHelp);
 extern UniValue resendwallettransactions(const UniValue& params, bool fHelp);
 
 extern UniValue getrawtransaction(const UniValue& params, bool fHelp); // in rcprawtransaction.cpp
@@ -254,10 +309,14 @@ extern UniValue getbestblockhash(const UniValue& params, bool fHelp);
 extern UniValue getdifficulty(const UniValue& params, bool fHelp);
 extern UniValue settxfee(const UniValue& params, bool fHelp);
 extern UniValue getmempoolinfo(const UniValue& params, bool fHelp);
+extern UniValue getsigcacheinfo(const UniValue& params, bool fHelp);
+extern UniValue getvalidationqueueinfo(const UniValue& params, bool fHelp);
 extern UniValue getrawmempool(const UniValue& params, bool fHelp);
+extern bool getrawmempool_stream(const UniValue& params, CJSONWriter& result);
 extern UniValue getblockhash(const UniValue& params, bool fHelp);
 extern UniValue getblockheader(const UniValue& params, bool fHelp);
 extern UniValue getblock(const UniValue& params, bool fHelp);
+extern bool getblock_stream(const UniValue& params, CJSONWriter& result);
 extern UniValue gettxoutsetinfo(const UniValue& params, bool fHelp);
 extern UniValue gettxout(const UniValue& params, bool fHelp);
 extern UniValue verifychain(const UniValue& params, bool fHelp);
@@ -268,6 +327,7 @@ extern UniValue reconsiderblock(const UniValue& params, bool fHelp);
 bool StartRPC();
 void InterruptRPC();
 void StopRPC();
+UniValue JSONRPCExecBatchObj(const UniValue& vReq);
 std::string JSONRPCExecBatch(const UniValue& vReq);
 
 #endif // BITCOIN_RPCSERVER_H
@@ -0,0 +1,267 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SCRIPT_HASHCACHE_H
+#define BITCOIN_SCRIPT_HASHCACHE_H
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include <boost/scoped_array.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+struct CHashCacheStats
+{
+    size_t nEntries;
+    size_t nCapacity;
+    size_t nMemoryUsage;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+
+    CHashCacheStats() : nEntries(0), nCapacity(0), nMemoryUsage(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0) {}
+};
+
+/** Number of independently locked parts a CHashCache is split into. */
+static const unsigned int HASHCACHE_SHARDS = 32;
+/** Number of slots (hash functions) an entry can be stored in. */
+static const unsigned int HASHCACHE_WAYS = 4;
+/** How many entries may be displaced by one insertion before giving up. */
+static const unsigned int HASHCACHE_MAX_KICKS = 8;
+/** Size of a CPU cache line, which the slot table is aligned to. */
+static const size_t HASHCACHE_LINE_SIZE = 64;
+
+/**
+ * One independently locked part of a CHashCache: a fixed-size cuckoo table.
+ * Every slot remembers the generation it was written in (0 means empty).
+ * A new generation starts whenever a quarter of the table has been
+ * written, and entries that are more than a generation old are the first
+ * to be overwritten, so recently added hashes survive eviction.
+ */
+class CHashCacheShard
+{
+private:
+    //! Bytes of an entry a slot keeps; the first four only choose the shard.
+    static const size_t KEY_SIZE = 28;
+
+    //! A slot keeps its generation next to the key and is 32 bytes, so with
+    //! the table aligned to a cache line a probe never straddles two lines.
+    struct Slot
+    {
+        unsigned char key[KEY_SIZE];
+        uint32_t nGeneration;
+    };
+
+    boost::mutex cs;
+    std::vector<unsigned char> vStorage;
+    Slot* vSlots;
+    uint32_t nGeneration;
+    uint32_t nWrittenInGeneration;
+    uint32_t nSlots;
+
+    size_t nUsed;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+
+    //! Entries are already random, so the hash functions just pick different words of them.
+    uint32_t SlotIndex(const unsigned char* key, unsigned int nWay) const
+    {
+        return ((uint64_t)ReadLE32(key + 4 * nWay) * nSlots) >> 32;
+    }
+
+    bool Holds(uint32_t nSlot, const unsigned char* key) const
+    {
+        return vSlots[nSlot].nGeneration != 0 && memcmp(vSlots[nSlot].key, key, KEY_SIZE) == 0;
+    }
+
+    bool IsStale(uint32_t nSlot) const
+    {
+        return vSlots[nSlot].nGeneration + 1 < nGeneration;
+    }
+
+    void Write(uint32_t nSlot, const unsigned char* key, uint32_t nEntryGeneration)
+    {
+        memcpy(vSlots[nSlot].key, key, KEY_SIZE);
+        vSlots[nSlot].nGeneration = nEntryGeneration;
+        if (++nWrittenInGeneration >= std::max(nSlots / 4, 1U)) {
+            nGeneration++;
+            nWrittenInGeneration = 0;
+        }
+    }
+
+    //! Find an empty slot for key, or else the oldest one if it is stale.
+    bool FindFreeSlot(const unsigned char* key, uint32_t& nSlotRet) const
+    {
+        bool fFound = false;
+        for (unsigned int i = 0; i < HASHCACHE_WAYS; i++) {
+            uint32_t nSlot = SlotIndex(key, i);
+            if (vSlots[nSlot].nGeneration == 0) {
+                nSlotRet = nSlot;
+                return true;
+            }
+            if (IsStale(nSlot) && (!fFound || vSlots[nSlot].nGeneration < vSlots[nSlotRet].nGeneration)) {
+                nSlotRet = nSlot;
+                fFound = true;
+            }
+        }
+        return fFound;
+    }
+
+public:
+    CHashCacheShard() : vSlots(NULL), nGeneration(1), nWrittenInGeneration(0), nSlots(0), nUsed(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0) {}
+
+    //! Allocate an empty table; only to be called before the shard is used.
+    void Resize(uint32_t nSlotsIn)
+    {
+        nSlots = nSlotsIn;
+        vStorage.assign((size_t)nSlots * sizeof(Slot) + HASHCACHE_LINE_SIZE - 1, 0);
+        uintptr_t nAddr = (uintptr_t)&vStorage[0];
+        vSlots = (Slot*)((nAddr + HASHCACHE_LINE_SIZE - 1) & ~(uintptr_t)(HASHCACHE_LINE_SIZE - 1));
+    }
+
+    bool Get(const uint256& entry, bool fErase)
+    {
+        const unsigned char* key = entry.begin() + 4;
+        boost::unique_lock<boost::mutex> lock(cs);
+        for (unsigned int i = 0; i < HASHCACHE_WAYS; i++) {
+            uint32_t nSlot = SlotIndex(key, i);
+            if (Holds(nSlot, key)) {
+                if (fErase) {
+                    vSlots[nSlot].nGeneration = 0;
+                    nUsed--;
+                }
+                nHits++;
+                return true;
+            }
+        }
+        nMisses++;
+        return false;
+    }
+
+    void Set(const uint256& entry)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        for (unsigned int i = 0; i < HASHCACHE_WAYS; i++) {
+            uint32_t nSlot = SlotIndex(entry.begin() + 4, i);
+            if (Holds(nSlot, entry.begin() + 4)) {
+                vSlots[nSlot].nGeneration = nGeneration;
+                return;
+            }
+        }
+        nInserts++;
+
+        unsigned char key[KEY_SIZE];
+        memcpy(key, entry.begin() + 4, KEY_SIZE);
+        uint32_t nEntryGeneration = nGeneration;
+        uint32_t nSlot;
+        for (unsigned int nKicks = 0; ; nKicks++) {
+            if (FindFreeSlot(key, nSlot)) {
+                if (vSlots[nSlot].nGeneration == 0)
+                    nUsed++;
+                else
+                    nEvictions++;
+                Write(nSlot, key, nEntryGeneration);
+                return;
+            }
+            if (nKicks == HASHCACHE_MAX_KICKS) {
+                // Nothing is stale enough to make room; drop the displaced entry.
+                nEvictions++;
+                return;
+            }
+            // Displace one of the candidates and try to move it elsewhere.
+            nSlot = SlotIndex(key, nKicks % HASHCACHE_WAYS);
+            Slot displaced = vSlots[nSlot];
+            Write(nSlot, key, nEntryGeneration);
+            memcpy(key, displaced.key, KEY_SIZE);
+            nEntryGeneration = displaced.nGeneration;
+        }
+    }
+
+    void GetStats(CHashCacheStats& stats)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        stats.nEntries += nUsed;
+        stats.nCapacity += nSlots;
+        stats.nHits += nHits;
+        stats.nMisses += nMisses;
+        stats.nInserts += nInserts;
+        stats.nEvictions += nEvictions;
+    }
+
+    static size_t SlotSize() { return sizeof(Slot); }
+    const void* Table() const { return vSlots; }
+};
+
+/**
+ * A fixed-size set of salted 256-bit hashes, split into independently locked
+ * shards so that concurrent validation threads rarely contend. The memory
+ * for it is allocated once, up front.
+ */
+class CHashCache
+{
+private:
+    //! Entries are SHA256(nonce || ...), see Salted()
+    uint256 nonce;
+    boost::scoped_array<CHashCacheShard> shards;
+    size_t nMemoryUsage;
+    //! Whether entries are stored at all (a size of zero disables the cache).
+    bool fEnabled;
+
+    CHashCacheShard& Shard(const uint256& entry)
+    {
+        return shards[ReadLE32(entry.begin()) % HASHCACHE_SHARDS];
+    }
+
+public:
+    CHashCache(size_t nBytes) : shards(new CHashCacheShard[HASHCACHE_SHARDS])
+    {
+        GetRandBytes(nonce.begin(), 32);
+        uint32_t nSlots = std::max(nBytes / CHashCacheShard::SlotSize() / HASHCACHE_SHARDS, (size_t)HASHCACHE_WAYS);
+        for (unsigned int i = 0; i < HASHCACHE_SHARDS; i++)
+            shards[i].Resize(nSlots);
+        nMemoryUsage = (size_t)nSlots * HASHCACHE_SHARDS * CHashCacheShard::SlotSize();
+        fEnabled = nBytes > 0;
+    }
+
+    //! A hasher that has been fed the nonce, for computing entries.
+    CSHA256 Salted() const
+    {
+        CSHA256 hasher;
+        hasher.Write(nonce.begin(), 32);
+        return hasher;
+    }
+
+    bool Get(const uint256& entry, bool fErase)
+    {
+        return Shard(entry).Get(entry, fErase);
+    }
+
+    void Set(const uint256& entry)
+    {
+        if (fEnabled)
+            Shard(entry).Set(entry);
+    }
+
+    void GetStats(CHashCacheStats& stats)
+    {
+        stats = CHashCacheStats();
+        for (unsigned int i = 0; i < HASHCACHE_SHARDS; i++)
+            shards[i].GetStats(stats);
+        stats.nMemoryUsage = nMemoryUsage;
+    }
+};
+
+#endif // BITCOIN_SCRIPT_HASHCACHE_H
@@ -1070,9 +1070,71 @@ public:
     }
 };
 
+/** Minimal stream that feeds everything written to it into a CSHA256. */
+class CSHA256Writer
+{
+private:
+    CSHA256& hasher;
+
+public:
+    CSHA256Writer(CSHA256& hasherIn) : hasher(hasherIn) {}
+
+    void write(const char* pch, size_t size)
+    {
+        hasher.Write((const unsigned char*)pch, size);
+    }
+};
+
+/** Minimal stream that appends everything written to it to a byte vector. */
+class CByteVectorWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+
+public:
+    CByteVectorWriter(std::vector<unsigned char>& vchIn) : vch(vchIn) {}
+
+    void write(const char* pch, size_t size)
+    {
+        vch.insert(vch.end(), (const unsigned char*)pch, (const unsigned char*)pch + size);
+    }
+};
+
+/** Size of a serialized input with blanked script: prevout, empty script, nSequence */
+static const size_t BLANKED_INPUT_SIZE = 32 + 4 + 1 + 4;
+
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+void PrecomputedTransactionData::Init(const CTransaction& tx)
+{
+    vchInputs.clear();
+    vchInputs.reserve(tx.vin.size() * BLANKED_INPUT_SIZE);
+    CByteVectorWriter inputs(vchInputs);
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        ::Serialize(inputs, tx.vin[i].prevout, SER_GETHASH, 0);
+        ::Serialize(inputs, CScript(), SER_GETHASH, 0);
+        ::Serialize(inputs, tx.vin[i].nSequence, SER_GETHASH, 0);
+    }
+    assert(vchInputs.size() == tx.vin.size() * BLANKED_INPUT_SIZE);
+
+    vchOutputs.clear();
+    CByteVectorWriter outputs(vchOutputs);
+    ::Serialize(outputs, tx.vout, SER_GETHASH, 0);
+    ::Serialize(outputs, tx.nLockTime, SER_GETHASH, 0);
+
+    CSHA256 hasher;
+    CSHA256Writer writer(hasher);
+    ::Serialize(writer, tx.nVersion, SER_GETHASH, 0);
+    ::WriteCompactSize(writer, tx.vin.size());
+    vMidstates.clear();
+    vMidstates.reserve(tx.vin.size());
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        vMidstates.push_back(hasher);
+        hasher.Write(&vchInputs[i * BLANKED_INPUT_SIZE], BLANKED_INPUT_SIZE);
+    }
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata)
 {
     static const uint256 one(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
     if (nIn >= txTo.vin.size()) {
@@ -1091,6 +1153,25 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    // For SIGHASH_ALL, everything but the input's scriptCode is the same for
+    // every input, so continue from the precomputed state and serializations.
+    if (txdata && txdata->vMidstates.size() == txTo.vin.size() && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        const unsigned char* pInput = &txdata->vchInputs[nIn * BLANKED_INPUT_SIZE];
+        CSHA256 hasher(txdata->vMidstates[nIn]);
+        CSHA256Writer writer(hasher);
+        hasher.Write(pInput, 36);
+        txTmp.SerializeScriptCode(writer, SER_GETHASH, 0);
+        hasher.Write(pInput + 37, 4);
+        hasher.Write(pInput + BLANKED_INPUT_SIZE, (txTo.vin.size() - nIn - 1) * BLANKED_INPUT_SIZE);
+        hasher.Write(&txdata->vchOutputs[0], txdata->vchOutputs.size());
+        ::Serialize(writer, nHashType, SER_GETHASH, 0);
+        uint256 hash;
+        hasher.Finalize(hash.begin());
+        CSHA256().Write(hash.begin(), 32).Finalize(hash.begin());
+        return hash;
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1115,7 +1196,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
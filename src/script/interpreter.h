@@ -7,6 +7,7 @@
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
 #include "script_error.h"
+#include "crypto/sha256.h"
 #include "primitives/transaction.h"
 
 #include <vector>
@@ -85,7 +86,29 @@ enum
 
 bool CheckSignatureEncoding(const std::vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror);
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/**
+ * Data about a transaction that SignatureHash() can share between all of its
+ * inputs, so that checking many of them does not re-serialize the whole
+ * transaction every time. Only used for SIGHASH_ALL without
+ * SIGHASH_ANYONECANPAY, the common case.
+ */
+struct PrecomputedTransactionData
+{
+    //! Serialization of every input with its script blanked out
+    std::vector<unsigned char> vchInputs;
+    //! Serialization of the outputs and nLockTime
+    std::vector<unsigned char> vchOutputs;
+    //! SHA256 states after nVersion, the input count and the first i blanked inputs
+    std::vector<CSHA256> vMidstates;
+
+    PrecomputedTransactionData() {}
+    PrecomputedTransactionData(const CTransaction& tx) { Init(tx); }
+
+    void Init(const CTransaction& tx);
+    bool IsInitialized() const { return !vMidstates.empty(); }
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata = NULL);
 
 class BaseSignatureChecker
 {
@@ -108,12 +131,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData* txdataIn = NULL) : txTo(txToIn), nIn(nInIn), txdata(txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
     bool CheckLockTime(const CScriptNum& nLockTime) const;
 };
@@ -5,101 +5,85 @@
 
 #include "sigcache.h"
 
-#include "memusage.h"
+#include "crypto/common.h"
 #include "pubkey.h"
-#include "random.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/unordered_set.hpp>
-
 namespace {
 
-/**
- * We're hashing a nonce into the entries themselves, so we don't need extra
- * blinding in the set hash computation.
- */
-class CSignatureCacheHasher
+//! -maxsigcachesize is shared equally between the two caches.
+size_t GetCacheSize()
 {
-public:
-    size_t operator()(const uint256& key) const {
-        return key.GetCheapHash();
-    }
-};
+    int64_t nMaxCacheSize = std::max(GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)0);
+    return nMaxCacheSize * ((size_t) 1 << 20) / 2;
+}
 
 /**
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
  * again when accepted into the block chain)
+ *
+ * Entries are SHA256(nonce || signature hash || public key || signature).
  */
-class CSignatureCache
+CHashCache& GetSignatureCache()
 {
-private:
-     //! Entries are SHA256(nonce || signature hash || public key || signature):
-    uint256 nonce;
-    typedef boost::unordered_set<uint256, CSignatureCacheHasher> map_type;
-    map_type setValid;
-    boost::shared_mutex cs_sigcache;
-
-
-public:
-    CSignatureCache()
-    {
-        GetRandBytes(nonce.begin(), 32);
-    }
+    static CHashCache signatureCache(GetCacheSize());
+    return signatureCache;
+}
 
-    void
-    ComputeEntry(uint256& entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey)
-    {
-        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(&pubkey[0], pubkey.size()).Write(&vchSig[0], vchSig.size()).Finalize(entry.begin());
-    }
+/**
+ * Transactions whose scripts all passed with a given set of flags, so that
+ * connecting a block does not have to run them again after mempool
+ * acceptance did.
+ *
+ * Entries are SHA256(nonce || txid || flags).
+ */
+CHashCache& GetScriptExecutionCache()
+{
+    static CHashCache scriptExecutionCache(GetCacheSize());
+    return scriptExecutionCache;
+}
 
-    bool
-    Get(const uint256& entry)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-        return setValid.count(entry);
-    }
+uint256 ComputeScriptExecutionEntry(const uint256& txid, unsigned int flags)
+{
+    unsigned char vchFlags[4];
+    WriteLE32(vchFlags, flags);
+    uint256 entry;
+    GetScriptExecutionCache().Salted().Write(txid.begin(), 32).Write(vchFlags, sizeof(vchFlags)).Finalize(entry.begin());
+    return entry;
+}
 
-    void Erase(const uint256& entry)
-    {
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        setValid.erase(entry);
-    }
+}
 
-    void Set(const uint256& entry)
-    {
-        size_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        while (memusage::DynamicUsage(setValid) > nMaxCacheSize)
-        {
-            map_type::size_type s = GetRand(setValid.bucket_count());
-            map_type::local_iterator it = setValid.begin(s);
-            if (it != setValid.end(s)) {
-                setValid.erase(*it);
-            }
-        }
-
-        setValid.insert(entry);
-    }
-};
+void GetSignatureCacheStats(CHashCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
 
+bool IsScriptExecutionCached(const uint256& txid, unsigned int flags, bool fErase)
+{
+    return GetScriptExecutionCache().Get(ComputeScriptExecutionEntry(txid, flags), fErase);
+}
+
+void AddScriptExecutionCache(const uint256& txid, unsigned int flags)
+{
+    GetScriptExecutionCache().Set(ComputeScriptExecutionEntry(txid, flags));
+}
+
+void GetScriptExecutionCacheStats(CHashCacheStats& stats)
+{
+    GetScriptExecutionCache().GetStats(stats);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    CHashCache& signatureCache = GetSignatureCache();
 
     uint256 entry;
-    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
+    signatureCache.Salted().Write(sighash.begin(), 32).Write(&pubkey[0], pubkey.size()).Write(&vchSig[0], vchSig.size()).Finalize(entry.begin());
 
-    if (signatureCache.Get(entry)) {
-        if (!store) {
-            signatureCache.Erase(entry);
-        }
+    if (signatureCache.Get(entry, !store)) {
         return true;
     }
 
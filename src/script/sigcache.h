@@ -6,15 +6,30 @@
 #ifndef BITCOIN_SCRIPT_SIGCACHE_H
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
+#include "script/hashcache.h"
 #include "script/interpreter.h"
 
 #include <vector>
 
-// DoS prevention: limit cache size to less than 40MB (over 500000
-// entries on 64-bit systems).
+// DoS prevention: limit the signature and script execution caches to 40MB
+// together (over 500000 entries each).
 static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 40;
 
 class CPubKey;
+class uint256;
+
+/** Get usage and hit/miss statistics of the signature cache */
+void GetSignatureCacheStats(CHashCacheStats& stats);
+
+/**
+ * Whether all scripts of transaction txid are known to pass with the given
+ * flags. A found entry is removed if fErase is set.
+ */
+bool IsScriptExecutionCached(const uint256& txid, unsigned int flags, bool fErase);
+/** Remember that all scripts of transaction txid passed with the given flags */
+void AddScriptExecutionCache(const uint256& txid, unsigned int flags);
+/** Get usage and hit/miss statistics of the script execution cache */
+void GetScriptExecutionCacheStats(CHashCacheStats& stats);
 
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
@@ -22,7 +37,7 @@ private:
     bool store;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true) : TransactionSignatureChecker(txToIn, nInIn), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true, const PrecomputedTransactionData* txdataIn=NULL) : TransactionSignatureChecker(txToIn, nInIn, txdataIn), store(storeIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
@@ -297,6 +297,12 @@ public:
         clear();
     }
 
+    /** Exchange the underlying buffer with vchOther, e.g. to reuse its allocation */
+    void swap(vector_type& vchOther) {
+        vch.swap(vchOther);
+        nReadPos = 0;
+    }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
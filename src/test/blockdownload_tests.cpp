@@ -0,0 +1,163 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Unit tests for the per-peer block download windows and the moving of
+// stalled blocks to faster peers
+
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "net.h"
+#include "random.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/assign/list_of.hpp>
+#include <boost/test/unit_test.hpp>
+
+// Tests these internal-to-main.cpp methods:
+extern bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex);
+extern bool UpdateBlockDownloadStats(NodeId nodeid, int64_t nTimeRequested, unsigned int nBytes, int64_t nNow);
+extern void StealStalledBlocks(NodeId nodeid, NodeId staller, unsigned int count, std::vector<CInv>& vGetData, const Consensus::Params& consensusParams, int64_t nNow);
+
+static CNodeStateStats GetStats(const CNode& node)
+{
+    CNodeStateStats stats;
+    BOOST_CHECK(GetNodeStateStats(node.GetId(), stats));
+    return stats;
+}
+
+// Deliver count blocks that were all requested at nTimeRequested, one every
+// nServiceTime microseconds
+static void DeliverBlocks(const CNode& node, int count, int64_t nTimeRequested, int64_t nServiceTime)
+{
+    LOCK(cs_main);
+    for (int i = 1; i <= count; i++)
+        BOOST_CHECK(UpdateBlockDownloadStats(node.GetId(), nTimeRequested, 1000, nTimeRequested + i * nServiceTime));
+}
+
+BOOST_FIXTURE_TEST_SUITE(blockdownload_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockdownload_window)
+{
+    CNode fast(INVALID_SOCKET, CAddress(CService("10.0.0.1", Params().GetDefaultPort())), "", true);
+    CNode slow(INVALID_SOCKET, CAddress(CService("10.0.0.2", Params().GetDefaultPort())), "", true);
+    BOOST_CHECK_EQUAL(GetStats(fast).nBlocksInFlightMax, DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetStats(fast).nBlockServiceTime, 0);
+
+    // A block every 10ms fills BLOCK_DOWNLOAD_TARGET_QUEUE_TIME with more
+    // blocks than the window may hold
+    DeliverBlocks(fast, 10, 1000000, 10000);
+    CNodeStateStats stats = GetStats(fast);
+    BOOST_CHECK_EQUAL(stats.nBlockServiceTime, 10000);
+    BOOST_CHECK_EQUAL(stats.nBlockBytesPerSec, 100000);
+    BOOST_CHECK_EQUAL(stats.nBlocksInFlightMax, MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A block every 2s leaves room for two of them and the one being sent
+    DeliverBlocks(slow, 1, 1000000, 2000000);
+    stats = GetStats(slow);
+    BOOST_CHECK_EQUAL(stats.nBlockServiceTime, 2000000);
+    BOOST_CHECK_EQUAL(stats.nBlocksInFlightMax, 1 + 1000000 * BLOCK_DOWNLOAD_TARGET_QUEUE_TIME / 2000000);
+
+    // Samples are averaged, so one slow block only shrinks the window a bit
+    DeliverBlocks(fast, 1, 2000000, 810000);
+    stats = GetStats(fast);
+    BOOST_CHECK_EQUAL(stats.nBlockServiceTime, 10000 + 800000 / 8);
+    BOOST_CHECK_EQUAL(stats.nBlocksInFlightMax, 1 + 1000000 * BLOCK_DOWNLOAD_TARGET_QUEUE_TIME / (10000 + 800000 / 8));
+
+    // ...while a peer that keeps taking longer than the target queue time
+    // still gets the minimum window
+    DeliverBlocks(slow, 30, 4000000, 10000000);
+    BOOST_CHECK_EQUAL(GetStats(slow).nBlocksInFlightMax, MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_unsolicited)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("10.0.0.1", Params().GetDefaultPort())), "", true);
+    DeliverBlocks(node, 1, 1000000, 50000);
+
+    // A block marked in flight only once it was processed, like an
+    // unsolicited compact block, arrived no later than it was "requested":
+    // it must neither take a sample nor resize the window
+    LOCK(cs_main);
+    BOOST_CHECK(!UpdateBlockDownloadStats(node.GetId(), 2000000, 1000000, 2000000));
+    BOOST_CHECK(!UpdateBlockDownloadStats(node.GetId(), 2000100, 1000000, 2000000));
+    CNodeStateStats stats = GetStats(node);
+    BOOST_CHECK_EQUAL(stats.nBlockServiceTime, 50000);
+    BOOST_CHECK_EQUAL(stats.nBlockLatency, 50000);
+    BOOST_CHECK_EQUAL(stats.nBlockBytesPerSec, 20000);
+    BOOST_CHECK_EQUAL(stats.nBlocksInFlightMax, 1 + 1000000 * BLOCK_DOWNLOAD_TARGET_QUEUE_TIME / 50000);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_steal)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    CNode staller(INVALID_SOCKET, CAddress(CService("10.0.0.1", Params().GetDefaultPort())), "", true);
+    CNode fast(INVALID_SOCKET, CAddress(CService("10.0.0.2", Params().GetDefaultPort())), "", true);
+    CNode unmeasured(INVALID_SOCKET, CAddress(CService("10.0.0.3", Params().GetDefaultPort())), "", true);
+
+    // Blocks that have not been downloaded, at heights 1 to 4
+    std::vector<uint256> vHashes(4);
+    std::vector<CBlockIndex> vIndex(4);
+    for (unsigned int i = 0; i < vIndex.size(); i++) {
+        vHashes[i] = GetRandHash();
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].nHeight = i + 1;
+    }
+
+    LOCK(cs_main);
+    int64_t nTimeRequested = GetTimeMicros();
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+        BOOST_CHECK(MarkBlockAsInFlight(staller.GetId(), vHashes[i], consensusParams, &vIndex[i]));
+    int64_t nTimeQueued = GetTimeMicros();
+    BOOST_CHECK_EQUAL(GetStats(staller).vHeightInFlight.size(), 4U);
+
+    // The fast peer takes 100ms per block, the staller 1s
+    DeliverBlocks(fast, 1, 1, 100000);
+    DeliverBlocks(staller, 1, 1, 1000000);
+    int nStallerWindow = GetStats(staller).nBlocksInFlightMax;
+
+    // A peer that has not delivered anything yet is not known to be faster
+    std::vector<CInv> vGetData;
+    StealStalledBlocks(unmeasured.GetId(), staller.GetId(), 4, vGetData, consensusParams, nTimeQueued + 1000000);
+    BOOST_CHECK(vGetData.empty());
+
+    // Nothing is moved while the staller has not yet taken longer than the
+    // fast peer would need
+    StealStalledBlocks(fast.GetId(), staller.GetId(), 4, vGetData, consensusParams, nTimeRequested + 50000);
+    BOOST_CHECK(vGetData.empty());
+    BOOST_CHECK_EQUAL(GetStats(staller).nBlocksInFlightMax, nStallerWindow);
+
+    // 250ms on: the fast peer would have delivered the first two blocks by
+    // now, but not a third after those
+    BOOST_REQUIRE(nTimeQueued - nTimeRequested < 50000);
+    StealStalledBlocks(fast.GetId(), staller.GetId(), 4, vGetData, consensusParams, nTimeQueued + 250000);
+    BOOST_CHECK_EQUAL(vGetData.size(), 2U);
+    for (unsigned int i = 0; i < vGetData.size(); i++)
+        BOOST_CHECK(vGetData[i].type == MSG_BLOCK && vGetData[i].hash == vHashes[i]);
+    std::vector<int> vMoved = boost::assign::list_of(1)(2);
+    std::vector<int> vKept = boost::assign::list_of(3)(4);
+    BOOST_CHECK(GetStats(fast).vHeightInFlight == vMoved);
+    BOOST_CHECK(GetStats(staller).vHeightInFlight == vKept);
+    BOOST_CHECK_EQUAL(GetStats(staller).nBlocksInFlightMax, std::max(MIN_BLOCKS_IN_TRANSIT_PER_PEER, nStallerWindow / 2));
+
+    // No more than count blocks are moved
+    vGetData.clear();
+    StealStalledBlocks(fast.GetId(), staller.GetId(), 1, vGetData, consensusParams, nTimeQueued + 10000000);
+    BOOST_CHECK_EQUAL(vGetData.size(), 1U);
+    BOOST_CHECK(vGetData[0].hash == vHashes[2]);
+
+    // Blocks never move to a slower peer, so the two can not keep taking
+    // them from each other
+    vGetData.clear();
+    StealStalledBlocks(staller.GetId(), fast.GetId(), 4, vGetData, consensusParams, nTimeQueued + 10000000);
+    BOOST_CHECK(vGetData.empty());
+    BOOST_CHECK_EQUAL(GetStats(fast).vHeightInFlight.size(), 3U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
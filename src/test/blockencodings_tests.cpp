@@ -0,0 +1,131 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "auxpow.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "serialize.h"
+#include "streams.h"
+#include "version.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+static CBlock BuildBlockTestCase(bool fAuxpow)
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(3);
+    block.vtx[0] = tx;
+    block.nVersion.SetBaseVersion(1);
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = tx;
+
+    tx.vin.resize(10);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = tx;
+
+    bool mutated;
+    block.hashMerkleRoot = block.ComputeMerkleRoot(&mutated);
+    assert(!mutated);
+
+    if (fAuxpow) {
+        CMutableTransaction txParent;
+        txParent.vin.resize(1);
+        txParent.vin[0].scriptSig.resize(100);
+        block.SetAuxpow(new CAuxPow(txParent));
+    }
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_roundtrip)
+{
+    for (int i = 0; i < 2; i++) {
+        const bool fAuxpow = (i == 1);
+        CBlock block(BuildBlockTestCase(fAuxpow));
+
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+        BOOST_CHECK(stream.empty());
+
+        // The header comes back with its auxpow, and the short IDs are keyed
+        // the same on both ends.
+        BOOST_CHECK_EQUAL(shortIDs2.header.GetHash().ToString(), block.GetHash().ToString());
+        BOOST_CHECK_EQUAL(shortIDs2.header.nVersion.IsAuxpow(), fAuxpow);
+        BOOST_CHECK_EQUAL(!!shortIDs2.header.auxpow, fAuxpow);
+        BOOST_CHECK_EQUAL(shortIDs2.BlockTxCount(), block.vtx.size());
+        for (size_t j = 0; j < block.vtx.size(); j++)
+            BOOST_CHECK_EQUAL(shortIDs2.GetShortID(block.vtx[j].GetHash()), shortIDs.GetShortID(block.vtx[j].GetHash()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(shortid_ignores_auxpow)
+{
+    // Short IDs depend only on the 80-byte header, so replacing the auxpow
+    // (which the block hash does not commit to) does not change them.
+    CBlock block(BuildBlockTestCase(true));
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig.resize(200);
+    block.SetAuxpow(new CAuxPow(txParent));
+    shortIDs2.header = block;
+    stream << shortIDs2;
+    CBlockHeaderAndShortTxIDs shortIDs3;
+    stream >> shortIDs3;
+
+    for (size_t j = 0; j < block.vtx.size(); j++)
+        BOOST_CHECK_EQUAL(shortIDs3.GetShortID(block.vtx[j].GetHash()), shortIDs.GetShortID(block.vtx[j].GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.resize(4);
+    req1.indexes[0] = 0;
+    req1.indexes[1] = 1;
+    req1.indexes[2] = 3;
+    req1.indexes[3] = 4;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK_EQUAL(req1.indexes.size(), req2.indexes.size());
+    BOOST_CHECK_EQUAL(req1.indexes[0], req2.indexes[0]);
+    BOOST_CHECK_EQUAL(req1.indexes[1], req2.indexes[1]);
+    BOOST_CHECK_EQUAL(req1.indexes[2], req2.indexes[2]);
+    BOOST_CHECK_EQUAL(req1.indexes[3], req2.indexes[3]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -535,6 +535,14 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     for (int i = 0; i < DATASIZE; i++) {
         BOOST_CHECK(rb2.contains(data[i]));
     }
+
+    // Memory use is fixed at construction:
+    size_t nUsage = rb2.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 0);
+    for (int i = 0; i < 10000; i++) {
+        rb2.insert(RandomData());
+    }
+    BOOST_CHECK_EQUAL(rb2.DynamicMemoryUsage(), nUsage);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,144 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cbor.h"
+#include "test/test_bitcoin.h"
+#include "utilstrencodings.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include <univalue.h>
+
+BOOST_FIXTURE_TEST_SUITE(cbor_tests, BasicTestingSetup)
+
+static std::string FromHex(const std::string& strHex)
+{
+    std::vector<unsigned char> vch = ParseHex(strHex);
+    return std::string(vch.begin(), vch.end());
+}
+
+static std::string EncodeHex(const UniValue& val)
+{
+    std::string str = EncodeCBOR(val);
+    return HexStr(str.begin(), str.end());
+}
+
+static UniValue DecodeHex(const std::string& strHex)
+{
+    UniValue val;
+    BOOST_CHECK_MESSAGE(DecodeCBOR(FromHex(strHex), val), strHex);
+    return val;
+}
+
+BOOST_AUTO_TEST_CASE(cbor_encode)
+{
+    // Examples from RFC 7049 appendix A
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue(0)), "00");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue(23)), "17");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue(24)), "1818");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue(1000)), "1903e8");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue(1000000)), "1a000f4240");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue((int64_t)1000000000000LL)), "1b000000e8d4a51000");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue((uint64_t)18446744073709551615ULL)), "1bffffffffffffffff");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue(-1)), "20");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue(-1000)), "3903e7");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue(1.1)), "fb3ff199999999999a");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue(false)), "f4");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue(true)), "f5");
+    BOOST_CHECK_EQUAL(EncodeHex(NullUniValue), "f6");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue("")), "60");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue("IETF")), "6449455446");
+
+    UniValue arr(UniValue::VARR);
+    arr.push_back(1);
+    UniValue inner(UniValue::VARR);
+    inner.push_back(2);
+    inner.push_back(3);
+    arr.push_back(inner);
+    BOOST_CHECK_EQUAL(EncodeHex(arr), "8201820203");
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("a", 1));
+    obj.push_back(Pair("b", UniValue(UniValue::VARR)));
+    BOOST_CHECK_EQUAL(EncodeHex(obj), "a2616101616280");
+
+    // Amounts are formatted with a fixed number of decimals
+    UniValue amount;
+    amount.setNumStr("12.50000000");
+    BOOST_CHECK_EQUAL(EncodeHex(amount), "fb4029000000000000");
+
+    // Hex travels as raw bytes, while keys and other strings stay text
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue("00ff")), "4200ff");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue("00FF")), "6430304646");
+    BOOST_CHECK_EQUAL(EncodeHex(UniValue("abc")), "63616263");
+    UniValue hexKey(UniValue::VOBJ);
+    hexKey.push_back(Pair("ab", "cd"));
+    BOOST_CHECK_EQUAL(EncodeHex(hexKey), "a162616241cd");
+}
+
+BOOST_AUTO_TEST_CASE(cbor_decode)
+{
+    BOOST_CHECK_EQUAL(DecodeHex("00").write(), "0");
+    BOOST_CHECK_EQUAL(DecodeHex("1bffffffffffffffff").write(), "18446744073709551615");
+    BOOST_CHECK_EQUAL(DecodeHex("3b7fffffffffffffff").write(), "-9223372036854775808");
+    BOOST_CHECK_EQUAL(DecodeHex("3903e7").write(), "-1000");
+    BOOST_CHECK_EQUAL(DecodeHex("f93c00").write(), "1");
+    BOOST_CHECK_EQUAL(DecodeHex("f9c400").write(), "-4");
+    BOOST_CHECK_EQUAL(DecodeHex("f90400").write(), "6.103515625e-05");
+    BOOST_CHECK_EQUAL(DecodeHex("fa47c35000").write(), "100000");
+    BOOST_CHECK_EQUAL(DecodeHex("fb3ff199999999999a").write(), "1.1");
+    BOOST_CHECK_EQUAL(DecodeHex("f7").write(), "null");
+    BOOST_CHECK_EQUAL(DecodeHex("4200ff").get_str(), "00ff");
+    BOOST_CHECK_EQUAL(DecodeHex("a26161016162820203").write(), "{\"a\":1,\"b\":[2,3]}");
+
+    // A request as sent by a client, with a raw transaction as bytes
+    UniValue req(UniValue::VOBJ);
+    req.push_back(Pair("method", "decoderawtransaction"));
+    UniValue params(UniValue::VARR);
+    params.push_back("0100000000");
+    params.push_back(true);
+    params.push_back(-0.5);
+    req.push_back(Pair("params", params));
+    req.push_back(Pair("id", "first"));
+    UniValue decoded;
+    BOOST_CHECK(DecodeCBOR(EncodeCBOR(req), decoded));
+    BOOST_CHECK_EQUAL(decoded.write(), req.write());
+}
+
+BOOST_AUTO_TEST_CASE(cbor_decode_invalid)
+{
+    const char* vInvalid[] = {
+        "",
+        "18",               // truncated argument
+        "1c",               // reserved additional information
+        "5f4101ff",         // indefinite length bytes
+        "9f01ff",           // indefinite length array
+        "c11a514b67b0",     // tagged value
+        "3bffffffffffffffff", // below the int64 range
+        "f97c00",           // infinity
+        "fb7ff8000000000000", // NaN
+        "f0",               // unassigned simple value
+        "6461",             // text shorter than its length
+        "83010203ff",       // trailing data
+        "8301",             // array with missing items
+        "9bffffffffffffffff", // huge array
+        "a10102",           // integer key
+        "a1416101",         // byte string key
+    };
+    for (size_t i = 0; i < sizeof(vInvalid) / sizeof(vInvalid[0]); i++) {
+        UniValue val;
+        BOOST_CHECK_MESSAGE(!DecodeCBOR(FromHex(vInvalid[i]), val), vInvalid[i]);
+    }
+
+    // Nesting beyond the limit is refused instead of exhausting the stack
+    std::string strDeep(MAX_CBOR_DEPTH, '\x81');
+    UniValue val;
+    BOOST_CHECK(DecodeCBOR(strDeep + '\x00', val));
+    BOOST_CHECK(!DecodeCBOR(strDeep + '\x81' + '\x00', val));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
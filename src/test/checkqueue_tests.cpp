@@ -0,0 +1,89 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+static boost::mutex csCounter;
+static unsigned int nCounter = 0;
+
+struct FakeCheck
+{
+    bool fOk;
+
+    FakeCheck() : fOk(true) {}
+    FakeCheck(bool fOkIn) : fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        boost::unique_lock<boost::mutex> lock(csCounter);
+        nCounter++;
+        return fOk;
+    }
+
+    void swap(FakeCheck& check)
+    {
+        std::swap(fOk, check.fOk);
+    }
+};
+
+static void RunChecks(CCheckQueue<FakeCheck>& queue, unsigned int nChecks, unsigned int nFail, bool fExpected)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csCounter);
+        nCounter = 0;
+    }
+    CCheckQueueControl<FakeCheck> control(&queue);
+    unsigned int nAdded = 0;
+    while (nAdded < nChecks) {
+        std::vector<FakeCheck> vChecks;
+        unsigned int nNow = std::min(nChecks - nAdded, 1 + (unsigned int)insecure_rand() % 50);
+        for (unsigned int i = 0; i < nNow; i++)
+            vChecks.push_back(FakeCheck(nAdded + i != nFail));
+        nAdded += nNow;
+        control.Add(vChecks);
+    }
+    BOOST_CHECK_EQUAL(control.Wait(), fExpected);
+    BOOST_CHECK(queue.IsIdle());
+    if (fExpected) {
+        boost::unique_lock<boost::mutex> lock(csCounter);
+        BOOST_CHECK_EQUAL(nCounter, nChecks);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_no_workers)
+{
+    CCheckQueue<FakeCheck> queue(16, 4);
+    RunChecks(queue, 1000, 1000, true);
+    RunChecks(queue, 1000, 500, false);
+    RunChecks(queue, 1, 1, true);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_workers)
+{
+    // More threads than queues, so that some of them have to share
+    CCheckQueue<FakeCheck> queue(16, 4);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 5; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<FakeCheck>::Thread, &queue));
+
+    for (int i = 0; i < 20; i++) {
+        RunChecks(queue, 1 + insecure_rand() % 5000, 1 << 30, true);
+        RunChecks(queue, 1 + insecure_rand() % 5000, 0, false);
+    }
+    RunChecks(queue, 1, 1, true);
+    RunChecks(queue, 0, 0, true);
+
+    queue.Quit();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
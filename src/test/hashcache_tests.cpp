@@ -0,0 +1,129 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "random.h"
+#include "script/hashcache.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(hashcache_tests, BasicTestingSetup)
+
+static std::vector<uint256> RandomHashes(size_t n)
+{
+    std::vector<uint256> v(n);
+    for (size_t i = 0; i < n; i++)
+        v[i] = GetRandHash();
+    return v;
+}
+
+static size_t CountPresent(CHashCacheShard& shard, const std::vector<uint256>& v, size_t nBegin, size_t nEnd)
+{
+    size_t n = 0;
+    for (size_t i = nBegin; i < nEnd; i++)
+        if (shard.Get(v[i], false))
+            n++;
+    return n;
+}
+
+BOOST_AUTO_TEST_CASE(hashcache_insert_contains)
+{
+    CHashCache cache(1 << 20);
+    std::vector<uint256> v = RandomHashes(1000);
+    for (size_t i = 0; i < 500; i++)
+        cache.Set(v[i]);
+    // Far below capacity, nothing is lost and nothing else is found
+    for (size_t i = 0; i < 500; i++)
+        BOOST_CHECK(cache.Get(v[i], false));
+    for (size_t i = 500; i < 1000; i++)
+        BOOST_CHECK(!cache.Get(v[i], false));
+
+    // Inserting again does not count as a new entry
+    cache.Set(v[0]);
+    CHashCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 500U);
+    BOOST_CHECK_EQUAL(stats.nInserts, 500U);
+    BOOST_CHECK_EQUAL(stats.nEvictions, 0U);
+    BOOST_CHECK_EQUAL(stats.nHits, 500U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 500U);
+    BOOST_CHECK(stats.nMemoryUsage <= (size_t)1 << 20);
+
+    // Erasing lookups remove the entry
+    BOOST_CHECK(cache.Get(v[1], true));
+    BOOST_CHECK(!cache.Get(v[1], false));
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 499U);
+}
+
+BOOST_AUTO_TEST_CASE(hashcache_disabled)
+{
+    CHashCache cache(0);
+    uint256 hash = GetRandHash();
+    cache.Set(hash);
+    BOOST_CHECK(!cache.Get(hash, false));
+}
+
+BOOST_AUTO_TEST_CASE(hashcache_size_limit)
+{
+    CHashCache cache(64 << 10);
+    CHashCacheStats stats;
+    cache.GetStats(stats);
+    size_t nCapacity = stats.nCapacity;
+    BOOST_CHECK(nCapacity > 0);
+    BOOST_CHECK(stats.nMemoryUsage <= 64 << 10);
+
+    std::vector<uint256> v = RandomHashes(nCapacity * 4);
+    for (size_t i = 0; i < v.size(); i++)
+        cache.Set(v[i]);
+    cache.GetStats(stats);
+    // The table never grows; every insert beyond it evicts something
+    BOOST_CHECK_EQUAL(stats.nCapacity, nCapacity);
+    BOOST_CHECK(stats.nEntries <= nCapacity);
+    BOOST_CHECK_EQUAL(stats.nInserts, v.size());
+    BOOST_CHECK_EQUAL(stats.nEntries + stats.nEvictions, stats.nInserts);
+    // A key and its generation are stored together, two slots to a cache line
+    BOOST_CHECK_EQUAL(CHashCacheShard::SlotSize(), HASHCACHE_LINE_SIZE / 2);
+    BOOST_CHECK_EQUAL(stats.nMemoryUsage, nCapacity * CHashCacheShard::SlotSize());
+
+    CHashCacheShard shard;
+    for (uint32_t nSlots = 1; nSlots < 64; nSlots += 7) {
+        shard.Resize(nSlots);
+        BOOST_CHECK_EQUAL((uintptr_t)shard.Table() % HASHCACHE_LINE_SIZE, 0U);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hashcache_generations)
+{
+    // A new generation starts every quarter of the table (256 writes here)
+    const size_t nSlots = 1024;
+    CHashCacheShard shard;
+    shard.Resize(nSlots);
+    std::vector<uint256> v = RandomHashes(nSlots * 8);
+    for (size_t i = 0; i < v.size(); i++)
+        shard.Set(v[i]);
+
+    // The last generation written is nearly intact, while the oldest
+    // entries have been overwritten by newer ones
+    size_t nRecent = CountPresent(shard, v, v.size() - nSlots / 4, v.size());
+    size_t nOldest = CountPresent(shard, v, 0, nSlots / 4);
+    BOOST_CHECK_MESSAGE(nRecent >= nSlots / 4 * 9 / 10, nRecent);
+    BOOST_CHECK_MESSAGE(nOldest <= nSlots / 4 / 10, nOldest);
+
+    // Inserting an entry again makes it current, so it outlives its peers
+    const size_t nBegin = v.size() - nSlots;
+    for (size_t i = nBegin; i < nBegin + 64; i++)
+        shard.Set(v[i]);
+    std::vector<uint256> vNew = RandomHashes(nSlots / 4);
+    for (size_t i = 0; i < vNew.size(); i++)
+        shard.Set(vNew[i]);
+    size_t nRefreshed = CountPresent(shard, v, nBegin, nBegin + 64);
+    size_t nPeers = CountPresent(shard, v, nBegin + 64, nBegin + 128);
+    BOOST_CHECK_MESSAGE(nRefreshed >= 60, nRefreshed);
+    BOOST_CHECK_MESSAGE(nPeers < nRefreshed, nPeers);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
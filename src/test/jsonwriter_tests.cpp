@@ -0,0 +1,97 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonwriter.h"
+#include "test/test_bitcoin.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <univalue.h>
+
+BOOST_FIXTURE_TEST_SUITE(jsonwriter_tests, BasicTestingSetup)
+
+static void AppendChunk(std::vector<std::string>* chunks, const std::string& chunk)
+{
+    chunks->push_back(chunk);
+}
+
+/** Write the same document with UniValue and with a writer */
+static void WriteDocument(CJSONWriter& writer, UniValue& expected)
+{
+    UniValue inner(UniValue::VOBJ);
+    inner.push_back(Pair("n", -42));
+    inner.push_back(Pair("s", "quote \" backslash \\ newline \n tab \t bell \x07 high \xc3\xa9"));
+    inner.push_back(Pair("empty", UniValue(UniValue::VARR)));
+
+    UniValue list(UniValue::VARR);
+    for (int i = 0; i < 100; i++)
+        list.push_back(strprintf("item%d", i));
+    list.push_back(true);
+    list.push_back(NullUniValue);
+
+    expected = UniValue(UniValue::VOBJ);
+    expected.push_back(Pair("inner", inner));
+    expected.push_back(Pair("list", list));
+    expected.push_back(Pair("empty", UniValue(UniValue::VOBJ)));
+    expected.push_back(Pair("big", (int64_t)-9223372036854775807LL));
+
+    writer.BeginObject();
+    writer.Pair("inner", inner);
+    writer.Key("list");
+    writer.BeginArray();
+    for (int i = 0; i < 100; i++)
+        writer.Str(strprintf("item%d", i));
+    writer.Bool(true);
+    writer.Null();
+    writer.EndArray();
+    writer.Key("empty");
+    writer.BeginObject();
+    writer.EndObject();
+    writer.Key("big");
+    writer.Int(-9223372036854775807LL);
+    writer.EndObject();
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_matches_univalue)
+{
+    std::vector<std::string> chunks;
+    CJSONWriter writer(boost::bind(AppendChunk, &chunks, _1));
+    UniValue expected;
+    WriteDocument(writer, expected);
+
+    // Everything fits before the first flush
+    BOOST_CHECK(chunks.empty());
+    BOOST_CHECK(!writer.Flushed());
+    BOOST_CHECK_EQUAL(writer.Release(), expected.write());
+    BOOST_CHECK_EQUAL(writer.Release(), "");
+
+    UniValue parsed;
+    BOOST_CHECK(parsed.read(expected.write()));
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_flush)
+{
+    std::vector<std::string> chunks;
+    CJSONWriter writer(boost::bind(AppendChunk, &chunks, _1), 16);
+    UniValue expected;
+    WriteDocument(writer, expected);
+    writer.Flush();
+
+    // Output is handed over in pieces once they reach the flush size
+    BOOST_CHECK(writer.Flushed());
+    BOOST_CHECK(chunks.size() > 1);
+    std::string strJoined;
+    BOOST_FOREACH(const std::string& chunk, chunks) {
+        BOOST_CHECK(!chunk.empty());
+        strJoined += chunk;
+    }
+    BOOST_CHECK_EQUAL(strJoined, expected.write());
+    BOOST_CHECK_EQUAL(writer.Release(), "");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,63 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "latencystats.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(latencystats_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(latencystats_empty)
+{
+    CLatencyStats stats;
+    BOOST_CHECK_EQUAL(stats.nCount, 0U);
+    BOOST_CHECK_EQUAL(stats.AverageMicros(), 0);
+    BOOST_CHECK_EQUAL(stats.QuantileMicros(0.5), 0);
+    BOOST_CHECK_EQUAL(stats.QuantileMicros(1), 0);
+}
+
+BOOST_AUTO_TEST_CASE(latencystats_buckets)
+{
+    CLatencyStats stats;
+    stats.Add(-5);        // clock went backwards: counted as no time at all
+    stats.Add(1000);      // bounds are inclusive
+    stats.Add(1001);
+    stats.Add(20000000);  // beyond the last bound
+    BOOST_CHECK_EQUAL(stats.nCount, 4U);
+    BOOST_CHECK_EQUAL(stats.nTotalMicros, 20002001);
+    BOOST_CHECK_EQUAL(stats.nMaxMicros, 20000000);
+    BOOST_CHECK_EQUAL(stats.vBuckets[0], 2U);
+    BOOST_CHECK_EQUAL(stats.vBuckets[1], 1U);
+    BOOST_CHECK_EQUAL(stats.vBuckets[LATENCY_BUCKETS - 1], 1U);
+
+    uint64_t nTotal = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        nTotal += stats.vBuckets[i];
+    BOOST_CHECK_EQUAL(nTotal, stats.nCount);
+}
+
+BOOST_AUTO_TEST_CASE(latencystats_quantiles)
+{
+    CLatencyStats stats;
+    for (int i = 0; i < 90; i++)
+        stats.Add(500);
+    for (int i = 0; i < 9; i++)
+        stats.Add(40000);
+    stats.Add(3000000);
+    BOOST_CHECK_EQUAL(stats.AverageMicros(), (90 * 500 + 9 * 40000 + 3000000) / 100);
+    // Quantiles are the upper bound of their bucket...
+    BOOST_CHECK_EQUAL(stats.QuantileMicros(0.5), 1000);
+    BOOST_CHECK_EQUAL(stats.QuantileMicros(0.9), 1000);
+    BOOST_CHECK_EQUAL(stats.QuantileMicros(0.95), 50000);
+    BOOST_CHECK_EQUAL(stats.QuantileMicros(0.99), 50000);
+    // ...but never more than the longest duration seen
+    BOOST_CHECK_EQUAL(stats.QuantileMicros(1), 3000000);
+
+    CLatencyStats fast;
+    fast.Add(200);
+    BOOST_CHECK_EQUAL(fast.QuantileMicros(0.5), 200);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
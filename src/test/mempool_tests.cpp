@@ -7,6 +7,7 @@
 
 #include "test/test_bitcoin.h"
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
 #include <list>
 #include <vector>
@@ -284,6 +285,167 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     CheckSort(pool, snapshotOrder);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolRelayOrderTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    /* low fee parent */
+    CMutableTransaction txParent = CMutableTransaction();
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+
+    /* high fee child, which must still come after its parent */
+    CMutableTransaction txChild = CMutableTransaction();
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 9 * COIN;
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(50000LL).FromTx(txChild));
+
+    /* unrelated transaction with a medium fee */
+    CMutableTransaction txOther = CMutableTransaction();
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txOther.vout[0].nValue = 5 * COIN;
+    pool.addUnchecked(txOther.GetHash(), entry.Fee(5000LL).FromTx(txOther));
+
+    uint256 hashMissing = uint256S("0x42");
+
+    std::vector<uint256> vHashes;
+    vHashes.push_back(hashMissing);
+    vHashes.push_back(txChild.GetHash());
+    vHashes.push_back(txOther.GetHash());
+    vHashes.push_back(txParent.GetHash());
+    pool.SortForRelay(vHashes);
+
+    // Transactions that are not in the mempool are not announced
+    BOOST_CHECK_EQUAL(vHashes.size(), 3);
+    BOOST_CHECK_EQUAL(vHashes[0].ToString(), txOther.GetHash().ToString());
+    BOOST_CHECK_EQUAL(vHashes[1].ToString(), txParent.GetHash().ToString());
+    BOOST_CHECK_EQUAL(vHashes[2].ToString(), txChild.GetHash().ToString());
+
+    // A child goes right after its parent when it pays better than the rest
+    CMutableTransaction txLow = CMutableTransaction();
+    txLow.vout.resize(1);
+    txLow.vout[0].scriptPubKey = CScript() << OP_12 << OP_EQUAL;
+    txLow.vout[0].nValue = 5 * COIN;
+    pool.addUnchecked(txLow.GetHash(), entry.Fee(100LL).FromTx(txLow));
+
+    vHashes.clear();
+    vHashes.push_back(txLow.GetHash());
+    vHashes.push_back(txChild.GetHash());
+    vHashes.push_back(txParent.GetHash());
+    pool.SortForRelay(vHashes);
+    BOOST_CHECK_EQUAL(vHashes.size(), 3);
+    BOOST_CHECK_EQUAL(vHashes[0].ToString(), txParent.GetHash().ToString());
+    BOOST_CHECK_EQUAL(vHashes[1].ToString(), txChild.GetHash().ToString());
+    BOOST_CHECK_EQUAL(vHashes[2].ToString(), txLow.GetHash().ToString());
+
+    // Parents that were announced before do not hold their children back
+    vHashes.clear();
+    vHashes.push_back(txLow.GetHash());
+    vHashes.push_back(txChild.GetHash());
+    pool.SortForRelay(vHashes);
+    BOOST_CHECK_EQUAL(vHashes.size(), 2);
+    BOOST_CHECK_EQUAL(vHashes[0].ToString(), txChild.GetHash().ToString());
+    BOOST_CHECK_EQUAL(vHashes[1].ToString(), txLow.GetHash().ToString());
+
+    // Only the first nMax are sorted; the others follow in any order
+    vHashes.clear();
+    vHashes.push_back(hashMissing);
+    vHashes.push_back(txLow.GetHash());
+    vHashes.push_back(txChild.GetHash());
+    vHashes.push_back(txParent.GetHash());
+    vHashes.push_back(txOther.GetHash());
+    BOOST_CHECK_EQUAL(pool.SortForRelay(vHashes, 2), 2);
+    BOOST_CHECK_EQUAL(vHashes.size(), 4);
+    BOOST_CHECK_EQUAL(vHashes[0].ToString(), txOther.GetHash().ToString());
+    BOOST_CHECK_EQUAL(vHashes[1].ToString(), txParent.GetHash().ToString());
+    std::set<uint256> setRest(vHashes.begin() + 2, vHashes.end());
+    BOOST_CHECK(setRest.count(txChild.GetHash()) && setRest.count(txLow.GetHash()));
+}
+
+// Collects a pool's notifications as (txid, reason or -1 for additions, sequence)
+struct MempoolEvents
+{
+    std::vector<std::pair<uint256, std::pair<int, uint64_t> > > v;
+
+    void Added(const CTransaction& tx, uint64_t nSequence)
+    {
+        v.push_back(std::make_pair(tx.GetHash(), std::make_pair(-1, nSequence)));
+    }
+
+    void Removed(const CTransaction& tx, MemPoolRemovalReason reason, uint64_t nSequence)
+    {
+        v.push_back(std::make_pair(tx.GetHash(), std::make_pair((int)reason, nSequence)));
+    }
+};
+
+BOOST_AUTO_TEST_CASE(MempoolNotificationTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    MempoolEvents events;
+    pool.NotifyEntryAdded.connect(boost::bind(&MempoolEvents::Added, &events, _1, _2));
+    pool.NotifyEntryRemoved.connect(boost::bind(&MempoolEvents::Removed, &events, _1, _2, _3));
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 11000LL;
+    // Spends txParent's input too, so it conflicts with it
+    CMutableTransaction txConflict;
+    txConflict.vin.resize(1);
+    txConflict.vin[0].scriptSig = CScript() << OP_12;
+    txConflict.vout.resize(1);
+    txConflict.vout[0].nValue = 10000LL;
+
+    pool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    pool.addUnchecked(txChild.GetHash(), entry.FromTx(txChild));
+    BOOST_CHECK_EQUAL(pool.GetSequence(), 2U);
+
+    // A block confirming txConflict evicts txParent and its child as conflicts
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txConflict);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts);
+    BOOST_CHECK_EQUAL(conflicts.size(), 2U);
+
+    pool.addUnchecked(txConflict.GetHash(), entry.FromTx(txConflict));
+    vtx.clear();
+    vtx.push_back(txConflict);
+    pool.removeForBlock(vtx, 2, conflicts);
+    pool.addUnchecked(txParent.GetHash(), entry.Time(0).FromTx(txParent));
+    BOOST_CHECK_EQUAL(pool.Expire(1), 1);
+
+    BOOST_REQUIRE_EQUAL(events.v.size(), 8U);
+    BOOST_CHECK(events.v[0].first == txParent.GetHash() && events.v[0].second.first == -1);
+    BOOST_CHECK(events.v[1].first == txChild.GetHash() && events.v[1].second.first == -1);
+    BOOST_CHECK_EQUAL(events.v[2].second.first, MEMPOOL_REMOVAL_CONFLICT);
+    BOOST_CHECK_EQUAL(events.v[3].second.first, MEMPOOL_REMOVAL_CONFLICT);
+    BOOST_CHECK(events.v[4].first == txConflict.GetHash() && events.v[4].second.first == -1);
+    BOOST_CHECK(events.v[5].first == txConflict.GetHash() && events.v[5].second.first == MEMPOOL_REMOVAL_BLOCK);
+    BOOST_CHECK(events.v[6].first == txParent.GetHash() && events.v[6].second.first == -1);
+    BOOST_CHECK(events.v[7].first == txParent.GetHash() && events.v[7].second.first == MEMPOOL_REMOVAL_EXPIRY);
+    // Every change has its own, increasing sequence number
+    for (unsigned int i = 0; i < events.v.size(); i++)
+        BOOST_CHECK_EQUAL(events.v[i].second.second, i + 1);
+    BOOST_CHECK_EQUAL(pool.GetSequence(), 8U);
+}
+
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
     CTxMemPool pool(CFeeRate(1000));
@@ -0,0 +1,129 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "hash.h"
+#include "net.h"
+#include "test/test_bitcoin.h"
+
+#include <string.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+static CSerializeData MakeMessage(const char* pszCommand, unsigned int nSize)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, nSize);
+    for (unsigned int i = 0; i < nSize; i++)
+        ss << (unsigned char)(i * 7);
+    CSerializeData data;
+    ss.GetAndClear(data);
+    return data;
+}
+
+static void CheckPayload(const CNetMessage& msg, unsigned int nSize)
+{
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK_EQUAL(msg.vRecv.size(), nSize);
+    bool fMatch = true;
+    for (unsigned int i = 0; i < nSize; i++)
+        fMatch &= ((unsigned char)msg.vRecv[i] == (unsigned char)(i * 7));
+    BOOST_CHECK(fMatch);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_read_chunked)
+{
+    // Larger than one buffer step, so the buffer has to grow
+    const unsigned int nSize = 600 * 1000;
+    CSerializeData data = MakeMessage("block", nSize);
+
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nPos = 0;
+    while (nPos < data.size()) {
+        unsigned int nChunk = std::min((unsigned int)data.size() - nPos, 1 + (nPos % 70001));
+        int nHandled = msg.in_data ? msg.readData(&data[nPos], nChunk) : msg.readHeader(&data[nPos], nChunk);
+        BOOST_REQUIRE(nHandled > 0);
+        nPos += nHandled;
+    }
+    BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "block");
+    CheckPayload(msg, nSize);
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_read_in_place)
+{
+    const unsigned int nSize = 300 * 1000;
+    CSerializeData data = MakeMessage("tx", nSize);
+
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(msg.readHeader(&data[0], 24), 24);
+    unsigned int nPos = 24;
+    while (!msg.complete()) {
+        // Receive into the message's own buffer, like the socket handler does
+        unsigned int nSpace;
+        char* pch = msg.PrepareData(nSpace);
+        BOOST_REQUIRE(nSpace > 0);
+        unsigned int nChunk = std::min(nSpace, std::min((unsigned int)data.size() - nPos, 50000U));
+        memcpy(pch, &data[nPos], nChunk);
+        BOOST_CHECK_EQUAL(msg.readData(pch, nChunk), (int)nChunk);
+        nPos += nChunk;
+    }
+    CheckPayload(msg, nSize);
+}
+
+BOOST_AUTO_TEST_CASE(shared_message_roundtrip)
+{
+    std::vector<unsigned char> vPayload(100000);
+    for (unsigned int i = 0; i < vPayload.size(); i++)
+        vPayload[i] = (unsigned char)(i * 13);
+    CSharedNetMsg msgShared = MakeSharedNetMsg("block", vPayload);
+
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    const char* pch = &(*msgShared)[0];
+    int nHandled = msg.readHeader(pch, msgShared->size());
+    BOOST_REQUIRE_EQUAL(nHandled, (int)CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK_EQUAL(msg.readData(pch + nHandled, msgShared->size() - nHandled), (int)(msgShared->size() - nHandled));
+    BOOST_REQUIRE(msg.complete());
+    BOOST_CHECK(msg.hdr.IsValid(Params().MessageStart()));
+    BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "block");
+
+    uint256 hash = Hash(msg.vRecv.begin(), msg.vRecv.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(nChecksum, msg.hdr.nChecksum);
+
+    std::vector<unsigned char> vRead;
+    msg.vRecv >> vRead;
+    BOOST_CHECK(vRead == vPayload);
+}
+
+BOOST_AUTO_TEST_CASE(historical_upload_refill)
+{
+    // 1000 bytes per second, with a burst of HISTORICAL_RATE_BURST_SECONDS
+    CNode::SetMaxHistoricalRate(1000);
+    BOOST_CHECK(CNode::HistoricalUploadAllowed(UPLOAD_OUTBOUND));
+    BOOST_CHECK(CNode::HistoricalUploadAllowed(UPLOAD_WHITELISTED));
+
+    // Empty the bucket; only whitelisted peers may go on
+    CNode::RecordHistoricalBytesSent(1000 * HISTORICAL_RATE_BURST_SECONDS);
+    BOOST_CHECK(!CNode::HistoricalUploadAllowed(UPLOAD_OUTBOUND));
+    BOOST_CHECK(CNode::HistoricalUploadAllowed(UPLOAD_WHITELISTED));
+
+    // Polling far more often than a token is earned must still refill it
+    int64_t nStart = GetTimeMicros();
+    bool fAllowed = false;
+    while (!fAllowed && GetTimeMicros() - nStart < 1000000)
+        fAllowed = CNode::HistoricalUploadAllowed(UPLOAD_OUTBOUND);
+    BOOST_CHECK(fAllowed);
+    BOOST_CHECK(GetTimeMicros() - nStart < 100000);
+
+    // Inbound peers wait until half the burst is back
+    BOOST_CHECK(!CNode::HistoricalUploadAllowed(UPLOAD_INBOUND));
+
+    CNode::SetMaxHistoricalRate(0);
+    BOOST_CHECK(CNode::HistoricalUploadAllowed(UPLOAD_INBOUND));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,187 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcserver.h"
+#include "rpcprotocol.h"
+#include "test/test_bitcoin.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include <univalue.h>
+
+BOOST_FIXTURE_TEST_SUITE(rpcbatch_tests, BasicTestingSetup)
+
+// What the test commands saw, guarded by csCalls
+static boost::mutex csCalls;
+static int nRunning = 0;
+static int nMaxRunning = 0;
+static std::vector<int> vFinished;
+
+/** batchtest_sleep index ms: sleeps, then returns index */
+static UniValue batchtest_sleep(const UniValue& params, bool fHelp)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csCalls);
+        nMaxRunning = std::max(nMaxRunning, ++nRunning);
+    }
+    MilliSleep(params[1].get_int());
+    boost::unique_lock<boost::mutex> lock(csCalls);
+    nRunning--;
+    vFinished.push_back(params[0].get_int());
+    return params[0];
+}
+
+/** batchtest_serial index: fails unless it runs alone, after every earlier call of the batch */
+static UniValue batchtest_serial(const UniValue& params, bool fHelp)
+{
+    boost::unique_lock<boost::mutex> lock(csCalls);
+    if (nRunning != 0 || vFinished.size() != (size_t)params[0].get_int())
+        throw std::runtime_error("serial call overlapped with others");
+    vFinished.push_back(params[0].get_int());
+    return params[0];
+}
+
+static const CRPCCommand vTestCommands[] =
+{ //  category              name                      actor (function)         okSafeMode okConcurrent
+    { "test",               "batchtest_sleep",        &batchtest_sleep,        true,      true  },
+    { "test",               "batchtest_serial",       &batchtest_serial,       true,      false },
+};
+
+static void RegisterTestCommands()
+{
+    for (unsigned int i = 0; i < sizeof(vTestCommands) / sizeof(vTestCommands[0]); i++)
+        tableRPC.appendCommand(vTestCommands[i].name, &vTestCommands[i]);
+    if (RPCIsInWarmup(NULL))
+        SetRPCWarmupFinished();
+    boost::unique_lock<boost::mutex> lock(csCalls);
+    nRunning = nMaxRunning = 0;
+    vFinished.clear();
+}
+
+static bool DispatchToThread(boost::thread_group* threads, const boost::function<void(void)>& func)
+{
+    threads->create_thread(func);
+    return true;
+}
+
+static bool DispatchNowhere(const boost::function<void(void)>& func)
+{
+    return false;
+}
+
+static UniValue Call(const std::string& strMethod, int nIndex, int nMillis = -1)
+{
+    UniValue params(UniValue::VARR);
+    params.push_back(nIndex);
+    if (nMillis >= 0)
+        params.push_back(nMillis);
+    UniValue request(UniValue::VOBJ);
+    request.push_back(Pair("method", strMethod));
+    request.push_back(Pair("params", params));
+    request.push_back(Pair("id", nIndex));
+    return request;
+}
+
+static void CheckInOrder(const UniValue& reply, size_t nSize)
+{
+    BOOST_CHECK_EQUAL(reply.size(), nSize);
+    for (size_t i = 0; i < reply.size(); i++) {
+        BOOST_CHECK(find_value(reply[i].get_obj(), "error").isNull());
+        BOOST_CHECK_EQUAL(find_value(reply[i].get_obj(), "id").get_int(), (int)i);
+        BOOST_CHECK_EQUAL(find_value(reply[i].get_obj(), "result").get_int(), (int)i);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rpcbatch_order)
+{
+    RegisterTestCommands();
+    boost::thread_group threads;
+    RPCSetBatchDispatcher(boost::bind(&DispatchToThread, &threads, _1), 4);
+
+    // Earlier calls take longer, so they finish last
+    UniValue batch(UniValue::VARR);
+    for (int i = 0; i < 6; i++)
+        batch.push_back(Call("batchtest_sleep", i, (6 - i) * 20));
+    UniValue reply = JSONRPCExecBatchObj(batch);
+    threads.join_all();
+
+    CheckInOrder(reply, 6);
+    BOOST_CHECK(nMaxRunning > 1);
+    BOOST_CHECK(vFinished.size() == 6 && vFinished[0] != 0);
+    RPCSetBatchDispatcher(RPCWorkDispatcher(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(rpcbatch_mixed)
+{
+    RegisterTestCommands();
+    boost::thread_group threads;
+    RPCSetBatchDispatcher(boost::bind(&DispatchToThread, &threads, _1), 4);
+
+    // Serial calls wait for the concurrent ones before them, and hold up those after them
+    UniValue batch(UniValue::VARR);
+    batch.push_back(Call("batchtest_sleep", 0, 60));
+    batch.push_back(Call("batchtest_sleep", 1, 20));
+    batch.push_back(Call("batchtest_sleep", 2, 40));
+    batch.push_back(Call("batchtest_serial", 3));
+    batch.push_back(Call("batchtest_sleep", 4, 40));
+    batch.push_back(Call("batchtest_sleep", 5, 20));
+    batch.push_back(Call("batchtest_serial", 6));
+    batch.push_back(Call("batchtest_serial", 7));
+    batch.push_back(Call("batchtest_sleep", 8, 0));
+    UniValue reply = JSONRPCExecBatchObj(batch);
+    threads.join_all();
+
+    CheckInOrder(reply, 9);
+    BOOST_CHECK(nMaxRunning > 1);
+    RPCSetBatchDispatcher(RPCWorkDispatcher(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(rpcbatch_sequential)
+{
+    // Without a dispatcher, or one that cannot queue anything, the batch
+    // runs on the calling thread alone
+    RegisterTestCommands();
+    UniValue batch(UniValue::VARR);
+    for (int i = 0; i < 4; i++)
+        batch.push_back(Call("batchtest_sleep", i, 4 - i));
+    CheckInOrder(JSONRPCExecBatchObj(batch), 4);
+
+    RPCSetBatchDispatcher(&DispatchNowhere, 4);
+    CheckInOrder(JSONRPCExecBatchObj(batch), 4);
+    BOOST_CHECK_EQUAL(nMaxRunning, 1);
+    BOOST_CHECK(vFinished.size() == 8 && vFinished[0] == 0 && vFinished[7] == 3);
+    RPCSetBatchDispatcher(RPCWorkDispatcher(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(rpcbatch_max_size)
+{
+    RegisterTestCommands();
+    UniValue batch(UniValue::VARR);
+    for (int i = 0; i < 4; i++)
+        batch.push_back(Call("batchtest_serial", i));
+
+    mapArgs["-rpcmaxbatchsize"] = "3";
+    try {
+        JSONRPCExecBatchObj(batch);
+        BOOST_ERROR("oversized batch was executed");
+    } catch (const UniValue& objError) {
+        BOOST_CHECK_EQUAL(find_value(objError, "code").get_int(), (int)RPC_INVALID_REQUEST);
+    }
+    // Nothing of a rejected batch runs
+    BOOST_CHECK(vFinished.empty());
+
+    mapArgs["-rpcmaxbatchsize"] = "4";
+    CheckInOrder(JSONRPCExecBatchObj(batch), 4);
+    mapArgs["-rpcmaxbatchsize"] = "0";
+    RegisterTestCommands();
+    CheckInOrder(JSONRPCExecBatchObj(batch), 4);
+    mapArgs.erase("-rpcmaxbatchsize");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,14 +2,18 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
 #include "consensus/validation.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
+#include "policy/policy.h"
 #include "pubkey.h"
 #include "txmempool.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
+#include "timedata.h"
 #include "test/test_bitcoin.h"
 #include "utiltime.h"
 
@@ -83,4 +87,47 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(tx_mempool_script_execution_cache, TestChain100Setup)
+{
+    // Transactions accepted to the memory pool are remembered as valid
+    // for the script flags of the next block, and connecting that block
+    // uses up the entry.
+
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    unsigned int flags;
+    {
+        LOCK(cs_main);
+        flags = GetBlockScriptFlags(chainActive.Tip(), CBlockHeader::CURRENT_VERSION, GetAdjustedTime(), Params().GetConsensus());
+    }
+    const uint256 txid = spend.GetHash();
+    BOOST_CHECK(!IsScriptExecutionCached(txid, flags, false));
+    BOOST_CHECK(ToMemPool(spend));
+    BOOST_CHECK(IsScriptExecutionCached(txid, flags, false));
+    BOOST_CHECK(!IsScriptExecutionCached(txid, flags & ~SCRIPT_VERIFY_P2SH, false));
+    // The policy check is not remembered: no block would ever look it up
+    BOOST_CHECK(STANDARD_SCRIPT_VERIFY_FLAGS != flags);
+    BOOST_CHECK(!IsScriptExecutionCached(txid, STANDARD_SCRIPT_VERIFY_FLAGS, false));
+
+    std::vector<CMutableTransaction> oneSpend;
+    oneSpend.push_back(spend);
+    CBlock block = CreateAndProcessBlock(oneSpend, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    BOOST_CHECK(!IsScriptExecutionCached(txid, flags, false));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
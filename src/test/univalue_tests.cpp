@@ -3,11 +3,13 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <stdint.h>
+#include <limits>
 #include <vector>
 #include <string>
 #include <map>
 #include <univalue.h>
 #include "test/test_bitcoin.h"
+#include "tinyformat.h"
 
 #include <boost/test/unit_test.hpp>
 
@@ -288,6 +290,86 @@ BOOST_AUTO_TEST_CASE(univalue_object)
 static const char *json1 =
 "[1.10000000,{\"key1\":\"str\\u0000\",\"key2\":800,\"key3\":{\"name\":\"martian http://test.com\"}}]";
 
+BOOST_AUTO_TEST_CASE(univalue_large_object)
+{
+    // Large objects are searched through an index, which must find the
+    // same values as the linear search used for small ones
+    UniValue obj(UniValue::VOBJ);
+    for (int i = 0; i < 1000; i++) {
+        BOOST_CHECK(obj.pushKV(strprintf("key%d", i), i));
+        BOOST_CHECK_EQUAL(find_value(obj, strprintf("key%d", i / 2)).get_int(), i / 2);
+    }
+    BOOST_CHECK(obj.pushKV("key7", 1007));
+    BOOST_CHECK_EQUAL(obj.size(), 1001);
+    BOOST_CHECK_EQUAL(obj["key7"].get_int(), 7);
+    BOOST_CHECK_EQUAL(obj["key999"].get_int(), 999);
+    BOOST_CHECK(!obj.exists("key1000"));
+    BOOST_CHECK(find_value(obj, "").isNull());
+
+    // Copies, and objects read from JSON, are indexed as well
+    UniValue copy = obj;
+    BOOST_CHECK_EQUAL(copy["key500"].get_int(), 500);
+    UniValue parsed;
+    BOOST_CHECK(parsed.read(obj.write()));
+    BOOST_CHECK_EQUAL(parsed["key7"].get_int(), 7);
+    BOOST_CHECK_EQUAL(parsed["key998"].get_int(), 998);
+    BOOST_CHECK_EQUAL(parsed.write(), obj.write());
+
+    UniValue merged(UniValue::VOBJ);
+    BOOST_CHECK(merged.pushKVs(obj));
+    BOOST_CHECK_EQUAL(merged["key123"].get_int(), 123);
+
+    obj.setObject();
+    BOOST_CHECK(!obj.exists("key7"));
+    BOOST_CHECK(obj.pushKV("key7", 0));
+    BOOST_CHECK_EQUAL(obj["key7"].get_int(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(univalue_swap)
+{
+    UniValue arr(UniValue::VARR);
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("list", UniValue(UniValue::VARR)));
+    BOOST_CHECK(arr.push_backSwap(obj));
+    BOOST_CHECK(obj.isNull());
+    BOOST_CHECK_EQUAL(arr.write(), "[{\"list\":[]}]");
+
+    UniValue str("text");
+    UniValue outer(UniValue::VOBJ);
+    BOOST_CHECK(outer.pushKVSwap("s", str));
+    BOOST_CHECK(str.isNull());
+    // Values are left alone if they cannot be added
+    BOOST_CHECK(!arr.pushKVSwap("a", outer) && outer.isObject());
+    BOOST_CHECK(!outer.push_backSwap(arr) && arr.isArray());
+
+    outer.swap(arr);
+    BOOST_CHECK_EQUAL(outer.write(), "[{\"list\":[]}]");
+    BOOST_CHECK_EQUAL(arr["s"].get_str(), "text");
+}
+
+BOOST_AUTO_TEST_CASE(univalue_numbers)
+{
+    UniValue v;
+    BOOST_CHECK(v.setInt(std::numeric_limits<int64_t>::min()));
+    BOOST_CHECK_EQUAL(v.getValStr(), "-9223372036854775808");
+    BOOST_CHECK_EQUAL(v.get_int64(), std::numeric_limits<int64_t>::min());
+    BOOST_CHECK(v.setInt(std::numeric_limits<uint64_t>::max()));
+    BOOST_CHECK_EQUAL(v.getValStr(), "18446744073709551615");
+    BOOST_CHECK_THROW(v.get_int64(), std::runtime_error);
+    BOOST_CHECK(v.setInt((int64_t)-2147483648LL));
+    BOOST_CHECK_EQUAL(v.get_int(), -2147483648LL);
+    BOOST_CHECK(v.setInt((int64_t)2147483648LL));
+    BOOST_CHECK_THROW(v.get_int(), std::runtime_error);
+    BOOST_CHECK_EQUAL(v.get_int64(), 2147483648LL);
+
+    BOOST_CHECK_EQUAL(UniValue(UniValue::VNUM, "007").get_int(), 7);
+    BOOST_CHECK_EQUAL(UniValue(UniValue::VNUM, "-0").get_int64(), 0);
+    BOOST_CHECK_THROW(UniValue(UniValue::VNUM, "1.5").get_int64(), std::runtime_error);
+    BOOST_CHECK_THROW(UniValue(UniValue::VNUM, "1e3").get_int(), std::runtime_error);
+    BOOST_CHECK_THROW(UniValue(UniValue::VNUM, std::string("12\0", 3)).get_int64(), std::runtime_error);
+    BOOST_CHECK_THROW(UniValue(UniValue::VNUM, "").get_int(), std::runtime_error);
+}
+
 BOOST_AUTO_TEST_CASE(univalue_readwrite)
 {
     UniValue v;
@@ -0,0 +1,151 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "validationinterface.h"
+
+#include "arith_uint256.h"
+#include "consensus/validation.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+#include "test/test_bitcoin.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(validationinterface_tests, BasicTestingSetup)
+
+// Records what it was told, and from which thread
+class TestListener : public CValidationInterface
+{
+public:
+    std::vector<uint256> vSeen;
+    std::vector<const CBlock*> vBlocks;
+    std::vector<bool> vInBlock;
+    int nBlockEvents;
+    boost::thread::id threadId;
+
+    TestListener() : nBlockEvents(0) {}
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+    {
+        vSeen.push_back(tx.GetHash());
+        vBlocks.push_back(pblock);
+        vInBlock.push_back(pblock && &tx >= &pblock->vtx.front() && &tx <= &pblock->vtx.back());
+        threadId = boost::this_thread::get_id();
+    }
+
+    void UpdatedTransaction(const uint256& hash)
+    {
+        vSeen.push_back(hash);
+    }
+
+    void UpdatedBlockTip(const CBlockIndex* pindex)
+    {
+        nBlockEvents++;
+    }
+
+    void BlockConnected(const CBlock& block, const CBlockIndex* pindex)
+    {
+        nBlockEvents++;
+    }
+
+    void BlockDisconnected(const CBlock& block)
+    {
+        nBlockEvents++;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(async_listeners)
+{
+    TestListener listener;
+    RegisterValidationInterface(&listener, true);
+    boost::thread thread(&ThreadValidationQueue);
+
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    std::vector<uint256> vExpected;
+    for (int i = 0; i < 3; i++) {
+        tx.vout[0].nValue = i;
+        block.vtx.push_back(tx);
+    }
+    BOOST_FOREACH(const CTransaction& txBlock, block.vtx) {
+        SyncWithWallets(txBlock, &block);
+        vExpected.push_back(txBlock.GetHash());
+    }
+    GetMainSignals().UpdatedTransaction(block.vtx[0].GetHash());
+    vExpected.push_back(block.vtx[0].GetHash());
+
+    // The block goes away before the listener gets to see it
+    block.SetNull();
+    SyncWithValidationQueue();
+
+    // Delivered in order on the queue's thread, with one shared copy of the block
+    BOOST_CHECK_EQUAL(listener.vSeen.size(), vExpected.size());
+    for (unsigned int i = 0; i < vExpected.size() && i < listener.vSeen.size(); i++)
+        BOOST_CHECK_EQUAL(listener.vSeen[i].ToString(), vExpected[i].ToString());
+    BOOST_CHECK(listener.threadId == thread.get_id());
+    BOOST_CHECK(listener.vBlocks.size() == 3 && listener.vBlocks[0] != &block);
+    BOOST_CHECK(listener.vBlocks.size() == 3 && listener.vBlocks[0] == listener.vBlocks[2]);
+    // The transactions are not copied again, they are those of the shared block
+    BOOST_CHECK(listener.vInBlock.size() == 3 && listener.vInBlock[0] && listener.vInBlock[2]);
+
+    CValidationQueueStats stats;
+    GetValidationQueueStats(stats);
+    BOOST_CHECK_EQUAL(stats.nListeners, 1U);
+    BOOST_CHECK_EQUAL(stats.nSize, 0U);
+    BOOST_CHECK(stats.nQueued >= 4);
+
+    thread.interrupt();
+    thread.join();
+    UnregisterValidationInterface(&listener);
+}
+
+BOOST_AUTO_TEST_CASE(full_queue_drops)
+{
+    TestListener listener;
+    RegisterValidationInterface(&listener, true);
+    SetValidationQueueSize(2);
+    CValidationQueueStats stats;
+    GetValidationQueueStats(stats);
+    uint64_t nDroppedBefore = stats.nDropped;
+
+    // Nothing delivers yet, so the queue fills up; the caller must not wait
+    int64_t nStart = GetTimeMillis();
+    for (int i = 0; i < 4; i++)
+        GetMainSignals().UpdatedTransaction(ArithToUint256(i));
+    BOOST_CHECK(GetTimeMillis() - nStart < 50);
+    GetValidationQueueStats(stats);
+    BOOST_CHECK_EQUAL(stats.nSize, 2U);
+    BOOST_CHECK_EQUAL(stats.nDropped - nDroppedBefore, 2U);
+
+    // Block connections, disconnections and tip updates are never dropped
+    CBlock block;
+    GetMainSignals().BlockDisconnected(block);
+    GetMainSignals().BlockConnected(block, NULL);
+    GetMainSignals().UpdatedBlockTip(NULL);
+    GetValidationQueueStats(stats);
+    BOOST_CHECK_EQUAL(stats.nSize, 5U);
+    BOOST_CHECK_EQUAL(stats.nDropped - nDroppedBefore, 2U);
+
+    // The oldest notifications are the ones delivered
+    boost::thread thread(&ThreadValidationQueue);
+    SyncWithValidationQueue();
+    BOOST_CHECK_EQUAL(listener.vSeen.size(), 2U);
+    BOOST_CHECK(listener.vSeen.size() == 2 && listener.vSeen[1] == ArithToUint256(1));
+    BOOST_CHECK_EQUAL(listener.nBlockEvents, 3);
+
+    thread.interrupt();
+    thread.join();
+    SetValidationQueueSize(DEFAULT_VALIDATION_QUEUE_SIZE);
+    UnregisterValidationInterface(&listener);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -16,6 +16,8 @@
 #include "utiltime.h"
 #include "version.h"
 
+#include <algorithm>
+
 using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -306,8 +308,22 @@ void CTxMemPoolEntry::UpdateState(int64_t modifySize, CAmount modifyFee, int64_t
     }
 }
 
+const char* GetRemovalReasonName(MemPoolRemovalReason reason)
+{
+    switch (reason) {
+    case MEMPOOL_REMOVAL_UNKNOWN: return "unknown";
+    case MEMPOOL_REMOVAL_EXPIRY: return "expiry";
+    case MEMPOOL_REMOVAL_SIZELIMIT: return "sizelimit";
+    case MEMPOOL_REMOVAL_REORG: return "reorg";
+    case MEMPOOL_REMOVAL_BLOCK: return "block";
+    case MEMPOOL_REMOVAL_CONFLICT: return "conflict";
+    case MEMPOOL_REMOVAL_REPLACED: return "replaced";
+    }
+    return "unknown";
+}
+
 CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), nSequence(0)
 {
     _clear(); //lock free clear
 
@@ -350,6 +366,12 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+uint64_t CTxMemPool::GetSequence() const
+{
+    LOCK(cs);
+    return nSequence;
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.
@@ -390,11 +412,15 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     totalTxSize += entry.GetTxSize();
     minerPolicyEstimator->processTransaction(entry, fCurrentEstimate);
 
+    NotifyEntryAdded(tx, ++nSequence);
+
     return true;
 }
 
-void CTxMemPool::removeUnchecked(txiter it)
+void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 {
+    NotifyEntryRemoved(it->GetTx(), reason, ++nSequence);
+
     const uint256 hash = it->GetTx().GetHash();
     BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
         mapNextTx.erase(txin.prevout);
@@ -437,7 +463,7 @@ void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants
     }
 }
 
-void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive)
+void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive, MemPoolRemovalReason reason)
 {
     // Remove transaction from memory pool
     {
@@ -471,7 +497,7 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
         BOOST_FOREACH(txiter it, setAllRemoves) {
             removed.push_back(it->GetTx());
         }
-        RemoveStaged(setAllRemoves);
+        RemoveStaged(setAllRemoves, reason);
     }
 }
 
@@ -496,7 +522,7 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned in
     }
     BOOST_FOREACH(const CTransaction& tx, transactionsToRemove) {
         list<CTransaction> removed;
-        remove(tx, removed, true);
+        remove(tx, removed, true, MEMPOOL_REMOVAL_REORG);
     }
 }
 
@@ -511,7 +537,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
             const CTransaction &txConflict = *it->second.ptx;
             if (txConflict != tx)
             {
-                remove(txConflict, removed, true);
+                remove(txConflict, removed, true, MEMPOOL_REMOVAL_CONFLICT);
                 ClearPrioritisation(txConflict.GetHash());
             }
         }
@@ -537,7 +563,7 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
         std::list<CTransaction> dummy;
-        remove(tx, dummy, false);
+        remove(tx, dummy, false, MEMPOOL_REMOVAL_BLOCK);
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
@@ -687,6 +713,70 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
         vtxid.push_back(mi->GetTx().GetHash());
 }
 
+namespace {
+/** Orders entries whose in-batch parents have been placed: the best fee rate on top */
+struct RelaySortKey
+{
+    CFeeRate feeRate;
+    CTxMemPool::txiter it;
+
+    RelaySortKey(CTxMemPool::txiter itIn) : feeRate(itIn->GetFee(), itIn->GetTxSize()), it(itIn) {}
+
+    bool operator<(const RelaySortKey& b) const
+    {
+        if (!(feeRate == b.feeRate))
+            return feeRate < b.feeRate;
+        return b.it->GetTx().GetHash() < it->GetTx().GetHash();
+    }
+};
+}
+
+size_t CTxMemPool::SortForRelay(vector<uint256>& vtxid, size_t nMax)
+{
+    LOCK(cs);
+    // The entries of the batch, with how many of their parents in the batch
+    // are not placed yet. Parents outside the batch have been announced
+    // already, so only direct links within it matter.
+    std::map<txiter, unsigned int, CompareIteratorByHash> mapPending;
+    BOOST_FOREACH(const uint256& hash, vtxid) {
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end())
+            mapPending.insert(std::make_pair(it, 0));
+    }
+    std::vector<RelaySortKey> vReady;
+    for (std::map<txiter, unsigned int, CompareIteratorByHash>::iterator mi = mapPending.begin(); mi != mapPending.end(); ++mi) {
+        BOOST_FOREACH(const txiter& parent, GetMemPoolParents(mi->first))
+            if (mapPending.count(parent))
+                mi->second++;
+        if (mi->second == 0)
+            vReady.push_back(RelaySortKey(mi->first));
+    }
+    // Heapify rather than sort: only the first nMax are taken off the heap,
+    // while the batch may be far larger.
+    std::make_heap(vReady.begin(), vReady.end());
+
+    vtxid.clear();
+    while (!vReady.empty() && vtxid.size() < nMax) {
+        std::pop_heap(vReady.begin(), vReady.end());
+        txiter it = vReady.back().it;
+        vReady.pop_back();
+        mapPending.erase(it);
+        vtxid.push_back(it->GetTx().GetHash());
+        BOOST_FOREACH(const txiter& child, GetMemPoolChildren(it)) {
+            std::map<txiter, unsigned int, CompareIteratorByHash>::iterator mi = mapPending.find(child);
+            if (mi != mapPending.end() && --mi->second == 0) {
+                vReady.push_back(RelaySortKey(child));
+                std::push_heap(vReady.begin(), vReady.end());
+            }
+        }
+    }
+
+    size_t nSorted = vtxid.size();
+    for (std::map<txiter, unsigned int, CompareIteratorByHash>::iterator mi = mapPending.begin(); mi != mapPending.end(); ++mi)
+        vtxid.push_back(mi->first->GetTx().GetHash());
+    return nSorted;
+}
+
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
@@ -812,11 +902,11 @@ size_t CTxMemPool::DynamicMemoryUsage() const {
     return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 9 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + cachedInnerUsage;
 }
 
-void CTxMemPool::RemoveStaged(setEntries &stage) {
+void CTxMemPool::RemoveStaged(setEntries &stage, MemPoolRemovalReason reason) {
     AssertLockHeld(cs);
     UpdateForRemoveFromMempool(stage);
     BOOST_FOREACH(const txiter& it, stage) {
-        removeUnchecked(it);
+        removeUnchecked(it, reason);
     }
 }
 
@@ -832,7 +922,7 @@ int CTxMemPool::Expire(int64_t time) {
     BOOST_FOREACH(txiter removeit, toremove) {
         CalculateDescendants(removeit, stage);
     }
-    RemoveStaged(stage);
+    RemoveStaged(stage, MEMPOOL_REMOVAL_EXPIRY);
     return stage.size();
 }
 
@@ -933,7 +1023,7 @@ void CTxMemPool::TrimToSize(size_t sizelimit) {
 
         setEntries stage;
         CalculateDescendants(mapTx.project<0>(it), stage);
-        RemoveStaged(stage);
+        RemoveStaged(stage, MEMPOOL_REMOVAL_SIZELIMIT);
         nTxnRemoved += stage.size();
     }
 
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <limits>
 #include <list>
 #include <set>
 
@@ -18,6 +19,8 @@
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 
+#include <boost/signals2/signal.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -275,11 +278,25 @@ public:
  * the feerate of the transaction without any descendants.
  *
  */
+/** Reason why a transaction was removed from the mempool */
+enum MemPoolRemovalReason {
+    MEMPOOL_REMOVAL_UNKNOWN = 0, //! Manually removed or unknown reason
+    MEMPOOL_REMOVAL_EXPIRY,      //! Expired from mempool
+    MEMPOOL_REMOVAL_SIZELIMIT,   //! Removed in size limiting
+    MEMPOOL_REMOVAL_REORG,       //! Removed for reorganization
+    MEMPOOL_REMOVAL_BLOCK,       //! Removed for block
+    MEMPOOL_REMOVAL_CONFLICT,    //! Removed for conflict with in-block transaction
+    MEMPOOL_REMOVAL_REPLACED     //! Removed for replacement
+};
+
+const char* GetRemovalReasonName(MemPoolRemovalReason reason);
+
 class CTxMemPool
 {
 private:
     uint32_t nCheckFrequency; //! Value n means that n times in 2^32 we check.
     unsigned int nTransactionsUpdated;
+    uint64_t nSequence; //! Bumped on every addition and removal
     CBlockPolicyEstimator* minerPolicyEstimator;
 
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
@@ -369,7 +386,7 @@ public:
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors, bool fCurrentEstimate = true);
 
-    void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
+    void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false, MemPoolRemovalReason reason = MEMPOOL_REMOVAL_UNKNOWN);
     void removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
     void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
@@ -377,9 +394,21 @@ public:
     void clear();
     void _clear(); //lock free
     void queryHashes(std::vector<uint256>& vtxid);
+    /**
+     * Sort the first nMax transaction ids into the order in which they should
+     * be announced: by decreasing fee rate, except that parents always
+     * precede their children. The rest follow in no particular order, and
+     * transactions that are no longer in the mempool are removed. Returns
+     * how many were sorted. Only direct links between the given transactions
+     * are followed, so the cost grows with their number rather than with
+     * their ancestors.
+     */
+    size_t SortForRelay(std::vector<uint256>& vtxid, size_t nMax = std::numeric_limits<size_t>::max());
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    /** The sequence number of the last addition or removal */
+    uint64_t GetSequence() const;
     /**
      * Check that none of this transactions inputs are in the mempool, and thus
      * the tx is not dependent on other mempool transactions to be included in a block.
@@ -395,7 +424,7 @@ public:
     /** Remove a set of transactions from the mempool.
      *  If a transaction is in this set, then all in-mempool descendants must
      *  also be in the set.*/
-    void RemoveStaged(setEntries &stage);
+    void RemoveStaged(setEntries &stage, MemPoolRemovalReason reason = MEMPOOL_REMOVAL_UNKNOWN);
 
     /** When adding transactions from a disconnected block back to the mempool,
      *  new mempool entries may have children in the mempool (which is generally
@@ -483,6 +512,13 @@ public:
 
     size_t DynamicMemoryUsage() const;
 
+    /**
+     * Fired under cs for every transaction entering or leaving the pool, with
+     * the sequence number the change was given.
+     */
+    boost::signals2::signal<void (const CTransaction &, uint64_t)> NotifyEntryAdded;
+    boost::signals2::signal<void (const CTransaction &, MemPoolRemovalReason, uint64_t)> NotifyEntryRemoved;
+
 private:
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
      *  the descendants for a single transaction that has been added to the
@@ -519,7 +555,7 @@ private:
      *  transactions in a chain before we've updated all the state for the
      *  removal.
      */
-    void removeUnchecked(txiter entry);
+    void removeUnchecked(txiter entry, MemPoolRemovalReason reason = MEMPOOL_REMOVAL_UNKNOWN);
 };
 
 /** 
@@ -47,7 +47,11 @@ public:
         std::string s(val_);
         setStr(s);
     }
-    ~UniValue() {}
+    // No destructor is declared, so C++11 compilers generate a move
+    // constructor and vectors of values are moved rather than copied.
+
+    /** Exchange contents with another value without copying them */
+    void swap(UniValue& other);
 
     void clear();
 
@@ -93,6 +97,8 @@ public:
         return push_back(s);
     }
     bool push_backV(const std::vector<UniValue>& vec);
+    /** Append val without copying it; val is left null */
+    bool push_backSwap(UniValue& val);
 
     bool pushKV(const std::string& key, const UniValue& val);
     bool pushKV(const std::string& key, const std::string& val) {
@@ -120,6 +126,8 @@ public:
         return pushKV(key, tmpVal);
     }
     bool pushKVs(const UniValue& obj);
+    /** Append key and val without copying val; val is left null */
+    bool pushKVSwap(const std::string& key, UniValue& val);
 
     std::string write(unsigned int prettyIndent = 0,
                       unsigned int indentLevel = 0) const;
@@ -134,8 +142,14 @@ private:
     std::string val;                       // numbers are stored as C++ strings
     std::vector<std::string> keys;
     std::vector<UniValue> values;
+    /** Hash table of positions in keys plus one, kept for large objects only */
+    std::vector<uint32_t> keyIndex;
 
     int findKey(const std::string& key) const;
+    void pushKey(const std::string& key);
+    void indexKey(size_t pos);
+    void rebuildKeyIndex();
+    void write(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
     void writeArray(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
     void writeObject(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
 
@@ -154,7 +168,8 @@ public:
 
     enum VType type() const { return getType(); }
     bool push_back(std::pair<std::string,UniValue> pear) {
-        return pushKV(pear.first, pear.second);
+        // pear is a copy already, there is no need to copy its value again
+        return pushKVSwap(pear.first, pear.second);
     }
     friend const UniValue& find_value( const UniValue& obj, const std::string& name);
 };
@@ -10,6 +10,7 @@
 #include <limits>
 #include <sstream>
 #include <stdexcept>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -28,6 +29,28 @@ static bool ParsePrechecks(const std::string& str)
     return true;
 }
 
+/** Parse the plain integers that make up most numbers without strtoll;
+ * returns false for anything else, which is left to the full parsers. */
+static bool ParseSimpleInt64(const std::string& str, int64_t *out)
+{
+    const char *p = str.c_str();
+    const char *end = p + str.size();
+    bool fNegative = (p != end && *p == '-');
+    if (fNegative)
+        p++;
+    // 18 digits cannot overflow an int64_t
+    if (p == end || end - p > 18)
+        return false;
+    int64_t n = 0;
+    for (; p != end; p++) {
+        if (*p < '0' || *p > '9')
+            return false;
+        n = n * 10 + (*p - '0');
+    }
+    *out = fNegative ? -n : n;
+    return true;
+}
+
 bool ParseInt32(const std::string& str, int32_t *out)
 {
     if (!ParsePrechecks(str))
@@ -78,12 +101,25 @@ using namespace std;
 
 const UniValue NullUniValue;
 
+/** Objects with fewer keys are searched linearly */
+static const size_t KEY_INDEX_MIN_SIZE = 16;
+
 void UniValue::clear()
 {
     typ = VNULL;
     val.clear();
     keys.clear();
     values.clear();
+    keyIndex.clear();
+}
+
+void UniValue::swap(UniValue& other)
+{
+    std::swap(typ, other.typ);
+    val.swap(other.val);
+    keys.swap(other.keys);
+    values.swap(other.values);
+    keyIndex.swap(other.keyIndex);
 }
 
 bool UniValue::setNull()
@@ -120,24 +156,26 @@ bool UniValue::setNumStr(const string& val_)
     return true;
 }
 
-bool UniValue::setInt(uint64_t val)
+bool UniValue::setInt(uint64_t val_)
 {
-    string s;
-    ostringstream oss;
-
-    oss << val;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)val_);
 
-    return setNumStr(oss.str());
+    clear();
+    typ = VNUM;
+    val = buf;
+    return true;
 }
 
-bool UniValue::setInt(int64_t val)
+bool UniValue::setInt(int64_t val_)
 {
-    string s;
-    ostringstream oss;
-
-    oss << val;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", (long long)val_);
 
-    return setNumStr(oss.str());
+    clear();
+    typ = VNUM;
+    val = buf;
+    return true;
 }
 
 bool UniValue::setFloat(double val)
@@ -193,31 +231,109 @@ bool UniValue::push_backV(const std::vector<UniValue>& vec)
     return true;
 }
 
+bool UniValue::push_backSwap(UniValue& val)
+{
+    if (typ != VARR)
+        return false;
+
+    values.push_back(UniValue());
+    values.back().swap(val);
+    return true;
+}
+
 bool UniValue::pushKV(const std::string& key, const UniValue& val)
 {
     if (typ != VOBJ)
         return false;
 
-    keys.push_back(key);
+    pushKey(key);
     values.push_back(val);
     return true;
 }
 
+bool UniValue::pushKVSwap(const std::string& key, UniValue& val)
+{
+    if (typ != VOBJ)
+        return false;
+
+    pushKey(key);
+    values.push_back(UniValue());
+    values.back().swap(val);
+    return true;
+}
+
 bool UniValue::pushKVs(const UniValue& obj)
 {
     if (typ != VOBJ || obj.typ != VOBJ)
         return false;
 
     for (unsigned int i = 0; i < obj.keys.size(); i++) {
-        keys.push_back(obj.keys[i]);
+        pushKey(obj.keys[i]);
         values.push_back(obj.values[i]);
     }
 
     return true;
 }
 
+static inline uint32_t HashKey(const std::string& key)
+{
+    // FNV-1a
+    uint32_t h = 2166136261U;
+    for (std::string::const_iterator it = key.begin(); it != key.end(); ++it)
+        h = (h ^ (unsigned char)*it) * 16777619U;
+    return h;
+}
+
+void UniValue::pushKey(const std::string& key)
+{
+    keys.push_back(key);
+    indexKey(keys.size() - 1);
+}
+
+/** Add keys[pos] to the index, building or growing it as needed. Like the
+ * linear search, the index finds the first of duplicate keys. */
+void UniValue::indexKey(size_t pos)
+{
+    if (keys.size() < KEY_INDEX_MIN_SIZE)
+        return;
+    // Keep the table at most half full
+    if (keyIndex.size() < keys.size() * 2) {
+        rebuildKeyIndex();
+        return;
+    }
+
+    size_t mask = keyIndex.size() - 1;
+    for (size_t i = HashKey(keys[pos]) & mask; ; i = (i + 1) & mask) {
+        if (keyIndex[i] == 0) {
+            keyIndex[i] = pos + 1;
+            return;
+        }
+        if (keys[keyIndex[i] - 1] == keys[pos])
+            return;
+    }
+}
+
+void UniValue::rebuildKeyIndex()
+{
+    size_t nSize = 64;
+    while (nSize < keys.size() * 4)
+        nSize *= 2;
+    keyIndex.assign(nSize, 0);
+    for (size_t pos = 0; pos < keys.size(); pos++)
+        indexKey(pos);
+}
+
 int UniValue::findKey(const std::string& key) const
 {
+    if (!keyIndex.empty()) {
+        size_t mask = keyIndex.size() - 1;
+        for (size_t i = HashKey(key) & mask; keyIndex[i] != 0; i = (i + 1) & mask) {
+            if (keys[keyIndex[i] - 1] == key)
+                return (int) keyIndex[i] - 1;
+        }
+        return -1;
+    }
+
     for (unsigned int i = 0; i < keys.size(); i++) {
         if (keys[i] == key)
             return (int) i;
@@ -280,15 +396,11 @@ const char *uvTypeName(UniValue::VType t)
 
 const UniValue& find_value( const UniValue& obj, const std::string& name)
 {
-    for (unsigned int i = 0; i < obj.keys.size(); i++)
-    {
-        if( obj.keys[i] == name )
-        {
-            return obj.values[i];
-        }
-    }
+    int index = obj.findKey(name);
+    if (index < 0)
+        return NullUniValue;
 
-    return NullUniValue;
+    return obj.values[index];
 }
 
 std::vector<std::string> UniValue::getKeys() const
@@ -323,6 +435,10 @@ int UniValue::get_int() const
 {
     if (typ != VNUM)
         throw std::runtime_error("JSON value is not an integer as expected");
+    int64_t simple;
+    if (ParseSimpleInt64(getValStr(), &simple) &&
+        simple >= std::numeric_limits<int32_t>::min() && simple <= std::numeric_limits<int32_t>::max())
+        return (int) simple;
     int32_t retval;
     if (!ParseInt32(getValStr(), &retval))
         throw std::runtime_error("JSON integer out of range");
@@ -334,6 +450,8 @@ int64_t UniValue::get_int64() const
     if (typ != VNUM)
         throw std::runtime_error("JSON value is not an integer as expected");
     int64_t retval;
+    if (ParseSimpleInt64(getValStr(), &retval))
+        return retval;
     if (!ParseInt64(getValStr(), &retval))
         throw std::runtime_error("JSON integer out of range");
     return retval;
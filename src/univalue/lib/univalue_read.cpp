@@ -9,6 +9,18 @@
 
 using namespace std;
 
+// Locale-independent versions of isdigit() and isspace(), which are called
+// for every character
+static inline bool json_isdigit(char ch)
+{
+    return ch >= '0' && ch <= '9';
+}
+
+static inline bool json_isspace(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\f' || ch == '\v';
+}
+
 // convert hexadecimal string to unsigned integer
 static const char *hatoui(const char *first, const char *last,
                           unsigned int& out)
@@ -17,7 +29,7 @@ static const char *hatoui(const char *first, const char *last,
     for (; first != last; ++first)
     {
         int digit;
-        if (isdigit(*first))
+        if (json_isdigit(*first))
             digit = *first - '0';
 
         else if (*first >= 'a' && *first <= 'f')
@@ -44,7 +56,7 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
 
     const char *rawStart = raw;
 
-    while ((*raw) && (isspace(*raw)))             // skip whitespace
+    while ((*raw) && (json_isspace(*raw)))        // skip whitespace
         raw++;
 
     switch (*raw) {
@@ -108,59 +120,47 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
     case '8':
     case '9': {
         // part 1: int
-        string numStr;
-
         const char *first = raw;
 
         const char *firstDigit = first;
-        if (!isdigit(*firstDigit))
+        if (!json_isdigit(*firstDigit))
             firstDigit++;
-        if ((*firstDigit == '0') && isdigit(firstDigit[1]))
+        if ((*firstDigit == '0') && json_isdigit(firstDigit[1]))
             return JTOK_ERR;
 
-        numStr += *raw;                       // copy first char
-        raw++;
+        raw++;                                // skip first char
 
-        if ((*first == '-') && (!isdigit(*raw)))
+        if ((*first == '-') && (!json_isdigit(*raw)))
             return JTOK_ERR;
 
-        while ((*raw) && isdigit(*raw)) {     // copy digits
-            numStr += *raw;
+        while (json_isdigit(*raw))            // skip digits
             raw++;
-        }
 
         // part 2: frac
         if (*raw == '.') {
-            numStr += *raw;                   // copy .
-            raw++;
+            raw++;                            // skip .
 
-            if (!isdigit(*raw))
+            if (!json_isdigit(*raw))
                 return JTOK_ERR;
-            while ((*raw) && isdigit(*raw)) { // copy digits
-                numStr += *raw;
+            while (json_isdigit(*raw))        // skip digits
                 raw++;
-            }
         }
 
         // part 3: exp
         if (*raw == 'e' || *raw == 'E') {
-            numStr += *raw;                   // copy E
-            raw++;
+            raw++;                            // skip E
 
-            if (*raw == '-' || *raw == '+') { // copy +/-
-                numStr += *raw;
+            if (*raw == '-' || *raw == '+')   // skip +/-
                 raw++;
-            }
 
-            if (!isdigit(*raw))
+            if (!json_isdigit(*raw))
                 return JTOK_ERR;
-            while ((*raw) && isdigit(*raw)) { // copy digits
-                numStr += *raw;
+            while (json_isdigit(*raw))        // skip digits
                 raw++;
-            }
         }
 
-        tokenVal = numStr;
+        // copy the whole number at once
+        tokenVal.assign(first, raw);
         consumed = (raw - rawStart);
         return JTOK_NUMBER;
         }
@@ -168,10 +168,19 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
     case '"': {
         raw++;                                // skip "
 
-        string valStr;
+        string& valStr = tokenVal;
 
         while (*raw) {
-            if (*raw < 0x20)
+            // copy runs of plain characters at once
+            const char *plain = raw;
+            while (*raw >= 0x20 && *raw != '\\' && *raw != '"')
+                raw++;
+            valStr.append(plain, raw);
+
+            if (*raw == 0)
+                break;
+
+            else if (*raw < 0x20)
                 return JTOK_ERR;
 
             else if (*raw == '\\') {
@@ -215,18 +224,12 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
                 raw++;                        // skip esc'd char
             }
 
-            else if (*raw == '"') {
+            else {
                 raw++;                        // skip "
                 break;                        // stop scanning
             }
-
-            else {
-                valStr += *raw;
-                raw++;
-            }
         }
 
-        tokenVal = valStr;
         consumed = (raw - rawStart);
         return JTOK_STRING;
         }
@@ -268,9 +271,8 @@ bool UniValue::read(const char *raw)
                     setArray();
                 stack.push_back(this);
             } else {
-                UniValue tmpVal(utyp);
                 UniValue *top = stack.back();
-                top->values.push_back(tmpVal);
+                top->values.push_back(UniValue(utyp));
 
                 UniValue *newTop = &(top->values.back());
                 stack.push_back(newTop);
@@ -349,9 +351,9 @@ bool UniValue::read(const char *raw)
             if (!stack.size() || expectName || expectColon)
                 return false;
 
-            UniValue tmpVal(VNUM, tokenVal);
             UniValue *top = stack.back();
-            top->values.push_back(tmpVal);
+            top->values.push_back(UniValue(VNUM));
+            top->values.back().val.swap(tokenVal);
 
             break;
             }
@@ -363,12 +365,12 @@ bool UniValue::read(const char *raw)
             UniValue *top = stack.back();
 
             if (expectName) {
-                top->keys.push_back(tokenVal);
+                top->pushKey(tokenVal);
                 expectName = false;
                 expectColon = true;
             } else {
-                UniValue tmpVal(VSTR, tokenVal);
-                top->values.push_back(tmpVal);
+                top->values.push_back(UniValue(VSTR));
+                top->values.back().val.swap(tokenVal);
             }
 
             break;
@@ -5,6 +5,20 @@
 
 #include "validationinterface.h"
 
+#include "consensus/validation.h"
+#include "primitives/block.h"
+#include "uint256.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
 static CMainSignals g_signals;
 
 CMainSignals& GetMainSignals()
@@ -12,9 +26,307 @@ CMainSignals& GetMainSignals()
     return g_signals;
 }
 
-void RegisterValidationInterface(CValidationInterface* pwalletIn) {
+/**
+ * Ordered queue of notifications for the asynchronous listeners. The slots
+ * connected to g_signals only copy what a notification refers to (blocks and
+ * transactions once, into refcounted objects shared by all listeners) and
+ * queue it, so validation does not wait for the listeners themselves.
+ */
+class CValidationQueue
+{
+private:
+    typedef boost::function<void (CValidationInterface*)> Notification;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<std::pair<int64_t, Notification> > queue;
+    std::vector<CValidationInterface*> vListeners;
+    bool fDelivering;
+    bool fConnected;
+
+    // The block of the last notification, which is usually also the block of
+    // the next one (all transactions of a connected block are synced in turn)
+    const CBlock* pblockLast;
+    uint256 hashBlockLast;
+    boost::shared_ptr<const CBlock> blockLast;
+
+    size_t nMaxSize;
+    size_t nPeakSize;
+    uint64_t nQueued;
+    uint64_t nDropped;
+    int64_t nWaitMicros;
+
+    boost::shared_ptr<const CBlock> ShareBlock(const CBlock* pblock)
+    {
+        if (!pblock)
+            return boost::shared_ptr<const CBlock>();
+        const uint256 hash = pblock->GetHash();
+        if (pblock != pblockLast || hash != hashBlockLast) {
+            blockLast.reset(new CBlock(*pblock));
+            pblockLast = pblock;
+            hashBlockLast = hash;
+        }
+        return blockLast;
+    }
+
+    // Block connections, disconnections and tip updates are queued even
+    // when the queue is full: a listener that missed one would go on with a
+    // wrong tip. They come at the pace of blocks, so the queue only grows by
+    // a few while full.
+    void Push(boost::unique_lock<boost::mutex>& lock, const Notification& notification, bool fKeep = false)
+    {
+        if (vListeners.empty())
+            return;
+        if (queue.size() >= nMaxSize && !fKeep) {
+            // The caller usually holds cs_main, so it must not wait for the
+            // listeners; a listener that falls this far behind misses events.
+            nDropped++;
+            return;
+        }
+        queue.push_back(std::make_pair(GetTimeMicros(), notification));
+        nQueued++;
+        nPeakSize = std::max(nPeakSize, queue.size());
+        cond.notify_all();
+    }
+
+    void Push(const Notification& notification, bool fKeep = false)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        Push(lock, notification, fKeep);
+    }
+
+    static void CallSyncTransaction(CValidationInterface* pvi, const boost::shared_ptr<const CTransaction>& tx)
+    {
+        pvi->SyncTransaction(*tx, NULL);
+    }
+
+    static void CallSyncTransactionInBlock(CValidationInterface* pvi, const boost::shared_ptr<const CBlock>& block, size_t nTx)
+    {
+        pvi->SyncTransaction(block->vtx[nTx], block.get());
+    }
+
+    static void CallBlockConnected(CValidationInterface* pvi, const boost::shared_ptr<const CBlock>& block, const CBlockIndex* pindex)
+    {
+        pvi->BlockConnected(*block, pindex);
+    }
+
+    static void CallBlockDisconnected(CValidationInterface* pvi, const boost::shared_ptr<const CBlock>& block)
+    {
+        pvi->BlockDisconnected(*block);
+    }
+
+    static void CallTransactionAddedToMempool(CValidationInterface* pvi, const boost::shared_ptr<const CTransaction>& tx, uint64_t nMempoolSequence)
+    {
+        pvi->TransactionAddedToMempool(*tx, nMempoolSequence);
+    }
+
+    static void CallTransactionRemovedFromMempool(CValidationInterface* pvi, const boost::shared_ptr<const CTransaction>& tx, MemPoolRemovalReason reason, uint64_t nMempoolSequence)
+    {
+        pvi->TransactionRemovedFromMempool(*tx, reason, nMempoolSequence);
+    }
+
+    static void CallBlockChecked(CValidationInterface* pvi, const boost::shared_ptr<const CBlock>& block, const CValidationState& state)
+    {
+        pvi->BlockChecked(*block, state);
+    }
+
+    void DoneDelivering()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fDelivering = false;
+        }
+        cond.notify_all();
+    }
+
+    // Slots connected to g_signals
+    void UpdatedBlockTip(const CBlockIndex* pindex)
+    {
+        Push(boost::bind(&CValidationInterface::UpdatedBlockTip, _1, pindex), true);
+    }
+
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+    {
+        // A transaction of a block is delivered as an index into the shared copy of the block
+        if (pblock && !pblock->vtx.empty() && &tx >= &pblock->vtx.front() && &tx <= &pblock->vtx.back()) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            Push(lock, boost::bind(&CallSyncTransactionInBlock, _1, ShareBlock(pblock), (size_t)(&tx - &pblock->vtx.front())));
+            return;
+        }
+        boost::shared_ptr<const CTransaction> txShared(new CTransaction(tx));
+        Push(boost::bind(&CallSyncTransaction, _1, txShared));
+    }
+
+    void BlockConnected(const CBlock& block, const CBlockIndex* pindex)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        Push(lock, boost::bind(&CallBlockConnected, _1, ShareBlock(&block), pindex), true);
+    }
+
+    void BlockDisconnected(const CBlock& block)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        Push(lock, boost::bind(&CallBlockDisconnected, _1, ShareBlock(&block)), true);
+    }
+
+    void TransactionAddedToMempool(const CTransaction& tx, uint64_t nMempoolSequence)
+    {
+        boost::shared_ptr<const CTransaction> txShared(new CTransaction(tx));
+        Push(boost::bind(&CallTransactionAddedToMempool, _1, txShared, nMempoolSequence));
+    }
+
+    void TransactionRemovedFromMempool(const CTransaction& tx, MemPoolRemovalReason reason, uint64_t nMempoolSequence)
+    {
+        boost::shared_ptr<const CTransaction> txShared(new CTransaction(tx));
+        Push(boost::bind(&CallTransactionRemovedFromMempool, _1, txShared, reason, nMempoolSequence));
+    }
+
+    void SetBestChain(const CBlockLocator& locator)
+    {
+        Push(boost::bind(&CValidationInterface::SetBestChain, _1, locator));
+    }
+
+    void UpdatedTransaction(const uint256& hash)
+    {
+        Push(boost::bind(&CValidationInterface::UpdatedTransaction, _1, hash));
+    }
+
+    void Inventory(const uint256& hash)
+    {
+        Push(boost::bind(&CValidationInterface::Inventory, _1, hash));
+    }
+
+    void ResendWalletTransactions(int64_t nBestBlockTime)
+    {
+        Push(boost::bind(&CValidationInterface::ResendWalletTransactions, _1, nBestBlockTime));
+    }
+
+    void BlockChecked(const CBlock& block, const CValidationState& state)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        Push(lock, boost::bind(&CallBlockChecked, _1, ShareBlock(&block), state));
+    }
+
+    void ResetRequestCount(const uint256& hash)
+    {
+        Push(boost::bind(&CValidationInterface::ResetRequestCount, _1, hash));
+    }
+
+public:
+    CValidationQueue() : fDelivering(false), fConnected(false), pblockLast(NULL),
+        nMaxSize(DEFAULT_VALIDATION_QUEUE_SIZE), nPeakSize(0), nQueued(0), nDropped(0), nWaitMicros(0) {}
+
+    void Register(CValidationInterface* pvi)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        vListeners.push_back(pvi);
+        if (!fConnected) {
+            g_signals.UpdatedBlockTip.connect(boost::bind(&CValidationQueue::UpdatedBlockTip, this, _1));
+            g_signals.SyncTransaction.connect(boost::bind(&CValidationQueue::SyncTransaction, this, _1, _2));
+            g_signals.BlockConnected.connect(boost::bind(&CValidationQueue::BlockConnected, this, _1, _2));
+            g_signals.BlockDisconnected.connect(boost::bind(&CValidationQueue::BlockDisconnected, this, _1));
+            g_signals.TransactionAddedToMempool.connect(boost::bind(&CValidationQueue::TransactionAddedToMempool, this, _1, _2));
+            g_signals.TransactionRemovedFromMempool.connect(boost::bind(&CValidationQueue::TransactionRemovedFromMempool, this, _1, _2, _3));
+            g_signals.UpdatedTransaction.connect(boost::bind(&CValidationQueue::UpdatedTransaction, this, _1));
+            g_signals.SetBestChain.connect(boost::bind(&CValidationQueue::SetBestChain, this, _1));
+            g_signals.Inventory.connect(boost::bind(&CValidationQueue::Inventory, this, _1));
+            g_signals.Broadcast.connect(boost::bind(&CValidationQueue::ResendWalletTransactions, this, _1));
+            g_signals.BlockChecked.connect(boost::bind(&CValidationQueue::BlockChecked, this, _1, _2));
+            g_signals.BlockFound.connect(boost::bind(&CValidationQueue::ResetRequestCount, this, _1));
+            fConnected = true;
+        }
+    }
+
+    void Unregister(CValidationInterface* pvi)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        // The listener may be deleted right after this returns
+        while (fDelivering)
+            cond.wait(lock);
+        vListeners.erase(std::remove(vListeners.begin(), vListeners.end(), pvi), vListeners.end());
+        if (vListeners.empty())
+            queue.clear();
+    }
+
+    void UnregisterAll()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fDelivering)
+            cond.wait(lock);
+        vListeners.clear();
+        queue.clear();
+        // disconnect_all_slots() on g_signals removed our slots as well
+        fConnected = false;
+    }
+
+    void SetMaxSize(size_t nMaxSizeIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nMaxSize = std::max<size_t>(nMaxSizeIn, 1);
+    }
+
+    void Thread()
+    {
+        while (true) {
+            Notification notification;
+            std::vector<CValidationInterface*> vListenersCopy;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.empty())
+                    cond.wait(lock);
+                nWaitMicros += GetTimeMicros() - queue.front().first;
+                notification.swap(queue.front().second);
+                queue.pop_front();
+                vListenersCopy = vListeners;
+                fDelivering = true;
+            }
+            cond.notify_all();
+
+            try {
+                BOOST_FOREACH(CValidationInterface* pvi, vListenersCopy)
+                    notification(pvi);
+            } catch (...) {
+                DoneDelivering();
+                throw;
+            }
+            DoneDelivering();
+        }
+    }
+
+    void Sync()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!queue.empty() || fDelivering)
+            cond.wait(lock);
+    }
+
+    void GetStats(CValidationQueueStats& stats)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        stats.nListeners = vListeners.size();
+        stats.nSize = queue.size();
+        stats.nMaxSize = nMaxSize;
+        stats.nPeakSize = nPeakSize;
+        stats.nQueued = nQueued;
+        stats.nDropped = nDropped;
+        stats.nWaitMicros = nWaitMicros;
+    }
+};
+
+static CValidationQueue g_queue;
+
+void RegisterValidationInterface(CValidationInterface* pwalletIn, bool fAsync) {
+    if (fAsync) {
+        g_signals.ScriptForMining.connect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
+        g_queue.Register(pwalletIn);
+        return;
+    }
     g_signals.UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
     g_signals.SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
+    g_signals.BlockConnected.connect(boost::bind(&CValidationInterface::BlockConnected, pwalletIn, _1, _2));
+    g_signals.BlockDisconnected.connect(boost::bind(&CValidationInterface::BlockDisconnected, pwalletIn, _1));
+    g_signals.TransactionAddedToMempool.connect(boost::bind(&CValidationInterface::TransactionAddedToMempool, pwalletIn, _1, _2));
+    g_signals.TransactionRemovedFromMempool.connect(boost::bind(&CValidationInterface::TransactionRemovedFromMempool, pwalletIn, _1, _2, _3));
     g_signals.UpdatedTransaction.connect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.SetBestChain.connect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
     g_signals.Inventory.connect(boost::bind(&CValidationInterface::Inventory, pwalletIn, _1));
@@ -25,6 +337,7 @@ void RegisterValidationInterface(CValidationInterface* pwalletIn) {
 }
 
 void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
+    g_queue.Unregister(pwalletIn);
     g_signals.BlockFound.disconnect(boost::bind(&CValidationInterface::ResetRequestCount, pwalletIn, _1));
     g_signals.ScriptForMining.disconnect(boost::bind(&CValidationInterface::GetScriptForMining, pwalletIn, _1));
     g_signals.BlockChecked.disconnect(boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2));
@@ -32,6 +345,10 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
     g_signals.Inventory.disconnect(boost::bind(&CValidationInterface::Inventory, pwalletIn, _1));
     g_signals.SetBestChain.disconnect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
     g_signals.UpdatedTransaction.disconnect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
+    g_signals.TransactionRemovedFromMempool.disconnect(boost::bind(&CValidationInterface::TransactionRemovedFromMempool, pwalletIn, _1, _2, _3));
+    g_signals.TransactionAddedToMempool.disconnect(boost::bind(&CValidationInterface::TransactionAddedToMempool, pwalletIn, _1, _2));
+    g_signals.BlockDisconnected.disconnect(boost::bind(&CValidationInterface::BlockDisconnected, pwalletIn, _1));
+    g_signals.BlockConnected.disconnect(boost::bind(&CValidationInterface::BlockConnected, pwalletIn, _1, _2));
     g_signals.SyncTransaction.disconnect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
     g_signals.UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
 }
@@ -44,10 +361,41 @@ void UnregisterAllValidationInterfaces() {
     g_signals.Inventory.disconnect_all_slots();
     g_signals.SetBestChain.disconnect_all_slots();
     g_signals.UpdatedTransaction.disconnect_all_slots();
+    g_signals.TransactionRemovedFromMempool.disconnect_all_slots();
+    g_signals.TransactionAddedToMempool.disconnect_all_slots();
+    g_signals.BlockDisconnected.disconnect_all_slots();
+    g_signals.BlockConnected.disconnect_all_slots();
     g_signals.SyncTransaction.disconnect_all_slots();
     g_signals.UpdatedBlockTip.disconnect_all_slots();
+    g_queue.UnregisterAll();
 }
 
 void SyncWithWallets(const CTransaction &tx, const CBlock *pblock) {
     g_signals.SyncTransaction(tx, pblock);
 }
+
+void RegisterMempoolSignals(CTxMemPool& pool) {
+    pool.NotifyEntryAdded.connect(boost::bind(boost::ref(g_signals.TransactionAddedToMempool), _1, _2));
+    pool.NotifyEntryRemoved.connect(boost::bind(boost::ref(g_signals.TransactionRemovedFromMempool), _1, _2, _3));
+}
+
+void UnregisterMempoolSignals(CTxMemPool& pool) {
+    pool.NotifyEntryAdded.disconnect_all_slots();
+    pool.NotifyEntryRemoved.disconnect_all_slots();
+}
+
+void SetValidationQueueSize(size_t nMaxSize) {
+    g_queue.SetMaxSize(nMaxSize);
+}
+
+void ThreadValidationQueue() {
+    g_queue.Thread();
+}
+
+void SyncWithValidationQueue() {
+    g_queue.Sync();
+}
+
+void GetValidationQueueStats(CValidationQueueStats& stats) {
+    g_queue.GetStats(stats);
+}
@@ -6,6 +6,10 @@
 #ifndef BITCOIN_VALIDATIONINTERFACE_H
 #define BITCOIN_VALIDATIONINTERFACE_H
 
+#include "txmempool.h"
+
+#include <stdint.h>
+
 #include <boost/signals2/signal.hpp>
 #include <boost/shared_ptr.hpp>
 
@@ -15,24 +19,64 @@ class CBlockIndex;
 class CReserveScript;
 class CTransaction;
 class CValidationInterface;
+class CValidationQueue;
 class CValidationState;
 class uint256;
 
+/** Default for -validationqueuesize, the notifications queued for asynchronous listeners */
+static const unsigned int DEFAULT_VALIDATION_QUEUE_SIZE = 1000;
+
 // These functions dispatch to one or all registered wallets
 
-/** Register a wallet to receive updates from core */
-void RegisterValidationInterface(CValidationInterface* pwalletIn);
+/**
+ * Register a wallet to receive updates from core. Asynchronous listeners are
+ * not called from the validation code itself, but in order from the thread
+ * running ThreadValidationQueue(), with copies of the blocks and transactions
+ * that are shared between them. Only GetScriptForMining stays synchronous.
+ */
+void RegisterValidationInterface(CValidationInterface* pwalletIn, bool fAsync = false);
 /** Unregister a wallet from core */
 void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 /** Unregister all wallets from core */
 void UnregisterAllValidationInterfaces();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL);
+/** Forward a mempool's additions and removals to the registered wallets */
+void RegisterMempoolSignals(CTxMemPool& pool);
+void UnregisterMempoolSignals(CTxMemPool& pool);
+
+/**
+ * Limit the number of notifications queued for asynchronous listeners;
+ * further ones are dropped, except for block connections, disconnections and
+ * tip updates
+ */
+void SetValidationQueueSize(size_t nMaxSize);
+/** Deliver queued notifications to asynchronous listeners; runs until interrupted */
+void ThreadValidationQueue();
+/** Wait until all notifications queued so far have been delivered */
+void SyncWithValidationQueue();
+
+struct CValidationQueueStats
+{
+    size_t nListeners;
+    size_t nSize;
+    size_t nMaxSize;
+    size_t nPeakSize;
+    uint64_t nQueued;
+    uint64_t nDropped;
+    int64_t nWaitMicros;
+};
+
+void GetValidationQueueStats(CValidationQueueStats& stats);
 
 class CValidationInterface {
 protected:
     virtual void UpdatedBlockTip(const CBlockIndex *pindex) {}
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock) {}
+    virtual void BlockConnected(const CBlock &block, const CBlockIndex *pindex) {}
+    virtual void BlockDisconnected(const CBlock &block) {}
+    virtual void TransactionAddedToMempool(const CTransaction &tx, uint64_t nMempoolSequence) {}
+    virtual void TransactionRemovedFromMempool(const CTransaction &tx, MemPoolRemovalReason reason, uint64_t nMempoolSequence) {}
     virtual void SetBestChain(const CBlockLocator &locator) {}
     virtual void UpdatedTransaction(const uint256 &hash) {}
     virtual void Inventory(const uint256 &hash) {}
@@ -40,9 +84,10 @@ protected:
     virtual void BlockChecked(const CBlock&, const CValidationState&) {}
     virtual void GetScriptForMining(boost::shared_ptr<CReserveScript>&) {};
     virtual void ResetRequestCount(const uint256 &hash) {};
-    friend void ::RegisterValidationInterface(CValidationInterface*);
+    friend void ::RegisterValidationInterface(CValidationInterface*, bool);
     friend void ::UnregisterValidationInterface(CValidationInterface*);
     friend void ::UnregisterAllValidationInterfaces();
+    friend class ::CValidationQueue;
 };
 
 struct CMainSignals {
@@ -50,6 +95,14 @@ struct CMainSignals {
     boost::signals2::signal<void (const CBlockIndex *)> UpdatedBlockTip;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void (const CTransaction &, const CBlock *)> SyncTransaction;
+    /** Notifies listeners of a block connected to the active chain, after its transactions were synced. */
+    boost::signals2::signal<void (const CBlock &, const CBlockIndex *)> BlockConnected;
+    /** Notifies listeners of a block disconnected from the active chain, after its transactions were synced. */
+    boost::signals2::signal<void (const CBlock &)> BlockDisconnected;
+    /** Notifies listeners of a transaction entering the mempool, with the mempool's sequence number. */
+    boost::signals2::signal<void (const CTransaction &, uint64_t)> TransactionAddedToMempool;
+    /** Notifies listeners of a transaction leaving the mempool, with the reason and the mempool's sequence number. */
+    boost::signals2::signal<void (const CTransaction &, MemPoolRemovalReason, uint64_t)> TransactionRemovedFromMempool;
     /** Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible). */
     boost::signals2::signal<void (const uint256 &)> UpdatedTransaction;
     /** Notifies listeners of a new active block chain. */
@@ -9,7 +9,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 110000;
+static const int PROTOCOL_VERSION = 110002;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -42,4 +42,10 @@ static const int NO_BLOOM_VERSION = 70011;
 //! Version when we switched to a size-based "headers" limit.
 static const int SIZE_HEADERS_LIMIT_VERSION = 110000;
 
+//! "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" (compact block relay) start with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 110001;
+
+//! "sendheaders" command and announcing blocks with headers starts with this version
+static const int SENDHEADERS_VERSION = 110002;
+
 #endif // BITCOIN_VERSION_H
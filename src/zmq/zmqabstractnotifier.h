@@ -7,15 +7,24 @@
 
 #include "zmqconfig.h"
 
+#include "sync.h"
+#include "txmempool.h"
+
+#include <stdint.h>
+
 class CBlockIndex;
+class CDataStream;
 class CZMQAbstractNotifier;
 
+/** Default number of messages a publisher queues per subscriber before dropping */
+static const int DEFAULT_ZMQ_SNDHWM = 1000;
+
 typedef CZMQAbstractNotifier* (*CZMQNotifierFactory)();
 
 class CZMQAbstractNotifier
 {
 public:
-    CZMQAbstractNotifier() : psocket(0) { }
+    CZMQAbstractNotifier() : psocket(0), outbound_message_high_water_mark(DEFAULT_ZMQ_SNDHWM), nPublished(0) { }
     virtual ~CZMQAbstractNotifier();
 
     template <typename T>
@@ -28,17 +37,32 @@ public:
     void SetType(const std::string &t) { type = t; }
     std::string GetAddress() const { return address; }
     void SetAddress(const std::string &a) { address = a; }
+    int GetOutboundMessageHighWaterMark() const { return outbound_message_high_water_mark; }
+    void SetOutboundMessageHighWaterMark(int hwm) { if (hwm >= 0) outbound_message_high_water_mark = hwm; }
+    uint64_t GetPublishedCount() const;
 
     virtual bool Initialize(void *pcontext) = 0;
     virtual void Shutdown() = 0;
 
-    virtual bool NotifyBlock(const CBlockIndex *pindex);
+    /**
+     * Notify about a new tip. pblockData is the block serialized for the
+     * network if the caller has it at hand, or NULL.
+     */
+    virtual bool NotifyBlock(const CBlockIndex *pindex, const CDataStream *pblockData);
     virtual bool NotifyTransaction(const CTransaction &transaction);
+    virtual bool NotifyBlockConnect(const CBlock &block, const CBlockIndex *pindex);
+    virtual bool NotifyBlockDisconnect(const CBlock &block);
+    virtual bool NotifyTransactionAcceptance(const CTransaction &transaction, uint64_t nMempoolSequence);
+    virtual bool NotifyTransactionRemoval(const CTransaction &transaction, MemPoolRemovalReason reason, uint64_t nMempoolSequence);
 
 protected:
     void *psocket;
     std::string type;
     std::string address;
+    int outbound_message_high_water_mark;
+    // Written by the notifying thread, read by getzmqnotifications
+    mutable CCriticalSection cs_stats;
+    uint64_t nPublished;
 };
 
 #endif // BITCOIN_ZMQ_ZMQABSTRACTNOTIFIER_H
@@ -9,13 +9,18 @@
 #include "main.h"
 #include "streams.h"
 #include "util.h"
+#include "utilstrencodings.h"
+
+#include <boost/bind.hpp>
 
 void zmqError(const char *str)
 {
     LogPrint("zmq", "zmq: Error: %s, errno=%s\n", str, zmq_strerror(errno));
 }
 
-CZMQNotificationInterface::CZMQNotificationInterface() : pcontext(NULL)
+CZMQNotificationInterface* g_zmq_notification_interface = NULL;
+
+CZMQNotificationInterface::CZMQNotificationInterface() : pcontext(NULL), fSerializeBlocks(false), blockData(SER_NETWORK, PROTOCOL_VERSION)
 {
 }
 
@@ -39,6 +44,8 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
     factories["pubhashtx"] = CZMQAbstractNotifier::Create<CZMQPublishHashTransactionNotifier>;
     factories["pubrawblock"] = CZMQAbstractNotifier::Create<CZMQPublishRawBlockNotifier>;
     factories["pubrawtx"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionNotifier>;
+    factories["pubsequence"] = CZMQAbstractNotifier::Create<CZMQPublishSequenceNotifier>;
+    factories["pubauxpow"] = CZMQAbstractNotifier::Create<CZMQPublishAuxpowNotifier>;
 
     for (std::map<std::string, CZMQNotifierFactory>::const_iterator i=factories.begin(); i!=factories.end(); ++i)
     {
@@ -50,6 +57,9 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
             CZMQAbstractNotifier *notifier = factory();
             notifier->SetType(i->first);
             notifier->SetAddress(address);
+            std::map<std::string, std::string>::const_iterator k = args.find("-zmqpubhwm");
+            if (k!=args.end())
+                notifier->SetOutboundMessageHighWaterMark(atoi(k->second));
             notifiers.push_back(notifier);
         }
     }
@@ -58,6 +68,7 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
     {
         notificationInterface = new CZMQNotificationInterface();
         notificationInterface->notifiers = notifiers;
+        notificationInterface->fSerializeBlocks = args.count("-zmqpubrawblock") > 0;
 
         if (!notificationInterface->Initialize())
         {
@@ -69,6 +80,15 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
     return notificationInterface;
 }
 
+std::list<const CZMQAbstractNotifier*> CZMQNotificationInterface::GetActiveNotifiers() const
+{
+    LOCK(cs_notifiers);
+    std::list<const CZMQAbstractNotifier*> result;
+    for (std::list<CZMQAbstractNotifier*>::const_iterator i = notifiers.begin(); i != notifiers.end(); ++i)
+        result.push_back(*i);
+    return result;
+}
+
 // Called at startup to conditionally set up ZMQ socket(s)
 bool CZMQNotificationInterface::Initialize()
 {
@@ -125,12 +145,13 @@ void CZMQNotificationInterface::Shutdown()
     }
 }
 
-void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex)
+void CZMQNotificationInterface::NotifyAll(const boost::function<bool (CZMQAbstractNotifier*)> &func)
 {
+    LOCK(cs_notifiers);
     for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
     {
         CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyBlock(pindex))
+        if (func(notifier))
         {
             i++;
         }
@@ -142,19 +163,45 @@ void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex)
     }
 }
 
+void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex)
+{
+    // The tip is normally the last block that was connected
+    const CDataStream *pblockData = NULL;
+    if (!blockData.empty() && hashBlockData == pindex->GetBlockHash())
+        pblockData = &blockData;
+
+    NotifyAll(boost::bind(&CZMQAbstractNotifier::NotifyBlock, _1, pindex, pblockData));
+}
+
 void CZMQNotificationInterface::SyncTransaction(const CTransaction &tx, const CBlock *pblock)
 {
-    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    NotifyAll(boost::bind(&CZMQAbstractNotifier::NotifyTransaction, _1, boost::cref(tx)));
+}
+
+void CZMQNotificationInterface::BlockConnected(const CBlock &block, const CBlockIndex *pindex)
+{
+    // Serialize the block once, from memory, for when it becomes the tip
+    if (fSerializeBlocks)
     {
-        CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyTransaction(tx))
-        {
-            i++;
-        }
-        else
-        {
-            notifier->Shutdown();
-            i = notifiers.erase(i);
-        }
+        blockData.clear();
+        blockData << block;
+        hashBlockData = block.GetHash();
     }
+
+    NotifyAll(boost::bind(&CZMQAbstractNotifier::NotifyBlockConnect, _1, boost::cref(block), pindex));
+}
+
+void CZMQNotificationInterface::BlockDisconnected(const CBlock &block)
+{
+    NotifyAll(boost::bind(&CZMQAbstractNotifier::NotifyBlockDisconnect, _1, boost::cref(block)));
+}
+
+void CZMQNotificationInterface::TransactionAddedToMempool(const CTransaction &tx, uint64_t nMempoolSequence)
+{
+    NotifyAll(boost::bind(&CZMQAbstractNotifier::NotifyTransactionAcceptance, _1, boost::cref(tx), nMempoolSequence));
+}
+
+void CZMQNotificationInterface::TransactionRemovedFromMempool(const CTransaction &tx, MemPoolRemovalReason reason, uint64_t nMempoolSequence)
+{
+    NotifyAll(boost::bind(&CZMQAbstractNotifier::NotifyTransactionRemoval, _1, boost::cref(tx), reason, nMempoolSequence));
 }
@@ -5,10 +5,16 @@
 #ifndef BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 #define BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 
+#include "streams.h"
+#include "sync.h"
+#include "uint256.h"
 #include "validationinterface.h"
+#include <list>
 #include <string>
 #include <map>
 
+#include <boost/function.hpp>
+
 class CBlockIndex;
 class CZMQAbstractNotifier;
 
@@ -19,6 +25,8 @@ public:
 
     static CZMQNotificationInterface* CreateWithArguments(const std::map<std::string, std::string> &args);
 
+    std::list<const CZMQAbstractNotifier*> GetActiveNotifiers() const;
+
 protected:
     bool Initialize();
     void Shutdown();
@@ -26,12 +34,29 @@ protected:
     // CValidationInterface
     void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
     void UpdatedBlockTip(const CBlockIndex *pindex);
+    void BlockConnected(const CBlock &block, const CBlockIndex *pindex);
+    void BlockDisconnected(const CBlock &block);
+    void TransactionAddedToMempool(const CTransaction &tx, uint64_t nMempoolSequence);
+    void TransactionRemovedFromMempool(const CTransaction &tx, MemPoolRemovalReason reason, uint64_t nMempoolSequence);
 
 private:
     CZMQNotificationInterface();
 
+    /** Call func on every notifier, shutting down those for which it fails */
+    void NotifyAll(const boost::function<bool (CZMQAbstractNotifier*)> &func);
+
     void *pcontext;
+    // Guards the list, which the notification thread prunes when a notifier fails
+    mutable CCriticalSection cs_notifiers;
     std::list<CZMQAbstractNotifier*> notifiers;
+
+    // Whether any notifier publishes whole blocks
+    bool fSerializeBlocks;
+    // The last block connected, serialized for publishing once it is the tip
+    uint256 hashBlockData;
+    CDataStream blockData;
 };
 
+extern CZMQNotificationInterface* g_zmq_notification_interface;
+
 #endif // BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
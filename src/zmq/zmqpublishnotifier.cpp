@@ -4,7 +4,9 @@
 
 #include "chainparams.h"
 #include "zmqpublishnotifier.h"
+#include "crypto/common.h"
 #include "main.h"
+#include "streams.h"
 #include "util.h"
 
 static std::multimap<std::string, CZMQAbstractPublishNotifier*> mapPublishNotifiers;
@@ -23,6 +25,7 @@ static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
         if (rc != 0)
         {
             zmqError("Unable to initialize ZMQ msg");
+            va_end(args);
             return -1;
         }
 
@@ -31,11 +34,14 @@ static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
 
         data = va_arg(args, const void*);
 
+        // A PUB socket never blocks: it drops the message for each
+        // subscriber at the high water mark and still delivers it to the others
         rc = zmq_msg_send(&msg, sock, data ? ZMQ_SNDMORE : 0);
         if (rc == -1)
         {
             zmqError("Unable to send ZMQ msg");
             zmq_msg_close(&msg);
+            va_end(args);
             return -1;
         }
 
@@ -46,6 +52,7 @@ static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
 
         size = va_arg(args, size_t);
     }
+    va_end(args);
     return 0;
 }
 
@@ -65,10 +72,21 @@ bool CZMQAbstractPublishNotifier::Initialize(void *pcontext)
             return false;
         }
 
-        int rc = zmq_bind(psocket, address.c_str());
+        LogPrint("zmq", "zmq: Outbound message high water mark for %s at %s is %d\n", type, address, outbound_message_high_water_mark);
+
+        int rc = zmq_setsockopt(psocket, ZMQ_SNDHWM, &outbound_message_high_water_mark, sizeof(outbound_message_high_water_mark));
+        if (rc != 0)
+        {
+            zmqError("Failed to set outbound message high water mark");
+            zmq_close(psocket);
+            return false;
+        }
+
+        rc = zmq_bind(psocket, address.c_str());
         if (rc!=0)
         {
             zmqError("Failed to bind address");
+            zmq_close(psocket);
             return false;
         }
 
@@ -117,15 +135,30 @@ void CZMQAbstractPublishNotifier::Shutdown()
     psocket = 0;
 }
 
-bool CZMQPublishHashBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
+bool CZMQAbstractPublishNotifier::SendMessage(const char *command, const void* data, size_t size)
+{
+    assert(psocket);
+
+    unsigned char msgseq[sizeof(uint32_t)];
+    WriteLE32(&msgseq[0], nSequence++);
+
+    int rc = zmq_send_multipart(psocket, command, strlen(command), data, size, msgseq, sizeof(msgseq), 0);
+    if (rc == -1)
+        return false;
+
+    LOCK(cs_stats);
+    nPublished++;
+    return true;
+}
+
+bool CZMQPublishHashBlockNotifier::NotifyBlock(const CBlockIndex *pindex, const CDataStream * /*pblockData*/)
 {
     uint256 hash = pindex->GetBlockHash();
     LogPrint("zmq", "zmq: Publish hashblock %s\n", hash.GetHex());
     char data[32];
     for (unsigned int i = 0; i < 32; i++)
         data[31 - i] = hash.begin()[i];
-    int rc = zmq_send_multipart(psocket, "hashblock", 9, data, 32, 0);
-    return rc == 0;
+    return SendMessage("hashblock", data, 32);
 }
 
 bool CZMQPublishHashTransactionNotifier::NotifyTransaction(const CTransaction &transaction)
@@ -135,14 +168,18 @@ bool CZMQPublishHashTransactionNotifier::NotifyTransaction(const CTransaction &t
     char data[32];
     for (unsigned int i = 0; i < 32; i++)
         data[31 - i] = hash.begin()[i];
-    int rc = zmq_send_multipart(psocket, "hashtx", 6, data, 32, 0);
-    return rc == 0;
+    return SendMessage("hashtx", data, 32);
 }
 
-bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
+bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex, const CDataStream *pblockData)
 {
     LogPrint("zmq", "zmq: Publish rawblock %s\n", pindex->GetBlockHash().GetHex());
 
+    if (pblockData)
+        return SendMessage("rawblock", &(*pblockData->begin()), pblockData->size());
+
+    // The tip was not connected in front of us (e.g. it was reached by
+    // disconnecting blocks), so read it back
     const Consensus::Params& consensusParams = Params().GetConsensus();
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
     {
@@ -157,8 +194,7 @@ bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
         ss << block;
     }
 
-    int rc = zmq_send_multipart(psocket, "rawblock", 8, &(*ss.begin()), ss.size(), 0);
-    return rc == 0;
+    return SendMessage("rawblock", &(*ss.begin()), ss.size());
 }
 
 bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &transaction)
@@ -167,6 +203,76 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     LogPrint("zmq", "zmq: Publish rawtx %s\n", hash.GetHex());
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
     ss << transaction;
-    int rc = zmq_send_multipart(psocket, "rawtx", 5, &(*ss.begin()), ss.size(), 0);
-    return rc == 0;
+    return SendMessage("rawtx", &(*ss.begin()), ss.size());
+}
+
+// Hashes are published in the byte order they are displayed in
+static void WriteHash(unsigned char *data, const uint256 &hash)
+{
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = hash.begin()[i];
+}
+
+bool CZMQPublishSequenceNotifier::NotifyBlockConnect(const CBlock &block, const CBlockIndex * /*pindex*/)
+{
+    uint256 hash = block.GetHash();
+    LogPrint("zmq", "zmq: Publish sequence block connect %s\n", hash.GetHex());
+    unsigned char data[32 + 1];
+    WriteHash(data, hash);
+    data[32] = 'C';
+    return SendMessage("sequence", data, sizeof(data));
+}
+
+bool CZMQPublishSequenceNotifier::NotifyBlockDisconnect(const CBlock &block)
+{
+    uint256 hash = block.GetHash();
+    LogPrint("zmq", "zmq: Publish sequence block disconnect %s\n", hash.GetHex());
+    unsigned char data[32 + 1];
+    WriteHash(data, hash);
+    data[32] = 'D';
+    return SendMessage("sequence", data, sizeof(data));
+}
+
+bool CZMQPublishSequenceNotifier::NotifyTransactionAcceptance(const CTransaction &transaction, uint64_t nMempoolSequence)
+{
+    uint256 hash = transaction.GetHash();
+    LogPrint("zmq", "zmq: Publish sequence mempool acceptance %s\n", hash.GetHex());
+    unsigned char data[32 + 1 + 8];
+    WriteHash(data, hash);
+    data[32] = 'A';
+    WriteLE64(&data[33], nMempoolSequence);
+    return SendMessage("sequence", data, sizeof(data));
+}
+
+bool CZMQPublishSequenceNotifier::NotifyTransactionRemoval(const CTransaction &transaction, MemPoolRemovalReason reason, uint64_t nMempoolSequence)
+{
+    uint256 hash = transaction.GetHash();
+    LogPrint("zmq", "zmq: Publish sequence mempool removal %s (%s)\n", hash.GetHex(), GetRemovalReasonName(reason));
+    unsigned char data[32 + 1 + 8 + 1];
+    WriteHash(data, hash);
+    data[32] = 'R';
+    WriteLE64(&data[33], nMempoolSequence);
+    data[41] = (unsigned char)reason;
+    return SendMessage("sequence", data, sizeof(data));
+}
+
+bool CZMQPublishAuxpowNotifier::NotifyBlockConnect(const CBlock &block, const CBlockIndex * /*pindex*/)
+{
+    if (!block.auxpow)
+        return true;
+
+    uint256 hash = block.GetHash();
+    LogPrint("zmq", "zmq: Publish auxpow %s\n", hash.GetHex());
+    const CAuxPow& auxpow = *block.auxpow;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << auxpow.parentBlock;
+    assert(ss.size() == 80);
+
+    unsigned char data[32 + 4 + 80 + 32 + 4];
+    WriteHash(data, hash);
+    WriteLE32(&data[32], block.nVersion.GetChainId());
+    memcpy(&data[36], &(*ss.begin()), 80);
+    WriteHash(&data[116], auxpow.GetHash());
+    WriteLE32(&data[148], auxpow.nChainIndex);
+    return SendMessage("auxpow", data, sizeof(data));
 }
@@ -12,14 +12,27 @@ class CBlockIndex;
 class CZMQAbstractPublishNotifier : public CZMQAbstractNotifier
 {
 public:
+    CZMQAbstractPublishNotifier() : nSequence(0) { }
+
+    /**
+     * Publish a three-part message (command, data, 4-byte LE sequence
+     * number) without blocking. ZeroMQ drops it for any subscriber that is
+     * at the high water mark, which sees a gap in the sequence numbers;
+     * returns false only if the socket failed.
+     */
+    bool SendMessage(const char *command, const void* data, size_t size);
+
     bool Initialize(void *pcontext);
     void Shutdown();
+
+private:
+    uint32_t nSequence; //! upcounting per message sequence number
 };
 
 class CZMQPublishHashBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
-    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyBlock(const CBlockIndex *pindex, const CDataStream *pblockData);
 };
 
 class CZMQPublishHashTransactionNotifier : public CZMQAbstractPublishNotifier
@@ -31,7 +44,7 @@ public:
 class CZMQPublishRawBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
-    bool NotifyBlock(const CBlockIndex *pindex);
+    bool NotifyBlock(const CBlockIndex *pindex, const CDataStream *pblockData);
 };
 
 class CZMQPublishRawTransactionNotifier : public CZMQAbstractPublishNotifier
@@ -40,4 +53,30 @@ public:
     bool NotifyTransaction(const CTransaction &transaction);
 };
 
+/**
+ * Publishes "sequence": the 32-byte hash of a block or transaction, a label
+ * ('C' block connected, 'D' block disconnected, 'A' added to the mempool,
+ * 'R' removed from the mempool) and for mempool events the 8-byte LE mempool
+ * sequence number. Removals end with a byte for the MemPoolRemovalReason.
+ */
+class CZMQPublishSequenceNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyBlockConnect(const CBlock &block, const CBlockIndex *pindex);
+    bool NotifyBlockDisconnect(const CBlock &block);
+    bool NotifyTransactionAcceptance(const CTransaction &transaction, uint64_t nMempoolSequence);
+    bool NotifyTransactionRemoval(const CTransaction &transaction, MemPoolRemovalReason reason, uint64_t nMempoolSequence);
+};
+
+/**
+ * Publishes "auxpow" for every merge-mined block connected: the 32-byte
+ * block hash, the 4-byte LE chain ID, the 80-byte parent block header, the
+ * 32-byte parent coinbase txid and the 4-byte LE chain merkle index.
+ */
+class CZMQPublishAuxpowNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyBlockConnect(const CBlock &block, const CBlockIndex *pindex);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H